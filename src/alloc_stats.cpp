@@ -0,0 +1,97 @@
+#include <iostream>
+#include <atomic>
+#include <cstdlib>
+#include <new>
+
+#include "alloc_stats.h"
+
+#ifdef OSGMAP_COUNT_ALLOCATIONS
+
+static std::atomic<uint64_t> allocationCount(0);
+static std::atomic<uint64_t> allocationBytes(0);
+
+static void* counted_alloc(size_t size)
+{
+    allocationCount.fetch_add(1, std::memory_order_relaxed);
+    allocationBytes.fetch_add(size, std::memory_order_relaxed);
+    return std::malloc(size ? size : 1);
+}
+
+void* operator new(size_t size)
+{
+    void* p = counted_alloc(size);
+    if (!p) throw std::bad_alloc();
+    return p;
+}
+
+void* operator new[](size_t size)
+{
+    void* p = counted_alloc(size);
+    if (!p) throw std::bad_alloc();
+    return p;
+}
+
+void* operator new(size_t size, const std::nothrow_t&) noexcept
+{
+    return counted_alloc(size);
+}
+void* operator new[](size_t size, const std::nothrow_t&) noexcept
+{
+    return counted_alloc(size);
+}
+
+void operator delete(void* p) noexcept { std::free(p); }
+void operator delete[](void* p) noexcept { std::free(p); }
+void operator delete(void* p, size_t) noexcept { std::free(p); }
+void operator delete[](void* p, size_t) noexcept { std::free(p); }
+void operator delete(void* p, const std::nothrow_t&) noexcept { std::free(p); }
+void operator delete[](void* p, const std::nothrow_t&) noexcept
+{
+    std::free(p);
+}
+
+bool allocations_counted() { return true; }
+
+AllocationCount allocation_count()
+{
+    AllocationCount c;
+    c.count = allocationCount.load(std::memory_order_relaxed);
+    c.bytes = allocationBytes.load(std::memory_order_relaxed);
+    return c;
+}
+
+#else
+
+bool allocations_counted() { return false; }
+
+AllocationCount allocation_count() { return AllocationCount(); }
+
+#endif
+
+////////////////////////////////////////////////////////////////////////////////
+
+StageProfile::StageProfile(const std::string& name) :
+    _name(name),
+    _start(osg::Timer::instance()->tick()),
+    _startCount(allocation_count())
+{
+}
+
+StageProfile::~StageProfile()
+{
+    double ms = osg::Timer::instance()->delta_m(_start,
+                                                osg::Timer::instance()->tick());
+    AllocationCount end = allocation_count();
+
+    std::cout << "--- PROFILE: " << _name << " " << ms << " ms";
+    if (allocations_counted())
+    {
+        uint64_t count = end.count - _startCount.count;
+        std::cout << ", " << count << " allocations, "
+                  << double(end.bytes - _startCount.bytes) / (1024.0 * 1024.0)
+                  << " MB";
+        if (_items > 0)
+            std::cout << ", " << double(count) / _items << " per feature";
+    }
+    std::cout << std::endl;
+}
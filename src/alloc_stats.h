@@ -0,0 +1,43 @@
+#ifndef ALLOC_STATS_H
+#define ALLOC_STATS_H
+
+#include <osg/Timer>
+
+#include <cstdint>
+#include <string>
+
+// Heap allocations made by the whole process so far. They are only counted
+// when the build has the CMake option OSGMAP_COUNT_ALLOCATIONS, which
+// replaces the global operator new and delete; otherwise both stay zero.
+// The counters are shared by all threads, so that the workers of
+// parallel_for() count towards the stage that started them; the frames
+// drawn while the layers load in the background count too, the numbers of
+// a stage only hold with --sync-load.
+struct AllocationCount
+{
+    uint64_t count = 0;
+    uint64_t bytes = 0;
+};
+
+bool allocations_counted();
+AllocationCount allocation_count();
+
+// One stage of the startup profile: prints its wall time and, when they are
+// counted, the allocations made in it as "--- PROFILE: <name> ..." once it
+// goes out of scope. With the number of features the stage handled the
+// allocations per feature are printed too.
+class StageProfile {
+public:
+    StageProfile(const std::string& name);
+    ~StageProfile();
+
+    void setNumItems(size_t items) { _items = items; }
+
+protected:
+    std::string _name;
+    size_t _items = 0;
+    osg::Timer_t _start;
+    AllocationCount _startCount;
+};
+
+#endif // ALLOC_STATS_H
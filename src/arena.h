@@ -0,0 +1,87 @@
+#ifndef ARENA_H
+#define ARENA_H
+
+#include <vector>
+#include <memory>
+#include <cstring>
+#include <cstddef>
+#include <string_view>
+#include <algorithm>
+
+// Monotonic storage for transient ingestion data. An allocation bumps a
+// pointer in the current block and nothing is freed on its own; reset()
+// rewinds to the first block but keeps all of them, so a layer reusing its
+// arena for every batch stops allocating once the largest batch was seen.
+// Not synchronised - one arena per thread, like the triangulator.
+class Arena {
+public:
+    Arena(size_t blockSize = 64 * 1024) : _blockSize(blockSize) {}
+
+    void* allocate(size_t bytes, size_t align = alignof(std::max_align_t))
+    {
+        for (;;)
+        {
+            if (_block < _blocks.size())
+            {
+                Block& b = _blocks[_block];
+                size_t offset = (_used + align - 1) & ~(align - 1);
+                if (offset + bytes <= b.size)
+                {
+                    _used = offset + bytes;
+                    return b.data.get() + offset;
+                }
+                ++_block;
+                _used = 0;
+                if (_block < _blocks.size()) continue;
+            }
+
+            Block b;
+            b.size = std::max(_blockSize, bytes + align);
+            b.data.reset(new char[b.size]);
+            _blocks.push_back(std::move(b));
+            _block = _blocks.size() - 1;
+            _used = 0;
+        }
+    }
+
+    template <typename T>
+    T* allocateArray(size_t count)
+    {
+        return static_cast<T*>(allocate(count * sizeof(T), alignof(T)));
+    }
+
+    // copy of the characters that lives until the next reset
+    std::string_view copy(const char* s, size_t length)
+    {
+        char* d = allocateArray<char>(length);
+        std::memcpy(d, s, length);
+        return std::string_view(d, length);
+    }
+
+    void reset()
+    {
+        _block = 0;
+        _used = 0;
+    }
+
+    size_t getCapacity() const
+    {
+        size_t size = 0;
+        for (const Block& b : _blocks) size += b.size;
+        return size;
+    }
+
+protected:
+    struct Block
+    {
+        std::unique_ptr<char[]> data;
+        size_t size = 0;
+    };
+
+    size_t _blockSize;
+    std::vector<Block> _blocks;
+    size_t _block = 0;
+    size_t _used = 0;
+};
+
+#endif // ARENA_H
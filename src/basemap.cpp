@@ -0,0 +1,497 @@
+#include <osgDB/ReadFile>
+#include <osgDB/WriteFile>
+#include <osgDB/FileUtils>
+#include <osgDB/FileNameUtils>
+#include <osg/CoordinateSystemNode>
+#include <osg/Geode>
+#include <osg/Geometry>
+#include <osg/LOD>
+#include <osg/Texture2D>
+#include <osg/BlendFunc>
+#include <osg/Depth>
+#include <osg/Timer>
+
+#include <iostream>
+#include <fstream>
+#include <sstream>
+#include <vector>
+#include <algorithm>
+#include <cmath>
+#include <cfloat>
+
+#include "common.h"
+#include "style.h"
+#include "basemap.h"
+#include "shapefile.h"
+#include "parallel.h"
+#include "terrain.h"
+#include "cache.h"
+
+static const char* cacheHeader = "osgMap-basemap";
+static const int cacheVersion = 1;
+
+// a tile is replaced by its children when the camera is closer than this
+// many tile sides, about where a texel of the children covers a pixel
+const float basemapTileDetail = 4.f;
+
+const unsigned int basemapMaxLevels = 7;
+
+// cells a side of a tile on a DEM, so that it follows the ground
+const unsigned int basemapTerrainCells = 16;
+
+static osg::Vec4ub to_color(const osg::Vec4& color)
+{
+    return osg::Vec4ub(
+        (unsigned char)(osg::clampBetween(color.r(), 0.f, 1.f) * 255.f + 0.5f),
+        (unsigned char)(osg::clampBetween(color.g(), 0.f, 1.f) * 255.f + 0.5f),
+        (unsigned char)(osg::clampBetween(color.b(), 0.f, 1.f) * 255.f + 0.5f),
+        (unsigned char)(osg::clampBetween(color.a(), 0.f, 1.f) * 255.f + 0.5f));
+}
+
+// even-odd scan conversion of one record into the tile, pixel centres
+// inside the rings get the colour
+static void fill_record(unsigned char* pixels, unsigned int tileSize,
+                        const osg::Vec2& tileOrigin,
+                        float pixel, const ShapeFile& shp, unsigned int record,
+                        const osg::Vec4ub& color, std::vector<float>& xs)
+{
+    const osg::Vec2* points = shp.getLocalPoints().data();
+    const osg::BoundingBox& bb = shp.getRecordBounds(record);
+
+    int rowMin = std::max(
+        0, int(std::floor((bb.yMin() - tileOrigin.y()) / pixel - 0.5f)));
+    int rowMax = std::min(int(tileSize) - 1,
+                          int(std::ceil((bb.yMax() - tileOrigin.y()) / pixel)));
+
+    for (int row = rowMin; row <= rowMax; ++row)
+    {
+        float y = tileOrigin.y() + (row + 0.5f) * pixel;
+
+        xs.clear();
+        for (unsigned int p = shp.getFirstPart(record);
+             p < shp.getEndPart(record); ++p)
+        {
+            unsigned int first = shp.getFirstPoint(p);
+            unsigned int end = shp.getEndPoint(p);
+            for (unsigned int i = first, j = end - 1; i < end; j = i++)
+            {
+                const osg::Vec2& a = points[i];
+                const osg::Vec2& b = points[j];
+                if ((a.y() > y) != (b.y() > y))
+                    xs.push_back(a.x() + (y - a.y()) * (b.x() - a.x())
+                                 / (b.y() - a.y()));
+            }
+        }
+        std::sort(xs.begin(), xs.end());
+
+        unsigned char* line = pixels + size_t(row) * tileSize * 4;
+        for (size_t k = 0; k + 1 < xs.size(); k += 2)
+        {
+            int begin = int(std::ceil((xs[k] - tileOrigin.x()) / pixel - 0.5f));
+            int end =
+                int(std::ceil((xs[k + 1] - tileOrigin.x()) / pixel - 0.5f));
+            begin = std::max(begin, 0);
+            end = std::min(end, int(tileSize));
+
+            for (int col = begin; col < end; ++col)
+            {
+                unsigned char* px = line + col * 4;
+                px[0] = color[0];
+                px[1] = color[1];
+                px[2] = color[2];
+                px[3] = color[3];
+            }
+        }
+    }
+}
+
+// the quad of a tile, on a DEM a grid of cells on its ground
+static osg::Geometry* create_tile_geometry(const osg::Vec3& corner, float side)
+{
+    if (!map_terrain.valid())
+        return osg::createTexturedQuadGeometry(
+            corner, osg::Vec3(side, 0.f, 0.f), osg::Vec3(0.f, side, 0.f));
+
+    unsigned int n = basemapTerrainCells;
+    osg::Vec3Array* verts = new osg::Vec3Array;
+    osg::Vec2Array* texCoords = new osg::Vec2Array;
+    for (unsigned int j = 0; j <= n; ++j)
+    {
+        for (unsigned int i = 0; i <= n; ++i)
+        {
+            osg::Vec2 t(float(i) / n, float(j) / n);
+            osg::Vec3 p = corner + osg::Vec3(t.x() * side, t.y() * side, 0.f);
+            p.z() = map_terrain->getHeight(p.x(), p.y());
+            verts->push_back(p);
+            texCoords->push_back(t);
+        }
+    }
+
+    osg::DrawElementsUShort* tris = new osg::DrawElementsUShort(GL_TRIANGLES);
+    for (unsigned int j = 0; j < n; ++j)
+    {
+        for (unsigned int i = 0; i < n; ++i)
+        {
+            unsigned short a = j * (n + 1) + i;
+            unsigned short b = a + 1, c = a + n + 2, d = a + n + 1;
+            tris->push_back(a); tris->push_back(b); tris->push_back(c);
+            tris->push_back(a); tris->push_back(c); tris->push_back(d);
+        }
+    }
+
+    osg::Geometry* geom = new osg::Geometry;
+    geom->setVertexArray(verts);
+    geom->setTexCoordArray(0, texCoords, osg::Array::BIND_PER_VERTEX);
+    geom->addPrimitiveSet(tris);
+    return geom;
+}
+
+BasemapPyramid::BasemapPyramid(unsigned int tileSize, float resolution) :
+    _tileSize(tileSize),
+    _resolution(resolution)
+{
+}
+
+void BasemapPyramid::rasteriseTile(
+    unsigned int x, unsigned int y, const ShapeFile* const* layers,
+    const std::vector<std::pair<unsigned int, unsigned int>>& records,
+    const std::vector<osg::Vec4ub>* colors)
+{
+    unsigned int level = _numLevels - 1;
+    float tileSide = _size / getTilesPerSide(level);
+    float pixel = tileSide / _tileSize;
+    osg::Vec2 tileOrigin = _origin + osg::Vec2(x * tileSide, y * tileSide);
+
+    // transparent where no polygon lies, as without the pyramid
+    osg::Image* image = new osg::Image;
+    image->allocateImage(_tileSize, _tileSize, 1, GL_RGBA, GL_UNSIGNED_BYTE);
+    std::fill(image->data(), image->data() + size_t(_tileSize) * _tileSize * 4,
+              0);
+
+    std::vector<float> xs;
+    for (const auto& r : records)
+    {
+        fill_record(image->data(), _tileSize, tileOrigin, pixel,
+                    *layers[r.first], r.second,
+                    colors[r.first][r.second], xs);
+    }
+
+    _tiles[level][y * getTilesPerSide(level) + x] = image;
+}
+
+// 2x2 box filter of the four children, weighted by their alpha so empty
+// texels do not darken the edges of the polygons
+void BasemapPyramid::downsample(unsigned int level, unsigned int x,
+                                unsigned int y)
+{
+    osg::Image* image = new osg::Image;
+    image->allocateImage(_tileSize, _tileSize, 1, GL_RGBA, GL_UNSIGNED_BYTE);
+
+    unsigned int half = _tileSize / 2;
+    for (unsigned int q = 0; q < 4; ++q)
+    {
+        const osg::Image* child = getTile(level + 1, 2 * x + (q & 1),
+                                          2 * y + (q >> 1));
+        const unsigned char* src = child->data();
+        unsigned int colOffset = (q & 1) * half;
+        unsigned int rowOffset = (q >> 1) * half;
+
+        for (unsigned int row = 0; row < half; ++row)
+        {
+            unsigned char* dst = image->data()
+                + (size_t(row + rowOffset) * _tileSize + colOffset) * 4;
+            for (unsigned int col = 0; col < half; ++col, dst += 4)
+            {
+                unsigned int sum[4] = {0, 0, 0, 0};
+                for (unsigned int s = 0; s < 4; ++s)
+                {
+                    const unsigned char* px =
+                        src + (size_t(2 * row + (s >> 1)) * _tileSize + 2 * col
+                               + (s & 1)) * 4;
+                    sum[0] += px[0] * px[3];
+                    sum[1] += px[1] * px[3];
+                    sum[2] += px[2] * px[3];
+                    sum[3] += px[3];
+                }
+
+                for (unsigned int c = 0; c < 3; ++c)
+                    dst[c] = sum[3] ? (unsigned char)(sum[c] / sum[3]) : 0;
+                dst[3] = (unsigned char)((sum[3] + 2) / 4);
+            }
+        }
+    }
+
+    _tiles[level][y * getTilesPerSide(level) + x] = image;
+}
+
+bool BasemapPyramid::rasterise(const ShapeFile& landuse, const ShapeFile& water)
+{
+    const ShapeFile* layers[2] = {&landuse, &water};
+
+    // square extent of both layers; levels are added until a texel of the
+    // finest one is no larger than the requested resolution
+    osg::BoundingBox bb = landuse.getLocalBounds();
+    bb.expandBy(water.getLocalBounds());
+    if (!bb.valid()) return false;
+
+    _origin.set(bb.xMin(), bb.yMin());
+    _size = std::max(bb.xMax() - bb.xMin(), bb.yMax() - bb.yMin());
+
+    _numLevels = 1;
+    while (_numLevels < basemapMaxLevels
+           && _size / (_tileSize << (_numLevels - 1)) > _resolution)
+        _numLevels++;
+
+    _tiles.assign(_numLevels, std::vector<osg::ref_ptr<osg::Image>>());
+    for (unsigned int l = 0; l < _numLevels; ++l)
+        _tiles[l].resize(getTilesPerSide(l) * getTilesPerSide(l));
+
+    // style colour of every record
+    std::vector<osg::Vec4ub> colors[2];
+    int fclass = landuse.getFieldIndex("fclass");
+    colors[0].resize(landuse.getNumRecords());
+    for (unsigned int r = 0; r < landuse.getNumRecords(); ++r)
+        colors[0][r] =
+            to_color(map_style->lookup(STYLE_LANDUSE,
+                                       landuse.getString(r, fclass)).color);
+    colors[1].assign(water.getNumRecords(),
+                     to_color(map_style->getDefault(STYLE_WATER).color));
+
+    // records binned to the finest tiles they overlap, water painted last
+    unsigned int finest = _numLevels - 1;
+    unsigned int side = getTilesPerSide(finest);
+    float tileSide = _size / side;
+    std::vector<std::vector<std::pair<unsigned int, unsigned int>>> bins(
+        side * side);
+    for (unsigned int l = 0; l < 2; ++l)
+    {
+        for (unsigned int r = 0; r < layers[l]->getNumRecords(); ++r)
+        {
+            const osg::BoundingBox& rb = layers[l]->getRecordBounds(r);
+            if (!rb.valid()) continue;
+
+            int x0 = std::max(
+                0, int(std::floor((rb.xMin() - _origin.x()) / tileSide)));
+            int y0 = std::max(
+                0, int(std::floor((rb.yMin() - _origin.y()) / tileSide)));
+            int x1 =
+                std::min(int(side) - 1,
+                         int(std::floor((rb.xMax() - _origin.x()) / tileSide)));
+            int y1 =
+                std::min(int(side) - 1,
+                         int(std::floor((rb.yMax() - _origin.y()) / tileSide)));
+            for (int y = y0; y <= y1; ++y)
+                for (int x = x0; x <= x1; ++x)
+                    bins[y * side + x].push_back(std::make_pair(l, r));
+        }
+    }
+
+    parallel_for(bins.size(), [&](size_t t)
+    {
+        rasteriseTile(t % side, t / side, layers, bins[t], colors);
+    }, 1);
+
+    for (unsigned int l = finest; l-- > 0;)
+    {
+        unsigned int n = getTilesPerSide(l);
+        parallel_for(n * n, [&](size_t t)
+        {
+            downsample(l, t % n, t / n);
+        }, 1);
+    }
+    return true;
+}
+
+bool BasemapPyramid::readCache(const std::string& base)
+{
+    std::ifstream file(base + "/pyramid.txt");
+    if (!file.is_open()) return false;
+
+    std::string header;
+    int version = 0;
+    unsigned int tileSize = 0, numLevels = 0;
+    osg::Vec2 origin;
+    float size = 0.f;
+    file >> header >> version >> tileSize >> numLevels >> origin.x()
+        >> origin.y() >> size;
+    if (!file || header != cacheHeader || version != cacheVersion
+        || tileSize != _tileSize || numLevels == 0
+        || numLevels > basemapMaxLevels)
+        return false;
+
+    std::vector<std::vector<osg::ref_ptr<osg::Image>>> tiles(numLevels);
+    for (unsigned int l = 0; l < numLevels; ++l)
+    {
+        unsigned int n = 1u << l;
+        tiles[l].resize(n * n);
+        for (unsigned int t = 0; t < n * n; ++t)
+        {
+            std::ostringstream name;
+            name << base << "/" << l << "/" << t % n << "_" << t / n << ".png";
+            tiles[l][t] = osgDB::readRefImageFile(name.str());
+            if (!tiles[l][t]) return false;
+        }
+    }
+
+    _numLevels = numLevels;
+    _origin = origin;
+    _size = size;
+    _tiles.swap(tiles);
+    return true;
+}
+
+bool BasemapPyramid::writeCache(const std::string& base) const
+{
+    for (unsigned int l = 0; l < _numLevels; ++l)
+    {
+        unsigned int n = getTilesPerSide(l);
+        for (unsigned int t = 0; t < n * n; ++t)
+        {
+            std::ostringstream name;
+            name << base << "/" << l << "/" << t % n << "_" << t / n << ".png";
+            if (!osgDB::makeDirectoryForFile(name.str())) return false;
+            if (!osgDB::writeImageFile(*_tiles[l][t], name.str())) return false;
+        }
+    }
+
+    // written last, so an interrupted write is not taken for a pyramid
+    std::ofstream file(base + "/pyramid.txt");
+    if (!file.is_open()) return false;
+
+    file.precision(9);
+    file << cacheHeader << " " << cacheVersion << "\n"
+         << _tileSize << " " << _numLevels << "\n"
+         << _origin.x() << " " << _origin.y() << " " << _size << "\n";
+    return bool(file);
+}
+
+bool BasemapPyramid::build(const osg::Matrixd& ltw,
+                           const std::string& file_path,
+                           const std::string& cacheDir)
+{
+    std::string landuse_file_path = file_path + "/gis_osm_landuse_a_free_1.shp";
+    std::string water_file_path = file_path + "/gis_osm_water_a_free_1.shp";
+
+    // the cache name identifies the data, the frame, the colours and the
+    // resolution of the pyramid
+    CacheKey key;
+    for (const std::string& path : {landuse_file_path, water_file_path})
+    {
+        key.mixFile(path);
+        key.mixFile(osgDB::getNameLessExtension(path) + ".dbf");
+    }
+    key.mix(ltw.ptr(), sizeof(double) * 16);
+    key.mix(&_resolution, sizeof(_resolution));
+    for (unsigned int id = 0; id < map_style->getNumIds(); ++id)
+        key.mix(map_style->rule(STYLE_LANDUSE, id).color.ptr(),
+                sizeof(osg::Vec4));
+    key.mix(map_style->getDefault(STYLE_LANDUSE).color.ptr(),
+            sizeof(osg::Vec4));
+    key.mix(map_style->getDefault(STYLE_WATER).color.ptr(), sizeof(osg::Vec4));
+
+    std::ostringstream base;
+    base << cacheDir << "/basemap_" << _tileSize << "_" << std::hex
+         << key.get();
+
+    if (readCache(base.str()))
+    {
+        std::cout << "--- BASEMAP: " << _numLevels << " levels from "
+                  << base.str() << std::endl;
+        return true;
+    }
+
+    ShapeFile landuse, water;
+    if (!landuse.load(landuse_file_path))
+    {
+        std::cout << "Cannot load file " << landuse_file_path << std::endl;
+        return false;
+    }
+    if (!water.load(water_file_path))
+    {
+        std::cout << "Cannot load file " << water_file_path << std::endl;
+        return false;
+    }
+
+    osg::Timer_t start = osg::Timer::instance()->tick();
+    landuse.toLocal(ltw);
+    water.toLocal(ltw);
+    if (!rasterise(landuse, water)) return false;
+
+    unsigned int finest = getTilesPerSide(_numLevels - 1) * _tileSize;
+    std::cout << "--- BASEMAP: Rasterised " << _numLevels << " levels, finest "
+              << finest << "x" << finest << " at " << _size / finest
+              << " m/px in "
+              << osg::Timer::instance()->delta_m(start,
+                                                 osg::Timer::instance()->tick())
+              << " ms" << std::endl;
+
+    if (!writeCache(base.str()))
+    {
+        std::cout << "Cannot write basemap cache " << base.str() << std::endl;
+    }
+    return true;
+}
+
+osg::Node* BasemapPyramid::createTileNode(unsigned int level, unsigned int x,
+                                          unsigned int y) const
+{
+    float side = _size / getTilesPerSide(level);
+    osg::Vec3 corner(_origin.x() + x * side, _origin.y() + y * side, 0.f);
+
+    osg::Geometry* quad = create_tile_geometry(corner, side);
+    quad->setUseDisplayList(false);
+    quad->setUseVertexBufferObjects(true);
+
+    osg::Texture2D* tex = new osg::Texture2D(getTile(level, x, y));
+    tex->setFilter(osg::Texture::MIN_FILTER,
+                   osg::Texture::LINEAR_MIPMAP_LINEAR);
+    tex->setFilter(osg::Texture::MAG_FILTER, osg::Texture::LINEAR);
+    tex->setWrap(osg::Texture::WRAP_S, osg::Texture::CLAMP_TO_EDGE);
+    tex->setWrap(osg::Texture::WRAP_T, osg::Texture::CLAMP_TO_EDGE);
+
+    osg::Geode* geode = new osg::Geode;
+    geode->addDrawable(quad);
+    geode->getOrCreateStateSet()->setTextureAttributeAndModes(0, tex);
+
+    if (level + 1 == _numLevels) return geode;
+
+    osg::Group* children = new osg::Group;
+    for (unsigned int q = 0; q < 4; ++q)
+        children->addChild(createTileNode(level + 1, 2 * x + (q & 1),
+                                          2 * y + (q >> 1)));
+
+    float range = side * basemapTileDetail;
+    osg::LOD* lod = new osg::LOD;
+    lod->addChild(children, 0.f, range);
+    lod->addChild(geode, range, FLT_MAX);
+    return lod;
+}
+
+osg::Node* BasemapPyramid::createNode() const
+{
+    if (_numLevels == 0) return nullptr;
+
+    osg::Node* node = createTileNode(0, 0, 0);
+
+    // drawn like the landuse polygons: first, without writing depth
+    osg::StateSet* ss = node->getOrCreateStateSet();
+    ss->setMode(GL_LIGHTING, osg::StateAttribute::OFF);
+    ss->setMode(GL_BLEND, osg::StateAttribute::ON);
+    ss->setAttributeAndModes(new osg::BlendFunc(GL_SRC_ALPHA,
+                                                GL_ONE_MINUS_SRC_ALPHA));
+    ss->setAttributeAndModes(new osg::Depth(osg::Depth::LESS, 0, 1, false));
+    ss->setRenderBinDetails(-10, "RenderBin");
+    ss->setNestRenderBins(false);
+    return node;
+}
+
+osg::Node* process_basemap(osg::Matrixd& ltw, const std::string & file_path)
+{
+    osg::ref_ptr<BasemapPyramid> pyramid = new BasemapPyramid;
+    if (!pyramid->build(ltw, file_path, "cache"))
+    {
+        std::cout << "Cannot build basemap of " << file_path << std::endl;
+        return nullptr;
+    }
+    return pyramid->createNode();
+}
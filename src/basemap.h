@@ -0,0 +1,79 @@
+#ifndef BASEMAP_H
+#define BASEMAP_H
+
+#include <osg/Referenced>
+#include <osg/ref_ptr>
+#include <osg/Vec2>
+#include <osg/Vec4ub>
+#include <osg/Image>
+#include <osg/Matrixd>
+#include <osg/Node>
+
+#include <string>
+#include <vector>
+
+class ShapeFile;
+
+// below this zoom level the ground is drawn from the basemap pyramid
+// instead of the landuse and water polygons
+const double basemapMaxZoom = 12.0;
+
+////////////////////////////////////////////////////////////////////////////////
+
+// Raster pyramid of the landuse and water layers in the style colours.
+// Polygons are scan converted on the CPU into square tiles of the finest
+// level, every coarser level averages four tiles of the one below. Building
+// it needs no graphics context, so it also runs headless, and the tiles are
+// kept on disk for the next run. Drawing the pyramid costs a few textured
+// quads whatever the number of polygons.
+class BasemapPyramid : public osg::Referenced {
+public:
+    BasemapPyramid(unsigned int tileSize = 256, float resolution = 10.f);
+
+    // loads the pyramid from cacheDir, or rasterises the shapefiles of
+    // file_path in the local frame of ltw and stores it there
+    bool build(const osg::Matrixd& ltw, const std::string& file_path,
+               const std::string& cacheDir);
+
+    unsigned int getNumLevels() const { return _numLevels; }
+    unsigned int getTilesPerSide(unsigned int level) const
+    {
+        return 1u << level;
+    }
+
+    osg::Image* getTile(unsigned int level, unsigned int x,
+                        unsigned int y) const
+    {
+        return _tiles[level][y * getTilesPerSide(level) + x].get();
+    }
+
+    // quadtree of tile quads at z = 0, or on the ground of map_terrain;
+    // every tile gives way to its four children once the camera is close
+    // enough to see their texels
+    osg::Node* createNode() const;
+
+protected:
+    bool readCache(const std::string& base);
+    bool writeCache(const std::string& base) const;
+    bool rasterise(const ShapeFile& landuse, const ShapeFile& water);
+    void rasteriseTile(
+        unsigned int x, unsigned int y, const ShapeFile* const* layers,
+        const std::vector<std::pair<unsigned int, unsigned int>>& records,
+        const std::vector<osg::Vec4ub>* colors);
+    void downsample(unsigned int level, unsigned int x, unsigned int y);
+    osg::Node* createTileNode(unsigned int level, unsigned int x,
+                              unsigned int y) const;
+
+    unsigned int _tileSize;
+    float _resolution;
+
+    // the pyramid covers the square [_origin, _origin + _size] of the local
+    // frame
+    unsigned int _numLevels = 0;
+    osg::Vec2 _origin;
+    float _size = 0.f;
+
+    std::vector<std::vector<osg::ref_ptr<osg::Image>>> _tiles;
+};
+
+#endif // BASEMAP_H
@@ -0,0 +1,273 @@
+#include <osg/CoordinateSystemNode>
+#include <osg/Geometry>
+#include <osg/TriangleIndexFunctor>
+#include <osg/Timer>
+#include <osgUtil/Tessellator>
+#include <osgViewer/Viewer>
+
+#include <iostream>
+#include <vector>
+#include <algorithm>
+#include <cmath>
+
+#include "common.h"
+#include "shapefile.h"
+#include "triangulator.h"
+#include "zoom.h"
+
+struct TriangleCounter
+{
+    size_t count = 0;
+
+    void operator()(unsigned int, unsigned int, unsigned int)
+    {
+        ++count;
+    }
+};
+
+// triangulates every polygon of the shapefile with the in-tree triangulator,
+// on one thread and then in parallel, and with osgUtil::Tessellator
+static void bench_shapefile(const std::string& path)
+{
+    ShapeFile shp;
+    if (!shp.load(path))
+    {
+        std::cout << "Cannot load file " << path << std::endl;
+        return;
+    }
+
+    osg::Matrixd ltw;
+    osg::Vec3d center = shp.getGeoBounds().center();
+    ellipsoid->computeLocalToWorldTransformFromLatLongHeight(
+        osg::DegreesToRadians(center.y()), osg::DegreesToRadians(center.x()),
+        0.0, ltw);
+    shp.toLocal(ltw);
+
+    std::vector<unsigned int> records(shp.getNumRecords());
+    for (unsigned i = 0; i < records.size(); i++) records[i] = i;
+
+    osg::Timer* timer = osg::Timer::instance();
+
+    // earcut, single thread
+    osg::Timer_t start = timer->tick();
+    size_t singleTriangles = 0;
+    {
+        Triangulator triangulator;
+        std::vector<unsigned int> triangles;
+        for (unsigned int r : records)
+        {
+            triangles.clear();
+            singleTriangles += triangulator.triangulate(shp, r, triangles);
+        }
+    }
+    double singleTime = timer->delta_m(start, timer->tick());
+
+    // earcut on all threads, merged into the layer geometry
+    start = timer->tick();
+    osg::ref_ptr<osg::Geometry> merged = createPolygonGeometry(shp, records);
+    double parallelTime = timer->delta_m(start, timer->tick());
+    size_t parallelTriangles = merged->getPrimitiveSet(0)->getNumIndices() / 3;
+
+    // GLU tessellator, one geometry of polygon rings per record as the shp
+    // plugin builds them
+    start = timer->tick();
+    size_t tessTriangles = 0;
+    const std::vector<osg::Vec2>& points = shp.getLocalPoints();
+    for (unsigned int r : records)
+    {
+        osg::ref_ptr<osg::Geometry> geom = new osg::Geometry;
+        osg::Vec3Array* verts = new osg::Vec3Array;
+        for (unsigned p = shp.getFirstPart(r); p < shp.getEndPart(r); p++)
+        {
+            unsigned int first = verts->size();
+            for (unsigned i = shp.getFirstPoint(p); i < shp.getEndPoint(p); i++)
+                verts->push_back(osg::Vec3(points[i], 0.f));
+            geom->addPrimitiveSet(new osg::DrawArrays(
+                osg::PrimitiveSet::POLYGON, first, verts->size() - first));
+        }
+        geom->setVertexArray(verts);
+
+        osg::ref_ptr<osgUtil::Tessellator> tess = new osgUtil::Tessellator;
+        tess->setTessellationType(osgUtil::Tessellator::TESS_TYPE_GEOMETRY);
+        tess->setWindingType(osgUtil::Tessellator::TESS_WINDING_ODD);
+        tess->setBoundaryOnly(false);
+        tess->retessellatePolygons(*geom);
+
+        osg::TriangleIndexFunctor<TriangleCounter> counter;
+        geom->accept(counter);
+        tessTriangles += counter.count;
+    }
+    double tessTime = timer->delta_m(start, timer->tick());
+
+    std::cout << "--- BENCH: " << path << ", " << shp.getNumRecords()
+              << " polygons, " << points.size() << " points" << std::endl;
+    std::cout << "    earcut 1 thread   " << singleTime << " ms, "
+              << singleTriangles << " triangles" << std::endl;
+    std::cout << "    earcut parallel   " << parallelTime << " ms, "
+              << parallelTriangles << " triangles" << std::endl;
+    std::cout << "    osgUtil::Tessellator " << tessTime << " ms, "
+              << tessTriangles << " triangles" << std::endl;
+}
+
+// polygons whose holes have several bridge candidates at the same x; the
+// triangles have to cover the polygon exactly once, all counter clockwise
+static bool check_hole_bridges()
+{
+    struct Case
+    {
+        const char* name;
+        std::vector<osg::Vec2> points;
+        std::vector<Triangulator::Ring> rings;
+    };
+    const Case cases[] = {
+        // both left corners of the square are as far from the hole
+        {"square",
+         {{0, 0}, {10, 0}, {10, 10}, {0, 10},
+          {4, 5}, {5, 4}, {6, 5}, {5, 6}},
+         {{0, 4}, {4, 8}}},
+        // spikes of the outer ring on the line from the hole to the corner
+        {"spikes",
+         {{0, 0}, {4, 0}, {4, 2}, {5, 0}, {6, 0}, {6, 3}, {7, 0}, {20, 0},
+          {20, 10}, {0, 10},
+          {10, 5}, {11, 4}, {12, 5}, {11, 6}},
+         {{0, 10}, {10, 14}}},
+        // a notch whose two corners share the x of the corner below them
+        {"notch",
+         {{0, 0}, {10, 0}, {10, 10}, {0, 10}, {0, 6}, {2, 6}, {2, 4},
+          {0, 4},
+          {6, 5}, {7, 4}, {8, 5}, {7, 6}},
+         {{0, 8}, {8, 12}}},
+        // two holes bridged one after the other to the same column
+        {"two holes",
+         {{0, 0}, {12, 0}, {12, 12}, {0, 12},
+          {4, 3}, {5, 2}, {6, 3}, {5, 4},
+          {4, 9}, {5, 8}, {6, 9}, {5, 10}},
+         {{0, 4}, {4, 8}, {8, 12}}},
+    };
+
+    auto ring_area = [](const Case& c, const Triangulator::Ring& ring)
+    {
+        double a = 0.0;
+        for (unsigned int i = ring.first, j = ring.second - 1;
+             i < ring.second; j = i++)
+        {
+            a += double(c.points[j].x()) * c.points[i].y()
+                - double(c.points[i].x()) * c.points[j].y();
+        }
+        return std::abs(a) * 0.5;
+    };
+
+    bool ok = true;
+    Triangulator triangulator;
+    std::vector<unsigned int> triangles;
+    for (const Case& c : cases)
+    {
+        double expected = ring_area(c, c.rings[0]);
+        for (size_t r = 1; r < c.rings.size(); ++r)
+            expected -= ring_area(c, c.rings[r]);
+
+        triangles.clear();
+        triangulator.triangulate(c.points.data(), c.rings.data(),
+                                 c.rings.size(), triangles);
+        double covered = 0.0;
+        bool clockwise = false;
+        for (size_t t = 0; t + 2 < triangles.size(); t += 3)
+        {
+            osg::Vec2 a = c.points[triangles[t]];
+            osg::Vec2 e1 = c.points[triangles[t + 1]] - a;
+            osg::Vec2 e2 = c.points[triangles[t + 2]] - a;
+            double twice = double(e1.x()) * e2.y() - double(e1.y()) * e2.x();
+            clockwise = clockwise || twice < 0.0;
+            covered += std::abs(twice) * 0.5;
+        }
+
+        if (clockwise || std::abs(covered - expected) > 1e-6 * expected)
+        {
+            std::cout << "--- CHECK: hole bridge \"" << c.name
+                      << "\" failed, triangles cover " << covered << " of "
+                      << expected << (clockwise ? ", some clockwise" : "")
+                      << std::endl;
+            ok = false;
+        }
+    }
+    return ok;
+}
+
+int bench_tessellation(const std::string& file_path)
+{
+    if (!check_hole_bridges()) return 1;
+    std::cout << "--- CHECK: hole bridges ok" << std::endl;
+
+    bench_shapefile(file_path + "/gis_osm_landuse_a_free_1.shp");
+    bench_shapefile(file_path + "/gis_osm_water_a_free_1.shp");
+    return 0;
+}
+
+// Frame times of a zoom sweep from the home view down to 1/64 of its
+// distance and back, in every threading model of a single window viewer.
+// The manipulator is detached and the view matrix set directly, so all
+// models render the same frames. Vertical sync caps every model at the
+// refresh rate and has to be off for the numbers to mean anything.
+int bench_threading(unsigned int frames)
+{
+    const unsigned int warmup = 60;
+
+    // the first frame puts the manipulator's home view on the camera
+    viewer->frame();
+    osg::Camera* camera = viewer->getCamera();
+    osg::Vec3d eye, center, up;
+    camera->getViewMatrix().getLookAt(eye, center, up);
+    viewer->setCameraManipulator(nullptr);
+
+    struct Model
+    {
+        osgViewer::Viewer::ThreadingModel model;
+        const char* name;
+    };
+    const Model models[] = {
+        {osgViewer::Viewer::SingleThreaded, "SingleThreaded"},
+        {osgViewer::Viewer::CullDrawThreadPerContext,
+         "CullDrawThreadPerContext"},
+        {osgViewer::Viewer::DrawThreadPerContext, "DrawThreadPerContext"}
+    };
+
+    osg::Timer* timer = osg::Timer::instance();
+    std::cout << "--- BENCH: threading, " << frames << " frames per model"
+              << std::endl;
+    for (const Model& m : models)
+    {
+        viewer->setThreadingModel(m.model);
+
+        std::vector<double> times;
+        times.reserve(frames);
+        for (unsigned int f = 0; f < warmup + frames && !viewer->done(); ++f)
+        {
+            double t = double(f % frames) / frames;
+            double scale = std::pow(2.0, -6.0 * std::sin(osg::PI * t));
+            camera->setViewMatrix(osg::Matrixd::lookAt(
+                center + (eye - center) * scale, center, up));
+
+            // the zoom the manipulator would publish, so that the layers
+            // of the zoom range appear and disappear along the sweep
+            if (map_zoom.valid())
+                map_zoom->setZoom(
+                    distanceToZoom((eye - center).length() * scale));
+
+            osg::Timer_t start = timer->tick();
+            viewer->frame();
+            if (f >= warmup)
+                times.push_back(timer->delta_m(start, timer->tick()));
+        }
+        if (times.empty()) break;
+
+        double total = 0.0;
+        for (double time : times) total += time;
+        std::sort(times.begin(), times.end());
+
+        std::cout << "    " << m.name << ": mean " << total / times.size()
+                  << " ms, median " << times[times.size() / 2]
+                  << " ms, 95% " << times[times.size() * 95 / 100] << " ms"
+                  << std::endl;
+    }
+    return 0;
+}
@@ -1,4 +1,3 @@
-#include <osgDB/ReadFile>
 #include <osgUtil/Optimizer>
 #include <osg/CoordinateSystemNode>
 
@@ -7,126 +6,500 @@
 #include <osgText/Text>
 #include <osg/MatrixTransform>
 #include <osg/ShapeDrawable>
-
-#include <osgSim/ShapeAttribute>
+#include <osg/LOD>
+#include <osg/Timer>
 
 #include <iostream>
+#include <vector>
+#include <map>
+#include <cmath>
+#include <cfloat>
+#include <algorithm>
 
 #include "common.h"
+#include "style.h"
+#include "zoom.h"
+#include "parallel.h"
+#include "shapefile.h"
+#include "triangulator.h"
+#include "picking.h"
+#include "chunker.h"
+#include "alloc_stats.h"
+#include "terrain.h"
 
 using namespace osg;
 
-// klasa typu NodeVisitor to wzorzec projektowy - warto zna!
-// Zadaniem glasy jest odwiedzi wszystkie wzy drzewa. Specjalizacja
-// tej klasy moe dokona odpowiednich zmian np zmieni pozycj wierzchokw,
-// doda now geometri, zmieni stany wywietlania itd
-class GeomVisitor : public osg::NodeVisitor
+// footprints without a usable height attribute
+const float defaultBuildingHeight = 10.f;
+const float buildingLevelHeight = 3.f;
+
+// side of the square ground cells, buildings are merged per cell
+const float buildingChunkSize = 1000.f;
+
+// every chunk is an osg::LOD: full walls and roofs up close, oriented boxes
+// of the footprints in the middle range and only the box roofs far away
+enum BuildingLevel
 {
+    BUILDING_FULL,
+    BUILDING_BOX,
+    BUILDING_FLAT,
+    BUILDING_NUM_LEVELS
+};
 
-public:
+const double buildingFullZoom = 16.0;
+const double buildingBoxZoom = 14.0;
 
-    GeomVisitor(/* add your params */) :
-        osg::NodeVisitor( NodeVisitor::TRAVERSE_ALL_CHILDREN )
+struct Footprint
+{
+    unsigned int record;
+    float height;
+    unsigned int chunk;
+};
+
+struct BuildingMesh
+{
+    std::vector<osg::Vec3> verts;
+    std::vector<osg::Vec3> normals;
+    std::vector<unsigned int> indices;
+
+    void clear()
     {
+        verts.clear();
+        normals.clear();
+        indices.clear();
     }
-    //////////////////////////////////////////////////////////////////////////////
-    void apply( osg::Node & node)
+};
+
+// Working storage of one extrusion thread, kept between footprints and
+// chunks: once it has grown to the largest chunk, extruding a footprint
+// allocates nothing.
+struct BuildingScratch
+{
+    Triangulator triangulator;
+    BuildingMesh levels[BUILDING_NUM_LEVELS];
+
+    std::vector<std::pair<unsigned, unsigned>> rings;
+    std::vector<unsigned int> triangles;
+    std::vector<osg::Vec2> points;
+    std::vector<osg::Vec2> hull;
+};
+
+// wysokosc budynku z atrybutow: "height" w cm, a gdy jej brak liczba pieter
+float building_height(const ShapeFile& shp, unsigned int record)
+{
+    float levels = 0.f;
+    for (unsigned j = 0; j < shp.getNumFields(); j++)
     {
-        traverse(node);
+        float value = float(shp.getDouble(record, j));
+
+        if (shp.getFieldName(j).find("height") != std::string::npos
+            && value > 0.f)
+            return value / 100.f; // cm
+        if (shp.getFieldName(j).find("levels") != std::string::npos)
+            levels = value;
     }
-    //////////////////////////////////////////////////////////////////////////////
-    void apply( osg::Geode & node)
+    return levels > 0.f ? levels * buildingLevelHeight : defaultBuildingHeight;
+}
+
+// footprints of the records with their heights, assigned to ground chunks
+void collect_footprints(const ShapeFile& shp, const GridChunker& chunker,
+                        std::vector<Footprint>& footprints,
+                        std::map<GridChunker::Cell, unsigned int>& chunks)
+{
+    for (unsigned int r = 0; r < shp.getNumRecords(); ++r)
     {
-        for ( unsigned i=0; i<node.getNumDrawables(); i++ ) {
-            osg::Geometry* geom = dynamic_cast <osg::Geometry*> (node.getDrawable(i));
+        if (shp.getFirstPart(r) == shp.getEndPart(r)) continue;
+
+        GridChunker::Cell key =
+            chunker.getCell(shp.getRecordBounds(r).center());
+        auto chunk =
+            chunks.insert(std::make_pair(key, (unsigned int)chunks.size()));
+
+        Footprint fp;
+        fp.record = r;
+        fp.height = building_height(shp, r);
+        fp.chunk = chunk.first->second;
+        footprints.push_back(fp);
+    }
+}
 
-            if ( !geom ) continue;
+// convex hull of the points, counter clockwise (Andrew's monotone chain);
+// the points are sorted in place
+static void convex_hull(std::vector<osg::Vec2>& pts,
+                        std::vector<osg::Vec2>& hull)
+{
+    std::sort(pts.begin(), pts.end());
+    pts.erase(std::unique(pts.begin(), pts.end()), pts.end());
+    if (pts.size() < 3)
+    {
+        hull = pts;
+        return;
+    }
 
-            osg::Vec3Array* verts = (osg::Vec3Array*) geom->getVertexArray();
+    auto cross = [](const osg::Vec2& o, const osg::Vec2& a, const osg::Vec2& b)
+    {
+        return (a.x() - o.x()) * (b.y() - o.y())
+            - (a.y() - o.y()) * (b.x() - o.x());
+    };
 
-            for ( unsigned j=0; j<verts->size(); j++ ) {
-                // tutaj mona zmodyfikowa wierzchoek
-#if 0
-                (*verts)[j] = osg::Vec3 ();
-#endif
-            }
+    hull.resize(2 * pts.size());
+    size_t k = 0;
+    for (size_t i = 0; i < pts.size(); ++i)
+    {
+        while (k >= 2 && cross(hull[k - 2], hull[k - 1], pts[i]) <= 0.f) --k;
+        hull[k++] = pts[i];
+    }
+    for (size_t i = pts.size() - 1, lower = k + 1; i > 0; --i)
+    {
+        while (k >= lower && cross(hull[k - 2], hull[k - 1], pts[i - 1]) <= 0.f)
+            --k;
+        hull[k++] = pts[i - 1];
+    }
+    hull.resize(k - 1);
+}
+
+// minimum area rectangle around a convex hull; one of its sides always lies
+// on a hull edge, so only those directions are tried. Corners are counter
+// clockwise.
+static bool oriented_box(const std::vector<osg::Vec2>& hull,
+                         osg::Vec2 corners[4])
+{
+    if (hull.size() < 3) return false;
+
+    float best = FLT_MAX;
+    for (size_t i = 0; i < hull.size(); ++i)
+    {
+        osg::Vec2 u = hull[(i + 1) % hull.size()] - hull[i];
+        if (u.normalize() < 1e-3f) continue;
+        osg::Vec2 v(-u.y(), u.x());
+
+        float minU = FLT_MAX, maxU = -FLT_MAX, minV = FLT_MAX, maxV = -FLT_MAX;
+        for (const osg::Vec2& p : hull)
+        {
+            float pu = p * u, pv = p * v;
+            minU = std::min(minU, pu);
+            maxU = std::max(maxU, pu);
+            minV = std::min(minV, pv);
+            maxV = std::max(maxV, pv);
+        }
+
+        float area = (maxU - minU) * (maxV - minV);
+        if (area < best)
+        {
+            best = area;
+            corners[0] = u * minU + v * minV;
+            corners[1] = u * maxU + v * minV;
+            corners[2] = u * maxU + v * maxV;
+            corners[3] = u * minU + v * maxV;
         }
     }
-};
+    return best < FLT_MAX;
+}
 
+// box of the four corners raised to height, walls are optional
+static void add_box(BuildingMesh& mesh, const osg::Vec2 corners[4],
+                    float height, bool walls)
+{
+    if (walls)
+    {
+        for (int i = 0; i < 4; ++i)
+        {
+            osg::Vec3 a(corners[i], 0.f);
+            osg::Vec3 b(corners[(i + 1) % 4], 0.f);
+            osg::Vec3 normal = (b - a) ^ osg::Vec3(0.f, 0.f, 1.f);
+            normal.normalize();
+
+            unsigned int base = mesh.verts.size();
+            mesh.verts.push_back(a);
+            mesh.verts.push_back(b);
+            mesh.verts.push_back(b + osg::Vec3(0.f, 0.f, height));
+            mesh.verts.push_back(a + osg::Vec3(0.f, 0.f, height));
+            mesh.normals.insert(mesh.normals.end(), 4, normal);
+
+            unsigned int quad[6] = {0, 1, 2, 0, 2, 3};
+            for (unsigned int k : quad) mesh.indices.push_back(base + k);
+        }
+    }
+
+    unsigned int base = mesh.verts.size();
+    for (int i = 0; i < 4; ++i)
+        mesh.verts.push_back(osg::Vec3(corners[i], height));
+    mesh.normals.insert(mesh.normals.end(), 4, osg::Vec3(0.f, 0.f, 1.f));
 
+    unsigned int quad[6] = {0, 1, 2, 0, 2, 3};
+    for (unsigned int k : quad) mesh.indices.push_back(base + k);
+}
 
-void parse_meta_data(osg::Node* model)
+static double ring_area(const osg::Vec2* points, unsigned first, unsigned count)
 {
-    osg::Group * group = model->asGroup();
-    GeomVisitor gv;
+    double area = 0.0;
+    for (unsigned i = 0, j = count - 1; i < count; j = i++)
+    {
+        const osg::Vec2& a = points[first + j];
+        const osg::Vec2& b = points[first + i];
+        area += double(a.x()) * b.y() - double(b.x()) * a.y();
+    }
+    return 0.5 * area;
+}
+
+static bool ring_contains(const osg::Vec2* points, unsigned first,
+                          unsigned count, const osg::Vec2& pt)
+{
+    bool inside = false;
+    for (unsigned i = 0, j = count - 1; i < count; j = i++)
+    {
+        const osg::Vec2& a = points[first + i];
+        const osg::Vec2& b = points[first + j];
+        if ((a.y() > pt.y()) != (b.y() > pt.y())
+            && pt.x() < (b.x() - a.x()) * (pt.y() - a.y()) / (b.y() - a.y())
+                    + a.x())
+            inside = !inside;
+    }
+    return inside;
+}
 
-    for (unsigned i = 0; i < group->getNumChildren(); i++)
+// walls and a flat roof of one footprint and the coarser levels: its
+// oriented box and the box roof alone, appended to the meshes of the levels.
+// Only reads the shapefile, so footprints can be extruded concurrently,
+// each thread with its own scratch.
+void extrude_building(const ShapeFile& shp, const Footprint& fp,
+                      BuildingMesh* levels,
+                      BuildingScratch& scratch)
+{
+    BuildingMesh& mesh = levels[BUILDING_FULL];
+    const osg::Vec2* src = shp.getLocalPoints().data();
+
+    // rings without the repeated closing vertex
+    std::vector<std::pair<unsigned, unsigned>>& rings = scratch.rings;
+    rings.clear();
+    for (unsigned p = shp.getFirstPart(fp.record);
+         p < shp.getEndPart(fp.record); ++p)
     {
-        osg::Node* kido = group->getChild(i);
-        osgSim::ShapeAttributeList * sal = (osgSim::ShapeAttributeList*)kido->getUserData();
-        if (!sal)
-            continue;
+        unsigned first = shp.getFirstPoint(p);
+        unsigned count = shp.getEndPoint(p) - first;
+        if (count > 1 && src[first] == src[first + count - 1]) --count;
+        if (count < 3) continue;
+        rings.push_back(std::make_pair(first, count));
+    }
+    if (rings.empty()) return;
 
-        float height = 0.f;
-        for (unsigned j = 0; j < sal->size(); j++)
+    const osg::Vec3 up(0.f, 0.f, fp.height);
+
+    for (const auto& ring : rings)
+    {
+        // shapefiles should list outer rings clockwise and holes counter
+        // clockwise, but not every export does; a ring inside an odd number
+        // of the others is a hole whatever its winding, and the walls are
+        // turned to face away from the building on either
+        bool hole = false;
+        for (const auto& other : rings)
+            if (&other != &ring && ring_contains(src, other.first, other.second,
+                                                 src[ring.first]))
+                hole = !hole;
+        bool reversed = (ring_area(src, ring.first, ring.second) > 0.0) != hole;
+
+        for (unsigned i = 0; i < ring.second; ++i)
         {
-            // wysokoci budynkow - przechodzimy wszystkie atrybuty 
-            // w poszukiwaniu atrybutu o nazwie "height"
-            if ((*sal)[j].getName().find("height") != std::string::npos)
-            {
-                if ((*sal)[j].getType() == osgSim::ShapeAttribute::DOUBLE)
-                    height = float((*sal)[j].getDouble()) / 100.f; // cm
-                else if ((*sal)[j].getType() == osgSim::ShapeAttribute::INTEGER)
-                    height = float((*sal)[j].getInt()) / 100.f; // cm
-                break;
-            }
+            osg::Vec3 a(src[ring.first + i], 0.f);
+            osg::Vec3 b(src[ring.first + (i + 1) % ring.second], 0.f);
+            if (!reversed) std::swap(a, b);
+
+            osg::Vec3 normal = (b - a) ^ osg::Vec3(0.f, 0.f, 1.f);
+            if (normal.normalize() < 1e-3f) continue;
+
+            unsigned int base = mesh.verts.size();
+            mesh.verts.push_back(a);
+            mesh.verts.push_back(b);
+            mesh.verts.push_back(b + up);
+            mesh.verts.push_back(a + up);
+            mesh.normals.insert(mesh.normals.end(), 4, normal);
+
+            unsigned int quad[6] = {0, 1, 2, 0, 2, 3};
+            for (unsigned int k : quad) mesh.indices.push_back(base + k);
         }
+    }
 
-        kido->accept(gv);
+    // roof - the points of the record at the top of the walls, triangulated
+    // counter clockwise with the holes
+    std::vector<unsigned int>& triangles = scratch.triangles;
+    triangles.clear();
+    scratch.triangulator.triangulate(shp, fp.record, triangles);
+
+    unsigned int first = shp.getFirstPoint(shp.getFirstPart(fp.record));
+    unsigned int end = shp.getFirstPoint(shp.getEndPart(fp.record));
+    unsigned int base = mesh.verts.size();
+    for (unsigned int i = first; i < end; ++i)
+        mesh.verts.push_back(osg::Vec3(src[i], fp.height));
+    mesh.normals.insert(mesh.normals.end(), end - first,
+                        osg::Vec3(0.f, 0.f, 1.f));
+    for (unsigned int i : triangles) mesh.indices.push_back(base + i - first);
+
+    std::vector<osg::Vec2>& points = scratch.points;
+    points.clear();
+    for (const auto& ring : rings)
+        points.insert(points.end(), src + ring.first,
+                      src + ring.first + ring.second);
+
+    convex_hull(points, scratch.hull);
+    osg::Vec2 corners[4];
+    if (oriented_box(scratch.hull, corners))
+    {
+        add_box(levels[BUILDING_BOX], corners, fp.height, true);
+        add_box(levels[BUILDING_FLAT], corners, fp.height, false);
     }
 }
 
+// geometry of the merged meshes of the buildings in a chunk
+osg::Geometry* create_building_geometry(const BuildingMesh& mesh)
+{
+    osg::Vec3Array* verts = new osg::Vec3Array(mesh.verts.begin(),
+                                               mesh.verts.end());
+    osg::Vec3Array* normals = new osg::Vec3Array(mesh.normals.begin(),
+                                                 mesh.normals.end());
+    osg::DrawElementsUInt* tris = new osg::DrawElementsUInt(
+        osg::PrimitiveSet::TRIANGLES, mesh.indices.begin(), mesh.indices.end());
+
+    osg::Geometry* geom = new osg::Geometry;
+    geom->setUseDisplayList(false);
+    geom->setUseVertexBufferObjects(true);
+    geom->setVertexArray(verts);
+    geom->setNormalArray(normals, osg::Array::BIND_PER_VERTEX);
+    geom->addPrimitiveSet(tris);
+    return geom;
+}
 
 osg::Node* process_buildings(osg::Matrixd& ltw, const std::string & file_path)
 {
     std::string buildings_file_path = file_path + "/buildings_levels.shp";
 
     // load the data
-    osg::ref_ptr<osg::Node> buildings_model = osgDB::readRefNodeFile(buildings_file_path);
-    if (!buildings_model)
+    ShapeFile shp;
+    if (!shp.load(buildings_file_path))
     {
         std::cout << "Cannot load file " << buildings_file_path << std::endl;
         return nullptr;
     }
 
-    // Transformacja ze wsprzdnych geograficznych (GEO) do wsprzdnych wiata (WGS)
-    ConvertFromGeoProjVisitor<true> cfgp;
-    buildings_model->accept(cfgp);
+    // Transformacja ze wsprzdnych geograficznych (GEO) do ukadu lokalnego
+    // mapy
+    shp.toLocal(ltw);
 
-    WorldToLocalVisitor ltwv(ltw, true);
-    buildings_model->accept(ltwv);
+    osg::Timer_t start = osg::Timer::instance()->tick();
 
-#if 0
-    // dokonuj dodatkowego przetwarzania wierzchokw po transformacji z ukadu Geo do WGS
-    parse_meta_data(buildings_model);
-#endif
+    const StyleRule& style = map_style->getDefault(STYLE_BUILDINGS);
+    GridChunker chunker(
+        style.chunkSize > 0.f ? style.chunkSize : buildingChunkSize);
 
+    std::vector<Footprint> footprints;
+    std::map<GridChunker::Cell, unsigned int> chunkIndex;
+    collect_footprints(shp, chunker, footprints, chunkIndex);
 
+    std::vector<std::vector<unsigned int>> members(chunkIndex.size());
+    for (unsigned int i = 0; i < footprints.size(); ++i)
+        members[footprints[i].chunk].push_back(i);
 
+    std::vector<GridChunker::Cell> cells(chunkIndex.size());
+    for (auto& chunk : chunkIndex) cells[chunk.second] = chunk.first;
 
+    // extrusion runs in parallel per chunk, the footprints of a chunk go
+    // straight into the meshes of its levels in the scratch of the thread
+    std::vector<osg::ref_ptr<osg::Geometry>> chunks(
+        members.size() * BUILDING_NUM_LEVELS);
+    std::vector<float> bases(map_terrain.valid() ? shp.getNumRecords() : 1,
+                             0.f);
+    {
+        StageProfile profile("buildings extrusion");
+        profile.setNumItems(footprints.size());
 
+        parallel_for(members.size(), [&](size_t c)
+        {
+            thread_local BuildingScratch scratch;
+            for (BuildingMesh& level : scratch.levels) level.clear();
 
-    // GOOD LUCK!
+            for (unsigned int i : members[c])
+            {
+                size_t begin[BUILDING_NUM_LEVELS];
+                for (int l = 0; l < BUILDING_NUM_LEVELS; ++l)
+                    begin[l] = scratch.levels[l].verts.size();
+                extrude_building(shp, footprints[i], scratch.levels, scratch);
+
+                // on a DEM the walls start at the lowest ground under the
+                // footprint
+                if (!map_terrain.valid()) continue;
+                unsigned int record = footprints[i].record;
+                unsigned int first =
+                    shp.getFirstPoint(shp.getFirstPart(record));
+                unsigned int end = shp.getFirstPoint(shp.getEndPart(record));
+                float base = map_terrain->getMinHeight(
+                    shp.getLocalPoints().data() + first, end - first);
+                bases[record] = base;
+                for (int l = 0; l < BUILDING_NUM_LEVELS; ++l)
+                {
+                    std::vector<osg::Vec3>& verts = scratch.levels[l].verts;
+                    for (size_t v = begin[l]; v < verts.size(); ++v)
+                        verts[v].z() += base;
+                }
+            }
 
+            // relative to the origin of the chunk
+            osg::Vec3 origin = chunker.getOrigin(cells[c]);
+            for (int l = 0; l < BUILDING_NUM_LEVELS; ++l)
+            {
+                for (osg::Vec3& v : scratch.levels[l].verts) v -= origin;
+                chunks[c * BUILDING_NUM_LEVELS + l] =
+                    create_building_geometry(scratch.levels[l]);
+            }
+        }, 1);
+    }
 
+    // the flat roofs stay until the minimum zoom of the buildings style
+    float ranges[BUILDING_NUM_LEVELS + 1] = {
+        0.f,
+        float(zoomToDistance(buildingFullZoom)),
+        float(zoomToDistance(buildingBoxZoom)),
+        style.minZoom > 0.f ? float(zoomToDistance(style.minZoom)) : FLT_MAX
+    };
 
+    size_t numVerts[BUILDING_NUM_LEVELS] = {0, 0, 0};
+    for (size_t c = 0; c < members.size(); ++c)
+    {
+        osg::LOD* lod = new osg::LOD;
+        for (int l = 0; l < BUILDING_NUM_LEVELS; ++l)
+        {
+            osg::Geometry* geom = chunks[c * BUILDING_NUM_LEVELS + l].get();
+            numVerts[l] += geom->getVertexArray()->getNumElements();
 
+            osg::Geode* geode = new osg::Geode;
+            geode->addDrawable(geom);
+            lod->addChild(geode, ranges[l], ranges[l + 1]);
+        }
+        chunker.addChunk(cells[c], lod);
+    }
+    osg::Node* buildings = chunker.build(register_chunk_stats("Buildings"));
 
+    buildings->setStateSet(createLitColorStateSet(style.color));
 
+    // below the minimum zoom the chunk LODs are not even visited
+    if (style.minZoom > 0.f || style.maxZoom < 30.f)
+        buildings->setCullCallback(
+            new ZoomRangeCallback(style.minZoom, style.maxZoom));
 
+    // footprints stay for picking as prisms of the extruded height, from
+    // the ground the walls start at
+    if (map_picker.valid())
+    {
+        std::vector<float> heights(shp.getNumRecords(), 0.f);
+        for (const Footprint& fp : footprints) heights[fp.record] = fp.height;
+        register_pick_index(new FeatureIndex("buildings", shp, bases, heights));
+    }
 
+    std::cout << "--- BUILDINGS: Extruded " << footprints.size()
+              << " buildings into " << members.size() << " chunks in "
+              << osg::Timer::instance()->delta_m(start,
+                                                 osg::Timer::instance()->tick())
+              << " ms, vertices full/box/flat " << numVerts[BUILDING_FULL]
+              << "/" << numVerts[BUILDING_BOX] << "/"
+              << numVerts[BUILDING_FLAT] << std::endl;
 
-    return buildings_model.release();
+    return buildings;
 }
-
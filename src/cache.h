@@ -0,0 +1,51 @@
+#ifndef CACHE_H
+#define CACHE_H
+
+#include <sys/stat.h>
+
+#include <cstddef>
+#include <cstdint>
+#include <string>
+
+// size of the file in bytes, 0 when it cannot be read
+inline size_t file_size(const std::string& path)
+{
+    struct stat info;
+    return stat(path.c_str(), &info) == 0 ? size_t(info.st_size) : 0;
+}
+
+// FNV-1a hash of what a file of the cache directory was built from, part
+// of its name: a change of the data, the frame or the style leads to
+// another file, so a stale one is never read.
+class CacheKey {
+public:
+    void mix(const void* data, size_t size)
+    {
+        for (size_t i = 0; i < size; ++i)
+        {
+            _hash ^= ((const unsigned char*)data)[i];
+            _hash *= 16777619u;
+        }
+    }
+
+    // the size and the modification time of the source file, so that any
+    // write to it, the same length or not, changes the key
+    void mixFile(const std::string& path)
+    {
+        struct stat info;
+        int64_t values[2] = {-1, 0};
+        if (stat(path.c_str(), &info) == 0)
+        {
+            values[0] = int64_t(info.st_size);
+            values[1] = int64_t(info.st_mtime);
+        }
+        mix(values, sizeof(values));
+    }
+
+    unsigned int get() const { return _hash; }
+
+protected:
+    unsigned int _hash = 2166136261u;
+};
+
+#endif // CACHE_H
@@ -7,6 +7,8 @@
 #include <osg/Node>
 #include <algorithm>
 
+#include "zoom.h"
+
 class GoogleMapsManipulator : public osgGA::CameraManipulator {
 public:
     GoogleMapsManipulator()
@@ -19,10 +21,30 @@ public:
         {
             const osg::BoundingSphere bs = _node->getBound();
             _center = bs.center();
-            _distance = bs.radius() * 0.5;
+            setDistance(bs.radius() * 0.5);
         }
     }
 
+    // Camera distance above the center; the map zoom level follows it.
+    void setDistance(double distance)
+    {
+        _distance = distance;
+        if (map_zoom.valid()) map_zoom->setZoom(distanceToZoom(_distance));
+    }
+    double getDistance() const { return _distance; }
+
+    // Smooth flight to a new center and distance, advanced by frame events;
+    // the distance changes geometrically so every zoom level takes as long.
+    void flyTo(const osg::Vec3d& center, double distance, double duration = 1.5)
+    {
+        _flightFrom = _center;
+        _flightFromDistance = _distance;
+        _flightTo = center;
+        _flightToDistance = distance;
+        _flightDuration = duration;
+        _flightStart = -1.0; // taken from the next frame
+    }
+
     void setNode(osg::Node* node) override
     {
         _node = node;
@@ -57,8 +79,24 @@ public:
     bool handle(const osgGA::GUIEventAdapter& ea,
                 osgGA::GUIActionAdapter& aa) override
     {
+        if (ea.getEventType() == osgGA::GUIEventAdapter::FRAME
+            && _flightDuration > 0.0)
+        {
+            if (_flightStart < 0.0) _flightStart = ea.getTime();
+            double t = std::min((ea.getTime() - _flightStart) / _flightDuration,
+                                1.0);
+            double s = t * t * (3.0 - 2.0 * t);
+            _center = _flightFrom * (1.0 - s) + _flightTo * s;
+            setDistance(std::exp(std::log(_flightFromDistance) * (1.0 - s)
+                                 + std::log(_flightToDistance) * s));
+            if (t >= 1.0) _flightDuration = 0.0;
+            aa.requestRedraw();
+            return false;
+        }
         if (ea.getEventType() == osgGA::GUIEventAdapter::PUSH)
         {
+            // Grabbing the map stops a flight.
+            _flightDuration = 0.0;
             // Remember cursor position to compute drag deltas.
             _lastX = ea.getXnormalized();
             _lastY = ea.getYnormalized();
@@ -85,11 +123,11 @@ public:
         if (ea.getEventType() == osgGA::GUIEventAdapter::SCROLL)
         {
             // Zoom toward/away from the center.
-            _distance *=
+            double distance = _distance *
                 (ea.getScrollingMotion() == osgGA::GUIEventAdapter::SCROLL_UP
                      ? 0.8
                      : 1.25);
-            _distance = std::max(_distance, 10.0);
+            setDistance(std::max(distance, 10.0));
             aa.requestRedraw();
             return true;
         }
@@ -105,4 +143,8 @@ private:
     osg::Vec3d _center;
     double _distance;
     float _lastX, _lastY;
+
+    osg::Vec3d _flightFrom, _flightTo;
+    double _flightFromDistance = 0.0, _flightToDistance = 0.0;
+    double _flightStart = 0.0, _flightDuration = 0.0;
 };
\ No newline at end of file
@@ -0,0 +1,128 @@
+#include <osg/Group>
+#include <osg/MatrixTransform>
+
+#include <vector>
+#include <map>
+#include <algorithm>
+#include <cmath>
+
+#include "chunker.h"
+#include "shapefile.h"
+#include "reload.h"
+
+// quadtree nodes with this many chunks or less hold them directly
+const unsigned int chunkTreeLeafSize = 4;
+
+ChunkStats* register_chunk_stats(const std::string& name)
+{
+    ChunkStats* stats = new ChunkStats(name);
+    if (LayerUpdate* update = staged_layer_update())
+        update->chunkStats.push_back(stats);
+    else map_chunk_stats.push_back(stats);
+    return stats;
+}
+
+void ChunkStats::publish(osg::Stats* stats, unsigned int frame)
+{
+    unsigned int drawn = _drawn.exchange(0);
+    if (!stats) return;
+
+    stats->setAttribute(frame, _name + " chunks drawn", drawn);
+    stats->setAttribute(frame, _name + " chunks culled",
+                        _numChunks - std::min(drawn, _numChunks));
+}
+
+////////////////////////////////////////////////////////////////////////////////
+
+GridChunker::Cell GridChunker::getCell(const osg::Vec3& p) const
+{
+    return Cell(int(std::floor(p.x() / _cellSize)),
+                int(std::floor(p.y() / _cellSize)));
+}
+
+osg::Vec3 GridChunker::getOrigin(const Cell& cell) const
+{
+    return osg::Vec3((cell.first + 0.5f) * _cellSize,
+                     (cell.second + 0.5f) * _cellSize, 0.f);
+}
+
+void GridChunker::split(const ShapeFile& shp,
+                        const std::vector<unsigned int>& records,
+                        std::map<Cell, std::vector<unsigned int>>& cells) const
+{
+    auto add = [&](unsigned int r)
+    {
+        if (shp.getFirstPart(r) == shp.getEndPart(r)) return;
+        cells[getCell(shp.getRecordBounds(r).center())].push_back(r);
+    };
+
+    if (records.empty())
+    {
+        for (unsigned int r = 0; r < shp.getNumRecords(); ++r) add(r);
+    }
+    else
+    {
+        for (unsigned int r : records) add(r);
+    }
+}
+
+osg::Node* GridChunker::build(ChunkStats* stats)
+{
+    osg::Group* root = new osg::Group;
+    if (_chunks.empty()) return root;
+
+    int x0 = _chunks[0].first.first, y0 = _chunks[0].first.second;
+    int x1 = x0, y1 = y0;
+    for (Chunk& c : _chunks)
+    {
+        x0 = std::min(x0, c.first.first);
+        y0 = std::min(y0, c.first.second);
+        x1 = std::max(x1, c.first.first);
+        y1 = std::max(y1, c.first.second);
+
+        osg::MatrixTransform* transform =
+            new osg::MatrixTransform(
+                osg::Matrixd::translate(getOrigin(c.first)));
+        transform->addChild(c.second.get());
+        c.second = transform;
+
+        if (stats) c.second->addCullCallback(new ChunkCullCallback(stats));
+    }
+    if (stats) stats->addChunks(_chunks.size());
+
+    int size = 1;
+    while (size <= std::max(x1 - x0, y1 - y0)) size *= 2;
+
+    root->addChild(buildQuad(_chunks, x0, y0, size));
+    _chunks.clear();
+    return root;
+}
+
+osg::Node* GridChunker::buildQuad(std::vector<Chunk>& chunks, int x, int y,
+                                  int size)
+{
+    osg::Group* group = new osg::Group;
+    if (chunks.size() <= chunkTreeLeafSize || size == 1)
+    {
+        for (Chunk& c : chunks) group->addChild(c.second.get());
+        return group;
+    }
+
+    int half = size / 2;
+    std::vector<Chunk> quadrants[4];
+    for (Chunk& c : chunks)
+    {
+        int q = (c.first.first >= x + half ? 1 : 0)
+            + (c.first.second >= y + half ? 2 : 0);
+        quadrants[q].push_back(c);
+    }
+    chunks.clear();
+
+    for (int q = 0; q < 4; ++q)
+    {
+        if (quadrants[q].empty()) continue;
+        group->addChild(buildQuad(quadrants[q], x + (q & 1 ? half : 0),
+                                  y + (q & 2 ? half : 0), half));
+    }
+    return group;
+}
@@ -0,0 +1,115 @@
+#ifndef CHUNKER_H
+#define CHUNKER_H
+
+#include <osg/Referenced>
+#include <osg/ref_ptr>
+#include <osg/Node>
+#include <osg/NodeCallback>
+#include <osg/NodeVisitor>
+#include <osg/Vec3>
+#include <osg/Stats>
+
+#include <atomic>
+#include <map>
+#include <string>
+#include <vector>
+#include <utility>
+
+class ShapeFile;
+
+// Chunks of one layer and how many of them passed frustum culling in the
+// last frame; the cull callback of a chunk is only reached when it did.
+class ChunkStats : public osg::Referenced {
+public:
+    ChunkStats(const std::string& name) : _name(name), _numChunks(0), _drawn(0)
+    {
+    }
+
+    const std::string& getName() const { return _name; }
+
+    unsigned int getNumChunks() const { return _numChunks; }
+    void addChunks(unsigned int count) { _numChunks += count; }
+
+    void countDrawn() { _drawn++; }
+
+    // stores the counts of the frame just finished as the attributes
+    // "<name> chunks drawn" and "<name> chunks culled", then starts over
+    void publish(osg::Stats* stats, unsigned int frame);
+
+protected:
+    std::string _name;
+    unsigned int _numChunks;
+    std::atomic<unsigned int> _drawn;
+};
+
+// stats of every chunked layer, for the stats handler
+extern std::vector<osg::ref_ptr<ChunkStats>> map_chunk_stats;
+
+// creates the stats of a layer and registers them, with the layer update
+// when this thread is loading one
+ChunkStats* register_chunk_stats(const std::string& name);
+
+class ChunkCullCallback : public osg::NodeCallback {
+public:
+    ChunkCullCallback(ChunkStats* stats) : _stats(stats) {}
+
+    void operator()(osg::Node* node, osg::NodeVisitor* nv) override
+    {
+        _stats->countDrawn();
+        traverse(node, nv);
+    }
+
+protected:
+    osg::ref_ptr<ChunkStats> _stats;
+};
+
+////////////////////////////////////////////////////////////////////////////////
+
+// Uniform grid of square cells over the local map frame, shared by the
+// layers. Records go to the cell of their bounds center and a layer turns
+// every cell into one chunk node. The chunks are then put into a quadtree
+// of groups over the cell indices, so cull drops blocks of cells with one
+// bounding sphere test and its cost follows the visible area instead of
+// the number of chunks.
+//
+// Every chunk has its own origin at the centre of its cell: layers build
+// the vertices of a chunk relative to getOrigin() and build() puts the
+// chunk under a transform to it. Vertices stay small floats anywhere in a
+// large extract while the offsets are double matrices, which OSG combines
+// with the view on the CPU.
+class GridChunker {
+public:
+    typedef std::pair<int, int> Cell;
+
+    GridChunker(float cellSize) : _cellSize(cellSize) {}
+
+    float getCellSize() const { return _cellSize; }
+    Cell getCell(const osg::Vec3& p) const;
+    // centre of the cell in the local map frame
+    osg::Vec3 getOrigin(const Cell& cell) const;
+
+    // records of shp with any parts by the cell they fall in; all of them
+    // when records is empty
+    void split(const ShapeFile& shp, const std::vector<unsigned int>& records,
+               std::map<Cell, std::vector<unsigned int>>& cells) const;
+
+    void addChunk(const Cell& cell, osg::Node* node)
+    {
+        _chunks.push_back(std::make_pair(cell, node));
+    }
+    unsigned int getNumChunks() const { return _chunks.size(); }
+
+    // quadtree of the chunks added so far, each under the transform to its
+    // origin and counted in stats when drawn
+    osg::Node* build(ChunkStats* stats);
+
+protected:
+    typedef std::pair<Cell, osg::ref_ptr<osg::Node>> Chunk;
+
+    osg::Node* buildQuad(std::vector<Chunk>& chunks, int x, int y, int size);
+
+    float _cellSize;
+    std::vector<Chunk> _chunks;
+};
+
+#endif // CHUNKER_H
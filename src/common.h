@@ -2,13 +2,31 @@
 #define COMMON_H
 
 namespace osgViewer { class Viewer; }
+class RoadsParse;
 
 
 osg::Node* process_landuse(osg::Matrixd& ltw, osg::BoundingBox& wbb, const std::string & file_path);
+// the frame process_landuse sets up, from the header of the landuse layer
+bool read_map_frame(const std::string & file_path, osg::Matrixd& ltw,
+                    osg::BoundingBox& wbb);
 osg::Node* process_water(osg::Matrixd& ltw, const std::string & file_path);
 osg::Node* process_buildings(osg::Matrixd& ltw, const std::string & file_path);
-osg::Node* process_roads(osg::Matrixd& ltw, const std::string & file_path);
+// leaves its parse of the roads file in parse for process_routing()
+osg::Node* process_roads(osg::Matrixd& ltw, const std::string & file_path,
+                         RoadsParse* parse = nullptr);
 osg::Node* process_labels(osg::Matrixd& ltw, const std::string & file_path);
+osg::Node* process_basemap(osg::Matrixd& ltw, const std::string & file_path);
+// DEM tiles, or directories of them, over the extent of the map; sets
+// map_terrain
+osg::Node* process_terrain(osg::Matrixd& ltw, const std::string & file_path,
+                           const std::vector<std::string>& dem_paths);
+// road graph of the roads layer, contracted or from the cache; the overlay
+// of the routes on it; built from the parse process_roads() left, when any
+osg::Node* process_routing(osg::Matrixd& ltw, const std::string & file_path,
+                           RoadsParse* parse = nullptr);
+
+int bench_tessellation(const std::string & file_path);
+int bench_threading(unsigned int frames);
 
 
 extern osg::ref_ptr<osg::EllipsoidModel> ellipsoid;
@@ -173,4 +191,48 @@ public:
     osg::BoundingBox & _bb;
     std::string _name;
 };
+
+////////////////////////////////////////////////////////////////////////////////
+
+// Marks nodes, drawables, state sets, their attributes and uniforms STATIC
+// unless they are already DYNAMIC. Nothing STATIC is touched after load, so
+// with DrawThreadPerContext the update and cull of the next frame may run
+// while the draw thread still renders the last one.
+class StaticDataVarianceVisitor : public osg::NodeVisitor
+{
+public:
+
+    StaticDataVarianceVisitor() :
+        osg::NodeVisitor(osg::NodeVisitor::TRAVERSE_ALL_CHILDREN)
+    {}
+
+    static void setStatic(osg::Object* object)
+    {
+        if (object && object->getDataVariance() != osg::Object::DYNAMIC)
+            object->setDataVariance(osg::Object::STATIC);
+    }
+
+    static void setStatic(osg::StateSet* ss)
+    {
+        if (!ss) return;
+        setStatic(static_cast<osg::Object*>(ss));
+        for (auto& a : ss->getAttributeList()) setStatic(a.second.first.get());
+        for (auto& unit : ss->getTextureAttributeList())
+            for (auto& a : unit) setStatic(a.second.first.get());
+        for (auto& u : ss->getUniformList()) setStatic(u.second.first.get());
+    }
+
+    virtual void apply(osg::Node& node)
+    {
+        setStatic(&node);
+        setStatic(node.getStateSet());
+        traverse(node);
+    }
+
+    virtual void apply(osg::Drawable& drawable)
+    {
+        setStatic(&drawable);
+        setStatic(drawable.getStateSet());
+    }
+};
 #endif // COMMON_H
\ No newline at end of file
@@ -0,0 +1,466 @@
+#include <osgDB/ReadFile>
+#include <osgDB/WriteFile>
+#include <osgDB/FileNameUtils>
+#include <osgDB/FileUtils>
+#include <osg/Texture2D>
+#include <osg/Program>
+#include <osg/BlendFunc>
+#include <osg/Timer>
+
+#include <iostream>
+#include <fstream>
+#include <sstream>
+#include <vector>
+#include <algorithm>
+#include <cstring>
+#include <cmath>
+#include <cfloat>
+
+#include "glyph_atlas.h"
+
+static const char* textVertSource = R"(
+    #version 420 compatibility
+
+    out vec2 v_texCoord;
+    out vec4 v_color;
+
+    void main()
+    {
+        v_texCoord = gl_MultiTexCoord0.xy;
+        v_color = gl_Color;
+        gl_Position = gl_ModelViewProjectionMatrix * gl_Vertex;
+    }
+)";
+
+// the atlas stores 0.5 on the glyph edge, growing towards the inside; the
+// outline is the band between the edge and outlineWidth further out
+static const char* textFragSource = R"(
+    #version 420 compatibility
+
+    uniform sampler2D glyphAtlas;
+    uniform vec4 outlineColor;
+    uniform float outlineWidth;
+
+    in vec2 v_texCoord;
+    in vec4 v_color;
+
+    void main()
+    {
+        float d = texture(glyphAtlas, v_texCoord).r;
+        float aa = fwidth(d);
+
+        float fill = smoothstep(0.5 - aa, 0.5 + aa, d);
+        float edge = 0.5 - outlineWidth;
+        float outline = smoothstep(edge - aa, edge + aa, d);
+
+        vec4 color = mix(outlineColor, v_color, fill);
+        color.a *= outline;
+        if (color.a <= 0.0) discard;
+
+        gl_FragColor = color;
+    }
+)";
+
+static const char* cacheHeader = "osgMap-glyph-atlas";
+static const int cacheVersion = 1;
+
+GlyphAtlas::GlyphAtlas(unsigned int resolution, unsigned int spread) :
+    _resolution(resolution), _spread(spread)
+{
+    _colors = new osg::Vec4Array;
+    _colors->push_back(osg::Vec4(1, 1, 1, 1));
+}
+
+// squared euclidean distance transform of one row (Felzenszwalb &
+// Huttenlocher), f holds 0 on the features and a large value elsewhere
+static void distanceTransform1D(const float* f, float* d, int n, int* v,
+                                float* z)
+{
+    int k = 0;
+    v[0] = 0;
+    z[0] = -FLT_MAX;
+    z[1] = FLT_MAX;
+    for (int q = 1; q < n; ++q)
+    {
+        float s =
+            ((f[q] + q * q) - (f[v[k]] + v[k] * v[k])) / (2 * q - 2 * v[k]);
+        while (s <= z[k])
+        {
+            --k;
+            s = ((f[q] + q * q) - (f[v[k]] + v[k] * v[k])) / (2 * q - 2 * v[k]);
+        }
+        ++k;
+        v[k] = q;
+        z[k] = s;
+        z[k + 1] = FLT_MAX;
+    }
+
+    k = 0;
+    for (int q = 0; q < n; ++q)
+    {
+        while (z[k + 1] < q) ++k;
+        d[q] = (q - v[k]) * (q - v[k]) + f[v[k]];
+    }
+}
+
+static void distanceTransform2D(std::vector<float>& grid, int w, int h)
+{
+    int n = std::max(w, h);
+    std::vector<float> f(n), d(n), z(n + 1);
+    std::vector<int> v(n);
+
+    for (int x = 0; x < w; ++x)
+    {
+        for (int y = 0; y < h; ++y) f[y] = grid[y * w + x];
+        distanceTransform1D(f.data(), d.data(), h, v.data(), z.data());
+        for (int y = 0; y < h; ++y) grid[y * w + x] = d[y];
+    }
+
+    for (int y = 0; y < h; ++y)
+    {
+        distanceTransform1D(&grid[y * w], d.data(), w, v.data(), z.data());
+        std::memcpy(&grid[y * w], d.data(), w * sizeof(float));
+    }
+}
+
+// distance field of the glyph bitmap grown by pad pixels on every side,
+// encoded as 0.5 + distance / (2 * spread) with positive distances inside
+static std::vector<unsigned char> computeDistanceField(const osg::Image* glyph,
+                                                       int pad, int spread)
+{
+    const float infinity = 1e20f;
+    int w = glyph->s() + 2 * pad;
+    int h = glyph->t() + 2 * pad;
+    unsigned int components =
+        osg::Image::computeNumComponents(glyph->getPixelFormat());
+
+    // toInside holds the distance to the nearest ink pixel, toOutside the
+    // distance to the nearest empty one
+    std::vector<float> toInside(w * h, infinity), toOutside(w * h, 0.f);
+    for (int y = 0; y < glyph->t(); ++y)
+    {
+        for (int x = 0; x < glyph->s(); ++x)
+        {
+            // coverage is the last component for both alpha and luminance
+            // glyph images
+            if (glyph->data(x, y)[components - 1] < 128) continue;
+
+            int i = (y + pad) * w + x + pad;
+            toInside[i] = 0.f;
+            toOutside[i] = infinity;
+        }
+    }
+
+    distanceTransform2D(toInside, w, h);
+    distanceTransform2D(toOutside, w, h);
+
+    std::vector<unsigned char> sdf(w * h);
+    for (int i = 0; i < w * h; ++i)
+    {
+        // pixel centres lie half a pixel away from the edge between them
+        float dist = toOutside[i] > 0.f ? std::sqrt(toOutside[i]) - 0.5f
+                                        : 0.5f - std::sqrt(toInside[i]);
+        float value = 0.5f + dist / (2.f * spread);
+        sdf[i] =
+            (unsigned char)(osg::clampBetween(value, 0.f, 1.f) * 255.f + 0.5f);
+    }
+    return sdf;
+}
+
+bool GlyphAtlas::rasterise(osgText::Font* font,
+                           const std::set<unsigned int>& charset)
+{
+    struct Cell
+    {
+        unsigned int code;
+        int x, y, w, h;
+        std::vector<unsigned char> sdf;
+    };
+    std::vector<Cell> cells;
+
+    osgText::FontResolution fontRes(_resolution, _resolution);
+    const float pxToEm = 1.f / _resolution;
+    const int pad = _spread;
+    size_t area = 0;
+
+    for (unsigned int code : charset)
+    {
+        osgText::Glyph* glyph = font->getGlyph(fontRes, code);
+        if (!glyph) continue;
+
+        GlyphInfo& info = _glyphs[code];
+        info.advance = glyph->getHorizontalAdvance();
+        if (glyph->s() <= 0 || glyph->t() <= 0) continue;
+
+        // the font plugin may leave a margin around the ink, the bearing
+        // refers to the ink itself
+        osg::Vec2 margin(
+            0.5f * (glyph->s() - glyph->getWidth() * _resolution),
+            0.5f * (glyph->t() - glyph->getHeight() * _resolution));
+        osg::Vec2 origin = glyph->getHorizontalBearing() - margin * pxToEm;
+
+        info.quadMin = origin - osg::Vec2(pad, pad) * pxToEm;
+        info.quadMax =
+            origin + osg::Vec2(glyph->s() + pad, glyph->t() + pad) * pxToEm;
+        info.inkBottom = glyph->getHorizontalBearing().y();
+
+        Cell cell;
+        cell.code = code;
+        cell.w = glyph->s() + 2 * pad;
+        cell.h = glyph->t() + 2 * pad;
+        cell.sdf = computeDistanceField(glyph, pad, _spread);
+        area += (cell.w + 1) * (cell.h + 1);
+        cells.push_back(std::move(cell));
+    }
+
+    if (_glyphs.empty()) return false;
+
+    // shelf packing of the cells sorted by height, one empty texel between
+    // cells keeps the mipmaps from bleeding into the neighbours
+    std::sort(cells.begin(), cells.end(),
+              [](const Cell& a, const Cell& b) { return a.h > b.h; });
+
+    int width = 256;
+    while ((size_t)width * width < area * 3 / 2) width *= 2;
+
+    int x = 1, y = 1, shelf = 0;
+    for (Cell& cell : cells)
+    {
+        if (x + cell.w + 1 > width)
+        {
+            y += shelf + 1;
+            x = 1;
+            shelf = 0;
+        }
+        cell.x = x;
+        cell.y = y;
+        x += cell.w + 1;
+        shelf = std::max(shelf, cell.h);
+    }
+
+    int height = 1;
+    while (height < y + shelf + 1) height *= 2;
+
+    _image = new osg::Image;
+    _image->allocateImage(width, height, 1, GL_LUMINANCE, GL_UNSIGNED_BYTE);
+    std::memset(_image->data(), 0, _image->getTotalSizeInBytes());
+
+    for (const Cell& cell : cells)
+    {
+        for (int row = 0; row < cell.h; ++row)
+        {
+            std::memcpy(_image->data(cell.x, cell.y + row),
+                        &cell.sdf[row * cell.w], cell.w);
+        }
+
+        GlyphInfo& info = _glyphs[cell.code];
+        info.texMin.set(float(cell.x) / width, float(cell.y) / height);
+        info.texMax.set(float(cell.x + cell.w) / width,
+                        float(cell.y + cell.h) / height);
+    }
+
+    return true;
+}
+
+bool GlyphAtlas::readCache(const std::string& base,
+                           const std::set<unsigned int>& charset)
+{
+    std::ifstream file(base + ".glyphs");
+    if (!file.is_open()) return false;
+
+    std::string header;
+    int version = 0;
+    unsigned int resolution = 0, spread = 0, count = 0;
+    file >> header >> version >> resolution >> spread >> count;
+    if (!file || header != cacheHeader || version != cacheVersion
+        || resolution != _resolution || spread != _spread
+        || count > charset.size())
+        return false;
+
+    std::unordered_map<unsigned int, GlyphInfo> glyphs;
+    for (unsigned int i = 0; i < count; ++i)
+    {
+        unsigned int code;
+        GlyphInfo info;
+        file >> code >> info.texMin.x() >> info.texMin.y()
+             >> info.texMax.x() >> info.texMax.y()
+             >> info.quadMin.x() >> info.quadMin.y()
+             >> info.quadMax.x() >> info.quadMax.y()
+             >> info.inkBottom >> info.advance;
+        if (!file) return false;
+        glyphs[code] = info;
+    }
+
+    osg::ref_ptr<osg::Image> image = osgDB::readRefImageFile(base + ".png");
+    if (!image) return false;
+
+    _glyphs.swap(glyphs);
+    _image = image;
+    return true;
+}
+
+bool GlyphAtlas::writeCache(const std::string& base) const
+{
+    if (!osgDB::makeDirectoryForFile(base)) return false;
+    if (!osgDB::writeImageFile(*_image, base + ".png")) return false;
+
+    std::ofstream file(base + ".glyphs");
+    if (!file.is_open()) return false;
+
+    file << cacheHeader << " " << cacheVersion << "\n"
+         << _resolution << " " << _spread << " " << _glyphs.size() << "\n";
+    file.precision(9);
+    for (const auto& g : _glyphs)
+    {
+        const GlyphInfo& info = g.second;
+        file << g.first << " "
+             << info.texMin.x() << " " << info.texMin.y() << " "
+             << info.texMax.x() << " " << info.texMax.y() << " "
+             << info.quadMin.x() << " " << info.quadMin.y() << " "
+             << info.quadMax.x() << " " << info.quadMax.y() << " "
+             << info.inkBottom << " " << info.advance << "\n";
+    }
+    return bool(file);
+}
+
+bool GlyphAtlas::build(const std::string& fontFile,
+                       const std::set<unsigned int>& charset,
+                       const std::string& cacheDir)
+{
+    // the cache name identifies the font, the raster size and the charset
+    unsigned int hash = 2166136261u;
+    for (unsigned int code : charset)
+    {
+        for (int i = 0; i < 4; ++i)
+        {
+            hash ^= (code >> (i * 8)) & 0xff;
+            hash *= 16777619u;
+        }
+    }
+
+    std::ostringstream base;
+    base << cacheDir << "/" << osgDB::getStrippedName(fontFile) << "_sdf"
+         << _resolution << "_" << std::hex << hash;
+
+    if (readCache(base.str(), charset))
+    {
+        std::cout << "--- GLYPHS: " << _glyphs.size() << " glyphs from "
+                  << base.str() << ".png" << std::endl;
+        createStateSet();
+        return true;
+    }
+
+    osg::ref_ptr<osgText::Font> font = osgText::readRefFontFile(fontFile);
+    if (!font)
+        font = osgText::readRefFontFile(osgDB::getSimpleFileName(fontFile));
+    if (!font) return false;
+
+    osg::Timer_t start = osg::Timer::instance()->tick();
+    if (!rasterise(font.get(), charset)) return false;
+
+    std::cout << "--- GLYPHS: Rasterised " << _glyphs.size() << " glyphs into "
+              << _image->s() << "x" << _image->t() << " atlas in "
+              << osg::Timer::instance()->delta_m(start,
+                                                 osg::Timer::instance()->tick())
+              << " ms" << std::endl;
+
+    if (!writeCache(base.str()))
+    {
+        std::cout << "Cannot write glyph cache " << base.str() << std::endl;
+    }
+
+    createStateSet();
+    return true;
+}
+
+void GlyphAtlas::createStateSet()
+{
+    osg::Texture2D* tex = new osg::Texture2D(_image.get());
+    tex->setFilter(osg::Texture::MIN_FILTER,
+                   osg::Texture::LINEAR_MIPMAP_LINEAR);
+    tex->setFilter(osg::Texture::MAG_FILTER, osg::Texture::LINEAR);
+    tex->setWrap(osg::Texture::WRAP_S, osg::Texture::CLAMP_TO_EDGE);
+    tex->setWrap(osg::Texture::WRAP_T, osg::Texture::CLAMP_TO_EDGE);
+
+    osg::Program* program = new osg::Program;
+    program->addShader(new osg::Shader(osg::Shader::VERTEX, textVertSource));
+    program->addShader(new osg::Shader(osg::Shader::FRAGMENT, textFragSource));
+
+    // same outline thickness as the osgText backdrop default, 7% of the em
+    float outlineWidth = 0.07f * _resolution / (2.f * _spread);
+
+    _stateSet = new osg::StateSet;
+    _stateSet->setTextureAttributeAndModes(0, tex, osg::StateAttribute::ON);
+    _stateSet->setAttributeAndModes(program, osg::StateAttribute::ON);
+    _stateSet->addUniform(new osg::Uniform("glyphAtlas", 0));
+    _stateSet->addUniform(
+        new osg::Uniform("outlineColor", osg::Vec4(0, 0, 0, 1)));
+    _stateSet->addUniform(new osg::Uniform("outlineWidth", outlineWidth));
+    _stateSet->setAttributeAndModes(
+        new osg::BlendFunc(GL_SRC_ALPHA, GL_ONE_MINUS_SRC_ALPHA),
+        osg::StateAttribute::ON);
+    _stateSet->setRenderingHint(osg::StateSet::TRANSPARENT_BIN);
+    _stateSet->setMode(GL_LIGHTING, osg::StateAttribute::OFF);
+}
+
+float GlyphAtlas::getTextWidth(const osgText::String& text) const
+{
+    float width = 0.f;
+    for (unsigned int code : text)
+    {
+        const GlyphInfo* info = getGlyph(code);
+        if (info) width += info->advance;
+    }
+    return width;
+}
+
+osg::Geometry* GlyphAtlas::createTextGeometry(const osgText::String& text,
+                                              float size) const
+{
+    float bottom = FLT_MAX;
+    for (unsigned int code : text)
+    {
+        const GlyphInfo* info = getGlyph(code);
+        if (info && info->quadMax.x() > info->quadMin.x())
+            bottom = std::min(bottom, info->inkBottom);
+    }
+    if (bottom == FLT_MAX) bottom = 0.f;
+
+    osg::Vec3Array* verts = new osg::Vec3Array;
+    osg::Vec2Array* texcoords = new osg::Vec2Array;
+
+    float pen = -0.5f * getTextWidth(text);
+    for (unsigned int code : text)
+    {
+        const GlyphInfo* info = getGlyph(code);
+        if (!info) continue;
+
+        if (info->quadMax.x() > info->quadMin.x())
+        {
+            float x0 = (pen + info->quadMin.x()) * size;
+            float x1 = (pen + info->quadMax.x()) * size;
+            float z0 = (info->quadMin.y() - bottom) * size;
+            float z1 = (info->quadMax.y() - bottom) * size;
+
+            verts->push_back(osg::Vec3(x0, 0, z0));
+            verts->push_back(osg::Vec3(x1, 0, z0));
+            verts->push_back(osg::Vec3(x1, 0, z1));
+            verts->push_back(osg::Vec3(x0, 0, z1));
+
+            texcoords->push_back(info->texMin);
+            texcoords->push_back(osg::Vec2(info->texMax.x(), info->texMin.y()));
+            texcoords->push_back(info->texMax);
+            texcoords->push_back(osg::Vec2(info->texMin.x(), info->texMax.y()));
+        }
+        pen += info->advance;
+    }
+
+    osg::Geometry* geom = new osg::Geometry;
+    geom->setVertexArray(verts);
+    geom->setTexCoordArray(0, texcoords);
+    geom->setColorArray(_colors.get(), osg::Array::BIND_OVERALL);
+    geom->addPrimitiveSet(new osg::DrawArrays(osg::PrimitiveSet::QUADS, 0,
+                                              verts->size()));
+    geom->setStateSet(_stateSet.get());
+    return geom;
+}
@@ -0,0 +1,78 @@
+#ifndef GLYPH_ATLAS_H
+#define GLYPH_ATLAS_H
+
+#include <osg/Referenced>
+#include <osg/ref_ptr>
+#include <osg/Vec2>
+#include <osg/Vec4>
+#include <osg/Image>
+#include <osg/Geometry>
+#include <osg/StateSet>
+#include <osgText/Font>
+#include <osgText/String>
+
+#include <string>
+#include <set>
+#include <unordered_map>
+
+// Metrics of one glyph, in em units of the font with the baseline at y = 0.
+// The quad drawn for a glyph is the bitmap rectangle grown by the distance
+// field spread, so the outline has room around the ink.
+struct GlyphInfo
+{
+    osg::Vec2 texMin, texMax;
+    osg::Vec2 quadMin, quadMax;
+    float inkBottom = 0.f;
+    float advance = 0.f;
+};
+
+////////////////////////////////////////////////////////////////////////////////
+
+// Signed distance field atlas with every glyph of a known character set. The
+// whole set is rasterised once at load time (or read back from the disk
+// cache), so drawing text never generates glyphs. Fill and outline are both
+// resolved in the fragment shader from the same distance, which keeps the
+// outline free of extra geometry.
+class GlyphAtlas : public osg::Referenced {
+public:
+    GlyphAtlas(unsigned int resolution = 48, unsigned int spread = 6);
+
+    // loads the atlas of the charset from cacheDir, or rasterises it from the
+    // font and stores it there for the next run
+    bool build(const std::string& fontFile,
+               const std::set<unsigned int>& charset,
+               const std::string& cacheDir);
+
+    const GlyphInfo* getGlyph(unsigned int charcode) const
+    {
+        auto it = _glyphs.find(charcode);
+        return it == _glyphs.end() ? nullptr : &it->second;
+    }
+
+    // advance width of the text, in em units
+    float getTextWidth(const osgText::String& text) const;
+
+    // quads of the text in the XZ plane, size is the em height in world units;
+    // the text is centred horizontally with its lowest ink at z = 0
+    osg::Geometry* createTextGeometry(const osgText::String& text,
+                                      float size) const;
+
+    osg::StateSet* getStateSet() const { return _stateSet.get(); }
+
+protected:
+    bool readCache(const std::string& base,
+                   const std::set<unsigned int>& charset);
+    bool writeCache(const std::string& base) const;
+    bool rasterise(osgText::Font* font, const std::set<unsigned int>& charset);
+    void createStateSet();
+
+    unsigned int _resolution;
+    unsigned int _spread;
+
+    std::unordered_map<unsigned int, GlyphInfo> _glyphs;
+    osg::ref_ptr<osg::Image> _image;
+    osg::ref_ptr<osg::StateSet> _stateSet;
+    osg::ref_ptr<osg::Vec4Array> _colors;
+};
+
+#endif // GLYPH_ATLAS_H
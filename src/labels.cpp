@@ -17,35 +17,61 @@
 #include <osg/Geometry>
 #include <osg/Image>
 #include <osg/Texture2D>
+#include <osg/LOD>
+#include <osg/Polytope>
+#include <osg/Timer>
+#include <osg/Stats>
+#include <osgViewer/Viewer>
 
 #include <iostream>
 #include <vector>
 #include <string>
+#include <string_view>
 #include <algorithm>
 #include <cctype>
 #include <fstream>
 #include <cstring>
 #include <map>
+#include <set>
 
 #include "common.h"
+#include "style.h"
+#include "glyph_atlas.h"
+#include "zoom.h"
+#include "shapefile.h"
+#include "picking.h"
+#include "search.h"
+#include "chunker.h"
+#include "arena.h"
+#include "alloc_stats.h"
+#include "trace.h"
+#include "terrain.h"
 
 using namespace osg;
 
+// labels hang this high above their points
+const float labelHeight = 25.0f;
+
+// a click this close to the anchor of a label picks its point
+const float labelPickRadius = 8.0f;
+
+// the strings are views into the attributes of the DBF reader
 struct LabelData
 {
     osg::Vec3 position;
-    std::string name;
-    std::string type;
-    std::string subtype;
+    std::string_view name;
+    std::string_view type;
+    std::string_view subtype;
 };
 
 class SimpleDBFReader {
 public:
+    // views into the arena of the reader, valid as long as it is
     struct Record
     {
-        std::string name;
-        std::string type;
-        std::string subtype;
+        std::string_view name;
+        std::string_view type;
+        std::string_view subtype;
     };
     std::vector<Record> records;
 
@@ -55,19 +81,23 @@ public:
         int length = 0;
     };
 
-    std::string cleanString(std::string s)
+    // the field without padding, optionally lower case, copied to the arena
+    std::string_view cleanString(const char* s, size_t length,
+                                 bool lower = false)
     {
-        while (!s.empty())
+        const char* end = s + length;
+        while (end > s)
         {
-            unsigned char c = (unsigned char)s.back();
+            unsigned char c = (unsigned char)end[-1];
             if (std::isalnum(c) || std::ispunct(c) || c > 127) break;
-            s.pop_back();
+            --end;
         }
-        s.erase(s.begin(),
-                std::find_if(s.begin(), s.end(), [](unsigned char ch) {
-                    return !std::isspace(ch);
-                }));
-        return s;
+        while (s < end && std::isspace((unsigned char)*s)) ++s;
+
+        char* d = _strings.allocateArray<char>(end - s);
+        for (size_t i = 0; i < size_t(end - s); ++i)
+            d[i] = lower ? char(std::tolower((unsigned char)s[i])) : s[i];
+        return std::string_view(d, end - s);
     }
 
     bool load(const std::string& path)
@@ -122,36 +152,36 @@ public:
         }
 
         file.seekg(headerSize);
-        char* buffer = new char[recordSize];
+        std::vector<char> buffer(recordSize);
+        records.reserve(numRecords);
 
         for (unsigned int i = 0; i < numRecords; ++i)
         {
-            file.read(buffer, recordSize);
+            file.read(buffer.data(), recordSize);
             if (file.gcount() < recordSize) break;
 
             Record rec;
             if (nameField.offset != -1)
-                rec.name = cleanString(
-                    std::string(buffer + nameField.offset, nameField.length));
+                rec.name = cleanString(buffer.data() + nameField.offset,
+                                       nameField.length);
             if (typeField.offset != -1)
-                rec.type = cleanString(
-                    std::string(buffer + typeField.offset, typeField.length));
+                rec.type = cleanString(buffer.data() + typeField.offset,
+                                       typeField.length, true);
             else
                 rec.type = "default";
             if (subtypeField.offset != -1)
-                rec.subtype = cleanString(std::string(
-                    buffer + subtypeField.offset, subtypeField.length));
-
-            std::transform(rec.type.begin(), rec.type.end(), rec.type.begin(),
-                           ::tolower);
-            std::transform(rec.subtype.begin(), rec.subtype.end(),
-                           rec.subtype.begin(), ::tolower);
+                rec.subtype = cleanString(buffer.data() + subtypeField.offset,
+                                          subtypeField.length, true);
 
             records.push_back(rec);
         }
-        delete[] buffer;
         return true;
     }
+
+protected:
+    // the attribute strings of all records, a few large blocks instead of
+    // three strings per record
+    Arena _strings;
 };
 
 class OnlyGeometryExtractor : public osg::NodeVisitor {
@@ -174,42 +204,6 @@ public:
     }
 };
 
-std::string determineIconTexture(const std::string& type,
-                                 const std::string& subtype)
-{
-    auto matches = [&](const std::string& keyword) {
-        return (subtype.find(keyword) != std::string::npos
-                || type.find(keyword) != std::string::npos);
-    };
-
-    // --- TRANSPORT ---
-    if (matches("bus_stop")) return "bus.png";
-    if (matches("tram_stop")) return "tram.png";
-    if (matches("subway_entrance")) return "subway.png";
-    if (matches("station")) return "train.png";
-    if (matches("halt")) return "default.png";
-
-    // --- EDUKACJA ---
-    if (matches("university")) return "university.png";
-    if (matches("college")) return "university.png";
-    if (matches("school")) return "school.png";
-    if (matches("kindergarten")) return "school.png";
-
-    // --- GASTRONOMIA / ROZRYWKA ---
-    if (matches("bar")) return "bar.png";
-    if (matches("pub")) return "bar.png";
-    if (matches("cafe")) return "cafe.png";
-    if (matches("restaurant")) return "restaurant.png";
-    if (matches("fast_food")) return "restaurant.png";
-
-    // --- ADMINISTRACJA ---
-    if (matches("townhall")) return "hall.png";
-    if (matches("government")) return "hall.png";
-    if (matches("public_building")) return "hall.png";
-
-    return "default.png"; // Brak dopasowania
-}
-
 osg::StateSet*
 getSharedStateSet(const std::string& filename,
                   std::map<std::string, osg::ref_ptr<osg::StateSet>>& cache)
@@ -250,72 +244,489 @@ getSharedStateSet(const std::string& filename,
     return ss.get();
 }
 
+// icon quad of one icon texture, shared by all labels showing it
+osg::Geometry* createIconGeometry(osg::StateSet* iconStateSet)
+{
+    osg::Geometry* iconGeom = new osg::Geometry();
+
+    float w = 6.0f;
+    float h = 6.0f;
+
+    osg::Vec3Array* verts = new osg::Vec3Array;
+    verts->push_back(osg::Vec3(-w, 0, -h));
+    verts->push_back(osg::Vec3(w, 0, -h));
+    verts->push_back(osg::Vec3(w, 0, h));
+    verts->push_back(osg::Vec3(-w, 0, h));
+    iconGeom->setVertexArray(verts);
+
+    osg::Vec2Array* texcoords = new osg::Vec2Array;
+    texcoords->push_back(osg::Vec2(0, 0));
+    texcoords->push_back(osg::Vec2(1, 0));
+    texcoords->push_back(osg::Vec2(1, 1));
+    texcoords->push_back(osg::Vec2(0, 1));
+    iconGeom->setTexCoordArray(0, texcoords);
+
+    osg::Vec4Array* colors = new osg::Vec4Array;
+    colors->push_back(osg::Vec4(1, 1, 1, 1));
+    iconGeom->setColorArray(colors, osg::Array::BIND_OVERALL);
+
+    iconGeom->addPrimitiveSet(
+        new osg::DrawArrays(osg::PrimitiveSet::QUADS, 0, 4));
+
+    iconGeom->setStateSet(iconStateSet);
+    return iconGeom;
+}
+
+// osgText label for when the glyph atlas cannot be built, its glyphs are
+// rendered while drawing
+osg::Drawable* createFallbackText(const osgText::String& string)
+{
+    static osg::ref_ptr<osgText::Font> sharedFont = []()
+    {
+        osg::ref_ptr<osgText::Font> font =
+            osgText::readRefFontFile("fonts/arial.ttf");
+        return font.valid() ? font : osgText::readRefFontFile("arial.ttf");
+    }();
+
+    osgText::Text* text = new osgText::Text;
+    text->setFont(sharedFont);
+    text->setText(string);
+    text->setAlignment(osgText::Text::CENTER_BOTTOM);
+    text->setAxisAlignment(osgText::Text::XZ_PLANE);
+    text->setCharacterSize(3.5f);
+    text->setBackdropType(osgText::Text::OUTLINE);
+    text->setColor(osg::Vec4(1, 1, 1, 1));
+    return text;
+}
+
+// the text comes from the atlas, or from osgText without one
 osg::Billboard* createLabelNode(const LabelData& data,
-                                osg::StateSet* sharedIconStateSet)
+                                osg::Geometry* sharedIcon,
+                                const GlyphAtlas* atlas)
 {
     osg::Billboard* bb = new osg::Billboard();
     bb->setMode(osg::Billboard::POINT_ROT_EYE);
 
-    bool hasIcon = (sharedIconStateSet != nullptr);
+    bool hasIcon = (sharedIcon != nullptr);
+
+    if (hasIcon) bb->addDrawable(sharedIcon, data.position);
 
-    if (hasIcon)
+    if (!data.name.empty())
     {
-        osg::Geometry* iconGeom = new osg::Geometry();
+        osgText::String text(std::string(data.name),
+                             osgText::String::ENCODING_UTF8);
 
-        float w = 6.0f;
-        float h = 6.0f;
+        float offsetZ = hasIcon ? 7.0f : 0.0f;
+        bb->addDrawable(atlas ? atlas->createTextGeometry(text, 3.5f)
+                              : createFallbackText(text),
+                        data.position + osg::Vec3(0, 0, offsetZ));
+    }
+
+    osg::StateSet* ss = bb->getOrCreateStateSet();
+    ss->setMode(GL_LIGHTING,
+                osg::StateAttribute::OFF | osg::StateAttribute::OVERRIDE);
+
+    return bb;
+}
+
+// Labels are kept in a quadtree keyed by their local position. Every cell is
+// mirrored by a scene graph node, so cull discards whole cells outside the
+// frustum, and each leaf is an osg::LOD with one child per minimum zoom
+// bucket. The same tree drives a screen-space collision pass: the visible
+// cells are queried, the candidate anchors are projected with the main
+// camera and their screen rectangles are inserted into a uniform grid in
+// priority order; labels which collide with an already placed one are
+// hidden. The pass runs incrementally within a fixed time budget per frame
+// and the result is applied only once the whole pass is finished, so
+// partially processed frames never flicker.
+class LabelDeclutterCallback : public osg::NodeCallback {
+public:
+    struct Entry
+    {
+        osg::ref_ptr<osg::Node> node;
+        osg::Vec3 anchor;
+        // label extents in world units relative to the anchor
+        float halfWidth;
+        float bottom, top;
+        int priority;
+        // camera distance matching the minimum zoom of the label
+        float maxDistance;
+    };
+
+    LabelDeclutterCallback(double budgetMs = 0.5, float cellSize = 64.f,
+                           unsigned int maxVisible = 400)
+        : _budgetMs(budgetMs), _cellSize(cellSize), _maxVisible(maxVisible),
+          _cursor(0), _numPlaced(0), _passValid(false)
+    {}
+
+    void addLabel(osg::Node* node, const osg::Vec3& anchor, float halfWidth,
+                  float bottom, float top, int priority, double minZoom)
+    {
+        Entry e;
+        e.node = node;
+        e.anchor = anchor;
+        e.halfWidth = halfWidth;
+        e.bottom = bottom;
+        e.top = top;
+        e.priority = priority;
+        e.maxDistance = float(zoomToDistance(minZoom));
+        _entries.push_back(e);
+    }
 
-        osg::Vec3Array* verts = new osg::Vec3Array;
-        verts->push_back(osg::Vec3(-w, 0, -h));
-        verts->push_back(osg::Vec3(w, 0, -h));
-        verts->push_back(osg::Vec3(w, 0, h));
-        verts->push_back(osg::Vec3(-w, 0, h));
-        iconGeom->setVertexArray(verts);
+    unsigned int getNumLabels() const { return _entries.size(); }
 
-        osg::Vec2Array* texcoords = new osg::Vec2Array;
-        texcoords->push_back(osg::Vec2(0, 0));
-        texcoords->push_back(osg::Vec2(1, 0));
-        texcoords->push_back(osg::Vec2(1, 1));
-        texcoords->push_back(osg::Vec2(0, 1));
-        iconGeom->setTexCoordArray(0, texcoords);
+    // sorts the labels by priority and builds the quadtree, must be called
+    // after the last addLabel; returns the root of the label subgraph.
+    // The leaf cells are the chunks of the layer counted in stats.
+    osg::Node* build(ChunkStats* stats = nullptr)
+    {
+        _chunkStats = stats;
 
-        osg::Vec4Array* colors = new osg::Vec4Array;
-        colors->push_back(osg::Vec4(1, 1, 1, 1));
-        iconGeom->setColorArray(colors, osg::Array::BIND_OVERALL);
+        std::stable_sort(_entries.begin(), _entries.end(),
+                         [](const Entry& a, const Entry& b) {
+                             return a.priority < b.priority;
+                         });
 
-        iconGeom->addPrimitiveSet(
-            new osg::DrawArrays(osg::PrimitiveSet::QUADS, 0, 4));
+        // labels start hidden and are revealed by the first pass
+        for (auto& e : _entries) e.node->setNodeMask(0u);
+        _visible.assign(_entries.size(), false);
+        _pending.assign(_entries.size(), false);
 
-        iconGeom->setStateSet(sharedIconStateSet);
+        osg::BoundingBox bounds;
+        std::vector<unsigned int> items(_entries.size());
+        for (unsigned int i = 0; i < items.size(); ++i)
+        {
+            items[i] = i;
+            bounds.expandBy(_entries[i].anchor);
+        }
 
-        bb->addDrawable(iconGeom, data.position);
+        _cells.clear();
+        osg::ref_ptr<osg::Node> root;
+        if (!items.empty()) buildCell(items, bounds, 0, root);
+        return root.valid() ? root.release() : new osg::Group;
     }
 
-    if (!data.name.empty())
+    void operator()(osg::Node* node, osg::NodeVisitor* nv) override
     {
-        osgText::Text* text = new osgText::Text;
-        static osg::ref_ptr<osgText::Font> sharedFont =
-            osgText::readRefFontFile("fonts/arial.ttf");
-        if (!sharedFont) sharedFont = osgText::readRefFontFile("arial.ttf");
+        TraceScope scope("declutter");
+        osg::Timer_t start = osg::Timer::instance()->tick();
 
-        text->setFont(sharedFont);
-        text->setText(osgText::String(data.name, osgText::String::ENCODING_UTF8));
-        text->setAlignment(osgText::Text::CENTER_BOTTOM);
-        text->setAxisAlignment(osgText::Text::XZ_PLANE);
-        text->setCharacterSize(3.5f);
-        text->setBackdropType(osgText::Text::OUTLINE);
-        text->setColor(osg::Vec4(1, 1, 1, 1));
+        osg::Camera* camera = viewer->getCamera();
+        const osg::Viewport* vp = camera->getViewport();
+        if (!vp || _cells.empty())
+        {
+            traverse(node, nv);
+            return;
+        }
 
-        float offsetZ = hasIcon ? 7.0f : 0.0f;
-        bb->addDrawable(text, data.position + osg::Vec3(0, 0, offsetZ));
+        osg::Matrixd modelView = osg::computeLocalToWorld(nv->getNodePath())
+            * camera->getViewMatrix();
+        const osg::Matrixd& proj = camera->getProjectionMatrix();
+
+        // a new pass starts only when the previous one is complete, so
+        // continuous camera motion can never starve it
+        unsigned int tested = 0;
+        bool finished = _cursor >= _candidates.size();
+        if (finished
+            && (!_passValid || modelView != _passModelView
+                || proj != _passProj || vp->width() != _passWidth
+                || vp->height() != _passHeight))
+        {
+            beginPass(modelView, proj, *vp);
+            finished = false;
+        }
+
+        if (!finished)
+        {
+            while (_cursor < _candidates.size())
+            {
+                unsigned int index = _candidates[_cursor];
+                _pending[index] = place(_entries[index]);
+                ++_cursor;
+                ++tested;
+
+                if ((tested & 15) == 0
+                    && osg::Timer::instance()->delta_m(
+                           start, osg::Timer::instance()->tick())
+                        > _budgetMs)
+                    break;
+            }
+
+            // on demand rendering has to come back for the rest of the pass
+            if (_cursor >= _candidates.size()) applyPass();
+            else viewer->requestRedraw();
+        }
+
+        osg::Stats* stats = viewer->getViewerStats();
+        if (stats && nv->getFrameStamp())
+        {
+            unsigned int frame = nv->getFrameStamp()->getFrameNumber();
+            stats->setAttribute(frame, "Declutter time taken",
+                                osg::Timer::instance()->delta_s(
+                                    start, osg::Timer::instance()->tick()));
+            stats->setAttribute(frame, "Labels tested", tested);
+            stats->setAttribute(frame, "Labels visible", _shown.size());
+        }
+
+        traverse(node, nv);
     }
 
-    osg::StateSet* ss = bb->getOrCreateStateSet();
-    ss->setMode(GL_LIGHTING,
-                osg::StateAttribute::OFF | osg::StateAttribute::OVERRIDE);
+protected:
+    struct Rect
+    {
+        float xMin, yMin, xMax, yMax;
+    };
 
-    return bb;
-}
+    struct Cell
+    {
+        osg::BoundingBox bounds;
+        osg::Vec3 center;
+        int children[4];
+        // leaf cells only, ascending so that they stay in priority order
+        std::vector<unsigned int> items;
+    };
+
+    int buildCell(std::vector<unsigned int>& items,
+                  const osg::BoundingBox& bounds, int depth,
+                  osg::ref_ptr<osg::Node>& node)
+    {
+        const unsigned int maxLeafItems = 64;
+        const int maxDepth = 12;
+        // labels extend past their anchors, keep them inside the cell
+        const float margin = 30.f;
+
+        int index = _cells.size();
+        _cells.push_back(Cell());
+        _cells[index].bounds.set(bounds.xMin() - margin,
+                                 bounds.yMin() - margin,
+                                 bounds.zMin() - margin,
+                                 bounds.xMax() + margin,
+                                 bounds.yMax() + margin,
+                                 bounds.zMax() + margin);
+        _cells[index].center = bounds.center();
+        for (int q = 0; q < 4; ++q) _cells[index].children[q] = -1;
+
+        if (items.size() <= maxLeafItems || depth >= maxDepth)
+        {
+            std::sort(items.begin(), items.end());
+
+            osg::ref_ptr<osg::LOD> lod = new osg::LOD;
+            lod->setCenterMode(osg::LOD::USER_DEFINED_CENTER);
+            lod->setCenter(bounds.center());
+            lod->setRadius(_cells[index].bounds.radius());
+            if (_chunkStats.valid())
+            {
+                lod->addCullCallback(new ChunkCullCallback(_chunkStats.get()));
+                _chunkStats->addChunks(1);
+            }
+
+            std::map<float, osg::ref_ptr<osg::Group>> buckets;
+            for (unsigned int i : items)
+            {
+                osg::ref_ptr<osg::Group>& bucket =
+                    buckets[_entries[i].maxDistance];
+                if (!bucket) bucket = new osg::Group;
+                bucket->addChild(_entries[i].node.get());
+            }
+            for (auto& b : buckets) lod->addChild(b.second.get(), 0.f, b.first);
+
+            _cells[index].items.swap(items);
+            node = lod;
+            return index;
+        }
+
+        const osg::Vec3 c = bounds.center();
+        std::vector<unsigned int> quadrants[4];
+        for (unsigned int i : items)
+        {
+            const osg::Vec3& p = _entries[i].anchor;
+            quadrants[(p.x() >= c.x() ? 1 : 0) + (p.y() >= c.y() ? 2 : 0)]
+                .push_back(i);
+        }
+        items.clear();
+
+        osg::ref_ptr<osg::Group> group = new osg::Group;
+        for (int q = 0; q < 4; ++q)
+        {
+            if (quadrants[q].empty()) continue;
+
+            osg::BoundingBox qb;
+            for (unsigned int i : quadrants[q]) qb.expandBy(_entries[i].anchor);
+
+            osg::ref_ptr<osg::Node> child;
+            int childIndex = buildCell(quadrants[q], qb, depth + 1, child);
+            _cells[index].children[q] = childIndex;
+            group->addChild(child.get());
+        }
+
+        node = group;
+        return index;
+    }
+
+    void collect(int index, osg::Polytope& frustum,
+                 const osg::Vec3& eye)
+    {
+        const Cell& cell = _cells[index];
+        if (!frustum.contains(cell.bounds)) return;
+
+        if (!cell.items.empty())
+        {
+            // same test as the leaf LOD, which ranges from the cell center
+            float distance = (eye - cell.center).length();
+            for (unsigned int i : cell.items)
+            {
+                if (_entries[i].maxDistance >= distance)
+                    _candidates.push_back(i);
+            }
+            return;
+        }
+
+        for (int q = 0; q < 4; ++q)
+        {
+            if (cell.children[q] >= 0) collect(cell.children[q], frustum, eye);
+        }
+    }
+
+    void beginPass(const osg::Matrixd& modelView, const osg::Matrixd& proj,
+                   const osg::Viewport& vp)
+    {
+        _passModelView = modelView;
+        _passProj = proj;
+        _passX = vp.x();
+        _passY = vp.y();
+        _passWidth = vp.width();
+        _passHeight = vp.height();
+        _passValid = true;
+
+        _cols = std::max(1, int(std::ceil(_passWidth / _cellSize)));
+        _rows = std::max(1, int(std::ceil(_passHeight / _cellSize)));
+        _grid.resize(_cols * _rows);
+        // clear keeps the capacity so steady state passes do not allocate
+        for (auto& cell : _grid) cell.clear();
+
+        // only labels in visible cells and above their zoom threshold are
+        // candidates, so the pass scales with what is on screen
+        osg::Polytope frustum;
+        frustum.setToUnitFrustum(false, false);
+        frustum.transformProvidingInverse(modelView * proj);
+        osg::Vec3 eye = osg::Matrixd::inverse(modelView).getTrans();
+
+        _candidates.clear();
+        collect(0, frustum, eye);
+        std::sort(_candidates.begin(), _candidates.end());
+
+        for (unsigned int i : _candidates) _pending[i] = false;
+        _cursor = 0;
+        _numPlaced = 0;
+    }
+
+    bool place(const Entry& e)
+    {
+        if (_numPlaced >= _maxVisible) return false;
+
+        osg::Vec3d eye = osg::Vec3d(e.anchor) * _passModelView;
+        double depth = -eye.z();
+        if (depth <= 0.0) return false;
+
+        osg::Vec4d clip = osg::Vec4d(eye, 1.0) * _passProj;
+        if (clip.w() <= 0.0) return false;
+
+        double sx = _passX + (clip.x() / clip.w() + 1.0) * 0.5 * _passWidth;
+        double sy = _passY + (clip.y() / clip.w() + 1.0) * 0.5 * _passHeight;
+
+        // pixels per world unit at the label depth
+        double ppu = _passProj(1, 1) * 0.5 * _passHeight / depth;
+
+        Rect r;
+        r.xMin = float(sx - e.halfWidth * ppu - _passX);
+        r.xMax = float(sx + e.halfWidth * ppu - _passX);
+        r.yMin = float(sy + e.bottom * ppu - _passY);
+        r.yMax = float(sy + e.top * ppu - _passY);
+
+        if (r.xMax < 0.f || r.yMax < 0.f || r.xMin >= _passWidth
+            || r.yMin >= _passHeight)
+            return false;
+
+        int c0 = std::max(0, int(r.xMin / _cellSize));
+        int c1 = std::min(_cols - 1, int(r.xMax / _cellSize));
+        int r0 = std::max(0, int(r.yMin / _cellSize));
+        int r1 = std::min(_rows - 1, int(r.yMax / _cellSize));
+
+        for (int y = r0; y <= r1; ++y)
+        {
+            for (int x = c0; x <= c1; ++x)
+            {
+                for (const Rect& o : _grid[y * _cols + x])
+                {
+                    if (r.xMin < o.xMax && o.xMin < r.xMax && r.yMin < o.yMax
+                        && o.yMin < r.yMax)
+                        return false;
+                }
+            }
+        }
+
+        for (int y = r0; y <= r1; ++y)
+        {
+            for (int x = c0; x <= c1; ++x) _grid[y * _cols + x].push_back(r);
+        }
+
+        ++_numPlaced;
+        return true;
+    }
+
+    void applyPass()
+    {
+        // hide the labels shown by the previous pass which lost this one;
+        // labels outside the candidate set have _pending cleared as well
+        for (unsigned int i : _shown)
+        {
+            if (!_pending[i])
+            {
+                _visible[i] = false;
+                _entries[i].node->setNodeMask(0u);
+            }
+        }
+
+        _shown.clear();
+        for (unsigned int i : _candidates)
+        {
+            if (!_pending[i]) continue;
+
+            _shown.push_back(i);
+            if (!_visible[i])
+            {
+                _visible[i] = true;
+                _entries[i].node->setNodeMask(~0u);
+            }
+        }
+
+        // the flags of the last pass must not leak into the next one
+        for (unsigned int i : _candidates) _pending[i] = false;
+    }
+
+    std::vector<Entry> _entries;
+    std::vector<Cell> _cells;
+    // leaf cells are the chunks of the layer
+    osg::ref_ptr<ChunkStats> _chunkStats;
+    std::vector<bool> _visible;
+    std::vector<bool> _pending;
+    std::vector<unsigned int> _candidates;
+    std::vector<unsigned int> _shown;
+    std::vector<std::vector<Rect>> _grid;
+
+    double _budgetMs;
+    float _cellSize;
+    unsigned int _maxVisible;
+
+    size_t _cursor;
+    unsigned int _numPlaced;
+
+    bool _passValid;
+    osg::Matrixd _passModelView;
+    osg::Matrixd _passProj;
+    double _passX, _passY, _passWidth, _passHeight;
+    int _cols, _rows;
+};
 
 osg::Node* createHUD() { return new osg::Group; }
 
@@ -341,16 +752,32 @@ osg::Node* process_labels(osg::Matrixd& ltw, const std::string& file_path)
     OnlyGeometryExtractor extractor;
     raw_model->accept(extractor);
 
+    // on a DEM the points are put on its ground
+    if (map_terrain.valid()) map_terrain->drape(extractor._positions, 0.f);
+
     SimpleDBFReader dbfReader;
-    bool hasDBF = dbfReader.load(dbf_path);
+    bool hasDBF = false;
+    {
+        StageProfile profile("labels attributes");
+        hasDBF = dbfReader.load(dbf_path);
+        profile.setNumItems(dbfReader.records.size());
+    }
 
     std::vector<LabelData> finalLabels;
     size_t count =
         std::min(extractor._positions.size(), dbfReader.records.size());
     if (!hasDBF) count = 0;
 
-    std::map<std::string, osg::ref_ptr<osg::StateSet>> iconStateSets;
-    osg::Group* labelsGroup = new osg::Group;
+    // znaki wszystkich nazw trafiaja do atlasu zanim powstanie pierwsza
+    // etykieta, wiec w trakcie rysowania nie sa generowane zadne glify
+    std::vector<LabelData> labels;
+    std::set<unsigned int> charset;
+    labels.reserve(count);
+    // reused for the std::string arguments of osgText and the style
+    std::string name, type, subtype;
+
+    // records with a label can be picked around their icon
+    std::vector<float> pickRadii(count, 0.f);
 
     for (size_t i = 0; i < count; ++i)
     {
@@ -379,21 +806,106 @@ osg::Node* process_labels(osg::Matrixd& ltw, const std::string& file_path)
         }
         if (allDigits) continue;
 
-        ld.position.z() += 25.0f;
+        ld.position.z() += labelHeight;
 
-        // Dobieranie ikony wg Twojej listy
-        std::string iconFile = determineIconTexture(ld.type, ld.subtype);
+        name.assign(ld.name);
+        osgText::String text(name, osgText::String::ENCODING_UTF8);
+        charset.insert(text.begin(), text.end());
+        labels.push_back(ld);
+        pickRadii[i] = labelPickRadius;
+    }
+
+    if (labels.empty()) return new osg::Group;
+
+    // without the atlas the labels still show, with osgText as before it
+    osg::ref_ptr<GlyphAtlas> atlas = new GlyphAtlas;
+    if (!atlas->build("fonts/arial.ttf", charset, "cache"))
+    {
+        std::cerr << "Warning: Cannot build glyph atlas of fonts/arial.ttf,"
+                  << " labels fall back to osgText" << std::endl;
+        atlas = nullptr;
+    }
+
+    std::map<std::string, osg::ref_ptr<osg::StateSet>> iconStateSets;
+    std::map<osg::StateSet*, osg::ref_ptr<osg::Geometry>> iconGeometries;
+    osg::Group* labelsGroup = new osg::Group;
+    osg::ref_ptr<LabelDeclutterCallback> declutter = new LabelDeclutterCallback;
+
+    // the whole layer is skipped below the lowest minimum zoom of any label
+    float minZoom = map_style->getDefault(STYLE_LABELS).minZoom;
+
+    for (const LabelData& ld : labels)
+    {
+        // ikona, ranga i minimalny zoom wg pliku stylu
+        subtype.assign(ld.subtype);
+        type.assign(ld.type);
+        const StyleRule& rule = map_style->lookup(STYLE_LABELS, subtype, type);
+        const std::string& iconFile = rule.icon;
 
         osg::StateSet* iconSS = nullptr;
+        osg::Geometry* icon = nullptr;
         if (!iconFile.empty())
         {
             iconSS = getSharedStateSet(iconFile, iconStateSets);
+            osg::ref_ptr<osg::Geometry>& shared = iconGeometries[iconSS];
+            if (!shared) shared = createIconGeometry(iconSS);
+            icon = shared.get();
         }
 
-        labelsGroup->addChild(createLabelNode(ld, iconSS));
+        osg::Node* label = createLabelNode(ld, icon, atlas.get());
+        // the declutter pass switches the node mask in every update
+        label->setDataVariance(osg::Object::DYNAMIC);
+
+        // extents match the icon quad and the text placed above it
+        name.assign(ld.name);
+        osgText::String text(name, osgText::String::ENCODING_UTF8);
+        unsigned int numChars = text.size();
+        float textHalfWidth =
+            atlas.valid() ? 0.5f * 3.5f * atlas->getTextWidth(text)
+                          : numChars * 1.05f;
+        float halfWidth = std::max(iconSS ? 6.0f : 0.0f, textHalfWidth);
+        float bottom = iconSS ? -6.0f : 0.0f;
+        float top = (iconSS ? 7.0f : 0.0f) + 3.5f;
+        int priority = rule.rank * 1000 + std::min<int>(numChars, 999);
+        declutter->addLabel(label, ld.position, halfWidth, bottom, top,
+                            priority, rule.minZoom);
+        if (map_search.valid())
+            register_search_entry(name, ld.position, rule.rank, "labels");
+        minZoom = std::min(minZoom, rule.minZoom);
+    }
+
+    labelsGroup->addChild(declutter->build(register_chunk_stats("Labels")));
+    labelsGroup->setUpdateCallback(declutter.get());
+    if (minZoom > 0.f)
+        labelsGroup->setCullCallback(new ZoomRangeCallback(minZoom));
+
+    if (map_picker.valid())
+    {
+        ShapeFile shp;
+        if (shp.load(shp_path) && shp.getNumRecords() >= count)
+        {
+            shp.toLocal(ltw);
+            pickRadii.resize(shp.getNumRecords(), 0.f);
+
+            // the labels stand on the ground at their anchors
+            std::vector<float> bases(1, labelHeight);
+            if (map_terrain.valid())
+            {
+                bases.assign(shp.getNumRecords(), labelHeight);
+                for (unsigned int r = 0; r < shp.getNumRecords(); ++r)
+                {
+                    if (shp.getFirstPart(r) == shp.getEndPart(r)) continue;
+                    unsigned int first = shp.getFirstPoint(shp.getFirstPart(r));
+                    const osg::Vec2& anchor = shp.getLocalPoints()[first];
+                    bases[r] += map_terrain->getHeight(anchor.x(), anchor.y());
+                }
+            }
+            register_pick_index(
+                new FeatureIndex("labels", shp, bases, pickRadii));
+        }
     }
 
-    std::cout << "--- LABELS: Utworzono " << labelsGroup->getNumChildren()
+    std::cout << "--- LABELS: Utworzono " << declutter->getNumLabels()
               << " etykiet." << std::endl;
     std::cout << "--- TEXTURES: Zaladowano " << iconStateSets.size()
               << " tekstur z folderu images/labelsTextures/." << std::endl;
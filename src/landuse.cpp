@@ -8,88 +8,202 @@
 #include <osg/MatrixTransform>
 #include <osg/ShapeDrawable>
 #include <osg/Depth>
-
-#include <osgSim/ShapeAttribute>
+#include <osg/Timer>
+#include <osg/Geode>
+#include <osg/LOD>
 
 #include <iostream>
 #include <map>
+#include <cmath>
 
 #include "common.h"
+#include "style.h"
+#include "shapefile.h"
+#include "triangulator.h"
+#include "simplify.h"
+#include "picking.h"
+#include "chunker.h"
+#include "terrain.h"
 
 using namespace osg;
 
-using Mapping = std::map<std::string, std::vector<osg::ref_ptr<osg::Node>>>;
+// side of the square ground cells, every class is merged per cell so far
+// away cells are culled while the draw calls stay few
+const float landuseChunkSize = 5000.f;
 
-void parse_meta_data(osg::Node* model, Mapping & umap)
-{
-    osg::Group * group = model->asGroup();
+// landuse class (fclass) -> records of the shapefile
+using Mapping = std::map<std::string, std::vector<unsigned int>>;
 
-    for (unsigned i = 0; i < group->getNumChildren(); i++)
+void parse_meta_data(const ShapeFile& shp, Mapping & umap)
+{
+    // dla terenu atrybut "fclass" to opis typu kultury; without the column
+    // every polygon is of the empty class, drawn in the layer default
+    int fclass = shp.getFieldIndex("fclass");
+    for (unsigned i = 0; i < shp.getNumRecords(); i++)
     {
-        osg::Node* kido = group->getChild(i);
-        osgSim::ShapeAttributeList * sal = (osgSim::ShapeAttributeList*)kido->getUserData();
-        if (!sal)
+        if (shp.getFirstPart(i) == shp.getEndPart(i))
             continue;
 
-        for (unsigned j = 0; j < sal->size(); j++)
-        {
-            // sprawdzamy czy atrybut nazywa si "fclass"
-            // dla terenu to opis typu kultury
-            if ((*sal)[j].getName().find("fclass") != std::string::npos)
-            {
-                if ((*sal)[j].getType() == osgSim::ShapeAttribute::STRING)
-                    umap[(*sal)[j].getString()].push_back(kido);
-            }
-        }
+        umap[shp.getString(i, fclass)].push_back(i);
     }
 }
 
+// the map frame is the tangent plane at the centre of the landuse layer,
+// wbb the world bounds of its corners
+static void compute_map_frame(const osg::BoundingBoxd& mgbb, osg::Matrixd& ltw,
+                              osg::BoundingBox& wbb)
+{
+    ellipsoid->computeLocalToWorldTransformFromLatLongHeight(
+        osg::DegreesToRadians(mgbb.center().y()),
+        osg::DegreesToRadians(mgbb.center().x()), 0.0, ltw);
+
+    wbb.init();
+    for (unsigned i = 0; i < 4; i++)
+    {
+        osg::Vec3d pos;
+        ellipsoid->convertLatLongHeightToXYZ(
+            osg::DegreesToRadians(i & 1 ? mgbb.yMax() : mgbb.yMin()),
+            osg::DegreesToRadians(i & 2 ? mgbb.xMax() : mgbb.xMin()), 0.0,
+            pos[0], pos[1], pos[2]);
+        wbb.expandBy(pos);
+    }
+}
+
+bool read_map_frame(const std::string& file_path, osg::Matrixd& ltw,
+                    osg::BoundingBox& wbb)
+{
+    osg::BoundingBoxd mgbb;
+    if (!ShapeFile::readGeoBounds(file_path + "/gis_osm_landuse_a_free_1.shp",
+                                  mgbb))
+        return false;
+
+    compute_map_frame(mgbb, ltw, wbb);
+    return true;
+}
+
 osg::Node* process_landuse(osg::Matrixd& ltw, osg::BoundingBox& wbb, const std::string & file_path)
 {
     std::string land_file_path = file_path + "/gis_osm_landuse_a_free_1.shp";
 
     // load the data
-    osg::ref_ptr<osg::Node> land_model = osgDB::readRefNodeFile(land_file_path);
-    if (!land_model)
+    ShapeFile shp;
+    if (!shp.load(land_file_path))
     {
         std::cout << "Cannot load file " << land_file_path << std::endl;
         return nullptr;
     }
 
-    osg::BoundingBox mgbb;
+    compute_map_frame(shp.getGeoBounds(), ltw, wbb);
 
-    ComputeBoundsVisitor cbv(mgbb);
-    land_model->accept(cbv);
-
-    ellipsoid->computeLocalToWorldTransformFromLatLongHeight(
-        osg::DegreesToRadians(mgbb.center().y()),
-        osg::DegreesToRadians(mgbb.center().x()), 0.0, ltw);
+    // Transformacja ze wsprzdnych geograficznych (GEO) do ukadu lokalnego
+    // mapy
+    shp.toLocal(ltw);
 
+    Mapping umap;
+    parse_meta_data(shp, umap);
+
+    // generalised copies of the layer for the distant views, level 0 is
+    // the layer itself
+    osg::Timer_t start = osg::Timer::instance()->tick();
+    PolygonSimplifier simplifier(shp);
+    std::vector<ShapeFile> generalised(polygonNumLevels - 1);
+    const ShapeFile* levels[polygonNumLevels] = {&shp};
+    for (unsigned l = 1; l < polygonNumLevels; l++)
+    {
+        simplifier.simplify(l, generalised[l - 1]);
+        levels[l] = &generalised[l - 1];
+    }
+    double simplifyTime =
+        osg::Timer::instance()->delta_m(start, osg::Timer::instance()->tick());
+
+    // one triangulated geometry per landuse class, chunk and level; a chunk
+    // is an osg::LOD of one geode per level, the classes share one state set
+    // each, colours and render order from the style file
+    float chunkSize = map_style->getDefault(STYLE_LANDUSE).chunkSize;
+    GridChunker chunker(chunkSize > 0.f ? chunkSize : landuseChunkSize);
+    std::map<GridChunker::Cell, std::vector<osg::ref_ptr<osg::Geode>>>
+        chunkLevels;
+    unsigned numGeometries = 0;
+    size_t numVerts[polygonNumLevels] = {};
+    for (auto& cls : umap)
+    {
+        const StyleRule& rule = map_style->lookup(STYLE_LANDUSE, cls.first);
+        osg::ref_ptr<osg::StateSet> ss = createColorStateSet(rule.color);
+        // the depth is not written, overlapping classes are drawn in order
+        ss->setRenderBinDetails(rule.order, "RenderBin");
+        ss->setNestRenderBins(false);
+
+        std::map<GridChunker::Cell, std::vector<unsigned int>> chunks;
+        chunker.split(shp, cls.second, chunks);
+        for (auto& chunk : chunks)
+        {
+            std::vector<osg::ref_ptr<osg::Geode>>& geodes =
+                chunkLevels[chunk.first];
+            if (geodes.empty()) geodes.resize(polygonNumLevels);
 
-    // Transformacja ze wsprzdnych geograficznych (GEO) do wsprzdnych wiata (WGS)
-    ConvertFromGeoProjVisitor<true> cfgp;
-    land_model->accept(cfgp);
+            for (unsigned l = 0; l < polygonNumLevels; l++)
+            {
+                osg::ref_ptr<osg::Geometry> geom = createPolygonGeometry(
+                    *levels[l], chunk.second, chunker.getOrigin(chunk.first));
+                if (geom->getPrimitiveSet(0)->getNumIndices() == 0) continue;
+
+                if (!geodes[l]) geodes[l] = new osg::Geode;
+                geom->setName(cls.first);
+                geom->setStateSet(ss.get());
+                geodes[l]->addDrawable(geom.get());
+                numVerts[l] += geom->getVertexArray()->getNumElements();
+                numGeometries++;
+            }
+        }
+    }
 
-    wbb=cfgp._box;
+    for (auto& chunk : chunkLevels)
+    {
+        osg::LOD* lod = new osg::LOD;
+        for (unsigned l = 0; l < polygonNumLevels; l++)
+        {
+            if (!chunk.second[l]) continue;
+            lod->addChild(chunk.second[l].get(), polygonLevelMinDistance(l),
+                          polygonLevelMaxDistance(l));
+        }
+        chunker.addChunk(chunk.first, lod);
+    }
+    osg::ref_ptr<osg::Node> land_model =
+        chunker.build(register_chunk_stats("Landuse"));
 
-    WorldToLocalVisitor ltwv(ltw, true);
-    land_model->accept(ltwv);
+    // on a DEM the polygons lie on its ground, their triangles split down
+    // to the samples of the grid so that they follow it between vertices
+    if (map_terrain.valid())
+    {
+        DrapeVisitor drape(map_terrain.get(), 0.f, map_terrain->getSpacing());
+        land_model->accept(drape);
+        drape.drape();
+    }
 
-#if 0
-    // dokonuj dodatkowego przetwarzania wierzchokw po transformacji z ukadu Geo do WGS
-    Mapping umap;
-    parse_meta_data(land_model, umap);
-#endif
+    std::cout << "--- LANDUSE: " << shp.getNumRecords()
+              << " polygons merged into " << numGeometries << " geometries ("
+              << umap.size() << " classes, " << chunkLevels.size()
+              << " chunks), simplified in " << simplifyTime
+              << " ms, vertices per level";
+    for (unsigned l = 0; l < polygonNumLevels; l++)
+        std::cout << (l ? "/" : " ") << numVerts[l];
+    std::cout << std::endl;
 
     // requirement from water geometry to avoid z-fighting
     // do not write to depth buffer - zmask set to false
     land_model->getOrCreateStateSet()->setAttributeAndModes
         (new osg::Depth(osg::Depth::LESS, 0, 1, false));
     // draw terrain first
-    land_model->getOrCreateStateSet()->setRenderBinDetails(-10, "RenderBin");
+    land_model->getOrCreateStateSet()->setRenderBinDetails(
+        map_style->getDefault(STYLE_LANDUSE).order, "RenderBin");
     // do not nest this render bin
     land_model->getOrCreateStateSet()->setNestRenderBins(false);
 
+    // the source polygons stay for picking, on the ground of a DEM
+    if (map_picker.valid())
+        register_pick_index(
+            new FeatureIndex("landuse", shp, ground_bases(shp), {0.f}));
+
 
 
 
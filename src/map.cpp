@@ -7,6 +7,8 @@
 #include <osgText/Text>
 #include <osg/MatrixTransform>
 #include <osg/ShapeDrawable>
+#include <osg/LOD>
+#include <osg/Timer>
 
 #include <osgViewer/Viewer>
 #include <osgViewer/ViewerEventHandlers>
@@ -22,9 +24,30 @@
 
 #include <osgGA/Device>
 
+#include <osgDB/DatabasePager>
+
+#include <osgUtil/GLObjectsVisitor>
+#include <osgUtil/IncrementalCompileOperation>
+
+#include <OpenThreads/Thread>
+
 #include <iostream>
+#include <cfloat>
 
 #include "common.h"
+#include "style.h"
+#include "basemap.h"
+#include "zoom.h"
+#include "picking.h"
+#include "search.h"
+#include "chunker.h"
+#include "post_process.h"
+#include "memory.h"
+#include "alloc_stats.h"
+#include "trace.h"
+#include "reload.h"
+#include "terrain.h"
+#include "routing.h"
 
 #include "camera_manip.cpp"
 
@@ -32,6 +55,42 @@ using namespace osg;
 
 osg::ref_ptr<osgViewer::Viewer> viewer;
 osg::ref_ptr<osg::EllipsoidModel> ellipsoid;
+osg::ref_ptr<MapStyle> map_style;
+osg::ref_ptr<ZoomLevel> map_zoom = new ZoomLevel;
+osg::ref_ptr<FeaturePicker> map_picker;
+osg::ref_ptr<NameIndex> map_search;
+std::vector<osg::ref_ptr<ChunkStats>> map_chunk_stats;
+osg::ref_ptr<MemoryReport> map_memory;
+osg::ref_ptr<FrameTrace> map_trace;
+osg::ref_ptr<Terrain> map_terrain;
+
+// frames the trace stays behind the viewer, so that their draw has finished
+const unsigned int traceFrameLag = 2;
+
+// how often the on demand loop looks for input while nothing is drawn, in
+// seconds
+const double idlePollInterval = 0.01;
+
+// whether the on demand loop has to render: input, redraw requests of the
+// handlers and callbacks, or data of the database pager still in flight
+static bool need_frame()
+{
+    if (viewer->getRequestRedraw() || viewer->getRequestContinousUpdate())
+        return true;
+    if (viewer->checkEvents()) return true;
+
+    osgDB::DatabasePager* pager = viewer->getDatabasePager();
+    return pager && (pager->requiresUpdateSceneGraph()
+                     || pager->getRequestsInProgress() > 0);
+}
+
+// loads one layer as a stage of the startup profile
+template <typename Load>
+static osg::ref_ptr<osg::Node> load_layer(const std::string& name, Load load)
+{
+    StageProfile profile(name);
+    return load();
+}
 
 int main(int argc, char** argv)
 {
@@ -42,12 +101,77 @@ int main(int argc, char** argv)
     arguments.getApplicationUsage()->setDescription(arguments.getApplicationName()+" is the standard OpenSceneGraph example which loads and visualises 3d models.");
     arguments.getApplicationUsage()->setCommandLineUsage(arguments.getApplicationName()+" [options] filename ...");
     arguments.getApplicationUsage()->addCommandLineOption("--image <filename>","Load an image and render it on a quad");
-    arguments.getApplicationUsage()->addCommandLineOption("--dem <filename>","Load an image/DEM and render it on a HeightField");
+    arguments.getApplicationUsage()->addCommandLineOption(
+        "--dem <path>",
+        "DEM tile (SRTM .hgt, or GeoTIFF through the GDAL plugin) or a "
+        "directory of them; the map follows its ground, may be repeated");
+    arguments.getApplicationUsage()->addCommandLineOption(
+        "--no-routing",
+        "Do not build the road graph; otherwise 'R' over the map at two "
+        "points shows the fastest route between them");
     arguments.getApplicationUsage()->addCommandLineOption("--login <url> <username> <password>","Provide authentication information for http file access.");
     arguments.getApplicationUsage()->addCommandLineOption("-p <filename>","Play specified camera path animation file, previously saved with 'z' key.");
     arguments.getApplicationUsage()->addCommandLineOption("--speed <factor>","Speed factor for animation playing (1 == normal speed).");
     arguments.getApplicationUsage()->addCommandLineOption("--device <device-name>","add named device to the viewer");
     arguments.getApplicationUsage()->addCommandLineOption("--stats","print out load and compile timing stats");
+    arguments.getApplicationUsage()->addCommandLineOption(
+        "--style <filename>",
+        "Style definition of the map layers (default style.ini)");
+    arguments.getApplicationUsage()->addCommandLineOption(
+        "--build-basemap",
+        "Rasterise the landuse and water basemap pyramid into the cache "
+        "without opening a window and exit");
+    arguments.getApplicationUsage()->addCommandLineOption(
+        "--search <name>",
+        "Fly to the best match of the street or place name; '/' in the "
+        "window searches too");
+    arguments.getApplicationUsage()->addCommandLineOption(
+        "--dynamic-resolution <ms>",
+        "Render at a lower resolution, upscaled and sharpened, whenever "
+        "the cull and draw of a frame take longer than <ms>");
+    arguments.getApplicationUsage()->addCommandLineOption(
+        "--on-demand",
+        "Render only for input, animation and pending data instead of "
+        "continuously");
+    arguments.getApplicationUsage()->addCommandLineOption(
+        "--max-fps <n>",
+        "Frame rate limit, also while rendering on demand (default "
+        "unlimited)");
+    arguments.getApplicationUsage()->addCommandLineOption(
+        "--idle-heartbeat <s>",
+        "Seconds between frames of an idle on demand display, 0 for none "
+        "(default 2)");
+    arguments.getApplicationUsage()->addCommandLineOption(
+        "--release-cpu-data",
+        "Drop the client side copies of vertex arrays and texture images "
+        "once they are uploaded");
+    arguments.getApplicationUsage()->addCommandLineOption(
+        "--watch",
+        "Load a layer again in the background when its files in the data "
+        "directory change");
+    arguments.getApplicationUsage()->addCommandLineOption(
+        "--sync-load",
+        "Load every layer before the window opens instead of in the "
+        "background");
+    arguments.getApplicationUsage()->addCommandLineOption(
+        "--trace <filename>",
+        "Record the frames as a Chrome trace, written on exit and with the "
+        "'T' key");
+    arguments.getApplicationUsage()->addCommandLineOption(
+        "--threading <model>",
+        "Threading model: SingleThreaded, CullDrawThreadPerContext, "
+        "DrawThreadPerContext, CullThreadPerCameraDrawThreadPerContext or "
+        "Automatic");
+    arguments.getApplicationUsage()->addCommandLineOption(
+        "--bench-threading",
+        "Time the frames of a zoom sweep in every threading model and exit");
+    arguments.getApplicationUsage()->addCommandLineOption(
+        "--bench-frames <n>",
+        "Frames per threading model of --bench-threading (default 600)");
+    arguments.getApplicationUsage()->addCommandLineOption(
+        "--bench-tessellation",
+        "Check the triangulation of holes on a few fixed polygons, time it "
+        "on the landuse and water layers and exit");
 
     ellipsoid = new osg::EllipsoidModel;
     viewer = new osgViewer::Viewer (arguments);
@@ -102,11 +226,42 @@ int main(int argc, char** argv)
         }
     }
 
+    if (arguments.read("--bench-tessellation"))
+    {
+        return bench_tessellation(file_path);
+    }
+
+    std::string style_file = "style.ini";
+    arguments.read("--style", style_file);
+
+    map_style = new MapStyle;
+    if (!map_style->load(osgDB::findDataFile(style_file)))
+    {
+        std::cout << "Cannot load style " << style_file << ", using defaults"
+                  << std::endl;
+    }
+
+    // headless build of the basemap; the landuse layer defines the map frame
+    if (arguments.read("--build-basemap"))
+    {
+        osg::Matrixd ltw;
+        osg::BoundingBox wbb;
+        osg::ref_ptr<osg::Node> land_model =
+            process_landuse(ltw, wbb, file_path);
+        if (!land_model) return 1;
+
+        osg::ref_ptr<osg::Node> basemap_model = process_basemap(ltw, file_path);
+        return basemap_model ? 0 : 1;
+    }
+
     // set up the camera manipulators.
+    osg::ref_ptr<GoogleMapsManipulator> mapManipulator =
+        new GoogleMapsManipulator();
     {
         osg::ref_ptr<osgGA::KeySwitchMatrixManipulator> keyswitchManipulator = new osgGA::KeySwitchMatrixManipulator;
 
-        keyswitchManipulator->addMatrixManipulator( '1', "GoogleMaps", new GoogleMapsManipulator());
+        keyswitchManipulator->addMatrixManipulator('1', "GoogleMaps",
+                                                   mapManipulator.get());
         keyswitchManipulator->addMatrixManipulator( '2', "Trackball", new osgGA::TrackballManipulator() );
         keyswitchManipulator->addMatrixManipulator( '3', "Flight", new osgGA::FlightManipulator() );
         keyswitchManipulator->addMatrixManipulator( '4', "Drive", new osgGA::DriveManipulator() );
@@ -146,7 +301,18 @@ int main(int argc, char** argv)
     viewer->addEventHandler(new osgViewer::WindowSizeHandler);
 
     // add the stats handler
-    viewer->addEventHandler(new osgViewer::StatsHandler);
+    osg::ref_ptr<osgViewer::StatsHandler> statsHandler =
+        new osgViewer::StatsHandler;
+    statsHandler->addUserStatsLine("Declutter",
+                                   osg::Vec4(0.9f, 0.9f, 0.3f, 1.0f),
+                                   osg::Vec4(0.9f, 0.9f, 0.3f, 0.5f),
+                                   "Declutter time taken", 1000.0, true, false,
+                                   "", "", 5.0);
+    statsHandler->addUserStatsLine("Labels", osg::Vec4(0.9f, 0.9f, 0.3f, 1.0f),
+                                   osg::Vec4(0.9f, 0.9f, 0.3f, 0.5f),
+                                   "Labels visible", 1.0, false, false,
+                                   "", "", 1000.0);
+    viewer->addEventHandler(statsHandler.get());
 
     // add the help handler
     viewer->addEventHandler(new osgViewer::HelpHandler(arguments.getApplicationUsage()));
@@ -175,25 +341,280 @@ int main(int argc, char** argv)
     //////////////////////////////////// CREATE MAP SCENE ///////////////
     /////////////////////////////////////////////////////////////////////
 
+    std::string search;
+    arguments.read("--search", search);
+
+    bool releaseCpuData = arguments.read("--release-cpu-data");
+    bool benchThreading = arguments.read("--bench-threading");
+    unsigned int benchFrames = 600;
+    arguments.read("--bench-frames", benchFrames);
+    bool watch = arguments.read("--watch");
+    bool routing = !arguments.read("--no-routing");
+
+    std::vector<std::string> demPaths;
+    std::string demPath;
+    while (arguments.read("--dem", demPath)) demPaths.push_back(demPath);
+
+    // the window opens on empty groups in place of the layers, framed by the
+    // header of the landuse layer, and the layers are built in the
+    // background; releasing the CPU data compiles the whole map at realize
+    // and the benchmark needs all of it, both load it first
+    bool syncLoad =
+        arguments.read("--sync-load") || releaseCpuData || benchThreading;
+
+    // layers hand their source shapes to the picker and their names to
+    // the search index as they load
+    map_picker = new FeaturePicker;
+    map_search = new NameIndex;
+
     osg::MatrixTransform * root = new osg::MatrixTransform;
     osg::Matrixd ltw;
     osg::BoundingBox wbb;
-    osg::ref_ptr<osg::Node> land_model = process_landuse(ltw, wbb, file_path);
-    root->setMatrix(ltw);
-    root->addChild(land_model);
+    if (!syncLoad && !read_map_frame(file_path, ltw, wbb))
+    {
+        std::cout << "Cannot read the map frame from the landuse header, "
+                     "loading the layers first"
+                  << std::endl;
+        syncLoad = true;
+    }
+
+    // the layer, or the group it replaces once loaded in the background
+    auto layer = [syncLoad](const std::string& name,
+                            auto load) -> osg::ref_ptr<osg::Node>
+    {
+        if (syncLoad) return load_layer(name, load);
+        return new osg::Group;
+    };
+
+    // the terrain comes first, the other layers take their heights from it;
+    // it needs the map frame before the landuse layer set it up
+    osg::ref_ptr<osg::Node> terrain_model;
+    if (!demPaths.empty() && (!syncLoad || read_map_frame(file_path, ltw, wbb)))
+    {
+        terrain_model = layer("terrain", [&]
+        {
+            return process_terrain(ltw, file_path, demPaths);
+        });
+        if (terrain_model) root->addChild(terrain_model);
+    }
 
-    osg::ref_ptr<osg::Node> water_model = process_water(ltw, file_path);
-    root->addChild(water_model);
+    osg::ref_ptr<osg::Node> land_model =
+        layer("landuse", [&] { return process_landuse(ltw, wbb, file_path); });
+    root->setMatrix(ltw);
+    // the home position of the first frame, before any layer is in
+    if (!syncLoad) root->setInitialBound(osg::BoundingSphere(wbb));
+
+    osg::ref_ptr<osg::Node> water_model =
+        layer("water", [&] { return process_water(ltw, file_path); });
+
+    // far away the landuse and water polygons give way to the raster basemap
+    osg::ref_ptr<osg::Group> ground = new osg::Group;
+    ground->addChild(land_model);
+    ground->addChild(water_model);
+
+    osg::ref_ptr<osg::Node> basemap_model =
+        layer("basemap", [&] { return process_basemap(ltw, file_path); });
+    float basemapDistance = zoomToDistance(basemapMaxZoom);
+    osg::ref_ptr<osg::LOD> ground_lod;
+    if (basemap_model)
+    {
+        // until the basemap is in, the polygons are drawn at any distance
+        ground_lod = new osg::LOD;
+        ground_lod->addChild(ground, 0.f, syncLoad ? basemapDistance : FLT_MAX);
+        ground_lod->addChild(basemap_model, basemapDistance, FLT_MAX);
+        root->addChild(ground_lod);
+    }
+    else
+    {
+        root->addChild(ground);
+    }
 
-    osg::ref_ptr<osg::Node> roads_model = process_roads(ltw, file_path);
+    // the road graph is built from the parse of the roads layer
+    osg::ref_ptr<RoadsParse> roads_parse = routing ? new RoadsParse : nullptr;
+    osg::ref_ptr<osg::Node> roads_model = layer("roads", [&]
+    {
+        return process_roads(ltw, file_path, roads_parse.get());
+    });
     root->addChild(roads_model);
 
-    osg::ref_ptr<osg::Node> buildings_model = process_buildings(ltw, file_path);
+    osg::ref_ptr<osg::Node> buildings_model =
+        layer("buildings", [&] { return process_buildings(ltw, file_path); });
     root->addChild(buildings_model);
 
-    osg::ref_ptr<osg::Node> labels_model = process_labels(ltw, file_path);
+    osg::ref_ptr<osg::Node> labels_model =
+        layer("labels", [&] { return process_labels(ltw, file_path); });
     root->addChild(labels_model);
 
+    // the road graph is built from the roads once more, or read from its
+    // cache; the route picked on it is drawn over the other layers
+    osg::ref_ptr<osg::Node> routing_model;
+    if (routing)
+    {
+        routing_model = layer("routing", [&]
+        {
+            return process_routing(ltw, file_path, roads_parse.get());
+        });
+        if (routing_model) root->addChild(routing_model);
+        if (syncLoad)
+            map_route = dynamic_cast<RouteOverlay*>(routing_model.get());
+    }
+
+    map_memory = new MemoryReport;
+    map_memory->addLayer("terrain", terrain_model);
+    map_memory->addLayer("landuse", land_model);
+    map_memory->addLayer("water", water_model);
+    map_memory->addLayer("basemap", basemap_model);
+    map_memory->addLayer("roads", roads_model);
+    map_memory->addLayer("buildings", buildings_model);
+    map_memory->addLayer("labels", labels_model);
+    map_memory->addLayer("routing", routing_model);
+
+    if (syncLoad)
+    {
+        osg::Timer_t start = osg::Timer::instance()->tick();
+        map_search->build();
+        std::cout << "--- SEARCH: Indexed " << map_search->getNumEntries()
+                  << " names in "
+                  << osg::Timer::instance()->delta_m(
+                         start, osg::Timer::instance()->tick())
+                  << " ms" << std::endl;
+    }
+
+    std::string threading;
+    if (arguments.read("--threading", threading))
+    {
+        if (threading == "SingleThreaded")
+            viewer->setThreadingModel(osgViewer::Viewer::SingleThreaded);
+        else if (threading == "CullDrawThreadPerContext")
+            viewer->setThreadingModel(
+                osgViewer::Viewer::CullDrawThreadPerContext);
+        else if (threading == "DrawThreadPerContext")
+            viewer->setThreadingModel(osgViewer::Viewer::DrawThreadPerContext);
+        else if (threading == "CullThreadPerCameraDrawThreadPerContext")
+            viewer->setThreadingModel(
+                osgViewer::Viewer::CullThreadPerCameraDrawThreadPerContext);
+        else if (threading == "Automatic")
+            viewer->setThreadingModel(osgViewer::Viewer::AutomaticSelection);
+        else std::cout << "Unknown threading model " << threading << std::endl;
+    }
+
+    // milliseconds per frame the render resolution adapts to, off when 0
+    double targetFrameTime = 0.0;
+    arguments.read("--dynamic-resolution", targetFrameTime);
+    if (targetFrameTime > 0.0)
+    {
+        statsHandler->addUserStatsLine("Resolution %",
+                                       osg::Vec4(0.9f, 0.5f, 0.9f, 1.0f),
+                                       osg::Vec4(0.9f, 0.5f, 0.9f, 0.5f),
+                                       "Resolution scale", 100.0, false, false,
+                                       "", "", 100.0);
+    }
+
+    bool onDemand = arguments.read("--on-demand");
+    double maxFrameRate = 0.0;
+    arguments.read("--max-fps", maxFrameRate);
+    double idleHeartbeat = 2.0;
+    arguments.read("--idle-heartbeat", idleHeartbeat);
+
+    // the background load and the watcher share the way a layer is swapped
+    // in; the layers keep the map frame they started with, a landuse layer
+    // with another extent would move it, that needs a restart
+    osg::ref_ptr<LayerReloader> reloader;
+    if (watch || !syncLoad)
+    {
+        reloader = new LayerReloader(file_path);
+        // the DEM is not watched, it is only loaded once
+        if (!syncLoad)
+        {
+            reloader->addLayer("terrain", {}, terrain_model,
+                               [ltw, file_path, demPaths]()
+            {
+                osg::Matrixd frame = ltw;
+                return process_terrain(frame, file_path, demPaths);
+            });
+        }
+        reloader->addLayer("landuse", {"gis_osm_landuse_a_free_1"}, land_model,
+                           [ltw, file_path]() -> osg::Node*
+        {
+            osg::Matrixd frame;
+            osg::BoundingBox bb;
+            osg::ref_ptr<osg::Node> node =
+                process_landuse(frame, bb, file_path);
+            if (node && frame != ltw)
+            {
+                std::cout << "--- RELOAD: landuse moved the map frame, "
+                             "restart to see it"
+                          << std::endl;
+                return nullptr;
+            }
+            return node.release();
+        });
+        reloader->addLayer("water", {"gis_osm_water_a_free_1"}, water_model,
+                           [ltw, file_path]()
+        {
+            osg::Matrixd frame = ltw;
+            return process_water(frame, file_path);
+        });
+        reloader->addLayer("roads", {"gis_osm_roads_free_1"}, roads_model,
+                           [ltw, file_path, roads_parse]()
+        {
+            osg::Matrixd frame = ltw;
+            return process_roads(frame, file_path, roads_parse.get());
+        });
+        reloader->addLayer("buildings", {"buildings_levels"}, buildings_model,
+                           [ltw, file_path]()
+        {
+            osg::Matrixd frame = ltw;
+            return process_buildings(frame, file_path);
+        });
+        reloader->addLayer("labels", {"test_pointss", "osm_points"},
+                           labels_model,
+                           [ltw, file_path]()
+        {
+            osg::Matrixd frame = ltw;
+            return process_labels(frame, file_path);
+        });
+        // the basemap is built from the other sources, it is only loaded once
+        if (!syncLoad)
+        {
+            reloader->addLayer("basemap", {}, basemap_model,
+                               [ltw, file_path]()
+                               {
+                                   osg::Matrixd frame = ltw;
+                                   return process_basemap(frame, file_path);
+                               },
+                               [ground_lod, basemapDistance](osg::Node*)
+                               {
+                                   ground_lod->setRange(0, 0.f,
+                                                        basemapDistance);
+                               });
+        }
+        // the graph follows the roads it is built from
+        reloader->addLayer("routing", {"gis_osm_roads_free_1"}, routing_model,
+                           [ltw, file_path, roads_parse]()
+                           {
+                               osg::Matrixd frame = ltw;
+                               return process_routing(frame, file_path,
+                                                      roads_parse.get());
+                           },
+                           [](osg::Node* node)
+                           {
+                               map_route = dynamic_cast<RouteOverlay*>(node);
+                           });
+
+        root->addUpdateCallback(reloader.get());
+        viewer->setIncrementalCompileOperation(
+            new osgUtil::IncrementalCompileOperation);
+    }
+
+    std::string traceFile;
+    if (arguments.read("--trace", traceFile))
+    {
+        map_trace = new FrameTrace(traceFile);
+        map_trace->attach(viewer.get());
+        viewer->addEventHandler(new TraceHandler);
+    }
+
     osg::Vec3d wtrans = wbb.center();
     wtrans.normalize();
     viewer->setLightingMode(osg::View::LightingMode::SKY_LIGHT);
@@ -213,15 +634,154 @@ int main(int argc, char** argv)
         return 1;
     }
 
-    viewer->setSceneData(root);
+    // nothing but the label masks changes after load, see the labels layer
+    StaticDataVarianceVisitor sdv;
+    root->accept(sdv);
+
+    if (targetFrameTime > 0.0)
+    {
+        osg::ref_ptr<DynamicResolution> dynres =
+            new DynamicResolution(targetFrameTime);
+        dynres->setFrameRateLimit(maxFrameRate);
+        viewer->setSceneData(dynres->createNode(root, viewer->getLight()));
+    }
+    else
+    {
+        viewer->setSceneData(root);
+    }
+
+    // click on a feature to print its attributes
+    viewer->addEventHandler(new PickHandler(ltw));
+
+    // search hits are in the map frame, the manipulator works in world space
+    auto flyTo = [mapManipulator, ltw](const osg::Vec3& position)
+    {
+        osg::Vec3d center = osg::Vec3d(position.x(), position.y(), 0.0) * ltw;
+        mapManipulator->flyTo(center, zoomToDistance(searchZoom));
+        viewer->requestRedraw();
+    };
+    viewer->addEventHandler(new SearchHandler(flyTo));
+
+    // 'R' at the start of a route and again at its destination
+    viewer->addEventHandler(new RouteHandler(ltw));
+
+    // memory per layer on 'M'
+    viewer->addEventHandler(new MemoryReportHandler);
+
+    // the whole map is compiled at realize, so every array is in a buffer
+    // object before its client side copy goes
+    if (releaseCpuData)
+    {
+        map_memory->prepareRelease();
+        viewer->setRealizeOperation(new osgUtil::GLObjectsOperation(
+            root, osgUtil::GLObjectsVisitor::COMPILE_DISPLAY_LISTS
+                      | osgUtil::GLObjectsVisitor::COMPILE_STATE_ATTRIBUTES));
+    }
 
     viewer->realize();
 
+    if (releaseCpuData) map_memory->releaseArrays();
+
+    // the memory report and the chunk lines of the stats need every layer,
+    // with the background load they wait for it
+    bool layersLoaded = false;
+    auto onLayersLoaded = [&]()
+    {
+        layersLoaded = true;
+        map_memory->print(std::cout);
+
+        // chunks drawn per layer; the culled ones are in the printed stats
+        for (const osg::ref_ptr<ChunkStats>& stats : map_chunk_stats)
+        {
+            statsHandler->addUserStatsLine(stats->getName() + " chunks",
+                                           osg::Vec4(0.5f, 0.9f, 0.9f, 1.0f),
+                                           osg::Vec4(0.5f, 0.9f, 0.9f, 0.5f),
+                                           stats->getName() + " chunks drawn",
+                                           1.0, false, false,
+                                           "", "", stats->getNumChunks());
+        }
+    };
+    if (syncLoad) onLayersLoaded();
+
+    if (benchThreading) return bench_threading(benchFrames);
+
+    if (reloader.valid())
+    {
+        if (!syncLoad)
+        {
+            viewer->getCamera()->addChild(reloader->createProgressHUD());
+            reloader->loadAll();
+        }
+        if (watch) reloader->start();
+    }
+
+    // frames are spaced by the frame rate limit; on demand, a frame is only
+    // drawn when something asks for it or the idle heartbeat is due
+    osg::Timer_t lastFrame = osg::Timer::instance()->tick();
+    bool firstFrame = false;
     while(!viewer->done())
     {
-        viewer->frame();
+        if (reloader.valid() && reloader->takeRedrawRequest())
+            viewer->requestRedraw();
+
+        double sinceFrame = osg::Timer::instance()->delta_s(
+            lastFrame, osg::Timer::instance()->tick());
+        if (maxFrameRate > 0.0 && sinceFrame < 1.0 / maxFrameRate)
+        {
+            OpenThreads::Thread::microSleep(
+                (unsigned int)((1.0 / maxFrameRate - sinceFrame) * 1e6));
+            continue;
+        }
+        if (onDemand && !need_frame()
+            && (idleHeartbeat <= 0.0 || sinceFrame < idleHeartbeat))
+        {
+            OpenThreads::Thread::microSleep(
+                (unsigned int)(idlePollInterval * 1e6));
+            continue;
+        }
+
+        lastFrame = osg::Timer::instance()->tick();
+        if (reloader.valid()) reloader->updateProgressHUD();
+        {
+            TraceScope scope("frame");
+            viewer->frame();
+        }
+
+        if (!firstFrame)
+        {
+            firstFrame = true;
+            std::cout << "--- LOAD: first frame after "
+                      << elapsedTime.elapsedTime_m() << " ms" << std::endl;
+        }
+
+        unsigned int frame = viewer->getViewerFrameStamp()->getFrameNumber();
+        if (!layersLoaded && !(reloader.valid() && reloader->isLoading()))
+            onLayersLoaded();
+
+        // the first frame homes the manipulator, the flight starts from
+        // there once the names of every layer are in
+        if (layersLoaded && !search.empty())
+        {
+            std::vector<NameIndex::Hit> hits;
+            map_search->search(search, hits, 1);
+            if (hits.empty())
+                std::cout << "--- SEARCH: nothing found for " << search
+                          << std::endl;
+            else flyTo(map_search->getEntry(hits[0].entry).position);
+            search.clear();
+        }
+
+        for (const osg::ref_ptr<ChunkStats>& stats : map_chunk_stats)
+            stats->publish(viewer->getViewerStats(), frame);
+
+        // the draw of the previous frame may still run in the threaded models
+        if (map_trace.valid() && frame >= traceFrameLag)
+            map_trace->addFrame(viewer.get(), frame - traceFrameLag);
     }
 
+    if (reloader.valid()) reloader->stop();
+    if (map_trace.valid()) map_trace->write();
+
     return 0;
 
 }
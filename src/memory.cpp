@@ -0,0 +1,263 @@
+#include <osg/Array>
+#include <osg/PrimitiveSet>
+#include <osg/Texture>
+#include <osg/Texture2D>
+#include <osg/Image>
+#include <osgGA/GUIEventAdapter>
+#include <osgGA/GUIActionAdapter>
+
+#include <iostream>
+#include <algorithm>
+#include <iomanip>
+#include <fstream>
+#include <unistd.h>
+
+#include "memory.h"
+
+// arrays of every kind the geometry has, without the empty slots
+static void get_arrays(osg::Geometry& geometry,
+                       std::vector<osg::Array*>& arrays)
+{
+    arrays.clear();
+    arrays.push_back(geometry.getVertexArray());
+    arrays.push_back(geometry.getNormalArray());
+    arrays.push_back(geometry.getColorArray());
+    arrays.push_back(geometry.getSecondaryColorArray());
+    arrays.push_back(geometry.getFogCoordArray());
+    for (osg::ref_ptr<osg::Array>& a : geometry.getTexCoordArrayList())
+        arrays.push_back(a.get());
+    for (osg::ref_ptr<osg::Array>& a : geometry.getVertexAttribArrayList())
+        arrays.push_back(a.get());
+    arrays.erase(std::remove(arrays.begin(), arrays.end(), nullptr),
+                 arrays.end());
+}
+
+static bool is_mipmapped(const osg::Texture* texture)
+{
+    osg::Texture::FilterMode f = texture->getFilter(osg::Texture::MIN_FILTER);
+    return f != osg::Texture::LINEAR && f != osg::Texture::NEAREST;
+}
+
+// resident set size of the process, 0 where /proc is missing
+static size_t resident_size()
+{
+    std::ifstream statm("/proc/self/statm");
+    size_t pages = 0, resident = 0;
+    if (!(statm >> pages >> resident)) return 0;
+    return resident * sysconf(_SC_PAGESIZE);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+
+void MemoryUsageVisitor::apply(osg::Node& node)
+{
+    applyStateSet(node.getStateSet());
+    traverse(node);
+}
+
+void MemoryUsageVisitor::apply(osg::Geometry& geometry)
+{
+    applyStateSet(geometry.getStateSet());
+    if (!_seen.insert(&geometry).second) return;
+    _usage.numGeometries++;
+
+    std::vector<osg::Array*> arrays;
+    get_arrays(geometry, arrays);
+    for (osg::Array* a : arrays)
+    {
+        if (!_seen.insert(a).second) continue;
+        _usage.arrays += a->getTotalDataSize();
+        _usage.buffers += a->getTotalDataSize();
+    }
+
+    for (unsigned int i = 0; i < geometry.getNumPrimitiveSets(); ++i)
+    {
+        osg::PrimitiveSet* ps = geometry.getPrimitiveSet(i);
+        if (!_seen.insert(ps).second) continue;
+        _usage.indices += ps->getTotalDataSize();
+        _usage.buffers += ps->getTotalDataSize();
+    }
+}
+
+void MemoryUsageVisitor::applyStateSet(const osg::StateSet* ss)
+{
+    if (!ss || !_seen.insert(ss).second) return;
+
+    for (unsigned int unit = 0; unit < ss->getTextureAttributeList().size();
+         ++unit)
+    {
+        const osg::Texture* texture = dynamic_cast<const osg::Texture*>(
+            ss->getTextureAttribute(unit, osg::StateAttribute::TEXTURE));
+        if (!texture || !_seen.insert(texture).second) continue;
+        _usage.numTextures++;
+
+        // RGBA8 without an image, with it the size of its pixels
+        size_t bytes = 0;
+        for (unsigned int i = 0; i < texture->getNumImages(); ++i)
+        {
+            const osg::Image* image = texture->getImage(i);
+            if (!image) continue;
+            bytes += image->getTotalSizeInBytes();
+            if (_seen.insert(image).second)
+                _usage.images += image->getTotalSizeInBytesIncludingMipmaps();
+        }
+        const osg::Texture2D* tex2d =
+            dynamic_cast<const osg::Texture2D*>(texture);
+        if (bytes == 0 && tex2d)
+            bytes = size_t(tex2d->getTextureWidth())
+                * tex2d->getTextureHeight() * 4;
+
+        _usage.textures += is_mipmapped(texture) ? bytes * 4 / 3 : bytes;
+    }
+}
+
+////////////////////////////////////////////////////////////////////////////////
+
+class PrepareReleaseVisitor : public osg::NodeVisitor {
+public:
+    PrepareReleaseVisitor() : osg::NodeVisitor(TRAVERSE_ALL_CHILDREN) {}
+
+    void apply(osg::Node& node) override
+    {
+        applyStateSet(node.getStateSet());
+        traverse(node);
+    }
+
+    void apply(osg::Geometry& geometry) override
+    {
+        applyStateSet(geometry.getStateSet());
+        geometry.setUseDisplayList(false);
+        geometry.setUseVertexBufferObjects(true);
+        geometry.setInitialBound(geometry.getBoundingBox());
+    }
+
+protected:
+    void applyStateSet(osg::StateSet* ss)
+    {
+        if (!ss) return;
+        for (unsigned int unit = 0; unit < ss->getTextureAttributeList().size();
+             ++unit)
+        {
+            osg::Texture* texture = dynamic_cast<osg::Texture*>(
+                ss->getTextureAttribute(unit, osg::StateAttribute::TEXTURE));
+            if (texture) texture->setUnRefImageDataAfterApply(true);
+        }
+    }
+};
+
+class ReleaseArraysVisitor : public osg::NodeVisitor {
+public:
+    ReleaseArraysVisitor() : osg::NodeVisitor(TRAVERSE_ALL_CHILDREN) {}
+
+    void apply(osg::Geometry& geometry) override
+    {
+        // arrays bound overall are read from the client side on every draw
+        std::vector<osg::Array*> arrays;
+        get_arrays(geometry, arrays);
+        for (osg::Array* a : arrays)
+        {
+            if (a->getBinding() != osg::Array::BIND_PER_VERTEX
+                || !a->getBufferObject())
+                continue;
+            if (!_released.insert(a).second) continue;
+
+            _bytes += a->getTotalDataSize();
+            a->resizeArray(0);
+            a->trim();
+        }
+    }
+
+    size_t getReleasedBytes() const { return _bytes; }
+
+protected:
+    std::set<const osg::Array*> _released;
+    size_t _bytes = 0;
+};
+
+////////////////////////////////////////////////////////////////////////////////
+
+void MemoryReport::addLayer(const std::string& name, osg::Node* node)
+{
+    if (!node) return;
+    for (Layer& layer : _layers)
+    {
+        if (layer.name != name) continue;
+        layer.node = node;
+        layer.released = 0;
+        return;
+    }
+
+    Layer layer;
+    layer.name = name;
+    layer.node = node;
+    _layers.push_back(layer);
+}
+
+void MemoryReport::prepareRelease()
+{
+    PrepareReleaseVisitor prv;
+    for (Layer& layer : _layers) layer.node->accept(prv);
+}
+
+void MemoryReport::releaseArrays()
+{
+    for (Layer& layer : _layers)
+    {
+        ReleaseArraysVisitor rav;
+        layer.node->accept(rav);
+        layer.released += rav.getReleasedBytes();
+    }
+}
+
+void MemoryReport::print(std::ostream& out) const
+{
+    auto mb = [](size_t bytes) { return double(bytes) / (1024.0 * 1024.0); };
+
+    out << "--- MEMORY (MB)      arrays   indices    images   gl buffers  "
+           "gl textures"
+        << std::endl;
+    out << std::fixed << std::setprecision(1);
+
+    MemoryUsage total;
+    for (const Layer& layer : _layers)
+    {
+        MemoryUsageVisitor muv;
+        layer.node->accept(muv);
+        MemoryUsage u = muv.getUsage();
+        u.buffers += layer.released;
+
+        out << "    " << std::left << std::setw(12) << layer.name << std::right
+            << std::setw(10) << mb(u.arrays) << std::setw(10) << mb(u.indices)
+            << std::setw(10) << mb(u.images) << std::setw(13) << mb(u.buffers)
+            << std::setw(13) << mb(u.textures) << std::endl;
+
+        total.arrays += u.arrays;
+        total.indices += u.indices;
+        total.images += u.images;
+        total.buffers += u.buffers;
+        total.textures += u.textures;
+    }
+
+    out << "    " << std::left << std::setw(12) << "total" << std::right
+        << std::setw(10) << mb(total.arrays) << std::setw(10)
+        << mb(total.indices) << std::setw(10) << mb(total.images)
+        << std::setw(13) << mb(total.buffers) << std::setw(13)
+        << mb(total.textures) << std::endl;
+
+    size_t rss = resident_size();
+    if (rss) out << "    resident set " << mb(rss) << " MB" << std::endl;
+    out << std::defaultfloat;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+
+bool MemoryReportHandler::handle(const osgGA::GUIEventAdapter& ea,
+                                 osgGA::GUIActionAdapter&)
+{
+    if (ea.getEventType() != osgGA::GUIEventAdapter::KEYDOWN
+        || ea.getKey() != 'M' || !map_memory.valid())
+        return false;
+
+    map_memory->print(std::cout);
+    return true;
+}
@@ -0,0 +1,91 @@
+#ifndef MEMORY_H
+#define MEMORY_H
+
+#include <osg/Referenced>
+#include <osg/ref_ptr>
+#include <osg/Node>
+#include <osg/NodeVisitor>
+#include <osg/Geometry>
+#include <osg/StateSet>
+#include <osgGA/GUIEventHandler>
+
+#include <iosfwd>
+#include <set>
+#include <string>
+#include <vector>
+
+// Bytes held by a subgraph; arrays, images and textures shared by several
+// drawables count once.
+struct MemoryUsage
+{
+    // client side copies
+    size_t arrays = 0;
+    size_t indices = 0;
+    size_t images = 0;
+    // estimated GL memory: buffer objects or display lists of the geometry,
+    // textures with their mipmaps
+    size_t buffers = 0;
+    size_t textures = 0;
+
+    unsigned int numGeometries = 0;
+    unsigned int numTextures = 0;
+};
+
+class MemoryUsageVisitor : public osg::NodeVisitor {
+public:
+    MemoryUsageVisitor() : osg::NodeVisitor(TRAVERSE_ALL_CHILDREN) {}
+
+    void apply(osg::Node& node) override;
+    void apply(osg::Geometry& geometry) override;
+
+    const MemoryUsage& getUsage() const { return _usage; }
+
+protected:
+    void applyStateSet(const osg::StateSet* ss);
+
+    std::set<const osg::Object*> _seen;
+    MemoryUsage _usage;
+};
+
+// Memory of every layer of the map, printed at startup and with the 'M'
+// key. The client side copies can be given up once they are in GL memory:
+// textures drop their images after the upload and geometry draws from
+// vertex buffer objects alone, its per vertex arrays emptied after the
+// whole scene was compiled at realize. Nothing reads the vertices of the
+// scene after that; picking has its own index of the shapes.
+class MemoryReport : public osg::Referenced {
+public:
+    // replaces the node of a layer of the same name
+    void addLayer(const std::string& name, osg::Node* node);
+
+    // before realize: buffer objects instead of display lists, bounds fixed
+    // to the current vertices and textures that unref their images
+    void prepareRelease();
+
+    // after the scene was compiled: empties the per vertex arrays that are
+    // in buffer objects, their sizes still count as GL memory
+    void releaseArrays();
+
+    void print(std::ostream& out) const;
+
+protected:
+    struct Layer
+    {
+        std::string name;
+        osg::ref_ptr<osg::Node> node;
+        size_t released = 0;
+    };
+
+    std::vector<Layer> _layers;
+};
+
+extern osg::ref_ptr<MemoryReport> map_memory;
+
+// prints the memory report on 'M'
+class MemoryReportHandler : public osgGA::GUIEventHandler {
+public:
+    bool handle(const osgGA::GUIEventAdapter& ea,
+                osgGA::GUIActionAdapter& aa) override;
+};
+
+#endif // MEMORY_H
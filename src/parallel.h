@@ -0,0 +1,78 @@
+#ifndef PARALLEL_H
+#define PARALLEL_H
+
+#include <thread>
+#include <atomic>
+#include <vector>
+#include <algorithm>
+
+// Calls func(i) for every i in [0, count) on all hardware threads, the
+// calling thread included. Items are handed out in batches from a shared
+// counter, so uneven work per item balances itself out. func must only
+// touch data owned by item i or shared read-only.
+template <typename Func>
+void parallel_for(size_t count, const Func& func, size_t batch = 64)
+{
+    if (count == 0) return;
+
+    size_t numThreads = std::max(1u, std::thread::hardware_concurrency());
+    numThreads = std::min(numThreads, (count + batch - 1) / batch);
+
+    std::atomic<size_t> next(0);
+    auto worker = [&]()
+    {
+        for (;;)
+        {
+            size_t begin = next.fetch_add(batch);
+            if (begin >= count) break;
+
+            size_t end = std::min(count, begin + batch);
+            for (size_t i = begin; i < end; ++i) func(i);
+        }
+    };
+
+    std::vector<std::thread> threads;
+    for (size_t t = 1; t < numThreads; ++t) threads.emplace_back(worker);
+    worker();
+    for (std::thread& t : threads) t.join();
+}
+
+// Sorts [first, last) on all hardware threads: blocks of the range are
+// sorted in parallel, then neighbouring blocks are merged pairwise, the
+// merges of a round in parallel as well.
+template <typename Iterator, typename Less>
+void parallel_sort(Iterator first, Iterator last, const Less& less)
+{
+    const size_t minBlock = 1 << 14;
+    size_t count = last - first;
+    size_t numBlocks = std::min<size_t>(
+        std::max(1u, std::thread::hardware_concurrency()), count / minBlock);
+    if (numBlocks < 2)
+    {
+        std::sort(first, last, less);
+        return;
+    }
+
+    std::vector<size_t> bounds(numBlocks + 1);
+    for (size_t b = 0; b <= numBlocks; ++b) bounds[b] = count * b / numBlocks;
+
+    parallel_for(numBlocks, [&](size_t b)
+    {
+        std::sort(first + bounds[b], first + bounds[b + 1], less);
+    }, 1);
+
+    for (size_t width = 1; width < numBlocks; width *= 2)
+    {
+        parallel_for((numBlocks + 2 * width - 1) / (2 * width), [&](size_t m)
+        {
+            size_t lo = 2 * width * m;
+            size_t mid = std::min(lo + width, numBlocks);
+            size_t hi = std::min(lo + 2 * width, numBlocks);
+            if (mid < hi)
+                std::inplace_merge(first + bounds[lo], first + bounds[mid],
+                                   first + bounds[hi], less);
+        }, 1);
+    }
+}
+
+#endif // PARALLEL_H
@@ -0,0 +1,471 @@
+#include <osg/Camera>
+#include <osg/Viewport>
+#include <osg/View>
+#include <osg/Timer>
+#include <osgGA/GUIEventAdapter>
+#include <osgGA/GUIActionAdapter>
+
+#include <iostream>
+#include <vector>
+#include <algorithm>
+#include <cmath>
+#include <cfloat>
+#include <cstdint>
+
+#include "picking.h"
+#include "parallel.h"
+#include "trace.h"
+#include "reload.h"
+#include "terrain.h"
+
+// records per leaf of the hierarchy
+const unsigned int pickLeafSize = 4;
+
+// a click is a press and release closer than this many pixels apart
+const float pickClickTolerance = 3.f;
+
+// hits of different layers this close to each other go to the upper layer
+const float pickTieDistance = 0.5f;
+
+static uint32_t spread_bits(uint32_t v)
+{
+    v &= 0xffff;
+    v = (v | (v << 8)) & 0x00ff00ff;
+    v = (v | (v << 4)) & 0x0f0f0f0f;
+    v = (v | (v << 2)) & 0x33333333;
+    v = (v | (v << 1)) & 0x55555555;
+    return v;
+}
+
+// nearest ratio in [0, maxDistance] where the segment enters the box, or -1
+static float hit_box(const osg::BoundingBox& bb, const osg::Vec3& start,
+                     const osg::Vec3& invDir, float maxDistance)
+{
+    if (!bb.valid()) return -1.f;
+
+    float t0 = 0.f, t1 = maxDistance;
+    for (int i = 0; i < 3; ++i)
+    {
+        float a = (bb._min[i] - start[i]) * invDir[i];
+        float b = (bb._max[i] - start[i]) * invDir[i];
+        if (a > b) std::swap(a, b);
+        t0 = std::max(t0, a);
+        t1 = std::min(t1, b);
+        if (t0 > t1) return -1.f;
+    }
+    return t0;
+}
+
+FeatureIndex::FeatureIndex(const std::string& name, ShapeFile& shp,
+                           const std::vector<float>& bases,
+                           const std::vector<float>& sizes) :
+    _name(name),
+    _shp(std::move(shp)),
+    _bases(bases),
+    _sizes(sizes)
+{
+    if (_bases.empty()) _bases.push_back(0.f);
+    if (_sizes.empty()) _sizes.push_back(0.f);
+
+    unsigned int numRecords = _shp.getNumRecords();
+    for (unsigned int r = 0; r < numRecords; ++r)
+    {
+        if (_shp.getFirstPart(r) != _shp.getEndPart(r)) _records.push_back(r);
+    }
+
+    // Morton order of the record centers keeps neighbouring records in the
+    // same leaves
+    const osg::BoundingBox& bounds = _shp.getLocalBounds();
+    float scaleX = 65535.f / std::max(bounds.xMax() - bounds.xMin(), 1.f);
+    float scaleY = 65535.f / std::max(bounds.yMax() - bounds.yMin(), 1.f);
+
+    std::vector<std::pair<uint32_t, unsigned int>> keys(_records.size());
+    parallel_for(keys.size(), [&](size_t i)
+    {
+        osg::Vec3 c = _shp.getRecordBounds(_records[i]).center();
+        uint32_t x = uint32_t(
+            osg::clampBetween((c.x() - bounds.xMin()) * scaleX, 0.f, 65535.f));
+        uint32_t y = uint32_t(
+            osg::clampBetween((c.y() - bounds.yMin()) * scaleY, 0.f, 65535.f));
+        keys[i] = std::make_pair(spread_bits(x) | (spread_bits(y) << 1),
+                                 _records[i]);
+    }, 4096);
+    std::sort(keys.begin(), keys.end());
+    for (size_t i = 0; i < keys.size(); ++i) _records[i] = keys[i].second;
+
+    _numLeaves = 1;
+    while (_numLeaves * pickLeafSize < _records.size()) _numLeaves *= 2;
+    _nodes.assign(2 * _numLeaves - 1, osg::BoundingBox());
+
+    // leaves from the shapes grown by their extent, then every level of
+    // inner nodes from the one below
+    ShapeFile::ShapeType type = _shp.getShapeType();
+    unsigned int firstLeaf = _numLeaves - 1;
+    parallel_for(_numLeaves, [&](size_t leaf)
+    {
+        osg::BoundingBox& bb = _nodes[firstLeaf + leaf];
+        size_t end = std::min(_records.size(), (leaf + 1) * pickLeafSize);
+        for (size_t i = leaf * pickLeafSize; i < end; ++i)
+        {
+            unsigned int r = _records[i];
+            const osg::BoundingBox& rb = _shp.getRecordBounds(r);
+            float size = getSize(r);
+            if (type == ShapeFile::POLYGON)
+            {
+                bb.expandBy(osg::Vec3(rb.xMin(), rb.yMin(), getBase(r)));
+                bb.expandBy(osg::Vec3(rb.xMax(), rb.yMax(), getBase(r) + size));
+            }
+            else if (type == ShapeFile::POLYLINE)
+            {
+                float low = FLT_MAX, high = -FLT_MAX;
+                unsigned int first = _shp.getFirstPoint(_shp.getFirstPart(r));
+                unsigned int end = _shp.getFirstPoint(_shp.getEndPart(r));
+                for (unsigned int k = first; k < end; ++k)
+                {
+                    low = std::min(low, getBase(k));
+                    high = std::max(high, getBase(k));
+                }
+                bb.expandBy(osg::Vec3(rb.xMin() - size, rb.yMin() - size, low));
+                bb.expandBy(osg::Vec3(rb.xMax() + size, rb.yMax() + size,
+                                      high));
+            }
+            else
+            {
+                bb.expandBy(osg::Vec3(rb.xMin() - size, rb.yMin() - size,
+                                      getBase(r) - size));
+                bb.expandBy(osg::Vec3(rb.xMax() + size, rb.yMax() + size,
+                                      getBase(r) + size));
+            }
+        }
+    }, 256);
+
+    for (unsigned int first = firstLeaf, count = _numLeaves; count > 1;
+         count /= 2)
+    {
+        first = (first - 1) / 2;
+        parallel_for(count / 2, [&](size_t i)
+        {
+            unsigned int n = first + i;
+            _nodes[n].expandBy(_nodes[2 * n + 1]);
+            _nodes[n].expandBy(_nodes[2 * n + 2]);
+        }, 1024);
+    }
+}
+
+int FeatureIndex::intersect(const osg::Vec3& start, const osg::Vec3& end,
+                            float& distance) const
+{
+    if (_records.empty()) return -1;
+
+    osg::Vec3 dir = end - start;
+    osg::Vec3 invDir(1.f / dir.x(), 1.f / dir.y(), 1.f / dir.z());
+    float best = std::min(distance, 1.f);
+    int record = -1;
+
+    // the tree is complete, so its depth is bounded by the bits of the size
+    unsigned int stack[64];
+    unsigned int top = 0;
+    stack[top++] = 0;
+    unsigned int firstLeaf = _numLeaves - 1;
+    while (top > 0)
+    {
+        unsigned int n = stack[--top];
+        if (hit_box(_nodes[n], start, invDir, best) < 0.f) continue;
+
+        if (n < firstLeaf)
+        {
+            stack[top++] = 2 * n + 2;
+            stack[top++] = 2 * n + 1;
+            continue;
+        }
+
+        size_t leaf = n - firstLeaf;
+        size_t last = std::min(_records.size(), (leaf + 1) * pickLeafSize);
+        for (size_t i = leaf * pickLeafSize; i < last; ++i)
+        {
+            float t = hitRecord(_records[i], start, dir);
+            if (t >= 0.f && t < best)
+            {
+                best = t;
+                record = _records[i];
+            }
+        }
+    }
+
+    if (record >= 0) distance = best;
+    return record;
+}
+
+float FeatureIndex::hitRecord(unsigned int record, const osg::Vec3& start,
+                              const osg::Vec3& dir) const
+{
+    switch (_shp.getShapeType())
+    {
+        case ShapeFile::POLYGON: return hitArea(record, start, dir);
+        case ShapeFile::POLYLINE: return hitLine(record, start, dir);
+        case ShapeFile::POINT:
+        case ShapeFile::MULTIPOINT: return hitPoint(record, start, dir);
+        default: return -1.f;
+    }
+}
+
+// even-odd rule over all rings of the record
+bool FeatureIndex::inside(unsigned int record, const osg::Vec2& p) const
+{
+    const std::vector<osg::Vec2>& points = _shp.getLocalPoints();
+
+    bool in = false;
+    for (unsigned int part = _shp.getFirstPart(record);
+         part < _shp.getEndPart(record); ++part)
+    {
+        unsigned int first = _shp.getFirstPoint(part);
+        unsigned int end = _shp.getEndPoint(part);
+        for (unsigned int i = first, j = end - 1; i < end; j = i++)
+        {
+            const osg::Vec2& a = points[i];
+            const osg::Vec2& b = points[j];
+            if ((a.y() > p.y()) != (b.y() > p.y())
+                && p.x() < (b.x() - a.x()) * (p.y() - a.y()) / (b.y() - a.y())
+                        + a.x())
+                in = !in;
+        }
+    }
+    return in;
+}
+
+// the segment enters the prism either through the roof or through a wall
+float FeatureIndex::hitArea(unsigned int record, const osg::Vec3& start,
+                            const osg::Vec3& dir) const
+{
+    if (dir.z() == 0.f) return -1.f;
+
+    float base = getBase(record);
+    float top = base + getSize(record);
+    float ta = (top - start.z()) / dir.z();
+    float tb = (base - start.z()) / dir.z();
+    if (ta > tb) std::swap(ta, tb);
+    ta = std::max(ta, 0.f);
+    tb = std::min(tb, 1.f);
+    if (ta > tb) return -1.f;
+
+    osg::Vec3 a = start + dir * ta;
+    osg::Vec3 b = start + dir * tb;
+    osg::Vec2 p0(a.x(), a.y()), p1(b.x(), b.y());
+    if (inside(record, p0)) return ta;
+    if (tb == ta) return -1.f;
+
+    // first wall crossed by the projection of the segment
+    const std::vector<osg::Vec2>& points = _shp.getLocalPoints();
+    osg::Vec2 d = p1 - p0;
+    float first = 2.f;
+    for (unsigned int part = _shp.getFirstPart(record);
+         part < _shp.getEndPart(record); ++part)
+    {
+        unsigned int begin = _shp.getFirstPoint(part);
+        unsigned int end = _shp.getEndPoint(part);
+        for (unsigned int i = begin + 1; i < end; ++i)
+        {
+            osg::Vec2 e = points[i] - points[i - 1];
+            float denom = d.x() * e.y() - d.y() * e.x();
+            if (denom == 0.f) continue;
+
+            osg::Vec2 w = points[i - 1] - p0;
+            float u = (w.x() * e.y() - w.y() * e.x()) / denom;
+            float v = (w.x() * d.y() - w.y() * d.x()) / denom;
+            if (u >= 0.f && u <= 1.f && v >= 0.f && v <= 1.f)
+                first = std::min(first, u);
+        }
+    }
+    return first <= 1.f ? ta + first * (tb - ta) : -1.f;
+}
+
+// every piece of the polyline is a strip across it, sloped along it from
+// the base of one point to the next; with equal bases it is the plane of
+// them all and the segment hits it where it crosses that height
+float FeatureIndex::hitLine(unsigned int record, const osg::Vec3& start,
+                            const osg::Vec3& dir) const
+{
+    float size = getSize(record);
+    float best = -1.f;
+
+    const std::vector<osg::Vec2>& points = _shp.getLocalPoints();
+    for (unsigned int part = _shp.getFirstPart(record);
+         part < _shp.getEndPart(record); ++part)
+    {
+        unsigned int begin = _shp.getFirstPoint(part);
+        unsigned int end = _shp.getEndPoint(part);
+        for (unsigned int i = begin + 1; i < end; ++i)
+        {
+            osg::Vec3 a(points[i - 1], getBase(i - 1));
+            osg::Vec3 e = osg::Vec3(points[i], getBase(i)) - a;
+            osg::Vec3 normal = e ^ osg::Vec3(-e.y(), e.x(), 0.f);
+            float denom = normal * dir;
+            if (denom == 0.f) continue;
+
+            float t = (normal * (a - start)) / denom;
+            if (t < 0.f || t > 1.f || (best >= 0.f && t >= best)) continue;
+
+            osg::Vec3 hit = start + dir * t;
+            osg::Vec2 p(hit.x(), hit.y());
+            osg::Vec2 e2(e.x(), e.y());
+            float len2 = e2.length2();
+            float u = osg::clampBetween(((p - points[i - 1]) * e2) / len2, 0.f,
+                                        1.f);
+            if ((points[i - 1] + e2 * u - p).length2() <= size * size) best = t;
+        }
+    }
+    return best;
+}
+
+float FeatureIndex::hitPoint(unsigned int record, const osg::Vec3& start,
+                             const osg::Vec3& dir) const
+{
+    const std::vector<osg::Vec2>& points = _shp.getLocalPoints();
+    float size = getSize(record);
+    float len2 = dir.length2();
+
+    float best = -1.f;
+    for (unsigned int part = _shp.getFirstPart(record);
+         part < _shp.getEndPart(record); ++part)
+    {
+        for (unsigned int i = _shp.getFirstPoint(part);
+             i < _shp.getEndPoint(part); ++i)
+        {
+            osg::Vec3 c(points[i].x(), points[i].y(), getBase(record));
+            float t = osg::clampBetween(((c - start) * dir) / len2, 0.f, 1.f);
+            if ((start + dir * t - c).length2() <= size * size
+                && (best < 0.f || t < best))
+                best = t;
+        }
+    }
+    return best;
+}
+
+void FeatureIndex::getAttributes(
+    unsigned int record,
+    std::vector<std::pair<std::string, std::string>>& attributes) const
+{
+    attributes.clear();
+    for (unsigned int f = 0; f < _shp.getNumFields(); ++f)
+        attributes.push_back(std::make_pair(_shp.getFieldName(f),
+                                            _shp.getString(record, f)));
+}
+
+////////////////////////////////////////////////////////////////////////////////
+
+void FeaturePicker::addLayer(FeatureIndex* index)
+{
+    for (osg::ref_ptr<FeatureIndex>& layer : _layers)
+    {
+        if (layer->getName() != index->getName()) continue;
+        layer = index;
+        return;
+    }
+    _layers.push_back(index);
+}
+
+void register_pick_index(FeatureIndex* index)
+{
+    if (LayerUpdate* update = staged_layer_update())
+        update->pickIndices.push_back(index);
+    else if (map_picker.valid()) map_picker->addLayer(index);
+}
+
+std::vector<float> ground_bases(const ShapeFile& shp)
+{
+    if (!map_terrain.valid()) return std::vector<float>(1, 0.f);
+
+    std::vector<float> bases(shp.getNumRecords());
+    parallel_for(bases.size(), [&](size_t r)
+    {
+        unsigned int first = shp.getFirstPoint(shp.getFirstPart(r));
+        unsigned int end = shp.getFirstPoint(shp.getEndPart(r));
+        bases[r] = map_terrain->getMinHeight(
+            shp.getLocalPoints().data() + first, end - first);
+    }, 256);
+    return bases;
+}
+
+bool FeaturePicker::pick(const osg::Vec3& start, const osg::Vec3& end,
+                         PickResult& result) const
+{
+    float length = (end - start).length();
+    if (length <= 0.f) return false;
+    float tie = pickTieDistance / length;
+
+    result = PickResult();
+    float best = FLT_MAX;
+    for (const osg::ref_ptr<FeatureIndex>& layer : _layers)
+    {
+        float distance = best + tie;
+        int record = layer->intersect(start, end, distance);
+        if (record < 0) continue;
+
+        result.layer = layer.get();
+        result.record = record;
+        result.position = start + (end - start) * distance;
+        best = distance;
+    }
+
+    if (!result.layer) return false;
+    result.layer->getAttributes(result.record, result.attributes);
+    return true;
+}
+
+bool FeaturePicker::pick(osg::View* view, float x, float y,
+                         const osg::Matrixd& ltw, PickResult& result) const
+{
+    osg::Camera* camera = view ? view->getCamera() : nullptr;
+    if (!camera || !camera->getViewport()) return false;
+
+    // window to the local map frame through the inverse of the whole chain
+    osg::Matrixd toWindow = osg::Matrixd(ltw) * camera->getViewMatrix()
+        * camera->getProjectionMatrix()
+        * camera->getViewport()->computeWindowMatrix();
+    osg::Matrixd fromWindow = osg::Matrixd::inverse(toWindow);
+
+    osg::Vec3d start = osg::Vec3d(x, y, 0.0) * fromWindow;
+    osg::Vec3d end = osg::Vec3d(x, y, 1.0) * fromWindow;
+    return pick(osg::Vec3(start), osg::Vec3(end), result);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+
+bool PickHandler::handle(const osgGA::GUIEventAdapter& ea,
+                         osgGA::GUIActionAdapter& aa)
+{
+    if (ea.getEventType() == osgGA::GUIEventAdapter::PUSH
+        && ea.getButton() == osgGA::GUIEventAdapter::LEFT_MOUSE_BUTTON)
+    {
+        _pushX = ea.getX();
+        _pushY = ea.getY();
+        return false;
+    }
+
+    if (ea.getEventType() != osgGA::GUIEventAdapter::RELEASE
+        || ea.getButton() != osgGA::GUIEventAdapter::LEFT_MOUSE_BUTTON
+        || std::fabs(ea.getX() - _pushX) > pickClickTolerance
+        || std::fabs(ea.getY() - _pushY) > pickClickTolerance
+        || !map_picker.valid())
+        return false;
+
+    TraceScope scope("pick");
+    osg::Timer_t start = osg::Timer::instance()->tick();
+    PickResult result;
+    bool found = map_picker->pick(aa.asView(), ea.getX(), ea.getY(), _ltw,
+                                  result);
+    double ms = osg::Timer::instance()->delta_m(start,
+                                                osg::Timer::instance()->tick());
+
+    if (!found)
+    {
+        std::cout << "--- PICK: nothing in " << ms << " ms" << std::endl;
+        return false;
+    }
+
+    std::cout << "--- PICK: " << result.layer->getName() << " #"
+              << result.record << " in " << ms << " ms" << std::endl;
+    for (const auto& a : result.attributes)
+        std::cout << "    " << a.first << " = " << a.second << std::endl;
+    return false;
+}
@@ -0,0 +1,138 @@
+#ifndef PICKING_H
+#define PICKING_H
+
+#include <osg/Referenced>
+#include <osg/ref_ptr>
+#include <osg/Vec3>
+#include <osg/Vec3d>
+#include <osg/Matrixd>
+#include <osg/BoundingBox>
+#include <osg/View>
+#include <osgGA/GUIEventHandler>
+
+#include <string>
+#include <vector>
+#include <utility>
+
+#include "shapefile.h"
+
+// Bounding volume hierarchy over the records of one layer in the local map
+// frame. Instead of the merged render geometry it keeps the source shapes,
+// so a hit is tested against a handful of rings of the record the leaf
+// refers to and the record number leads straight to its attributes.
+// Records are ordered along a Morton curve and grouped by four into the
+// leaves of a complete binary tree stored in an array; leaf and inner
+// bounds are computed level by level in parallel.
+class FeatureIndex : public osg::Referenced {
+public:
+    // takes the shapes of shp over. Polygons are prisms from their base up
+    // by the size of the record, polylines are strips at the height of the
+    // bases of their points and points are spheres around their base; size
+    // is the half width of a strip and the radius of a sphere. sizes has
+    // one entry per record, or a single one for all of them; so has bases,
+    // except that the bases of polylines are per point of shp, so that the
+    // strips follow the ground of a DEM.
+    FeatureIndex(const std::string& name, ShapeFile& shp,
+                 const std::vector<float>& bases,
+                 const std::vector<float>& sizes);
+
+    const std::string& getName() const { return _name; }
+    const ShapeFile& getShapeFile() const { return _shp; }
+
+    // nearest record hit by the segment [start, end] closer than distance,
+    // which is then the ratio along the segment; -1 when there is none
+    int intersect(const osg::Vec3& start, const osg::Vec3& end,
+                  float& distance) const;
+
+    // every attribute column of the record as a name and value pair
+    void getAttributes(
+        unsigned int record,
+        std::vector<std::pair<std::string, std::string>>& attributes) const;
+
+protected:
+    float hitRecord(unsigned int record, const osg::Vec3& start,
+                    const osg::Vec3& dir) const;
+    float hitArea(unsigned int record, const osg::Vec3& start,
+                  const osg::Vec3& dir) const;
+    float hitLine(unsigned int record, const osg::Vec3& start,
+                  const osg::Vec3& dir) const;
+    float hitPoint(unsigned int record, const osg::Vec3& start,
+                   const osg::Vec3& dir) const;
+    bool inside(unsigned int record, const osg::Vec2& p) const;
+
+    float getSize(unsigned int record) const
+    {
+        return _sizes.size() == 1 ? _sizes[0] : _sizes[record];
+    }
+    // n is the record, or the point of a polyline
+    float getBase(unsigned int n) const
+    {
+        return _bases.size() == 1 ? _bases[0] : _bases[n];
+    }
+
+    std::string _name;
+    ShapeFile _shp;
+    std::vector<float> _bases;
+    std::vector<float> _sizes;
+
+    // records in curve order and the tree, node n has children 2n+1 and 2n+2
+    // and the leaves are the last _numLeaves nodes
+    std::vector<unsigned int> _records;
+    std::vector<osg::BoundingBox> _nodes;
+    unsigned int _numLeaves = 0;
+};
+
+////////////////////////////////////////////////////////////////////////////////
+
+struct PickResult
+{
+    const FeatureIndex* layer = nullptr;
+    int record = -1;
+    osg::Vec3 position;
+    std::vector<std::pair<std::string, std::string>> attributes;
+};
+
+// Identifies the feature under a point of the view across the layers which
+// registered an index; layers added later are drawn on top and win ties.
+class FeaturePicker : public osg::Referenced {
+public:
+    // an index of the same name, from a layer loaded again, is replaced in
+    // place
+    void addLayer(FeatureIndex* index);
+
+    // segment in the local map frame
+    bool pick(const osg::Vec3& start, const osg::Vec3& end,
+              PickResult& result) const;
+
+    // window coordinates of the camera of view; ltw is the map frame
+    bool pick(osg::View* view, float x, float y, const osg::Matrixd& ltw,
+              PickResult& result) const;
+
+protected:
+    std::vector<osg::ref_ptr<FeatureIndex>> _layers;
+};
+
+extern osg::ref_ptr<FeaturePicker> map_picker;
+
+// adds the index to the picker, or to the layer update this thread is loading
+void register_pick_index(FeatureIndex* index);
+
+// bases of polygons lying on the ground: the lowest height of the terrain
+// under each record, or a single 0 without one
+std::vector<float> ground_bases(const ShapeFile& shp);
+
+// Prints the attributes of the feature clicked with the left button; a drag
+// of the map is not a click.
+class PickHandler : public osgGA::GUIEventHandler {
+public:
+    PickHandler(const osg::Matrixd& ltw) : _ltw(ltw) {}
+
+    bool handle(const osgGA::GUIEventAdapter& ea,
+                osgGA::GUIActionAdapter& aa) override;
+
+protected:
+    osg::Matrixd _ltw;
+    float _pushX = 0.f, _pushY = 0.f;
+};
+
+#endif // PICKING_H
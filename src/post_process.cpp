@@ -1,15 +1,271 @@
-#include <osgDB/ReadFile>
-#include <osgUtil/Optimizer>
-#include <osg/CoordinateSystemNode>
+#include <osg/Group>
+#include <osg/Geode>
+#include <osg/Geometry>
+#include <osg/LightSource>
+#include <osg/Program>
+#include <osg/Shader>
+#include <osg/Depth>
+#include <osg/Viewport>
+#include <osg/Stats>
+#include <osg/EllipsoidModel>
+#include <osgViewer/Viewer>
 
-#include <osg/Switch>
-#include <osg/Types>
-#include <osgText/Text>
-#include <osg/MatrixTransform>
-#include <osg/ShapeDrawable>
+#include <algorithm>
 
-#include <iostream>
+#include "common.h"
+#include "post_process.h"
 
-using namespace osg;
+// change of the resolution fraction per step
+const float dynresStep = 0.05f;
+// frames between two steps, so the frame time settles on the new fraction
+const unsigned int dynresSettleFrames = 15;
+// band around the target frame time where the fraction stays put
+const double dynresSlowerThan = 1.05;
+const double dynresFasterThan = 0.8;
+// weight of the last frame in the averaged frame time
+const double dynresSmoothing = 0.1;
+// frames back from the latest one of the camera stats to look for a
+// finished draw, which lags behind with the threaded models
+const unsigned int dynresStatsFrames = 3;
+// sharpening at the minimum fraction, none at full resolution
+const float dynresMaxSharpness = 0.6f;
 
-// GOOD LUCK!
\ No newline at end of file
+static const char* upscaleVertSource = R"(
+    #version 420 compatibility
+
+    out vec2 v_texCoord;
+
+    void main()
+    {
+        v_texCoord = gl_MultiTexCoord0.xy;
+        gl_Position = gl_ModelViewProjectionMatrix * gl_Vertex;
+    }
+)";
+
+// bilinear from the rendered part of the texture, then an unsharp mask
+// against the four neighbours to win back some of the lost edges
+static const char* upscaleFragSource = R"(
+    #version 420 compatibility
+
+    uniform sampler2D sceneTexture;
+    uniform vec2 sceneScale;
+    uniform vec2 texelSize;
+    uniform float sharpness;
+
+    in vec2 v_texCoord;
+
+    void main()
+    {
+        vec2 lo = 0.5 * texelSize;
+        vec2 hi = sceneScale - 0.5 * texelSize;
+        vec2 uv = clamp(v_texCoord * sceneScale, lo, hi);
+
+        vec3 c = texture(sceneTexture, uv).rgb;
+        vec3 n = texture(sceneTexture,
+                         clamp(uv + vec2(texelSize.x, 0.0), lo, hi)).rgb
+               + texture(sceneTexture,
+                         clamp(uv - vec2(texelSize.x, 0.0), lo, hi)).rgb
+               + texture(sceneTexture,
+                         clamp(uv + vec2(0.0, texelSize.y), lo, hi)).rgb
+               + texture(sceneTexture,
+                         clamp(uv - vec2(0.0, texelSize.y), lo, hi)).rgb;
+
+        gl_FragColor = vec4(clamp(c + sharpness * (c - 0.25 * n), 0.0, 1.0),
+                            1.0);
+    }
+)";
+
+DynamicResolution::DynamicResolution(double targetFrameTime, float minScale) :
+    _targetFrameTime(targetFrameTime / 1000.0),
+    _minScale(minScale)
+{
+}
+
+osg::Node* DynamicResolution::createNode(osg::Node* scene, osg::Light* light)
+{
+    _texture = new osg::Texture2D;
+    _texture->setInternalFormat(GL_RGBA8);
+    _texture->setFilter(osg::Texture::MIN_FILTER, osg::Texture::LINEAR);
+    _texture->setFilter(osg::Texture::MAG_FILTER, osg::Texture::LINEAR);
+    _texture->setWrap(osg::Texture::WRAP_S, osg::Texture::CLAMP_TO_EDGE);
+    _texture->setWrap(osg::Texture::WRAP_T, osg::Texture::CLAMP_TO_EDGE);
+    _texture->setDataVariance(osg::Object::DYNAMIC);
+
+    // relative with identity matrices, so it renders with the view and
+    // projection of the main camera
+    _rtt = new osg::Camera;
+    _rtt->setReferenceFrame(osg::Transform::RELATIVE_RF);
+    _rtt->setRenderOrder(osg::Camera::PRE_RENDER);
+    _rtt->setRenderTargetImplementation(osg::Camera::FRAME_BUFFER_OBJECT);
+    _rtt->setClearMask(GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT);
+    _rtt->setClearColor(viewer->getCamera()->getClearColor());
+    _rtt->attach(osg::Camera::COLOR_BUFFER, _texture.get());
+    _rtt->attach(osg::Camera::DEPTH_BUFFER, GL_DEPTH_COMPONENT24);
+    _rtt->setDataVariance(osg::Object::DYNAMIC);
+
+    // the sky light of the view only reaches the main camera
+    osg::LightSource* lightSource = new osg::LightSource;
+    lightSource->setLight(light);
+    lightSource->setStateSetModes(*_rtt->getOrCreateStateSet(),
+                                  osg::StateAttribute::ON);
+    _rtt->addChild(lightSource);
+    _rtt->addChild(scene);
+
+    osg::Geometry* quad = osg::createTexturedQuadGeometry(
+        osg::Vec3(0, 0, 0), osg::Vec3(1, 0, 0), osg::Vec3(0, 1, 0));
+    osg::Geode* geode = new osg::Geode;
+    geode->addDrawable(quad);
+
+    osg::Program* program = new osg::Program;
+    program->addShader(new osg::Shader(osg::Shader::VERTEX, upscaleVertSource));
+    program->addShader(new osg::Shader(osg::Shader::FRAGMENT,
+                                       upscaleFragSource));
+
+    _scaleUniform = new osg::Uniform("sceneScale", osg::Vec2(1, 1));
+    _texelUniform = new osg::Uniform("texelSize", osg::Vec2(1, 1));
+    _sharpnessUniform = new osg::Uniform("sharpness", 0.f);
+    _scaleUniform->setDataVariance(osg::Object::DYNAMIC);
+    _texelUniform->setDataVariance(osg::Object::DYNAMIC);
+    _sharpnessUniform->setDataVariance(osg::Object::DYNAMIC);
+
+    osg::StateSet* ss = geode->getOrCreateStateSet();
+    ss->setTextureAttributeAndModes(0, _texture.get(), osg::StateAttribute::ON);
+    ss->setAttributeAndModes(program, osg::StateAttribute::ON);
+    ss->addUniform(new osg::Uniform("sceneTexture", 0));
+    ss->addUniform(_scaleUniform.get());
+    ss->addUniform(_texelUniform.get());
+    ss->addUniform(_sharpnessUniform.get());
+    ss->setMode(GL_LIGHTING, osg::StateAttribute::OFF);
+    ss->setMode(GL_DEPTH_TEST, osg::StateAttribute::OFF);
+    ss->setAttributeAndModes(
+        new osg::Depth(osg::Depth::ALWAYS, 0.0, 1.0, false),
+        osg::StateAttribute::ON);
+
+    osg::Camera* hud = new osg::Camera;
+    hud->setReferenceFrame(osg::Transform::ABSOLUTE_RF);
+    hud->setProjectionMatrixAsOrtho2D(0, 1, 0, 1);
+    hud->setViewMatrix(osg::Matrixd::identity());
+    hud->setRenderOrder(osg::Camera::NESTED_RENDER);
+    hud->setClearMask(0);
+    hud->setAllowEventFocus(false);
+    hud->addChild(geode);
+
+    osg::Group* root = new osg::Group;
+    root->addChild(_rtt.get());
+    root->addChild(hud);
+    root->setUpdateCallback(this);
+    return root;
+}
+
+void DynamicResolution::setFrameRateLimit(double maxFrameRate)
+{
+    _framePeriod = maxFrameRate > 0.0 ? 1.0 / maxFrameRate : 0.0;
+}
+
+// seconds the cull and the draw of the frame took, the draw on the GPU when
+// the timer queries measured it; false while the frame is not drawn yet
+static bool render_cost(osg::Stats* stats, unsigned int frame, double& cost)
+{
+    double cull, draw, gpu;
+    if (!stats->getAttribute(frame, "Cull traversal time taken", cull)
+        || !stats->getAttribute(frame, "Draw traversal time taken", draw))
+        return false;
+    if (stats->getAttribute(frame, "GPU draw time taken", gpu))
+        draw = std::max(draw, gpu);
+    cost = cull + draw;
+    return true;
+}
+
+void DynamicResolution::resize(int width, int height)
+{
+    _width = width;
+    _height = height;
+
+    // the texture keeps the window size, the fraction only moves the
+    // viewport; a new size needs a new FBO
+    _texture->setTextureSize(width, height);
+    _texture->dirtyTextureObject();
+    _rtt->setRenderingCache(0);
+    _texelUniform->set(osg::Vec2(1.f / width, 1.f / height));
+}
+
+void DynamicResolution::applyScale()
+{
+    int w = std::max(1, int(_width * _scale + 0.5f));
+    int h = std::max(1, int(_height * _scale + 0.5f));
+
+    // a new viewport instead of changing the one a draw thread may still use
+    _rtt->setViewport(new osg::Viewport(0, 0, w, h));
+    _scaleUniform->set(osg::Vec2(float(w) / _width, float(h) / _height));
+    _sharpnessUniform->set(dynresMaxSharpness * (1.f - _scale)
+                           / std::max(1.f - _minScale, 0.01f));
+}
+
+void DynamicResolution::operator()(osg::Node* node, osg::NodeVisitor* nv)
+{
+    const osg::Viewport* vp = viewer->getCamera()->getViewport();
+    if (vp && vp->width() > 0 && vp->height() > 0
+        && (int(vp->width()) != _width || int(vp->height()) != _height))
+    {
+        resize(int(vp->width()), int(vp->height()));
+        applyScale();
+    }
+
+    const osg::FrameStamp* fs = nv->getFrameStamp();
+    osg::Stats* cameraStats = viewer->getCamera()->getStats();
+    if (fs && cameraStats && _width > 0)
+    {
+        // the stats handler stops the collection when it hides its pages
+        if (!cameraStats->collectStats("rendering"))
+            cameraStats->collectStats("rendering", true);
+        if (!cameraStats->collectStats("gpu"))
+            cameraStats->collectStats("gpu", true);
+
+        // the latest frame drawn since the last step; on demand rendering
+        // pauses between frames without making them look slow
+        double cost = 0.0;
+        unsigned int frame = cameraStats->getLatestFrameNumber();
+        unsigned int drawn = 0;
+        for (unsigned int i = 0; i < dynresStatsFrames && i < frame; ++i)
+        {
+            if (render_cost(cameraStats, frame - i, cost))
+            {
+                drawn = frame - i;
+                break;
+            }
+        }
+
+        if (drawn > _lastStatsFrame)
+        {
+            _lastStatsFrame = drawn;
+            _frameTime = _frameTime > 0.0
+                ? _frameTime + dynresSmoothing * (cost - _frameTime)
+                : cost;
+
+            // throttled frames only have to render within the period
+            double target = std::max(_targetFrameTime, _framePeriod);
+            float scale = _scale;
+            if (++_framesSinceChange >= dynresSettleFrames)
+            {
+                if (_frameTime > target * dynresSlowerThan)
+                    scale = std::max(_minScale, _scale - dynresStep);
+                else if (_frameTime < target * dynresFasterThan)
+                    scale = std::min(1.f, _scale + dynresStep);
+            }
+
+            if (scale != _scale)
+            {
+                _scale = scale;
+                _framesSinceChange = 0;
+                applyScale();
+            }
+        }
+
+        osg::Stats* stats = viewer->getViewerStats();
+        if (stats)
+            stats->setAttribute(fs->getFrameNumber(), "Resolution scale",
+                                _scale);
+    }
+
+    traverse(node, nv);
+}
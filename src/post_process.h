@@ -0,0 +1,62 @@
+#ifndef POST_PROCESS_H
+#define POST_PROCESS_H
+
+#include <osg/ref_ptr>
+#include <osg/Node>
+#include <osg/NodeCallback>
+#include <osg/NodeVisitor>
+#include <osg/Camera>
+#include <osg/Texture2D>
+#include <osg/Uniform>
+#include <osg/Light>
+
+// Dynamic resolution: the map is rendered into a texture at a fraction of
+// the window size and drawn over the window by a full screen quad, sampled
+// bilinearly and sharpened the more the lower the fraction. Only the
+// viewport of the render to texture camera changes with the fraction, the
+// texture keeps the window size. As an update callback it moves the
+// fraction in steps towards the target frame time; it only steps down when
+// frames are clearly too slow and up when they are clearly fast enough,
+// and never twice within a few frames, so the resolution does not pump.
+// The time of a frame is what rendering it cost, its cull and draw from
+// the camera stats, not the interval between frames, which holds the
+// waits for the vertical sync and the frame rate limit too.
+class DynamicResolution : public osg::NodeCallback {
+public:
+    // targetFrameTime in milliseconds
+    DynamicResolution(double targetFrameTime, float minScale = 0.5f);
+
+    // graph for the view: the scene rendered into the texture, lit by the
+    // sky light of the view, and the upscaling quad
+    osg::Node* createNode(osg::Node* scene, osg::Light* light);
+
+    float getScale() const { return _scale; }
+
+    // frames per second the main loop is throttled to, 0 for none; a frame
+    // that renders within the period is fast enough
+    void setFrameRateLimit(double maxFrameRate);
+
+    void operator()(osg::Node* node, osg::NodeVisitor* nv) override;
+
+protected:
+    void resize(int width, int height);
+    void applyScale();
+
+    double _targetFrameTime;
+    double _framePeriod = 0.0;
+    float _minScale;
+    float _scale = 1.f;
+
+    int _width = 0, _height = 0;
+    unsigned int _lastStatsFrame = 0;
+    double _frameTime = 0.0;
+    unsigned int _framesSinceChange = 0;
+
+    osg::ref_ptr<osg::Camera> _rtt;
+    osg::ref_ptr<osg::Texture2D> _texture;
+    osg::ref_ptr<osg::Uniform> _scaleUniform;
+    osg::ref_ptr<osg::Uniform> _texelUniform;
+    osg::ref_ptr<osg::Uniform> _sharpnessUniform;
+};
+
+#endif // POST_PROCESS_H
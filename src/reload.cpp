@@ -0,0 +1,396 @@
+#include <osg/Group>
+#include <osg/Geode>
+#include <osg/Timer>
+#include <osgDB/FileNameUtils>
+#include <osgText/Text>
+#include <osgUtil/IncrementalCompileOperation>
+#include <osgViewer/Viewer>
+
+#include <iostream>
+#include <algorithm>
+#include <chrono>
+#include <set>
+
+#ifdef __linux__
+#include <sys/inotify.h>
+#include <poll.h>
+#include <unistd.h>
+#endif
+
+#include "common.h"
+#include "reload.h"
+#include "picking.h"
+#include "chunker.h"
+#include "memory.h"
+#include "alloc_stats.h"
+
+// a layer reloads once its files did not change for this long, in seconds
+const double reloadSettleTime = 1.0;
+// how long the watcher waits for changes before it looks at the settled
+// layers and whether it should stop, in milliseconds
+const int reloadPollInterval = 200;
+// how often a load waiting for the one before to be swapped in looks again,
+// in milliseconds
+const int reloadWaitInterval = 5;
+
+static thread_local LayerUpdate* stagedUpdate = nullptr;
+
+LayerUpdate* staged_layer_update()
+{
+    return stagedUpdate;
+}
+
+// swaps the update in once the incremental compile made its GL objects
+class CommitCompiledLayer
+    : public osgUtil::IncrementalCompileOperation::CompileCompletedCallback {
+public:
+    CommitCompiledLayer(LayerReloader* reloader, LayerUpdate* update) :
+        _reloader(reloader), _update(update) {}
+
+    bool compileCompleted(
+        osgUtil::IncrementalCompileOperation::CompileSet*) override
+    {
+        _reloader->commit(_update.get());
+        return true;
+    }
+
+protected:
+    osg::ref_ptr<LayerReloader> _reloader;
+    osg::ref_ptr<LayerUpdate> _update;
+};
+
+////////////////////////////////////////////////////////////////////////////////
+
+LayerReloader::LayerReloader(const std::string& directory) :
+    _directory(directory),
+    _done(false),
+    _numLoading(0),
+    _redraw(false),
+    _inFlight(0)
+{
+}
+
+LayerReloader::~LayerReloader()
+{
+    stop();
+}
+
+void LayerReloader::addLayer(const std::string& name,
+                             const std::vector<std::string>& files,
+                             osg::Node* node, const Load& load,
+                             const Attached& attached)
+{
+    if (!node) return;
+
+    Layer layer;
+    layer.name = name;
+    layer.files = files;
+    layer.node = node;
+    layer.load = load;
+    layer.attached = attached;
+    _layers.push_back(layer);
+}
+
+void LayerReloader::loadAll()
+{
+    _loadStart = osg::Timer::instance()->tick();
+    _numLoading = _layers.size();
+    _loadThread = std::thread([this]()
+    {
+        for (size_t l = 0; l < _layers.size() && !_done; ++l)
+        {
+            setProgress("Loading " + _layers[l].name + " ("
+                        + std::to_string(l + 1) + "/"
+                        + std::to_string(_layers.size()) + ")");
+            _redraw = true;
+            reload(_layers[l], true);
+        }
+    });
+}
+
+std::string LayerReloader::getProgress() const
+{
+    std::lock_guard<std::mutex> lock(_progressMutex);
+    return _progress;
+}
+
+void LayerReloader::setProgress(const std::string& progress)
+{
+    std::lock_guard<std::mutex> lock(_progressMutex);
+    _progress = progress;
+}
+
+osg::Camera* LayerReloader::createProgressHUD()
+{
+    osgText::Text* text = new osgText::Text;
+    text->setDataVariance(osg::Object::DYNAMIC);
+    text->setFont("fonts/arial.ttf");
+    text->setCharacterSize(18.f);
+    text->setPosition(osg::Vec3(10.f, 10.f, 0.f));
+    text->setColor(osg::Vec4(1.f, 1.f, 1.f, 1.f));
+    text->setBackdropType(osgText::Text::OUTLINE);
+
+    osg::Geode* geode = new osg::Geode;
+    geode->addDrawable(text);
+
+    osg::Camera* hud = new osg::Camera;
+    hud->setReferenceFrame(osg::Transform::ABSOLUTE_RF);
+    hud->setProjectionMatrixAsOrtho2D(0, 1280, 0, 1024);
+    hud->setViewMatrix(osg::Matrix::identity());
+    hud->setClearMask(GL_DEPTH_BUFFER_BIT);
+    hud->setRenderOrder(osg::Camera::POST_RENDER);
+    hud->setAllowEventFocus(false);
+    hud->getOrCreateStateSet()->setMode(GL_LIGHTING, osg::StateAttribute::OFF);
+    hud->addChild(geode);
+
+    _progressHUD = hud;
+    _progressText = text;
+    return hud;
+}
+
+void LayerReloader::updateProgressHUD()
+{
+    if (!_progressHUD.valid()) return;
+
+    std::string progress = getProgress();
+    if (progress != _progressShown)
+    {
+        _progressText->setText(progress);
+        _progressShown = progress;
+    }
+    if (!isLoading()) _progressHUD->setNodeMask(0);
+}
+
+bool LayerReloader::start()
+{
+#ifdef __linux__
+    _fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+    if (_fd < 0 || inotify_add_watch(_fd, _directory.c_str(),
+                                     IN_CLOSE_WRITE | IN_MOVED_TO) < 0)
+    {
+        std::cerr << "Cannot watch " << _directory << " for changed layers"
+                  << std::endl;
+        if (_fd >= 0) close(_fd);
+        _fd = -1;
+        return false;
+    }
+
+    _done = false;
+    _thread = std::thread([this]() { run(); });
+    std::cout << "--- RELOAD: watching " << _directory << " for "
+              << _layers.size() << " layers" << std::endl;
+    return true;
+#else
+    std::cerr << "Watching the data directory needs inotify" << std::endl;
+    return false;
+#endif
+}
+
+void LayerReloader::stop()
+{
+    _done = true;
+    if (_thread.joinable()) _thread.join();
+    if (_loadThread.joinable()) _loadThread.join();
+#ifdef __linux__
+    if (_fd >= 0) close(_fd);
+#endif
+    _fd = -1;
+}
+
+void LayerReloader::findLayers(const std::string& fileName,
+                               std::set<int>& layers) const
+{
+    std::string file = osgDB::getNameLessExtension(fileName);
+    for (size_t l = 0; l < _layers.size(); ++l)
+    {
+        const std::vector<std::string>& files = _layers[l].files;
+        if (std::find(files.begin(), files.end(), file) != files.end())
+            layers.insert(int(l));
+    }
+}
+
+void LayerReloader::run()
+{
+#ifdef __linux__
+    std::set<int> changed;
+    osg::Timer_t lastChange = 0;
+    alignas(inotify_event) char buffer[4096];
+
+    while (!_done)
+    {
+        pollfd pfd = {_fd, POLLIN, 0};
+        if (poll(&pfd, 1, reloadPollInterval) > 0)
+        {
+            ssize_t length = read(_fd, buffer, sizeof(buffer));
+            for (ssize_t offset = 0; offset < length;)
+            {
+                const inotify_event* event =
+                    reinterpret_cast<const inotify_event*>(buffer + offset);
+                offset += sizeof(inotify_event) + event->len;
+                if (event->len == 0) continue;
+
+                std::set<int> layers;
+                findLayers(event->name, layers);
+                if (layers.empty()) continue;
+                changed.insert(layers.begin(), layers.end());
+                lastChange = osg::Timer::instance()->tick();
+            }
+            continue;
+        }
+
+        if (changed.empty() || _inFlight > 0 || _numLoading > 0
+            || osg::Timer::instance()->delta_s(lastChange,
+                                               osg::Timer::instance()->tick())
+                < reloadSettleTime)
+            continue;
+
+        for (int layer : changed) reload(_layers[layer], false);
+        changed.clear();
+    }
+#endif
+}
+
+void LayerReloader::reload(Layer& layer, bool startup)
+{
+    if (!startup)
+        std::cout << "--- RELOAD: " << layer.name
+                  << " changed, loading it again" << std::endl;
+    osg::Timer_t start = osg::Timer::instance()->tick();
+
+    osg::ref_ptr<LayerUpdate> update = new LayerUpdate;
+    update->layer = layer.name;
+    update->startup = startup;
+    stagedUpdate = update.get();
+    {
+        StageProfile profile(layer.name);
+        update->node = layer.load();
+    }
+    stagedUpdate = nullptr;
+
+    if (!update->node)
+    {
+        if (startup) startupLayerDone();
+        else
+            std::cout << "--- RELOAD: " << layer.name
+                      << " failed, the loaded one stays" << std::endl;
+        return;
+    }
+
+    StaticDataVarianceVisitor sdv;
+    update->node->accept(sdv);
+
+    // the search keeps one index, it is built again with the names of the
+    // other layers; map_search only changes in the commit, so this waits
+    // for the layer loaded before to be swapped in
+    while (_inFlight > 0 && !_done)
+        std::this_thread::sleep_for(
+            std::chrono::milliseconds(reloadWaitInterval));
+
+    bool hadNames = false;
+    for (unsigned int i = 0; i < map_search->getNumEntries() && !hadNames; ++i)
+        hadNames = map_search->getEntry(i).layer == layer.name;
+    if (hadNames || !update->searchEntries.empty())
+    {
+        update->search = new NameIndex;
+        for (unsigned int i = 0; i < map_search->getNumEntries(); ++i)
+        {
+            const NameIndex::Entry& e = map_search->getEntry(i);
+            if (e.layer != layer.name)
+                update->search->addEntry(e.name, e.position, e.rank, e.layer);
+        }
+        for (const NameIndex::Entry& e : update->searchEntries)
+            update->search->addEntry(e.name, e.position, e.rank, e.layer);
+        update->search->build();
+    }
+
+    update->loadTime =
+        osg::Timer::instance()->delta_m(start, osg::Timer::instance()->tick());
+
+    _inFlight++;
+    {
+        std::lock_guard<std::mutex> lock(_mutex);
+        _loaded.push_back(update);
+    }
+    _redraw = true;
+}
+
+void LayerReloader::operator()(osg::Node* node, osg::NodeVisitor* nv)
+{
+    std::vector<osg::ref_ptr<LayerUpdate>> loaded;
+    {
+        std::lock_guard<std::mutex> lock(_mutex);
+        loaded.swap(_loaded);
+    }
+
+    osgUtil::IncrementalCompileOperation* ico =
+        viewer->getIncrementalCompileOperation();
+    for (osg::ref_ptr<LayerUpdate>& update : loaded)
+    {
+        if (!ico)
+        {
+            commit(update.get());
+            continue;
+        }
+
+        osg::ref_ptr<osgUtil::IncrementalCompileOperation::CompileSet>
+            compileSet = new osgUtil::IncrementalCompileOperation::CompileSet(
+                update->node.get());
+        compileSet->_compileCompletedCallback =
+            new CommitCompiledLayer(this, update.get());
+        ico->add(compileSet.get());
+    }
+
+    // on demand rendering has to go on while the compile runs
+    if (_inFlight > 0) viewer->requestRedraw();
+
+    traverse(node, nv);
+}
+
+void LayerReloader::commit(LayerUpdate* update)
+{
+    auto it = std::find_if(_layers.begin(), _layers.end(),
+                           [update](const Layer& l)
+                           { return l.name == update->layer; });
+    if (it == _layers.end()) return;
+    Layer& layer = *it;
+
+    osg::Node::ParentList parents = layer.node->getParents();
+    for (osg::Group* parent : parents)
+        parent->replaceChild(layer.node.get(), update->node.get());
+    layer.node = update->node;
+
+    for (const osg::ref_ptr<FeatureIndex>& index : update->pickIndices)
+        if (map_picker.valid()) map_picker->addLayer(index.get());
+
+    for (const osg::ref_ptr<ChunkStats>& stats : update->chunkStats)
+    {
+        auto s = std::find_if(map_chunk_stats.begin(), map_chunk_stats.end(),
+                              [&stats](const osg::ref_ptr<ChunkStats>& c)
+                              { return c->getName() == stats->getName(); });
+        if (s != map_chunk_stats.end()) *s = stats;
+        else map_chunk_stats.push_back(stats);
+    }
+
+    if (update->search.valid()) map_search = update->search;
+    if (map_memory.valid()) map_memory->addLayer(layer.name, layer.node.get());
+    if (layer.attached) layer.attached(layer.node.get());
+
+    _inFlight--;
+    if (!update->startup)
+        std::cout << "--- RELOAD: " << layer.name << " swapped in, loaded in "
+                  << update->loadTime << " ms" << std::endl;
+    else startupLayerDone();
+}
+
+void LayerReloader::startupLayerDone()
+{
+    if (--_numLoading > 0) return;
+
+    // one more frame takes the progress off the window
+    setProgress("");
+    _redraw = true;
+    std::cout << "--- LOAD: all layers in after "
+              << osg::Timer::instance()->delta_m(
+                     _loadStart, osg::Timer::instance()->tick())
+              << " ms" << std::endl;
+}
@@ -0,0 +1,146 @@
+#ifndef RELOAD_H
+#define RELOAD_H
+
+#include <osg/Referenced>
+#include <osg/ref_ptr>
+#include <osg/Node>
+#include <osg/NodeCallback>
+#include <osg/NodeVisitor>
+#include <osg/Camera>
+#include <osg/Timer>
+#include <osgText/Text>
+
+#include <atomic>
+#include <functional>
+#include <mutex>
+#include <set>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "search.h"
+
+class FeatureIndex;
+class ChunkStats;
+
+// A layer loaded again off the main thread and what it registered while it
+// loaded, all of which replaces the layer's current state at once.
+struct LayerUpdate : public osg::Referenced
+{
+    std::string layer;
+    osg::ref_ptr<osg::Node> node;
+    std::vector<osg::ref_ptr<FeatureIndex>> pickIndices;
+    std::vector<osg::ref_ptr<ChunkStats>> chunkStats;
+    std::vector<NameIndex::Entry> searchEntries;
+    // the names of the other layers with the new ones of this layer
+    osg::ref_ptr<NameIndex> search;
+    double loadTime = 0.0;
+    // the first load of the layer by loadAll()
+    bool startup = false;
+};
+
+// the update the calling thread is loading, null outside of a reload; the
+// register functions of picking, search and chunking put what a layer
+// registers there instead of into the globals the frames read
+LayerUpdate* staged_layer_update();
+
+// Watches the data directory with inotify and loads a layer again when its
+// files change, the other layers stay as they are. The layer is processed
+// on the watcher thread and handed to the update callback of the root,
+// which puts it into the incremental compile of the viewer; once its GL
+// objects exist it replaces the old node and the old registrations in one
+// update traversal, so the first frame with it does not wait for uploads.
+// Files of a shapefile are written one after the other, a layer reloads
+// once none of them changed for a while.
+//
+// The startup goes the same way: the window opens with empty groups in
+// place of the layers and loadAll() builds them one after the other on a
+// thread of its own, each swapped in as soon as it is compiled.
+class LayerReloader : public osg::NodeCallback {
+public:
+    // processes the layer from the files in the data directory, null when
+    // it could not
+    typedef std::function<osg::Node*()> Load;
+    // called in the update traversal after node replaced the previous one
+    typedef std::function<void(osg::Node* node)> Attached;
+
+    LayerReloader(const std::string& directory);
+    ~LayerReloader();
+
+    // files are the names without extension of the layer's sources, node
+    // the one in the scene now
+    void addLayer(const std::string& name,
+                  const std::vector<std::string>& files, osg::Node* node,
+                  const Load& load, const Attached& attached = Attached());
+
+    // builds every layer once, in the order they were added
+    void loadAll();
+    // layers of loadAll() not swapped in yet
+    bool isLoading() const { return _numLoading > 0; }
+    // the layer loadAll() is working on, empty once all are in
+    std::string getProgress() const;
+    // text of the progress in a corner of the window, for the master camera;
+    // the update traversal does not reach it, updateProgressHUD() sets the
+    // text from the frame loop
+    osg::Camera* createProgressHUD();
+    void updateProgressHUD();
+
+    // whether the loader or the watcher asked for a frame since the last
+    // call; they cannot call requestRedraw() of the viewer themselves, the
+    // frame loop does it for them
+    bool takeRedrawRequest() { return _redraw.exchange(false); }
+
+    // watches the directory, false when it cannot be watched
+    bool start();
+    void stop();
+
+    void operator()(osg::Node* node, osg::NodeVisitor* nv) override;
+
+    // swaps the update into the scene, in the update traversal
+    void commit(LayerUpdate* update);
+
+protected:
+    struct Layer
+    {
+        std::string name;
+        std::vector<std::string> files;
+        osg::ref_ptr<osg::Node> node;
+        Load load;
+        Attached attached;
+    };
+
+    // the layers built from the file, the roads feed two
+    void findLayers(const std::string& fileName, std::set<int>& layers) const;
+    void run();
+    void reload(Layer& layer, bool startup);
+    void setProgress(const std::string& progress);
+    // counts a layer of loadAll() as done, swapped in or failed to load;
+    // the last one takes the progress off and logs the startup time
+    void startupLayerDone();
+
+    std::string _directory;
+    std::vector<Layer> _layers;
+
+    int _fd = -1;
+    std::thread _thread;
+    std::thread _loadThread;
+    std::atomic<bool> _done;
+
+    std::atomic<int> _numLoading;
+    osg::Timer_t _loadStart = 0;
+    mutable std::mutex _progressMutex;
+    std::string _progress;
+    osg::ref_ptr<osg::Camera> _progressHUD;
+    osg::ref_ptr<osgText::Text> _progressText;
+    std::string _progressShown;
+
+    std::atomic<bool> _redraw;
+
+    // loaded and not yet swapped in; the next reload waits for them, it
+    // builds on the names of the search they replace
+    std::atomic<int> _inFlight;
+    std::mutex _mutex;
+    std::vector<osg::ref_ptr<LayerUpdate>> _loaded;
+};
+
+#endif // RELOAD_H
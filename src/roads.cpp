@@ -14,19 +14,39 @@
 #include <osg/Program>
 #include <osg/Shader>
 #include <osg/Material>
-#include <osgSim/ShapeAttribute>
 #include <osg/Depth>
 
 #include <iostream>
 #include <vector>
+#include <map>
 #include <string>
 #include <algorithm>
 #include <cmath>
 
 #include "common.h"
+#include "style.h"
+#include "zoom.h"
+#include "shapefile.h"
+#include "picking.h"
+#include "search.h"
+#include "chunker.h"
+#include "alloc_stats.h"
+#include "terrain.h"
+#include "parallel.h"
+#include "arena.h"
+#include "routing.h"
 
 using namespace osg;
 
+// roads float this high above the ground polygons
+const float roadHeight = 0.4f;
+
+// segments of a street name within one cell of this side are one search hit
+const float roadSearchCell = 2000.f;
+
+// side of the square cells the road meshes are merged in
+const float roadChunkSize = 1000.f;
+
 static const char* vertSource = R"(
     #version 420 compatibility
     attribute vec3 a_tangent; 
@@ -79,15 +99,6 @@ static const char* fragSource = R"(
     }
 )";
 
-inline std::string trim(const std::string& str)
-{
-    const char* ws = " \t\n\r\f\v";
-    size_t start = str.find_first_not_of(ws);
-    if (start == std::string::npos) return "";
-    size_t end = str.find_last_not_of(ws);
-    return str.substr(start, end - start + 1);
-}
-
 osg::StateSet* createTextureStateSet(osg::Program* program,
                                      const std::string& diffPath,
                                      const std::string& normPath, int order = 0)
@@ -161,105 +172,140 @@ osg::StateSet* createTextureStateSet(osg::Program* program,
     return ss;
 }
 
-class RoadGeneratorVisitor : public osg::NodeVisitor {
+// Builds the meshes of the roads straight from the polylines of the
+// shapefile, in its local frame.
+class RoadGenerator {
 public:
-    osg::ref_ptr<osg::StateSet> _highwayState;
-    osg::ref_ptr<osg::StateSet> _cityState;
-    osg::ref_ptr<osg::StateSet> _pathState;
-
-    RoadGeneratorVisitor(osg::StateSet* highway, osg::StateSet* city,
-                         osg::StateSet* path)
-        : osg::NodeVisitor(TRAVERSE_ALL_CHILDREN), _highwayState(highway),
-          _cityState(city), _pathState(path)
-    {}
-
-    // wydobywamy fclass z drawable
-    inline std::string extractFClass(osg::Drawable* drawable)
+    // state set of every style class id, shifted by one so that slot 0
+    // holds the layer default used for unknown classes
+    std::vector<osg::ref_ptr<osg::StateSet>> _stateSets;
+
+    // triangles of the roads of one chunk sharing a state set; every road
+    // appends to the arrays of its batch, so a road costs no allocations of
+    // its own once the arrays have grown
+    struct RoadBatch
     {
-        if (!drawable) return "";
-
-        osgSim::ShapeAttributeList* sal =
-            dynamic_cast<osgSim::ShapeAttributeList*>(drawable->getUserData());
-
-        if (!sal) return "";
-
-        for (unsigned int i = 0; i < sal->size(); ++i)
-        {
-            const osgSim::ShapeAttribute& attr = (*sal)[i];
-            if (attr.getName() == "fclass"
-                && attr.getType() == osgSim::ShapeAttribute::STRING)
+        osg::ref_ptr<osg::Vec3Array> vertices, normals, tangents;
+        osg::ref_ptr<osg::Vec2Array> texCoords;
+    };
+    typedef std::map<osg::StateSet*, RoadBatch> Chunk;
+
+    // road batches grouped by the zoom range of their style class, so a
+    // whole range is skipped at once when it is out of view, and within a
+    // range by chunk
+    GridChunker _chunker;
+    std::map<std::pair<float, float>, std::map<GridChunker::Cell, Chunk>>
+        _zoomChunks;
+    unsigned int _numRoads = 0;
+
+    RoadGenerator(osg::Program* program, float chunkSize) :
+        _chunker(chunkSize)
+    {
+        // classes sharing a texture set and render order share a state set
+        std::map<std::pair<int, int>, osg::ref_ptr<osg::StateSet>> cache;
+        auto stateSetFor = [&](const StyleRule& rule) {
+            osg::ref_ptr<osg::StateSet>& ss =
+                cache[std::make_pair(rule.texture, rule.order)];
+            if (!ss)
             {
-                const char* str = attr.getString();
-                return str ? trim(std::string(str)) : "";
+                std::string diffPath, normPath;
+                if (rule.texture >= 0)
+                {
+                    diffPath = map_style->getTexture(rule.texture).diffuse;
+                    normPath = map_style->getTexture(rule.texture).normal;
+                }
+                ss = createTextureStateSet(program, diffPath, normPath,
+                                           rule.order);
             }
-        }
-        return "";
-    }
-
-    inline float getWidthForFClass(const std::string& fclass)
-    {
-        if (fclass == "motorway" || fclass == "trunk") return 19.0f;
-        if (fclass == "motorway_link" || fclass == "trunk_link") return 18.0f;
-        if (fclass == "primary") return 17.0f;
-        if (fclass == "secondary" || fclass == "primary_link") return 16.0f;
-        if (fclass == "secondary_link" || fclass == "tertiary") return 14.0f;
-        if (fclass == "residential" || fclass == "living_street"
-            || fclass == "tertiary_link")
-            return 13.0f;
-        if (fclass == "service" || fclass == "unclassified") return 11.0f;
-        if (fclass == "path" || fclass == "footway" || fclass == "cycleway")
-            return 11.5f;
-        if (fclass == "track" || fclass == "steps" || fclass == "pedestrian")
-            return 10.5f;
-        return 13.5f;
-    }
+            return ss;
+        };
 
-    inline osg::StateSet* selectStateSetForWidth(float width)
-    {
-        return (width >= 18.0f) ? _highwayState.get()
-            : (width >= 12.0f)  ? _cityState.get()
-                                : _pathState.get();
+        _stateSets.resize(map_style->getNumIds() + 1);
+        _stateSets[0] = stateSetFor(map_style->getDefault(STYLE_ROADS));
+        for (unsigned int id = 0; id < map_style->getNumIds(); ++id)
+        {
+            _stateSets[id + 1] =
+                stateSetFor(map_style->rule(STYLE_ROADS, id));
+        }
     }
 
-    void apply(osg::Geode& geode) override
+    // every part of the records with a road class becomes a road; on a DEM
+    // its points are split at the sample spacing and put on the ground
+    void addRoads(const ShapeFile& shp)
     {
-        std::vector<osg::Drawable*> toRemove;
-        std::vector<osg::Drawable*> toAdd;
+        const std::vector<osg::Vec2>& points = shp.getLocalPoints();
+        int fclass = shp.getFieldIndex("fclass");
+        float maxSegment =
+            map_terrain.valid() ? map_terrain->getSpacing() : 0.f;
 
-        // rezerwacja pamieci
-        toRemove.reserve(geode.getNumDrawables());
-        toAdd.reserve(geode.getNumDrawables());
-
-        for (unsigned int i = 0; i < geode.getNumDrawables(); ++i)
+        for (unsigned int r = 0; r < shp.getNumRecords(); ++r)
         {
-            osg::Geometry* lineGeom = geode.getDrawable(i)->asGeometry();
-            if (!lineGeom || !lineGeom->getVertexArray()) continue;
-            if (lineGeom->getNumPrimitiveSets() == 0) continue;
-
-            GLenum mode = lineGeom->getPrimitiveSet(0)->getMode();
-            if (mode != GL_LINE_STRIP && mode != GL_LINE_LOOP
-                && mode != GL_LINES)
-                continue;
+            shp.getString(r, fclass, _fclass);
+            if (_fclass.empty()) continue;
+
+            // one hash lookup, everything else is indexed by the class id
+            int id = map_style->find(_fclass);
+            const StyleRule& rule = map_style->rule(STYLE_ROADS, id);
+
+            GridChunker::Cell cell =
+                _chunker.getCell(shp.getRecordBounds(r).center());
+            RoadBatch& batch =
+                _zoomChunks[std::make_pair(rule.minZoom, rule.maxZoom)][cell]
+                           [_stateSets[id + 1].get()];
+            if (!batch.vertices)
+            {
+                batch.vertices = new osg::Vec3Array;
+                batch.normals = new osg::Vec3Array;
+                batch.tangents = new osg::Vec3Array;
+                batch.texCoords = new osg::Vec2Array;
+            }
 
-            std::string fclass = extractFClass(lineGeom);
-            if (fclass.empty()) continue;
+            for (unsigned int part = shp.getFirstPart(r);
+                 part < shp.getEndPart(r); ++part)
+            {
+                unsigned int first = shp.getFirstPoint(part),
+                             end = shp.getEndPoint(part);
+                if (end - first < 2) continue;
+
+                // the points of the road live in the arena until the next one
+                _arena.reset();
+                size_t numPoints = end - first;
+                if (maxSegment > 0.f)
+                {
+                    for (unsigned int k = first + 1; k < end; ++k)
+                        numPoints += splits(points[k - 1], points[k],
+                                            maxSegment);
+                }
+                osg::Vec3* line = _arena.allocateArray<osg::Vec3>(numPoints);
 
-            float width = getWidthForFClass(fclass);
-            osg::StateSet* selectedState = selectStateSetForWidth(width);
+                size_t n = 0;
+                for (unsigned int k = first; k < end; ++k)
+                {
+                    if (k > first && maxSegment > 0.f)
+                    {
+                        const osg::Vec2& a = points[k - 1];
+                        osg::Vec2 d = points[k] - a;
+                        unsigned int steps = splits(a, points[k], maxSegment);
+                        for (unsigned int s = 1; s <= steps; ++s)
+                        {
+                            osg::Vec2 p = a + d * (float(s) / (steps + 1));
+                            line[n++].set(p.x(), p.y(), 0.f);
+                        }
+                    }
+                    line[n++].set(points[k].x(), points[k].y(), 0.f);
+                }
+                if (map_terrain.valid())
+                {
+                    for (size_t k = 0; k < numPoints; ++k)
+                        line[k].z() =
+                            map_terrain->getHeight(line[k].x(), line[k].y());
+                }
 
-            osg::Geometry* roadMesh = createRoadMesh(lineGeom, width);
-            if (roadMesh)
-            {
-                roadMesh->setStateSet(selectedState);
-                toRemove.push_back(lineGeom);
-                toAdd.push_back(roadMesh);
+                addRoadMesh(line, numPoints, rule.width,
+                            _chunker.getOrigin(cell), batch);
             }
+            _numRoads++;
         }
-
-        for (auto d : toRemove) geode.removeDrawable(d);
-        for (auto d : toAdd) geode.addDrawable(d);
-
-        traverse(geode);
     }
 
     struct RoadProfile
@@ -269,33 +315,31 @@ public:
         float vCoord = 0.0f;
     };
 
-    osg::Geometry* createRoadMesh(osg::Geometry* line, float width)
+    // triangles of the road along the polyline, appended to the batch
+    // relative to the origin of its chunk
+    void addRoadMesh(const osg::Vec3* points, size_t numPoints, float width,
+                     const osg::Vec3& origin, RoadBatch& batch)
     {
-        osg::Vec3Array* points =
-            dynamic_cast<osg::Vec3Array*>(line->getVertexArray());
-        if (!points || points->size() < 2) return nullptr;
-
-        const size_t numPoints = points->size();
         const float halfWidth = width * 0.5f;
-        const float zOffset = 0.4f;
+        const float zOffset = roadHeight;
         const osg::Vec3 up(0, 0, 1);
 
-        // rezerwacja pamieci
-        std::vector<RoadProfile> profiles;
-        profiles.reserve(numPoints);
+        // reused for every road
+        std::vector<RoadProfile>& profiles = _profiles;
+        profiles.clear();
 
         // wierzcholki
         float currentV = 0.0f;
         for (size_t i = 0; i < numPoints; ++i)
         {
-            osg::Vec3 p = (*points)[i];
+            osg::Vec3 p = points[i] - origin;
             p.z() += zOffset;
 
             const osg::Vec3 normal = up;
 
             if (i > 0)
             {
-                currentV += ((*points)[i] - (*points)[i - 1]).length()
+                currentV += (points[i] - points[i - 1]).length()
                     * 0.1f; // jak daleko od pocz drogi
             }
 
@@ -305,7 +349,7 @@ public:
             if (i == 0)
             {
                 // poczatek drogi
-                osg::Vec3 d1 = (*points)[i + 1] - (*points)[i];
+                osg::Vec3 d1 = points[i + 1] - points[i];
                 d1.normalize();
                 sideVector = d1 ^ normal;
                 sideVector.normalize();
@@ -314,7 +358,7 @@ public:
             else if (i == numPoints - 1)
             {
                 // koniec drogi
-                osg::Vec3 d1 = (*points)[i] - (*points)[i - 1];
+                osg::Vec3 d1 = points[i] - points[i - 1];
                 d1.normalize();
                 sideVector = d1 ^ normal;
                 sideVector.normalize();
@@ -324,10 +368,10 @@ public:
             {
                 // srodek drogi - MITRING alg
 
-                osg::Vec3 d1 = (*points)[i] - (*points)[i - 1];
+                osg::Vec3 d1 = points[i] - points[i - 1];
                 d1.normalize();
 
-                osg::Vec3 d2 = (*points)[i + 1] - (*points)[i];
+                osg::Vec3 d2 = points[i + 1] - points[i];
                 d2.normalize();
 
                 osg::Vec3 r1 = d1 ^ normal;
@@ -365,12 +409,17 @@ public:
         const size_t numSegments = numPoints - 1;
         const size_t numVertices = numSegments * 6; // 2 trojkaty po 3 wierzch
 
-        osg::Vec3Array* vertices = new osg::Vec3Array(numVertices);
-        osg::Vec3Array* normals = new osg::Vec3Array(numVertices);
-        osg::Vec2Array* texCoords = new osg::Vec2Array(numVertices);
-        osg::Vec3Array* tangents = new osg::Vec3Array(numVertices);
+        size_t idx = batch.vertices->size();
+        batch.vertices->resize(idx + numVertices);
+        batch.normals->resize(idx + numVertices);
+        batch.texCoords->resize(idx + numVertices);
+        batch.tangents->resize(idx + numVertices);
+
+        osg::Vec3Array* vertices = batch.vertices.get();
+        osg::Vec3Array* normals = batch.normals.get();
+        osg::Vec2Array* texCoords = batch.texCoords.get();
+        osg::Vec3Array* tangents = batch.tangents.get();
 
-        size_t idx = 0;
         for (size_t i = 0; i < numSegments; ++i)
         {
             const RoadProfile& p0 = profiles[i];
@@ -414,15 +463,21 @@ public:
 
             idx += 3;
         }
+    }
 
+    // geometry of a finished batch
+    static osg::Geometry* createBatchGeometry(const RoadBatch& batch)
+    {
         osg::Geometry* mesh = new osg::Geometry();
-        mesh->setVertexArray(vertices);
-        mesh->setNormalArray(normals, osg::Array::BIND_PER_VERTEX);
-        mesh->setTexCoordArray(0, texCoords, osg::Array::BIND_PER_VERTEX);
-        mesh->setVertexAttribArray(6, tangents, osg::Array::BIND_PER_VERTEX);
+        mesh->setVertexArray(batch.vertices.get());
+        mesh->setNormalArray(batch.normals.get(), osg::Array::BIND_PER_VERTEX);
+        mesh->setTexCoordArray(0, batch.texCoords.get(),
+                               osg::Array::BIND_PER_VERTEX);
+        mesh->setVertexAttribArray(6, batch.tangents.get(),
+                                   osg::Array::BIND_PER_VERTEX);
 
         mesh->addPrimitiveSet(
-            new osg::DrawArrays(GL_TRIANGLES, 0, numVertices));
+            new osg::DrawArrays(GL_TRIANGLES, 0, batch.vertices->size()));
 
         // optymalizacja renderowania
         mesh->setDataVariance(osg::Object::STATIC);
@@ -432,29 +487,47 @@ public:
 
         return mesh;
     }
+
+protected:
+    // points added between a and b so that no piece is longer than
+    // maxSegment
+    static unsigned int splits(const osg::Vec2& a, const osg::Vec2& b,
+                               float maxSegment)
+    {
+        unsigned int steps =
+            (unsigned int)std::ceil((b - a).length() / maxSegment);
+        return steps > 1 ? steps - 1 : 0;
+    }
+
+    // scratch kept between roads
+    std::string _fclass;
+    std::vector<RoadProfile> _profiles;
+    Arena _arena;
 };
 
 // glowna funkcja
 
-osg::Node* process_roads(osg::Matrixd& ltw, const std::string& file_path)
+osg::Node* process_roads(osg::Matrixd& ltw, const std::string& file_path,
+                         RoadsParse* parse)
 {
     std::string roads_file_path = file_path + "/gis_osm_roads_free_1.shp";
+    if (parse) parse->clear();
 
-    // load the data
-    osg::ref_ptr<osg::Node> roads_model =
-        osgDB::readRefNodeFile(roads_file_path);
-    if (!roads_model)
+    // one parse of the file feeds the meshes, the picking, the street names
+    // and, through parse, the road graph
+    ShapeFile shp;
     {
-        std::cout << "Cannot load file " << roads_file_path << std::endl;
-        return nullptr;
+        StageProfile profile("roads load");
+        if (!shp.load(roads_file_path)
+            || shp.getShapeType() != ShapeFile::POLYLINE)
+        {
+            std::cout << "Cannot load file " << roads_file_path << std::endl;
+            return nullptr;
+        }
+        shp.toLocal(ltw);
+        profile.setNumItems(shp.getNumRecords());
     }
 
-    ConvertFromGeoProjVisitor<true> cfgp;
-    roads_model->accept(cfgp);
-
-    WorldToLocalVisitor ltwv(ltw, true);
-    roads_model->accept(ltwv);
-
     // przygotowanie shaderw
     osg::Program* program = new osg::Program;
     program->setName("RoadNormalMapping");
@@ -462,34 +535,122 @@ osg::Node* process_roads(osg::Matrixd& ltw, const std::string& file_path)
     program->addShader(new osg::Shader(osg::Shader::FRAGMENT, fragSource));
     program->addBindAttribLocation("a_tangent", 6);
 
-    // tekstury
-    std::string images_path = "images";
-
+    // tekstury wg pliku stylu
     std::cout << "Laduje tekstury..." << std::endl;
-    osg::StateSet* ssHighway =
-        createTextureStateSet(program, images_path + "/highway_d.png",
-                              images_path + "/highway_n.png", -7);
-    osg::StateSet* ssCity = createTextureStateSet(
-        program, images_path + "/city_d.png", images_path + "/city_n.png", -8);
-    osg::StateSet* ssPath = createTextureStateSet(
-        program, images_path + "/path_d.png", images_path + "/path_n.png", -9);
+    float chunkSize = map_style->getDefault(STYLE_ROADS).chunkSize;
+    RoadGenerator generator(program,
+                            chunkSize > 0.f ? chunkSize : roadChunkSize);
 
     std::cout << "Generuje geometrie drog..." << std::endl;
-    RoadGeneratorVisitor generator(ssHighway, ssCity, ssPath);
-    roads_model->accept(generator);
+    {
+        StageProfile profile("roads meshes");
+        generator.addRoads(shp);
+        profile.setNumItems(generator._numRoads);
+    }
 
-    // optymalizacja sceny
+    // optymalizacja sceny, osobno dla kazdego chunka i zakresu zoomu; the
+    // roads are batched already, the optimizer only indexes the triangles.
+    // The callbacks go on afterwards so it cannot fold them away
     osgUtil::Optimizer optimizer;
-    optimizer.optimize(roads_model,
-                       osgUtil::Optimizer::FLATTEN_STATIC_TRANSFORMS
-                           | osgUtil::Optimizer::REMOVE_REDUNDANT_NODES
-                           | osgUtil::Optimizer::MERGE_GEOMETRY
-                           | osgUtil::Optimizer::SPATIALIZE_GROUPS
-                           | osgUtil::Optimizer::INDEX_MESH
-                           | osgUtil::Optimizer::VERTEX_PRETRANSFORM
-                           | osgUtil::Optimizer::VERTEX_POSTTRANSFORM);
+    osg::ref_ptr<ChunkStats> stats = register_chunk_stats("Roads");
+    osg::Group* roads = new osg::Group;
+    for (auto& z : generator._zoomChunks)
+    {
+        unsigned int numDrawables = 0;
+        for (auto& chunk : z.second)
+        {
+            osg::Geode* geode = new osg::Geode;
+            for (auto& batch : chunk.second)
+            {
+                osg::Geometry* mesh =
+                    RoadGenerator::createBatchGeometry(batch.second);
+                mesh->setStateSet(batch.first);
+                geode->addDrawable(mesh);
+            }
+            optimizer.optimize(geode,
+                               osgUtil::Optimizer::INDEX_MESH
+                                   | osgUtil::Optimizer::VERTEX_PRETRANSFORM
+                                   | osgUtil::Optimizer::VERTEX_POSTTRANSFORM);
+            numDrawables += geode->getNumDrawables();
+            generator._chunker.addChunk(chunk.first, geode);
+        }
+
+        osg::Node* range = generator._chunker.build(stats.get());
+        float minZoom = z.first.first, maxZoom = z.first.second;
+        if (minZoom > 0.f || maxZoom < 30.f)
+            range->setCullCallback(new ZoomRangeCallback(minZoom, maxZoom));
+        roads->addChild(range);
+
+        std::cout << "--- ROADS: zoom " << minZoom << "-" << maxZoom << ": "
+                  << numDrawables << " geometrii w " << z.second.size()
+                  << " chunkach" << std::endl;
+    }
+
+    if (map_picker.valid() || map_search.valid())
+    {
+        int fclass = shp.getFieldIndex("fclass");
+        int name = shp.getFieldIndex("name");
+
+        typedef std::pair<std::string, std::pair<int, int>> StreetKey;
+        std::map<StreetKey, std::pair<osg::BoundingBox, int>> streets;
+        std::vector<float> halfWidths(shp.getNumRecords());
+
+        // the strings are reused, only a new street in a cell copies its name
+        std::string roadClass;
+        StreetKey key;
+        for (unsigned int r = 0; r < shp.getNumRecords(); ++r)
+        {
+            shp.getString(r, fclass, roadClass);
+            const StyleRule& rule = map_style->rule(STYLE_ROADS,
+                                                    map_style->find(roadClass));
+            halfWidths[r] = 0.5f * rule.width;
+
+            shp.getString(r, name, key.first);
+            if (key.first.empty()) continue;
+
+            const osg::BoundingBox& bb = shp.getRecordBounds(r);
+            key.second = std::make_pair(
+                int(std::floor(bb.center().x() / roadSearchCell)),
+                int(std::floor(bb.center().y() / roadSearchCell)));
+            auto it = streets.find(key);
+            if (it == streets.end())
+                it = streets.insert(std::make_pair(
+                    key, std::make_pair(osg::BoundingBox(), rule.rank))).first;
+            it->second.first.expandBy(bb);
+            it->second.second = std::min(it->second.second, rule.rank);
+        }
+
+        if (map_search.valid())
+        {
+            for (const auto& s : streets)
+                register_search_entry(s.first.first, s.second.first.center(),
+                                      s.second.second, "roads");
+        }
+        if (map_picker.valid())
+        {
+            // on a DEM the strips follow the ground under the points
+            std::vector<float> bases(1, roadHeight);
+            if (map_terrain.valid())
+            {
+                const std::vector<osg::Vec2>& points = shp.getLocalPoints();
+                bases.resize(points.size());
+                parallel_for(points.size(), [&](size_t i)
+                {
+                    bases[i] =
+                        map_terrain->getHeight(points[i].x(), points[i].y())
+                        + roadHeight;
+                }, 4096);
+            }
+            // the index takes the parse over, the graph reads it from there
+            FeatureIndex* index =
+                new FeatureIndex("roads", shp, bases, halfWidths);
+            register_pick_index(index);
+            if (parse) parse->setIndex(index);
+        }
+    }
+    if (parse && !parse->get()) parse->setShapeFile(shp);
 
     std::cout << "Przetwarzanie zakonczone\n" << std::endl;
 
-    return roads_model.release();
+    return roads;
 }
\ No newline at end of file
@@ -0,0 +1,1071 @@
+#include <osg/Geometry>
+#include <osg/LineWidth>
+#include <osg/Point>
+#include <osg/Timer>
+#include <osgDB/FileUtils>
+#include <osgDB/FileNameUtils>
+#include <osgGA/GUIEventAdapter>
+#include <osgGA/GUIActionAdapter>
+
+#include <iostream>
+#include <fstream>
+#include <sstream>
+#include <algorithm>
+#include <numeric>
+#include <atomic>
+#include <memory>
+#include <queue>
+#include <cmath>
+#include <cfloat>
+#include <climits>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+
+#include "common.h"
+#include "style.h"
+#include "routing.h"
+#include "shapefile.h"
+#include "parallel.h"
+#include "terrain.h"
+#include "trace.h"
+#include "cache.h"
+#include "picking.h"
+
+static const char* cacheHeader = "osgMap-routing";
+static const int cacheVersion = 1;
+
+// nodes a witness search settles before it gives up; the shortcut it could
+// not rule out is then added, which costs an edge but is never wrong
+const unsigned int witnessMaxSettled = 100;
+// nodes per cell of the grid findNode() looks in
+const float nodesPerCell = 4.f;
+// height of the route line over the ground
+const float routeHeight = 1.f;
+// after the map layers, before the transparent labels
+const int routeRenderBin = 5;
+
+enum RoadDirection
+{
+    DIRECTION_FORWARD = 1,
+    DIRECTION_BACKWARD = 2
+};
+
+// the exact bits of the position, points the ways share are stored the same
+static uint64_t position_key(const osg::Vec2& p)
+{
+    uint32_t x, y;
+    std::memcpy(&x, p.ptr(), sizeof(x));
+    std::memcpy(&y, p.ptr() + 1, sizeof(y));
+    return (uint64_t(x) << 32) | y;
+}
+
+template <typename T>
+static void write_array(std::ostream& out, const std::vector<T>& values)
+{
+    uint64_t size = values.size();
+    out.write((const char*)&size, sizeof(size));
+    out.write((const char*)values.data(), sizeof(T) * size);
+}
+
+// fileSize bounds the count of the file, a damaged one fails before the
+// array is allocated
+template <typename T>
+static bool read_array(std::istream& in, std::vector<T>& values,
+                       size_t fileSize)
+{
+    uint64_t size = 0;
+    if (!in.read((char*)&size, sizeof(size))) return false;
+
+    std::streamoff offset = in.tellg();
+    if (offset < 0 || size_t(offset) > fileSize
+        || size > (fileSize - size_t(offset)) / sizeof(T))
+        return false;
+    values.resize(size);
+    return bool(in.read((char*)values.data(), sizeof(T) * size));
+}
+
+////////////////////////////////////////////////////////////////////////////////
+
+bool RoadGraph::build(const ShapeFile& shp)
+{
+    if (shp.getShapeType() != ShapeFile::POLYLINE) return false;
+
+    const std::vector<osg::Vec2>& points = shp.getLocalPoints();
+    unsigned int numRecords = shp.getNumRecords();
+    int fclassField = shp.getFieldIndex("fclass");
+    int onewayField = shp.getFieldIndex("oneway");
+
+    // metres per millisecond on every record, 0 off the network, and the
+    // directions it may be driven in; one way streets are F along their
+    // points and T against them
+    std::vector<float> speeds(numRecords);
+    std::vector<unsigned char> directions(numRecords);
+    parallel_for(numRecords, [&](size_t r)
+    {
+        static thread_local std::string value;
+        shp.getString(r, fclassField, value);
+        speeds[r] = map_style->rule(STYLE_ROADS,
+                                    map_style->find(value)).speed / 3600.f;
+        shp.getString(r, onewayField, value);
+        directions[r] = value == "F" ? DIRECTION_FORWARD
+                      : value == "T" ? DIRECTION_BACKWARD
+                      : DIRECTION_FORWARD | DIRECTION_BACKWARD;
+    });
+
+    // the points of the roads sorted by position, the others at the end;
+    // ways cross at the points they share, not only at their ends, so
+    // every position more than one point has is a node, and so are the ends
+    const uint64_t offNetwork = ~uint64_t(0);
+    std::vector<std::pair<uint64_t, unsigned int>> keys(
+        points.size(), std::make_pair(offNetwork, 0u));
+    std::vector<unsigned char> ends(points.size(), 0);
+    parallel_for(numRecords, [&](size_t r)
+    {
+        for (unsigned int part = shp.getFirstPart(r); part < shp.getEndPart(r);
+             ++part)
+        {
+            unsigned int first = shp.getFirstPoint(part),
+                         end = shp.getEndPoint(part);
+            for (unsigned int p = first; p < end; ++p)
+                keys[p] = std::make_pair(
+                    speeds[r] > 0.f ? position_key(points[p]) : offNetwork, p);
+            if (end > first) ends[first] = ends[end - 1] = 1;
+        }
+    });
+
+    typedef std::pair<uint64_t, unsigned int> Key;
+    parallel_sort(keys.begin(), keys.end(),
+                  [](const Key& a, const Key& b) { return a < b; });
+    size_t numKeys = std::lower_bound(keys.begin(), keys.end(),
+                                      std::make_pair(offNetwork, 0u))
+        - keys.begin();
+
+    // the first key of every run of equal ones is marked when the run is a
+    // node, the marks numbered in order
+    std::vector<unsigned int> runNodes(numKeys, 0);
+    parallel_for(numKeys, [&](size_t k)
+    {
+        if (k > 0 && keys[k - 1].first == keys[k].first) return;
+        size_t end = k + 1;
+        while (end < numKeys && keys[end].first == keys[k].first) ++end;
+        bool node = end - k > 1;
+        for (size_t j = k; j < end && !node; ++j)
+            node = ends[keys[j].second] != 0;
+        runNodes[k] = node ? 1 : 0;
+    }, 1024);
+
+    unsigned int numNodes = 0;
+    for (size_t k = 0; k < numKeys; ++k)
+        runNodes[k] = runNodes[k] ? numNodes++ : ~0u;
+
+    std::vector<unsigned int> pointNodes(points.size(), ~0u);
+    std::vector<osg::Vec2> positions(numNodes);
+    parallel_for(numKeys, [&](size_t k)
+    {
+        unsigned int node = runNodes[k];
+        if (node == ~0u) return;
+        positions[node] = points[keys[k].second];
+        for (size_t j = k; j < numKeys && keys[j].first == keys[k].first; ++j)
+            pointNodes[keys[j].second] = node;
+    }, 1024);
+    std::vector<Key>().swap(keys);
+    std::vector<unsigned int>().swap(runNodes);
+
+    // calls emit(from, to, first, end, length) for the pieces of a road
+    // between its nodes, [first, end) their points; a piece that comes back
+    // to the node it started at leads nowhere
+    auto walk = [&](unsigned int r, auto emit)
+    {
+        if (speeds[r] <= 0.f) return;
+        for (unsigned int part = shp.getFirstPart(r); part < shp.getEndPart(r);
+             ++part)
+        {
+            unsigned int first = shp.getFirstPoint(part),
+                         end = shp.getEndPoint(part);
+            unsigned int start = first;
+            float length = 0.f;
+            for (unsigned int p = first + 1; p < end; ++p)
+            {
+                length += (points[p] - points[p - 1]).length();
+                if (pointNodes[p] == ~0u) continue;
+                if (pointNodes[p] != pointNodes[start])
+                    emit(pointNodes[start], pointNodes[p], start, p + 1,
+                         length);
+                start = p;
+                length = 0.f;
+            }
+        }
+    };
+
+    // pieces and their points counted per road, then written at the
+    // offsets of the counts
+    std::vector<unsigned int> recordGeometries(numRecords + 1, 0);
+    std::vector<unsigned int> recordPoints(numRecords + 1, 0);
+    parallel_for(numRecords, [&](size_t r)
+    {
+        walk(r, [&](unsigned int, unsigned int, unsigned int first,
+                    unsigned int end, float)
+        {
+            recordGeometries[r + 1]++;
+            recordPoints[r + 1] += end - first;
+        });
+    });
+    std::partial_sum(recordGeometries.begin(), recordGeometries.end(),
+                     recordGeometries.begin());
+    std::partial_sum(recordPoints.begin(), recordPoints.end(),
+                     recordPoints.begin());
+
+    unsigned int numGeometries = recordGeometries[numRecords];
+    _geometryFrom.resize(numGeometries);
+    _geometryFirst.resize(numGeometries + 1);
+    _geometryPoints.resize(recordPoints[numRecords]);
+    _geometryFirst[numGeometries] = _geometryPoints.size();
+    std::vector<unsigned int> geometryTo(numGeometries);
+    std::vector<unsigned int> weights(numGeometries);
+    std::vector<unsigned char> geometryDirections(numGeometries);
+    parallel_for(numRecords, [&](size_t r)
+    {
+        unsigned int g = recordGeometries[r];
+        unsigned int point = recordPoints[r];
+        walk(r, [&](unsigned int from, unsigned int to, unsigned int first,
+                    unsigned int end, float length)
+        {
+            _geometryFrom[g] = from;
+            geometryTo[g] = to;
+            weights[g] = std::max(1u,
+                                  (unsigned int)(length / speeds[r] + 0.5f));
+            geometryDirections[g] = directions[r];
+            _geometryFirst[g] = point;
+            std::copy(points.begin() + first, points.begin() + end,
+                      _geometryPoints.begin() + point);
+            point += end - first;
+            ++g;
+        });
+    });
+
+    // the directed edges of every piece, given to func with their source
+    auto edgesOf = [&](unsigned int g, auto func)
+    {
+        if (geometryDirections[g] & DIRECTION_FORWARD)
+            func(_geometryFrom[g], Edge{geometryTo[g], weights[g], ~int(g)});
+        if (geometryDirections[g] & DIRECTION_BACKWARD)
+            func(geometryTo[g], Edge{_geometryFrom[g], weights[g], ~int(g)});
+    };
+
+    // compressed rows: the out degrees counted, their prefix sum, and every
+    // edge put where the cursor of its source points
+    std::unique_ptr<std::atomic<unsigned int>[]> cursors(
+        new std::atomic<unsigned int>[numNodes]());
+    parallel_for(numGeometries, [&](size_t g)
+    {
+        edgesOf(g, [&](unsigned int source, const Edge&)
+        {
+            cursors[source].fetch_add(1, std::memory_order_relaxed);
+        });
+    });
+
+    _first.assign(numNodes + 1, 0);
+    for (unsigned int n = 0; n < numNodes; ++n)
+    {
+        _first[n + 1] = _first[n] + cursors[n].load(std::memory_order_relaxed);
+        cursors[n].store(_first[n], std::memory_order_relaxed);
+    }
+
+    _edges.resize(_first[numNodes]);
+    parallel_for(numGeometries, [&](size_t g)
+    {
+        edgesOf(g, [&](unsigned int source, const Edge& edge)
+        {
+            _edges[cursors[source].fetch_add(1, std::memory_order_relaxed)] =
+                edge;
+        });
+    });
+
+    // rows in a fixed order, so the hierarchy does not depend on the threads
+    parallel_for(numNodes, [&](size_t n)
+    {
+        std::sort(_edges.begin() + _first[n], _edges.begin() + _first[n + 1],
+                  [](const Edge& a, const Edge& b)
+        {
+            if (a.target != b.target) return a.target < b.target;
+            if (a.weight != b.weight) return a.weight < b.weight;
+            return a.via < b.via;
+        });
+    });
+
+    _positions.swap(positions);
+    buildNodeGrid();
+    return !_edges.empty();
+}
+
+void RoadGraph::contract()
+{
+    typedef std::vector<std::vector<Edge>> Adjacency;
+    struct Shortcut
+    {
+        unsigned int from, to, weight;
+    };
+
+    // Dijkstra from an in-neighbour of the node to contract, around it, for
+    // paths to its out-neighbours as fast as the ones through it
+    struct Witness
+    {
+        std::vector<unsigned int> distance;
+        std::vector<unsigned int> reached;
+        std::vector<std::pair<unsigned int, unsigned int>> heap;
+
+        void run(const Adjacency& out, unsigned int source, unsigned int skip,
+                 unsigned int limit)
+        {
+            typedef std::greater<std::pair<unsigned int, unsigned int>> Later;
+            for (unsigned int n : reached) distance[n] = UINT_MAX;
+            reached.clear();
+            heap.clear();
+
+            distance[source] = 0;
+            reached.push_back(source);
+            heap.push_back(std::make_pair(0u, source));
+            for (unsigned int settled = 0;
+                 !heap.empty() && settled < witnessMaxSettled; ++settled)
+            {
+                std::pop_heap(heap.begin(), heap.end(), Later());
+                std::pair<unsigned int, unsigned int> top = heap.back();
+                heap.pop_back();
+                if (top.first > limit) break;
+                if (top.first > distance[top.second]) continue;
+
+                for (const Edge& e : out[top.second])
+                {
+                    unsigned int d = top.first + e.weight;
+                    if (e.target == skip || d >= distance[e.target]) continue;
+                    if (distance[e.target] == UINT_MAX)
+                        reached.push_back(e.target);
+                    distance[e.target] = d;
+                    heap.push_back(std::make_pair(d, e.target));
+                    std::push_heap(heap.begin(), heap.end(), Later());
+                }
+            }
+        }
+    };
+    static thread_local Witness witness;
+
+    unsigned int numNodes = getNumNodes();
+
+    // the graph not contracted yet, in with the sources as targets
+    Adjacency out(numNodes), in(numNodes);
+    // adds the edge or makes the one there faster, false when it is not
+    auto addEdge = [&](unsigned int from, unsigned int to, unsigned int weight,
+                       int via)
+    {
+        for (Edge& e : out[from])
+        {
+            if (e.target != to) continue;
+            if (e.weight <= weight) return false;
+            e.weight = weight;
+            e.via = via;
+            for (Edge& r : in[to])
+            {
+                if (r.target == from) { r.weight = weight; r.via = via; }
+            }
+            return true;
+        }
+        out[from].push_back(Edge{to, weight, via});
+        in[to].push_back(Edge{from, weight, via});
+        return true;
+    };
+    for (unsigned int n = 0; n < numNodes; ++n)
+    {
+        for (unsigned int e = _first[n]; e < _first[n + 1]; ++e)
+            addEdge(n, _edges[e].target, _edges[e].weight, _edges[e].via);
+    }
+    std::vector<unsigned int>().swap(_first);
+    std::vector<Edge>().swap(_edges);
+
+    // the shortcuts contracting v takes and its priority: twice the edges
+    // it adds less the ones it removes, plus its neighbours contracted
+    // before and the levels of the hierarchy below it, which spread the
+    // contraction evenly over the map
+    std::vector<unsigned int> contractedNeighbours(numNodes, 0);
+    std::vector<unsigned int> depths(numNodes, 0);
+    auto simulate = [&](unsigned int v, std::vector<Shortcut>& shortcuts)
+    {
+        if (witness.distance.size() != numNodes)
+            witness.distance.assign(numNodes, UINT_MAX);
+        shortcuts.clear();
+
+        unsigned int maxOut = 0;
+        for (const Edge& o : out[v]) maxOut = std::max(maxOut, o.weight);
+        for (const Edge& i : in[v])
+        {
+            witness.run(out, i.target, v, i.weight + maxOut);
+            for (const Edge& o : out[v])
+            {
+                unsigned int weight = i.weight + o.weight;
+                if (o.target != i.target && witness.distance[o.target] > weight)
+                    shortcuts.push_back(Shortcut{i.target, o.target, weight});
+            }
+        }
+        return 2 * (int(shortcuts.size()) - int(in[v].size() + out[v].size()))
+            + int(contractedNeighbours[v]) + int(depths[v]);
+    };
+
+    // the first priorities of all nodes are independent of each other
+    std::vector<int> priorities(numNodes);
+    parallel_for(numNodes, [&](size_t v)
+    {
+        std::vector<Shortcut> shortcuts;
+        priorities[v] = simulate(v, shortcuts);
+    });
+
+    // least important node first; the priorities of the neighbours are not
+    // updated with every contraction but when they come up, a node whose
+    // priority grew past the next one is queued again
+    typedef std::pair<int, unsigned int> Entry;
+    std::priority_queue<Entry, std::vector<Entry>, std::greater<Entry>> queue;
+    for (unsigned int v = 0; v < numNodes; ++v)
+        queue.push(Entry(priorities[v], v));
+
+    Adjacency up(numNodes), down(numNodes);
+    std::vector<char> contracted(numNodes, 0);
+    std::vector<Shortcut> shortcuts;
+    while (!queue.empty())
+    {
+        Entry top = queue.top();
+        queue.pop();
+        unsigned int v = top.second;
+        if (contracted[v] || top.first != priorities[v]) continue;
+
+        // the contractions around v may have made it more important
+        int priority = simulate(v, shortcuts);
+        if (priority > top.first && !queue.empty()
+            && priority > queue.top().first)
+        {
+            priorities[v] = priority;
+            queue.push(Entry(priority, v));
+            continue;
+        }
+
+        for (const Shortcut& s : shortcuts)
+            addEdge(s.from, s.to, s.weight, int(v));
+        contracted[v] = 1;
+
+        // what is left of v leads up the hierarchy
+        up[v].swap(out[v]);
+        down[v].swap(in[v]);
+        auto isV = [v](const Edge& e) { return e.target == v; };
+        for (const Edge& e : up[v])
+            in[e.target].erase(std::remove_if(in[e.target].begin(),
+                                              in[e.target].end(), isV),
+                               in[e.target].end());
+        for (const Edge& e : down[v])
+            out[e.target].erase(std::remove_if(out[e.target].begin(),
+                                               out[e.target].end(), isV),
+                                out[e.target].end());
+
+        for (const std::vector<Edge>* edges : {&up[v], &down[v]})
+        {
+            for (const Edge& e : *edges)
+            {
+                contractedNeighbours[e.target]++;
+                depths[e.target] = std::max(depths[e.target], depths[v] + 1);
+            }
+        }
+    }
+    witness = Witness();
+
+    auto flatten =
+        [numNodes](Adjacency& lists, std::vector<unsigned int>& first,
+                   std::vector<Edge>& edges)
+    {
+        first.assign(numNodes + 1, 0);
+        for (unsigned int n = 0; n < numNodes; ++n)
+            first[n + 1] = first[n] + lists[n].size();
+        edges.resize(first[numNodes]);
+        parallel_for(numNodes, [&](size_t n)
+        {
+            std::copy(lists[n].begin(), lists[n].end(),
+                      edges.begin() + first[n]);
+            std::vector<Edge>().swap(lists[n]);
+        });
+    };
+    flatten(up, _upFirst, _up);
+    flatten(down, _downFirst, _down);
+}
+
+bool RoadGraph::readCache(const std::string& path)
+{
+    std::ifstream file(path, std::ios::binary);
+    if (!file.is_open()) return false;
+
+    std::string header;
+    int version = 0;
+    if (!std::getline(file, header) || header != cacheHeader
+        || !file.read((char*)&version, sizeof(version))
+        || version != cacheVersion)
+        return false;
+
+    size_t size = file_size(path);
+    if (!read_array(file, _positions, size)
+        || !read_array(file, _geometryFrom, size)
+        || !read_array(file, _geometryFirst, size)
+        || !read_array(file, _geometryPoints, size)
+        || !read_array(file, _upFirst, size) || !read_array(file, _up, size)
+        || !read_array(file, _downFirst, size) || !read_array(file, _down, size)
+        || _upFirst.size() != _positions.size() + 1
+        || _downFirst.size() != _positions.size() + 1
+        || _geometryFirst.size() != _geometryFrom.size() + 1)
+    {
+        _positions.clear();
+        _upFirst.clear();
+        _downFirst.clear();
+        return false;
+    }
+
+    buildNodeGrid();
+    return true;
+}
+
+bool RoadGraph::writeCache(const std::string& path) const
+{
+    if (!osgDB::makeDirectoryForFile(path)) return false;
+
+    // written under another name and renamed, so an interrupted write is
+    // not taken for a graph
+    std::string temporary = path + ".tmp";
+    {
+        std::ofstream file(temporary, std::ios::binary);
+        if (!file.is_open()) return false;
+
+        file << cacheHeader << "\n";
+        file.write((const char*)&cacheVersion, sizeof(cacheVersion));
+        write_array(file, _positions);
+        write_array(file, _geometryFrom);
+        write_array(file, _geometryFirst);
+        write_array(file, _geometryPoints);
+        write_array(file, _upFirst);
+        write_array(file, _up);
+        write_array(file, _downFirst);
+        write_array(file, _down);
+        if (!file) return false;
+    }
+    return std::rename(temporary.c_str(), path.c_str()) == 0;
+}
+
+void RoadGraph::buildNodeGrid()
+{
+    unsigned int numNodes = getNumNodes();
+    _cellFirst.clear();
+    _cellNodes.clear();
+    if (numNodes == 0) return;
+
+    osg::BoundingBox bounds;
+    for (const osg::Vec2& p : _positions)
+        bounds.expandBy(osg::Vec3(p.x(), p.y(), 0.f));
+    float width = bounds.xMax() - bounds.xMin();
+    float height = bounds.yMax() - bounds.yMin();
+    _cellSize = std::max(
+        std::sqrt(std::max(width * height, 1.f) * nodesPerCell / numNodes),
+        1.f);
+    _gridOrigin.set(bounds.xMin(), bounds.yMin());
+    _gridX = (unsigned int)(width / _cellSize) + 1;
+    _gridY = (unsigned int)(height / _cellSize) + 1;
+    unsigned int numCells = _gridX * _gridY;
+
+    // the same counting sort as the edges: cells counted, summed up, filled
+    std::vector<unsigned int> cells(numNodes);
+    std::unique_ptr<std::atomic<unsigned int>[]> cursors(
+        new std::atomic<unsigned int>[numCells]());
+    parallel_for(numNodes, [&](size_t n)
+    {
+        const osg::Vec2& p = _positions[n];
+        unsigned int x = std::min(
+            _gridX - 1, (unsigned int)((p.x() - _gridOrigin.x()) / _cellSize));
+        unsigned int y = std::min(
+            _gridY - 1, (unsigned int)((p.y() - _gridOrigin.y()) / _cellSize));
+        cells[n] = y * _gridX + x;
+        cursors[cells[n]].fetch_add(1, std::memory_order_relaxed);
+    });
+
+    _cellFirst.assign(numCells + 1, 0);
+    for (unsigned int c = 0; c < numCells; ++c)
+    {
+        _cellFirst[c + 1] =
+            _cellFirst[c] + cursors[c].load(std::memory_order_relaxed);
+        cursors[c].store(_cellFirst[c], std::memory_order_relaxed);
+    }
+
+    _cellNodes.resize(numNodes);
+    parallel_for(numNodes, [&](size_t n)
+    {
+        _cellNodes[cursors[cells[n]].fetch_add(1, std::memory_order_relaxed)] =
+            n;
+    });
+}
+
+int RoadGraph::findNode(const osg::Vec2& point) const
+{
+    if (_cellFirst.empty()) return -1;
+
+    int cx = osg::clampBetween(
+        int(std::floor((point.x() - _gridOrigin.x()) / _cellSize)), 0,
+        int(_gridX) - 1);
+    int cy = osg::clampBetween(
+        int(std::floor((point.y() - _gridOrigin.y()) / _cellSize)), 0,
+        int(_gridY) - 1);
+
+    // rings of cells around the point's one; the nodes beyond the ring
+    // looked at last are at least a cell per ring further away
+    int best = -1;
+    float bestDistance2 = FLT_MAX;
+    int numRings = int(std::max(_gridX, _gridY));
+    for (int ring = 0; ring < numRings; ++ring)
+    {
+        float reach = (ring - 1) * _cellSize;
+        if (best >= 0 && bestDistance2 <= reach * reach) break;
+
+        for (int y = std::max(cy - ring, 0);
+             y <= std::min(cy + ring, int(_gridY) - 1); ++y)
+        {
+            for (int x = std::max(cx - ring, 0);
+                 x <= std::min(cx + ring, int(_gridX) - 1); ++x)
+            {
+                if (std::abs(x - cx) != ring && std::abs(y - cy) != ring)
+                    continue;
+
+                unsigned int cell = y * _gridX + x;
+                for (unsigned int i = _cellFirst[cell];
+                     i < _cellFirst[cell + 1]; ++i)
+                {
+                    float distance2 =
+                        (_positions[_cellNodes[i]] - point).length2();
+                    if (distance2 < bestDistance2)
+                    {
+                        bestDistance2 = distance2;
+                        best = int(_cellNodes[i]);
+                    }
+                }
+            }
+        }
+    }
+    return best;
+}
+
+const RoadGraph::Edge* RoadGraph::findEdge(
+    const std::vector<unsigned int>& first, const std::vector<Edge>& edges,
+    unsigned int node, unsigned int target) const
+{
+    for (unsigned int e = first[node]; e < first[node + 1]; ++e)
+    {
+        if (edges[e].target == target) return &edges[e];
+    }
+    return nullptr;
+}
+
+void RoadGraph::appendGeometry(unsigned int from, unsigned int geometry,
+                               std::vector<osg::Vec2>& points) const
+{
+    unsigned int first = _geometryFirst[geometry];
+    unsigned int count = _geometryFirst[geometry + 1] - first;
+    bool forward = _geometryFrom[geometry] == from;
+
+    // the node between two pieces is the last point of one and the first
+    // of the next, it is added once
+    for (unsigned int i = points.empty() ? 0 : 1; i < count; ++i)
+        points.push_back(
+            _geometryPoints[forward ? first + i : first + count - 1 - i]);
+}
+
+bool RoadGraph::route(unsigned int from, unsigned int to,
+                      std::vector<osg::Vec2>& points, float& seconds) const
+{
+    typedef std::pair<unsigned int, unsigned int> Entry;
+    typedef std::greater<Entry> Later;
+
+    points.clear();
+    seconds = 0.f;
+    unsigned int numNodes = getNumNodes();
+    if (from >= numNodes || to >= numNodes || _upFirst.size() != numNodes + 1)
+        return false;
+
+    // a new generation leaves the arrays of the last query behind without
+    // clearing them, only when it wraps they are cleared for real
+    if (++_generation == 0)
+    {
+        for (Search& s : _searches)
+            std::fill(s.stamp.begin(), s.stamp.end(), 0u);
+        _generation = 1;
+    }
+    for (Search& s : _searches)
+    {
+        if (s.stamp.size() != numNodes)
+        {
+            s.stamp.assign(numNodes, 0u);
+            s.distance.resize(numNodes);
+            s.parent.resize(numNodes);
+            s.parentEdge.resize(numNodes);
+        }
+        s.heap.clear();
+    }
+
+    auto reach = [this](Search& s, unsigned int node, unsigned int distance,
+                        unsigned int parent, unsigned int edge)
+    {
+        s.stamp[node] = _generation;
+        s.distance[node] = distance;
+        s.parent[node] = parent;
+        s.parentEdge[node] = edge;
+        s.heap.push_back(Entry(distance, node));
+        std::push_heap(s.heap.begin(), s.heap.end(), Later());
+    };
+    reach(_searches[0], from, 0, from, 0);
+    reach(_searches[1], to, 0, to, 0);
+
+    // forward from the start on the edges out of the nodes and backward
+    // from the destination on the edges into them, both only upwards; a
+    // side stops once nothing it has left is faster than the best route
+    const std::vector<unsigned int>* firsts[2] = {&_upFirst, &_downFirst};
+    const std::vector<Edge>* edges[2] = {&_up, &_down};
+    unsigned int best = UINT_MAX, meet = from;
+    while (!_searches[0].heap.empty() || !_searches[1].heap.empty())
+    {
+        for (int side = 0; side < 2; ++side)
+        {
+            Search& s = _searches[side];
+            const Search& other = _searches[1 - side];
+            if (s.heap.empty()) continue;
+
+            std::pop_heap(s.heap.begin(), s.heap.end(), Later());
+            Entry top = s.heap.back();
+            s.heap.pop_back();
+            unsigned int node = top.second;
+            if (top.first >= best)
+            {
+                s.heap.clear();
+                continue;
+            }
+            if (top.first > s.distance[node]) continue;
+
+            if (other.stamp[node] == _generation
+                && top.first + other.distance[node] < best)
+            {
+                best = top.first + other.distance[node];
+                meet = node;
+            }
+
+            for (unsigned int e = (*firsts[side])[node];
+                 e < (*firsts[side])[node + 1]; ++e)
+            {
+                const Edge& edge = (*edges[side])[e];
+                unsigned int distance = top.first + edge.weight;
+                if (s.stamp[edge.target] == _generation
+                    && s.distance[edge.target] <= distance)
+                    continue;
+                reach(s, edge.target, distance, node, e);
+            }
+        }
+    }
+    if (best == UINT_MAX) return false;
+
+    // the edges of the hierarchy along the route, the last one first so
+    // that the list is a stack of what is left to walk
+    struct Step
+    {
+        unsigned int from, to;
+        int via;
+    };
+    std::vector<Step> steps;
+    for (unsigned int node = meet; node != to; node = _searches[1].parent[node])
+        steps.push_back(Step{node, _searches[1].parent[node],
+                             _down[_searches[1].parentEdge[node]].via});
+    std::reverse(steps.begin(), steps.end());
+    for (unsigned int node = meet; node != from;
+         node = _searches[0].parent[node])
+        steps.push_back(Step{_searches[0].parent[node], node,
+                             _up[_searches[0].parentEdge[node]].via});
+
+    // a shortcut is replaced by the two edges it bypasses, both up from
+    // its via node, until only roads are left
+    while (!steps.empty())
+    {
+        Step step = steps.back();
+        steps.pop_back();
+        if (step.via < 0)
+        {
+            appendGeometry(step.from, ~step.via, points);
+            continue;
+        }
+
+        unsigned int via = step.via;
+        const Edge* first = findEdge(_downFirst, _down, via, step.from);
+        const Edge* second = findEdge(_upFirst, _up, via, step.to);
+        if (!first || !second) return false;
+        steps.push_back(Step{via, step.to, second->via});
+        steps.push_back(Step{step.from, via, first->via});
+    }
+
+    if (points.empty()) points.push_back(_positions[from]);
+    seconds = best / 1000.f;
+    return true;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+
+osg::ref_ptr<RouteOverlay> map_route;
+
+RouteOverlay::RouteOverlay(RoadGraph* graph) :
+    _graph(graph)
+{
+    setName("route");
+    // the drawable is swapped for every route
+    setDataVariance(osg::Object::DYNAMIC);
+
+    const StyleRule& style = map_style->getDefault(STYLE_ROUTE);
+    osg::StateSet* ss = getOrCreateStateSet();
+    ss->setAttributeAndModes(new osg::LineWidth(style.width));
+    ss->setAttributeAndModes(new osg::Point(2.f * style.width));
+    ss->setMode(GL_LIGHTING, osg::StateAttribute::OFF);
+    ss->setMode(GL_DEPTH_TEST, osg::StateAttribute::OFF);
+    ss->setRenderBinDetails(routeRenderBin, "RenderBin");
+}
+
+osg::Geometry* RouteOverlay::createGeometry(
+    const std::vector<osg::Vec2>& points) const
+{
+    osg::Vec3Array* vertices = new osg::Vec3Array(points.size());
+    for (size_t i = 0; i < points.size(); ++i)
+    {
+        const osg::Vec2& p = points[i];
+        float ground =
+            map_terrain.valid() ? map_terrain->getHeight(p.x(), p.y()) : 0.f;
+        (*vertices)[i].set(p.x(), p.y(), ground + routeHeight);
+    }
+
+    osg::Vec4Array* colors = new osg::Vec4Array(1);
+    (*colors)[0] = map_style->getDefault(STYLE_ROUTE).color;
+
+    osg::Geometry* geom = new osg::Geometry;
+    geom->setVertexArray(vertices);
+    geom->setColorArray(colors, osg::Array::BIND_OVERALL);
+    if (points.size() > 1)
+        geom->addPrimitiveSet(
+            new osg::DrawArrays(GL_LINE_STRIP, 0, points.size()));
+
+    // dots at the ends
+    osg::DrawElementsUInt* ends = new osg::DrawElementsUInt(GL_POINTS);
+    ends->push_back(0);
+    if (points.size() > 1) ends->push_back(points.size() - 1);
+    geom->addPrimitiveSet(ends);
+
+    geom->setUseDisplayList(false);
+    geom->setUseVertexBufferObjects(true);
+    return geom;
+}
+
+void RouteOverlay::showStart(const osg::Vec2& start)
+{
+    int node = _graph->findNode(start);
+    if (node < 0) return;
+
+    removeDrawables(0, getNumDrawables());
+    addDrawable(
+        createGeometry(std::vector<osg::Vec2>(1, _graph->getPosition(node))));
+    std::cout << "--- ROUTE: from node " << node
+              << ", 'R' again at the destination" << std::endl;
+}
+
+bool RouteOverlay::showRoute(const osg::Vec2& from, const osg::Vec2& to)
+{
+    int a = _graph->findNode(from);
+    int b = _graph->findNode(to);
+    if (a < 0 || b < 0) return false;
+
+    TraceScope scope("route");
+    osg::Timer_t start = osg::Timer::instance()->tick();
+    std::vector<osg::Vec2> points;
+    float seconds = 0.f;
+    bool found = _graph->route(a, b, points, seconds);
+    double ms = osg::Timer::instance()->delta_m(start,
+                                                osg::Timer::instance()->tick());
+
+    removeDrawables(0, getNumDrawables());
+    if (!found)
+    {
+        std::cout << "--- ROUTE: no road from node " << a << " to " << b
+                  << ", searched in " << ms << " ms" << std::endl;
+        return false;
+    }
+
+    float length = 0.f;
+    for (size_t i = 1; i < points.size(); ++i)
+        length += (points[i] - points[i - 1]).length();
+    addDrawable(createGeometry(points));
+
+    std::cout << "--- ROUTE: " << length / 1000.f << " km, " << seconds / 60.f
+              << " min, " << points.size() << " points in " << ms << " ms"
+              << std::endl;
+    return true;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+
+bool RouteHandler::groundPoint(osg::View* view, float x, float y,
+                               osg::Vec2& point) const
+{
+    osg::Camera* camera = view ? view->getCamera() : nullptr;
+    if (!camera || !camera->getViewport()) return false;
+
+    // the ray of the picking, through the plane of the map and then, on a
+    // terrain, down to its ground a few times over
+    osg::Matrixd toWindow = osg::Matrixd(_ltw) * camera->getViewMatrix()
+        * camera->getProjectionMatrix()
+        * camera->getViewport()->computeWindowMatrix();
+    osg::Matrixd fromWindow = osg::Matrixd::inverse(toWindow);
+    osg::Vec3d start = osg::Vec3d(x, y, 0.0) * fromWindow;
+    osg::Vec3d end = osg::Vec3d(x, y, 1.0) * fromWindow;
+    osg::Vec3d dir = end - start;
+    if (std::fabs(dir.z()) < 1e-9) return false;
+
+    double ground = 0.0;
+    osg::Vec3d hit;
+    for (int i = 0; i < (map_terrain.valid() ? 4 : 1); ++i)
+    {
+        double t = (ground - start.z()) / dir.z();
+        if (t < 0.0) return false;
+        hit = start + dir * t;
+        if (map_terrain.valid())
+            ground = map_terrain->getHeight(hit.x(), hit.y());
+    }
+
+    point.set(hit.x(), hit.y());
+    return true;
+}
+
+bool RouteHandler::handle(const osgGA::GUIEventAdapter& ea,
+                          osgGA::GUIActionAdapter& aa)
+{
+    if (ea.getEventType() != osgGA::GUIEventAdapter::KEYDOWN
+        || ea.getKey() != 'R' || ea.getHandled() || !map_route.valid())
+        return false;
+
+    osg::Vec2 point;
+    if (!groundPoint(aa.asView(), ea.getX(), ea.getY(), point)) return false;
+
+    if (!_hasStart)
+    {
+        map_route->showStart(point);
+        _start = point;
+        _hasStart = true;
+    }
+    else
+    {
+        map_route->showRoute(_start, point);
+        _hasStart = false;
+    }
+    aa.requestRedraw();
+    return true;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+
+RoadsParse::RoadsParse()
+{
+}
+
+RoadsParse::~RoadsParse()
+{
+}
+
+void RoadsParse::setIndex(const FeatureIndex* index)
+{
+    _shp.reset();
+    _index = index;
+}
+
+void RoadsParse::setShapeFile(ShapeFile& shp)
+{
+    _index = nullptr;
+    _shp.reset(new ShapeFile(std::move(shp)));
+}
+
+const ShapeFile* RoadsParse::get() const
+{
+    if (_index.valid()) return &_index->getShapeFile();
+    return _shp.get();
+}
+
+void RoadsParse::clear()
+{
+    _index = nullptr;
+    _shp.reset();
+}
+
+////////////////////////////////////////////////////////////////////////////////
+
+osg::Node* process_routing(osg::Matrixd& ltw, const std::string & file_path,
+                           RoadsParse* parse)
+{
+    std::string roads_file_path = file_path + "/gis_osm_roads_free_1.shp";
+
+    // the cache name identifies the data, the frame and the speeds; the
+    // classes and the one way flags come from the .dbf
+    CacheKey key;
+    key.mixFile(roads_file_path);
+    key.mixFile(osgDB::getNameLessExtension(roads_file_path) + ".dbf");
+    key.mix(ltw.ptr(), sizeof(double) * 16);
+    for (unsigned int id = 0; id < map_style->getNumIds(); ++id)
+        key.mix(&map_style->rule(STYLE_ROADS, id).speed, sizeof(float));
+    key.mix(&map_style->getDefault(STYLE_ROADS).speed, sizeof(float));
+
+    std::ostringstream path;
+    path << "cache/routing_" << std::hex << key.get() << ".bin";
+
+    osg::ref_ptr<RoadGraph> graph = new RoadGraph;
+    if (graph->readCache(path.str()))
+    {
+        if (parse) parse->clear();
+        std::cout << "--- ROUTING: " << graph->getNumNodes() << " nodes, "
+                  << graph->getNumEdges() << " edges from " << path.str()
+                  << std::endl;
+        return new RouteOverlay(graph.get());
+    }
+
+    ShapeFile loaded;
+    const ShapeFile* shp = parse ? parse->get() : nullptr;
+    if (!shp)
+    {
+        if (!loaded.load(roads_file_path))
+        {
+            std::cout << "Cannot load file " << roads_file_path << std::endl;
+            return nullptr;
+        }
+        loaded.toLocal(ltw);
+        shp = &loaded;
+    }
+
+    osg::Timer_t start = osg::Timer::instance()->tick();
+    bool hasRoads = graph->build(*shp);
+    // the parse of the roads is not needed once the graph is built
+    if (parse) parse->clear();
+    if (!hasRoads)
+    {
+        std::cout << "--- ROUTING: no road classes with a speed in the style"
+                  << std::endl;
+        return nullptr;
+    }
+    osg::Timer_t built = osg::Timer::instance()->tick();
+    graph->contract();
+    osg::Timer_t contracted = osg::Timer::instance()->tick();
+
+    std::cout << "--- ROUTING: " << graph->getNumNodes() << " nodes built in "
+              << osg::Timer::instance()->delta_m(start, built)
+              << " ms, contracted to " << graph->getNumEdges() << " edges in "
+              << osg::Timer::instance()->delta_m(built, contracted) << " ms"
+              << std::endl;
+
+    if (!graph->writeCache(path.str()))
+    {
+        std::cout << "Cannot write routing cache " << path.str() << std::endl;
+    }
+    return new RouteOverlay(graph.get());
+}
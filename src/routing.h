@@ -0,0 +1,185 @@
+#ifndef ROUTING_H
+#define ROUTING_H
+
+#include <osg/Referenced>
+#include <osg/ref_ptr>
+#include <osg/Vec2>
+#include <osg/Matrixd>
+#include <osg/Geode>
+#include <osgGA/GUIEventHandler>
+
+#include <string>
+#include <vector>
+#include <memory>
+
+class ShapeFile;
+class FeatureIndex;
+
+// Road network of the roads layer for routing by car. Nodes are the points
+// the ways share, welded by their exact position, and the ends of the ways;
+// edges are the pieces of the ways between them, weighted by the time to
+// drive them at the speed the style gives their class, one way streets in
+// their direction only. The adjacency is kept in compressed sparse rows:
+// the edges of all nodes in one array and the offset of every node's first
+// edge in another.
+//
+// contract() turns the graph into a contraction hierarchy: the nodes are
+// taken out one after the other, least important first, with shortcuts
+// between their neighbours wherever the node was on the only fastest path.
+// Every node keeps the edges to the nodes contracted after it, which is all
+// a query needs: a Dijkstra search from either end that only goes up the
+// hierarchy, meeting on the most important node of the route; it settles a
+// few hundred nodes where a plain one would settle half the country. The
+// hierarchy is written to the cache, built once per data set.
+class RoadGraph : public osg::Referenced {
+public:
+    // builds the graph of the polylines of shp, in its local frame; false
+    // when none of them is a road the style gives a speed to
+    bool build(const ShapeFile& shp);
+
+    // replaces the graph of build() by its contraction hierarchy
+    void contract();
+
+    bool readCache(const std::string& path);
+    bool writeCache(const std::string& path) const;
+
+    unsigned int getNumNodes() const { return _positions.size(); }
+    // edges of the hierarchy, the shortcuts among them
+    unsigned int getNumEdges() const { return _up.size() + _down.size(); }
+    const osg::Vec2& getPosition(unsigned int node) const
+    {
+        return _positions[node];
+    }
+
+    // node nearest to the point of the local frame, -1 when there is none
+    int findNode(const osg::Vec2& point) const;
+
+    // fastest route between two nodes with the points of the road geometry
+    // along it, false when there is none; not reentrant, the searches share
+    // their state from one query to the next
+    bool route(unsigned int from, unsigned int to,
+               std::vector<osg::Vec2>& points, float& seconds) const;
+
+protected:
+    struct Edge
+    {
+        unsigned int target;
+        // milliseconds
+        unsigned int weight;
+        // node a shortcut bypasses, or ~geometry of an edge of the roads
+        int via;
+    };
+
+    // a search of the query, its arrays valid where stamp is the generation
+    struct Search
+    {
+        std::vector<unsigned int> stamp;
+        std::vector<unsigned int> distance;
+        std::vector<unsigned int> parent;
+        std::vector<unsigned int> parentEdge;
+        std::vector<std::pair<unsigned int, unsigned int>> heap;
+    };
+
+    void buildNodeGrid();
+    void appendGeometry(unsigned int from, unsigned int geometry,
+                        std::vector<osg::Vec2>& points) const;
+    const Edge* findEdge(const std::vector<unsigned int>& first,
+                         const std::vector<Edge>& edges,
+                         unsigned int node, unsigned int target) const;
+
+    std::vector<osg::Vec2> _positions;
+
+    // the polylines of the edges, from the node _geometryFrom
+    std::vector<unsigned int> _geometryFrom;
+    std::vector<unsigned int> _geometryFirst;
+    std::vector<osg::Vec2> _geometryPoints;
+
+    // the graph of build(), until contract()
+    std::vector<unsigned int> _first;
+    std::vector<Edge> _edges;
+
+    // edges of the hierarchy up from every node, to the nodes contracted
+    // after it: out of it and, with the source as target, into it
+    std::vector<unsigned int> _upFirst;
+    std::vector<Edge> _up;
+    std::vector<unsigned int> _downFirst;
+    std::vector<Edge> _down;
+
+    // nodes bucketed into square cells for findNode()
+    osg::Vec2 _gridOrigin;
+    float _cellSize = 1.f;
+    unsigned int _gridX = 0, _gridY = 0;
+    std::vector<unsigned int> _cellFirst;
+    std::vector<unsigned int> _cellNodes;
+
+    mutable Search _searches[2];
+    mutable unsigned int _generation = 0;
+};
+
+////////////////////////////////////////////////////////////////////////////////
+
+// The graph of the roads and the route picked on it, drawn as a line of a
+// constant width in pixels over the map. A new route replaces the geometry
+// instead of changing it, the draw of the last frame may still use it.
+class RouteOverlay : public osg::Geode {
+public:
+    RouteOverlay(RoadGraph* graph);
+
+    RoadGraph* getGraph() const { return _graph.get(); }
+
+    // marks the start of the next route
+    void showStart(const osg::Vec2& start);
+    // draws the fastest route between the nodes nearest to the points and
+    // prints it, false when they are not connected
+    bool showRoute(const osg::Vec2& from, const osg::Vec2& to);
+
+protected:
+    osg::Geometry* createGeometry(const std::vector<osg::Vec2>& points) const;
+
+    osg::ref_ptr<RoadGraph> _graph;
+};
+
+extern osg::ref_ptr<RouteOverlay> map_route;
+
+// The roads file as process_roads() read it, left for process_routing() so
+// the graph is built without parsing the file again. Both run on the same
+// loading thread, the roads first; the routing takes the parse and clears
+// it. Once the pick index of the roads took the parse over it is read from
+// there.
+class RoadsParse : public osg::Referenced {
+public:
+    RoadsParse();
+
+    void setIndex(const FeatureIndex* index);
+    // takes shp over
+    void setShapeFile(ShapeFile& shp);
+
+    // null when the roads left none
+    const ShapeFile* get() const;
+    void clear();
+
+protected:
+    ~RoadsParse();
+
+    osg::ref_ptr<const FeatureIndex> _index;
+    std::unique_ptr<ShapeFile> _shp;
+};
+
+// 'R' over the map sets the start of a route, the next 'R' its destination
+class RouteHandler : public osgGA::GUIEventHandler {
+public:
+    RouteHandler(const osg::Matrixd& ltw) : _ltw(ltw) {}
+
+    bool handle(const osgGA::GUIEventAdapter& ea,
+                osgGA::GUIActionAdapter& aa) override;
+
+protected:
+    // the ground under the window position, in the local frame
+    bool groundPoint(osg::View* view, float x, float y, osg::Vec2& point) const;
+
+    osg::Matrixd _ltw;
+    bool _hasStart = false;
+    osg::Vec2 _start;
+};
+
+#endif // ROUTING_H
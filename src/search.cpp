@@ -0,0 +1,298 @@
+#include <osg/Timer>
+#include <osgGA/GUIEventAdapter>
+#include <osgGA/GUIActionAdapter>
+
+#include <iostream>
+#include <vector>
+#include <algorithm>
+#include <cstring>
+#include <cstdint>
+
+#include "search.h"
+#include "parallel.h"
+#include "trace.h"
+#include "reload.h"
+
+// keys of one query range looked at for ranking; short prefixes match a lot
+// of names and the scan stops here, in alphabetical order
+const unsigned int searchMaxScan = 4096;
+
+// U+00C0 - U+00FF without diacritics, ' ' for signs
+static const char latin1Fold[] =
+    "aaaaaaaceeeeiiii" "dnooooo ouuuuyts"
+    "aaaaaaaceeeeiiii" "dnooooo ouuuuyty";
+
+// U+0100 - U+017F without diacritics
+static const char latinExtAFold[] =
+    "aaaaaaccccccccdd" "ddeeeeeeeeeegggg"
+    "gggghhhhiiiiiiii" "iiiijjkkklllllll"
+    "lllnnnnnnnnnoooo" "oooorrrrrrssssss"
+    "ssttttttuuuuuuuu" "uuuuwwyyyzzzzzzs";
+
+std::string fold_name(const std::string& name)
+{
+    std::string folded;
+    folded.reserve(name.size());
+
+    auto put = [&](char c)
+    {
+        if (c == ' ')
+        {
+            if (!folded.empty() && folded.back() != ' ') folded.push_back(' ');
+        }
+        else
+        {
+            folded.push_back(c);
+        }
+    };
+
+    const unsigned char* s = (const unsigned char*)name.c_str();
+    size_t n = name.size();
+    for (size_t i = 0; i < n;)
+    {
+        unsigned char c = s[i];
+        if (c < 0x80)
+        {
+            if (c >= 'A' && c <= 'Z') put(char(c - 'A' + 'a'));
+            else if ((c >= 'a' && c <= 'z') || (c >= '0' && c <= '9'))
+                put(char(c));
+            else put(' ');
+            ++i;
+            continue;
+        }
+
+        // sequence length from the lead byte; broken sequences are dropped
+        size_t len = c >= 0xf0 ? 4 : c >= 0xe0 ? 3 : c >= 0xc0 ? 2 : 1;
+        if (len == 1 || i + len > n)
+        {
+            ++i;
+            continue;
+        }
+
+        uint32_t cp = c & (0x7f >> len);
+        for (size_t k = 1; k < len; ++k) cp = (cp << 6) | (s[i + k] & 0x3f);
+
+        if (cp >= 0xc0 && cp < 0x100) put(latin1Fold[cp - 0xc0]);
+        else if (cp >= 0x100 && cp < 0x180) put(latinExtAFold[cp - 0x100]);
+        else folded.append(name, i, len);
+        i += len;
+    }
+
+    if (!folded.empty() && folded.back() == ' ') folded.pop_back();
+    return folded;
+}
+
+void NameIndex::addEntry(const std::string& name, const osg::Vec3& position,
+                         int rank, const char* layer)
+{
+    Entry e;
+    e.name = name;
+    e.position = position;
+    e.rank = rank;
+    e.layer = layer;
+    _entries.push_back(e);
+}
+
+void register_search_entry(const std::string& name, const osg::Vec3& position,
+                           int rank, const char* layer)
+{
+    if (LayerUpdate* update = staged_layer_update())
+    {
+        NameIndex::Entry e;
+        e.name = name;
+        e.position = position;
+        e.rank = rank;
+        e.layer = layer;
+        update->searchEntries.push_back(e);
+    }
+    else if (map_search.valid())
+    {
+        map_search->addEntry(name, position, rank, layer);
+    }
+}
+
+void NameIndex::build()
+{
+    std::vector<std::string> folded(_entries.size());
+    parallel_for(_entries.size(), [&](size_t i)
+    {
+        folded[i] = fold_name(_entries[i].name);
+    }, 1024);
+
+    _text.clear();
+    _nameOffsets.resize(_entries.size());
+    for (size_t i = 0; i < folded.size(); ++i)
+    {
+        _nameOffsets[i] = _text.size();
+        _text.insert(_text.end(), folded[i].begin(), folded[i].end());
+        _text.push_back('\0');
+    }
+
+    // one key per word start, bucketed by the first byte so the buckets
+    // sort in parallel and simply follow each other
+    std::vector<std::vector<Key>> buckets(256);
+    for (unsigned int i = 0; i < folded.size(); ++i)
+    {
+        const std::string& f = folded[i];
+        for (size_t p = 0; p < f.size(); ++p)
+        {
+            if (p > 0 && f[p - 1] != ' ') continue;
+            Key k;
+            k.offset = _nameOffsets[i] + p;
+            k.entry = i;
+            buckets[(unsigned char)f[p]].push_back(k);
+        }
+    }
+
+    parallel_for(buckets.size(), [&](size_t b)
+    {
+        std::sort(buckets[b].begin(), buckets[b].end(),
+                  [&](const Key& x, const Key& y)
+        {
+            int c = std::strcmp(&_text[x.offset], &_text[y.offset]);
+            if (c != 0) return c < 0;
+            return _entries[x.entry].rank < _entries[y.entry].rank;
+        });
+    }, 1);
+
+    _keys.clear();
+    for (const std::vector<Key>& bucket : buckets)
+        _keys.insert(_keys.end(), bucket.begin(), bucket.end());
+}
+
+void NameIndex::search(const std::string& query, std::vector<Hit>& hits,
+                       unsigned int maxHits) const
+{
+    hits.clear();
+    std::string q = fold_name(query);
+    if (q.empty() || _keys.empty()) return;
+
+    // first key not below the query, then every key it prefixes
+    unsigned int lo = 0, hi = _keys.size();
+    while (lo < hi)
+    {
+        unsigned int mid = (lo + hi) / 2;
+        if (std::strcmp(key(mid), q.c_str()) < 0) lo = mid + 1;
+        else hi = mid;
+    }
+
+    // exact matches first, then matches of the first word, then the rank of
+    // the style and shorter names
+    unsigned int end = std::min<unsigned int>(_keys.size(), lo + searchMaxScan);
+    for (unsigned int k = lo; k < end; ++k)
+    {
+        const char* s = key(k);
+        if (std::strncmp(s, q.c_str(), q.size()) != 0) break;
+
+        const Key& kk = _keys[k];
+        bool exact = s[q.size()] == '\0' || s[q.size()] == ' ';
+        bool first = kk.offset == _nameOffsets[kk.entry];
+        unsigned int length = std::strlen(&_text[_nameOffsets[kk.entry]]);
+
+        Hit h;
+        h.entry = kk.entry;
+        h.score = (exact ? 0 : 1 << 28) + (first ? 0 : 1 << 27)
+            + (std::min(std::max(_entries[kk.entry].rank, 0), 1023) << 16)
+            + std::min(length, 65535u);
+        hits.push_back(h);
+    }
+
+    // an entry matched by several of its words counts once
+    std::sort(hits.begin(), hits.end(), [](const Hit& a, const Hit& b)
+    {
+        return a.entry != b.entry ? a.entry < b.entry : a.score < b.score;
+    });
+    hits.erase(std::unique(hits.begin(), hits.end(),
+                           [](const Hit& a, const Hit& b)
+    {
+        return a.entry == b.entry;
+    }), hits.end());
+
+    auto byScore = [](const Hit& a, const Hit& b) { return a.score < b.score; };
+    if (hits.size() > maxHits)
+    {
+        std::partial_sort(hits.begin(), hits.begin() + maxHits, hits.end(),
+                          byScore);
+        hits.resize(maxHits);
+    }
+    else
+    {
+        std::sort(hits.begin(), hits.end(), byScore);
+    }
+}
+
+////////////////////////////////////////////////////////////////////////////////
+
+bool SearchHandler::handle(const osgGA::GUIEventAdapter& ea,
+                           osgGA::GUIActionAdapter& aa)
+{
+    if (ea.getEventType() != osgGA::GUIEventAdapter::KEYDOWN
+        || !map_search.valid())
+        return false;
+
+    int key = ea.getKey();
+    if (!_active)
+    {
+        if (key != '/') return false;
+
+        _active = true;
+        _query.clear();
+        _hits.clear();
+        std::cout << "--- SEARCH: type a name, Return flies to the first "
+                     "hit, Backspace on an empty query cancels"
+                  << std::endl;
+        return true;
+    }
+
+    if (key == osgGA::GUIEventAdapter::KEY_Return)
+    {
+        _active = false;
+        if (!_hits.empty())
+        {
+            const NameIndex::Entry& e = map_search->getEntry(_hits[0].entry);
+            std::cout << "--- SEARCH: flying to " << e.name << std::endl;
+            _flyTo(e.position);
+            aa.requestRedraw();
+        }
+        return true;
+    }
+
+    // Escape is left to the viewer, an empty query is cancelled instead
+    if (key == osgGA::GUIEventAdapter::KEY_BackSpace)
+    {
+        if (_query.empty())
+        {
+            _active = false;
+            return true;
+        }
+
+        // whole UTF-8 sequences
+        while (!_query.empty() && (_query.back() & 0xc0) == 0x80)
+            _query.pop_back();
+        if (!_query.empty()) _query.pop_back();
+        update();
+        return true;
+    }
+
+    if (key >= 0x20 && key < 0x7f)
+    {
+        _query.push_back(char(key));
+        update();
+    }
+    return true;
+}
+
+void SearchHandler::update()
+{
+    TraceScope scope("search");
+    osg::Timer_t start = osg::Timer::instance()->tick();
+    map_search->search(_query, _hits, 5);
+    double us = osg::Timer::instance()->delta_u(start,
+                                                osg::Timer::instance()->tick());
+
+    std::cout << "--- SEARCH: \"" << _query << "\" " << _hits.size()
+              << " hits in " << us << " us" << std::endl;
+    for (unsigned int i = 0; i < _hits.size(); ++i)
+        std::cout << "    " << i + 1 << ". "
+                  << map_search->getEntry(_hits[i].entry).name << std::endl;
+}
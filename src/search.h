@@ -0,0 +1,102 @@
+#ifndef SEARCH_H
+#define SEARCH_H
+
+#include <osg/Referenced>
+#include <osg/ref_ptr>
+#include <osg/Vec3>
+#include <osgGA/GUIEventHandler>
+
+#include <string>
+#include <vector>
+#include <functional>
+
+// zoom level the map flies to for a search hit
+const double searchZoom = 17.0;
+
+// lower case ASCII form of a UTF-8 name for matching: Latin letters lose
+// their diacritics, punctuation becomes single spaces, other scripts stay
+std::string fold_name(const std::string& name);
+
+// Prefix search over the names of the map. Every word of a folded name
+// starts one key, so "ul. Nowy Swiat" is found by "nowy" and "swiat" as well.
+// The keys are offsets into one buffer of folded names sorted as strings;
+// a query is two binary searches for the range of keys it prefixes and a
+// bounded scan of that range for the best ranked entries.
+class NameIndex : public osg::Referenced {
+public:
+    struct Entry
+    {
+        std::string name;
+        // local map frame
+        osg::Vec3 position;
+        // lower is more important, as the rank of the style
+        int rank;
+        // name of the layer it came from
+        const char* layer;
+    };
+
+    struct Hit
+    {
+        unsigned int entry;
+        int score;
+    };
+
+    // entries are collected while the layers load
+    void addEntry(const std::string& name, const osg::Vec3& position, int rank,
+                  const char* layer);
+
+    // folds the names and sorts the keys, in parallel
+    void build();
+
+    unsigned int getNumEntries() const { return _entries.size(); }
+    const Entry& getEntry(unsigned int entry) const { return _entries[entry]; }
+
+    // best entries for the query, at most maxHits of them, best first
+    void search(const std::string& query, std::vector<Hit>& hits,
+                unsigned int maxHits = 10) const;
+
+protected:
+    const char* key(unsigned int k) const { return &_text[_keys[k].offset]; }
+
+    std::vector<Entry> _entries;
+
+    struct Key
+    {
+        unsigned int offset;
+        unsigned int entry;
+    };
+    // zero terminated folded names, one after another
+    std::vector<char> _text;
+    std::vector<unsigned int> _nameOffsets;
+    std::vector<Key> _keys;
+};
+
+extern osg::ref_ptr<NameIndex> map_search;
+
+// adds a name of the layer to the search, or to the layer update this
+// thread is loading
+void register_search_entry(const std::string& name, const osg::Vec3& position,
+                           int rank, const char* layer);
+
+// Search typed into the map window: '/' starts a query, the hits are printed
+// as it is typed, Return flies to the best one and Backspace on an empty
+// query cancels.
+class SearchHandler : public osgGA::GUIEventHandler {
+public:
+    typedef std::function<void(const osg::Vec3& position)> FlyTo;
+
+    SearchHandler(const FlyTo& flyTo) : _flyTo(flyTo) {}
+
+    bool handle(const osgGA::GUIEventAdapter& ea,
+                osgGA::GUIActionAdapter& aa) override;
+
+protected:
+    void update();
+
+    FlyTo _flyTo;
+    bool _active = false;
+    std::string _query;
+    std::vector<NameIndex::Hit> _hits;
+};
+
+#endif // SEARCH_H
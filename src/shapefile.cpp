@@ -0,0 +1,272 @@
+#include <osg/CoordinateSystemNode>
+#include <osg/Geode>
+#include <osg/Geometry>
+#include <osgDB/FileNameUtils>
+
+#include <iostream>
+#include <fstream>
+#include <iterator>
+#include <algorithm>
+#include <cstring>
+#include <cstdlib>
+#include <cctype>
+#include <cstdint>
+
+#include "common.h"
+#include "shapefile.h"
+#include "parallel.h"
+
+// the .shp format mixes big endian (file and record headers) with little
+// endian (shape contents) values
+static unsigned int readBE32(const unsigned char* p)
+{
+    return (unsigned int)p[0] << 24 | (unsigned int)p[1] << 16
+        | (unsigned int)p[2] << 8 | p[3];
+}
+
+static unsigned int readLE32(const unsigned char* p)
+{
+    return (unsigned int)p[3] << 24 | (unsigned int)p[2] << 16
+        | (unsigned int)p[1] << 8 | p[0];
+}
+
+static double readLEDouble(const unsigned char* p)
+{
+    uint64_t bits = 0;
+    for (int i = 7; i >= 0; --i) bits = bits << 8 | p[i];
+    double value;
+    std::memcpy(&value, &bits, sizeof(value));
+    return value;
+}
+
+static osg::Vec2d readPoint(const unsigned char* p)
+{
+    return osg::Vec2d(readLEDouble(p), readLEDouble(p + 8));
+}
+
+bool ShapeFile::readGeoBounds(const std::string& shpPath,
+                              osg::BoundingBoxd& bounds)
+{
+    std::ifstream file(shpPath, std::ios::binary);
+    unsigned char header[100];
+    if (!file.read(reinterpret_cast<char*>(header), sizeof(header))
+        || readBE32(header) != 9994)
+        return false;
+
+    bounds.set(readLEDouble(header + 36), readLEDouble(header + 44), 0.0,
+               readLEDouble(header + 52), readLEDouble(header + 60), 0.0);
+    return true;
+}
+
+bool ShapeFile::load(const std::string& shpPath)
+{
+    std::ifstream file(shpPath, std::ios::binary);
+    if (!file.is_open()) return false;
+
+    std::vector<unsigned char> data((std::istreambuf_iterator<char>(file)),
+                                    std::istreambuf_iterator<char>());
+    if (data.size() < 100 || readBE32(&data[0]) != 9994) return false;
+
+    // Z (1x) and M (2x) variants share the layout of the plain shapes up to
+    // the points, multipatches are not supported
+    unsigned int type = readLE32(&data[32]);
+    if (type == 31) return false;
+    _shapeType = ShapeType(type % 10);
+
+    _geoBounds.set(readLEDouble(&data[36]), readLEDouble(&data[44]), 0.0,
+                   readLEDouble(&data[52]), readLEDouble(&data[60]), 0.0);
+
+    size_t pos = 100;
+    while (pos + 8 <= data.size())
+    {
+        size_t length = size_t(readBE32(&data[pos + 4])) * 2;
+        const unsigned char* rec = &data[pos + 8];
+        pos += 8 + length;
+        if (pos > data.size() || length < 4) break;
+
+        // records of other types than the file (null shapes) keep no parts
+        unsigned int recType = readLE32(rec) % 10;
+        if (recType == POINT && length >= 20)
+        {
+            _geo.push_back(readPoint(rec + 4));
+            _partPoints.push_back(_geo.size());
+        }
+        else if ((recType == POLYLINE || recType == POLYGON) && length >= 44)
+        {
+            unsigned int numParts = readLE32(rec + 36);
+            unsigned int numPoints = readLE32(rec + 40);
+            if (44 + 4 * size_t(numParts) + 16 * size_t(numPoints) <= length)
+            {
+                const unsigned char* parts = rec + 44;
+                const unsigned char* points = parts + 4 * numParts;
+                unsigned int base = _geo.size();
+
+                for (unsigned int i = 0; i < numPoints; ++i)
+                    _geo.push_back(readPoint(points + 16 * i));
+
+                // parts are consecutive, each one ends where the next starts
+                for (unsigned int k = 0; k < numParts; ++k)
+                {
+                    unsigned int end = k + 1 < numParts
+                        ? readLE32(parts + 4 * (k + 1))
+                        : numPoints;
+                    end = std::min(std::max(end, _partPoints.back() - base),
+                                   numPoints);
+                    _partPoints.push_back(base + end);
+                }
+            }
+        }
+        else if (recType == MULTIPOINT && length >= 40)
+        {
+            unsigned int numPoints = readLE32(rec + 36);
+            if (40 + 16 * size_t(numPoints) <= length)
+            {
+                for (unsigned int i = 0; i < numPoints; ++i)
+                {
+                    _geo.push_back(readPoint(rec + 40 + 16 * i));
+                    _partPoints.push_back(_geo.size());
+                }
+            }
+        }
+
+        _recordParts.push_back(_partPoints.size() - 1);
+    }
+
+    loadDBF(osgDB::getNameLessExtension(shpPath) + ".dbf");
+    return true;
+}
+
+bool ShapeFile::loadDBF(const std::string& path)
+{
+    std::ifstream file(path, std::ios::binary);
+    if (!file.is_open()) return false;
+
+    std::vector<char> data((std::istreambuf_iterator<char>(file)),
+                           std::istreambuf_iterator<char>());
+    if (data.size() < 32) return false;
+
+    const unsigned char* header = (const unsigned char*)&data[0];
+    unsigned int numRows = readLE32(header + 4);
+    unsigned int headerSize = header[8] | header[9] << 8;
+    _recordLength = header[10] | header[11] << 8;
+    if (headerSize > data.size() || _recordLength == 0) return false;
+
+    // field descriptors follow the header until the 0x0D terminator, the
+    // values start after the deletion flag of every row
+    unsigned int offset = 1;
+    for (size_t pos = 32; pos + 32 <= headerSize && data[pos] != 0x0D;
+         pos += 32)
+    {
+        Field field;
+        field.name = std::string(&data[pos], strnlen(&data[pos], 11));
+        std::transform(field.name.begin(), field.name.end(), field.name.begin(),
+                       ::tolower);
+        field.type = data[pos + 11];
+        field.offset = offset;
+        field.length = (unsigned char)data[pos + 16];
+        offset += field.length;
+
+        // a field past the end of the row would read into the next one, or
+        // past the table for the last row
+        if (field.offset + field.length > _recordLength)
+        {
+            std::cerr << "Warning: field " << field.name << " of " << path
+                      << " ends past the record length " << _recordLength
+                      << ", dropped" << std::endl;
+            continue;
+        }
+        _fields.push_back(field);
+    }
+
+    _numRows = std::min<size_t>(numRows,
+                                (data.size() - headerSize) / _recordLength);
+    _table.assign(data.begin() + headerSize,
+                  data.begin() + headerSize + size_t(_numRows) * _recordLength);
+    return true;
+}
+
+void ShapeFile::toLocal(const osg::Matrixd& ltw)
+{
+    osg::Matrixd worldToLocal = osg::Matrixd::inverse(ltw);
+
+    _local.resize(_geo.size());
+    _bounds.assign(getNumRecords(), osg::BoundingBox());
+
+    parallel_for(getNumRecords(), [&](size_t r)
+    {
+        unsigned int first = _partPoints[_recordParts[r]];
+        unsigned int end = _partPoints[_recordParts[r + 1]];
+        for (unsigned int i = first; i < end; ++i)
+        {
+            osg::Vec3d world;
+            ellipsoid->convertLatLongHeightToXYZ(
+                osg::DegreesToRadians(_geo[i].y()),
+                osg::DegreesToRadians(_geo[i].x()), 0.0, world[0], world[1],
+                world[2]);
+
+            osg::Vec3d local = world * worldToLocal;
+            _local[i].set(local.x(), local.y());
+            _bounds[r].expandBy(osg::Vec3(local.x(), local.y(), 0.f));
+        }
+    });
+
+    _localBounds.init();
+    for (const osg::BoundingBox& box : _bounds) _localBounds.expandBy(box);
+}
+
+int ShapeFile::getFieldIndex(const std::string& name) const
+{
+    std::string lower = name;
+    std::transform(lower.begin(), lower.end(), lower.begin(), ::tolower);
+    for (unsigned int i = 0; i < _fields.size(); ++i)
+    {
+        if (_fields[i].name == lower) return i;
+    }
+    return -1;
+}
+
+// the value without the padding, as a range of the table
+static void field_range(const char*& begin, const char*& end)
+{
+    // values are padded with spaces (some writers use zeros)
+    while (end > begin && (end[-1] == ' ' || end[-1] == '\0')) --end;
+    while (begin < end && *begin == ' ') ++begin;
+}
+
+std::string ShapeFile::getString(unsigned int record, int field) const
+{
+    std::string value;
+    getString(record, field, value);
+    return value;
+}
+
+void ShapeFile::getString(unsigned int record, int field,
+                          std::string& value) const
+{
+    value.clear();
+    if (field < 0 || record >= _numRows) return;
+
+    const Field& f = _fields[field];
+    const char* begin = &_table[size_t(record) * _recordLength + f.offset];
+    const char* end = begin + f.length;
+    field_range(begin, end);
+    value.assign(begin, end);
+}
+
+double ShapeFile::getDouble(unsigned int record, int field) const
+{
+    if (field < 0 || record >= _numRows) return 0.0;
+
+    const Field& f = _fields[field];
+    const char* begin = &_table[size_t(record) * _recordLength + f.offset];
+    const char* end = begin + f.length;
+    field_range(begin, end);
+
+    // numeric fields are at most a few dozen characters, parsed on the stack
+    char buffer[64];
+    size_t length = std::min<size_t>(end - begin, sizeof(buffer) - 1);
+    if (length == 0) return 0.0;
+    std::memcpy(buffer, begin, length);
+    buffer[length] = '\0';
+    return std::atof(buffer);
+}
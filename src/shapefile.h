@@ -0,0 +1,115 @@
+#ifndef SHAPEFILE_H
+#define SHAPEFILE_H
+
+#include <osg/Vec2>
+#include <osg/Vec2d>
+#include <osg/Matrixd>
+#include <osg/BoundingBox>
+
+#include <string>
+#include <vector>
+
+// Reader of ESRI shapefiles with their .dbf attribute table. Unlike the osg
+// shp plugin it keeps polygons as the rings stored in the file, without
+// tessellating them, so layers can triangulate and merge them on their own.
+// Points of all records live in one array, every record owns a range of
+// parts and every part a range of points.
+class ShapeFile {
+public:
+    enum ShapeType
+    {
+        NULL_SHAPE = 0,
+        POINT = 1,
+        POLYLINE = 3,
+        POLYGON = 5,
+        MULTIPOINT = 8
+    };
+
+    // reads file.shp and, when it exists, file.dbf next to it
+    bool load(const std::string& shpPath);
+
+    // the bounds of getGeoBounds() from the header alone
+    static bool readGeoBounds(const std::string& shpPath,
+                              osg::BoundingBoxd& bounds);
+
+    // base type of the shapes, Z and M variants are reported as the plain one
+    ShapeType getShapeType() const { return _shapeType; }
+
+    // bounds from the file header, x is the longitude and y the latitude
+    const osg::BoundingBoxd& getGeoBounds() const { return _geoBounds; }
+
+    unsigned int getNumRecords() const { return _recordParts.size() - 1; }
+
+    unsigned int getFirstPart(unsigned int record) const
+    {
+        return _recordParts[record];
+    }
+    unsigned int getEndPart(unsigned int record) const
+    {
+        return _recordParts[record + 1];
+    }
+
+    unsigned int getFirstPoint(unsigned int part) const
+    {
+        return _partPoints[part];
+    }
+    unsigned int getEndPoint(unsigned int part) const
+    {
+        return _partPoints[part + 1];
+    }
+
+    const std::vector<osg::Vec2d>& getGeoPoints() const { return _geo; }
+
+    // converts every point from longitude/latitude to the local frame of
+    // ltw in double precision, in parallel; heights are dropped
+    void toLocal(const osg::Matrixd& ltw);
+
+    const std::vector<osg::Vec2>& getLocalPoints() const { return _local; }
+    const osg::BoundingBox& getRecordBounds(unsigned int record) const
+    {
+        return _bounds[record];
+    }
+    const osg::BoundingBox& getLocalBounds() const { return _localBounds; }
+
+    // attribute columns with lower case names, matched case insensitively;
+    // -1 when the column does not exist
+    int getFieldIndex(const std::string& name) const;
+    unsigned int getNumFields() const { return _fields.size(); }
+    const std::string& getFieldName(unsigned int field) const
+    {
+        return _fields[field].name;
+    }
+    std::string getString(unsigned int record, int field) const;
+    // into value, reusing its storage for loops over many records
+    void getString(unsigned int record, int field, std::string& value) const;
+    double getDouble(unsigned int record, int field) const;
+
+protected:
+    friend class PolygonSimplifier;
+
+    bool loadDBF(const std::string& path);
+
+    ShapeType _shapeType = NULL_SHAPE;
+    osg::BoundingBoxd _geoBounds;
+
+    std::vector<osg::Vec2d> _geo;
+    std::vector<osg::Vec2> _local;
+    std::vector<unsigned int> _partPoints = std::vector<unsigned int>(1, 0);
+    std::vector<unsigned int> _recordParts = std::vector<unsigned int>(1, 0);
+    std::vector<osg::BoundingBox> _bounds;
+    osg::BoundingBox _localBounds;
+
+    struct Field
+    {
+        std::string name;
+        char type;
+        unsigned int offset;
+        unsigned int length;
+    };
+    std::vector<Field> _fields;
+    std::vector<char> _table;
+    unsigned int _recordLength = 0;
+    unsigned int _numRows = 0;
+};
+
+#endif // SHAPEFILE_H
@@ -0,0 +1,511 @@
+#include <osg/Vec2>
+#include <osg/BoundingBox>
+
+#include <vector>
+#include <queue>
+#include <unordered_map>
+#include <algorithm>
+#include <cmath>
+#include <cstring>
+#include <cstdint>
+
+#include "common.h"
+#include "simplify.h"
+#include "zoom.h"
+#include "parallel.h"
+
+// size of a screen pixel per metre of camera distance, about one pixel of a
+// 1000 pixels high view with a 60 degree field
+const float polygonPixelSize = 1e-3f;
+
+// polygons and rings under this many pixels of area disappear
+const float polygonMinPixels = 4.f;
+
+// segments per cell of the grid a chain is bucketed into for the crossing
+// tests, a chain shorter than this has a single cell
+const float chainSegmentsPerCell = 8.f;
+
+static double signed_area(const osg::Vec2* points, const unsigned int* ring,
+                          unsigned int count)
+{
+    double area = 0.0;
+    for (unsigned int i = 0, j = count - 1; i < count; j = i++)
+    {
+        const osg::Vec2& a = points[ring[j]];
+        const osg::Vec2& b = points[ring[i]];
+        area += double(a.x()) * b.y() - double(b.x()) * a.y();
+    }
+    return 0.5 * area;
+}
+
+static float triangle_area(const osg::Vec2& a, const osg::Vec2& b,
+                           const osg::Vec2& c)
+{
+    return 0.5f
+        * std::fabs((b.x() - a.x()) * (c.y() - a.y())
+                    - (b.y() - a.y()) * (c.x() - a.x()));
+}
+
+static float orient(const osg::Vec2& a, const osg::Vec2& b, const osg::Vec2& c)
+{
+    return (b.x() - a.x()) * (c.y() - a.y())
+        - (b.y() - a.y()) * (c.x() - a.x());
+}
+
+// proper crossing only, segments meeting at an end point do not count
+static bool crosses(const osg::Vec2& a, const osg::Vec2& b, const osg::Vec2& c,
+                    const osg::Vec2& d)
+{
+    if (std::max(a.x(), b.x()) < std::min(c.x(), d.x())
+        || std::max(c.x(), d.x()) < std::min(a.x(), b.x())
+        || std::max(a.y(), b.y()) < std::min(c.y(), d.y())
+        || std::max(c.y(), d.y()) < std::min(a.y(), b.y()))
+        return false;
+
+    float o1 = orient(a, b, c), o2 = orient(a, b, d);
+    float o3 = orient(c, d, a), o4 = orient(c, d, b);
+    return ((o1 > 0.f && o2 < 0.f) || (o1 < 0.f && o2 > 0.f))
+        && ((o3 > 0.f && o4 < 0.f) || (o3 < 0.f && o4 > 0.f));
+}
+
+// ring of a part without the repeated closing point
+static unsigned int ring_points(const ShapeFile& shp, unsigned int part,
+                                std::vector<unsigned int>& ring)
+{
+    const std::vector<osg::Vec2>& points = shp.getLocalPoints();
+    unsigned int first = shp.getFirstPoint(part);
+    unsigned int end = shp.getEndPoint(part);
+    if (end - first > 1 && points[first] == points[end - 1]) --end;
+
+    ring.clear();
+    for (unsigned int i = first; i < end; ++i) ring.push_back(i);
+    return ring.size();
+}
+
+PolygonSimplifier::PolygonSimplifier(const ShapeFile& shp) :
+    _shp(shp)
+{
+    const std::vector<osg::Vec2>& points = shp.getLocalPoints();
+
+    // points of different rings are the same vertex when their coordinates
+    // are equal, they come from the same source coordinates
+    std::unordered_map<uint64_t, unsigned int> ids;
+    std::vector<unsigned int> id(points.size());
+    for (unsigned int i = 0; i < points.size(); ++i)
+    {
+        uint32_t x, y;
+        std::memcpy(&x, points[i].ptr(), sizeof(x));
+        std::memcpy(&y, points[i].ptr() + 1, sizeof(y));
+        id[i] = ids.emplace(uint64_t(x) << 32 | y,
+                            (unsigned int)ids.size()).first->second;
+    }
+
+    // a vertex inside a chain has the same two neighbours in every ring it
+    // belongs to, any other count makes it a chain end
+    struct Neighbours
+    {
+        unsigned int id[2];
+        unsigned int count = 0;
+    };
+    std::vector<Neighbours> neighbours(ids.size());
+    auto add = [&](unsigned int v, unsigned int n)
+    {
+        Neighbours& nb = neighbours[v];
+        if (v == n || nb.count > 2) return;
+        for (unsigned int k = 0; k < nb.count; ++k)
+            if (nb.id[k] == n) return;
+        if (nb.count < 2) nb.id[nb.count] = n;
+        nb.count++;
+    };
+
+    std::vector<unsigned int> ring;
+    for (unsigned int r = 0; r < shp.getNumRecords(); ++r)
+    {
+        for (unsigned int p = shp.getFirstPart(r); p < shp.getEndPart(r); ++p)
+        {
+            unsigned int n = ring_points(shp, p, ring);
+            for (unsigned int k = 0; k < n; ++k)
+            {
+                add(id[ring[k]], id[ring[(k + n - 1) % n]]);
+                add(id[ring[k]], id[ring[(k + 1) % n]]);
+            }
+        }
+    }
+
+    std::vector<bool> nodeIds(ids.size());
+    for (unsigned int v = 0; v < ids.size(); ++v)
+        nodeIds[v] = neighbours[v].count != 2;
+
+    // rings without a chain end get their lowest point as one; a ring shared
+    // as a whole picks the same point in both polygons
+    for (unsigned int r = 0; r < shp.getNumRecords(); ++r)
+    {
+        for (unsigned int p = shp.getFirstPart(r); p < shp.getEndPart(r); ++p)
+        {
+            unsigned int n = ring_points(shp, p, ring);
+            if (n == 0) continue;
+
+            bool found = false;
+            unsigned int lowest = ring[0];
+            for (unsigned int i : ring)
+            {
+                found = found || nodeIds[id[i]];
+                if (points[i] < points[lowest]) lowest = i;
+            }
+            if (!found) nodeIds[id[lowest]] = true;
+        }
+    }
+
+    _node.resize(points.size());
+    for (unsigned int i = 0; i < points.size(); ++i) _node[i] = nodeIds[id[i]];
+}
+
+// The chains of a layer, each once, one after the other in vertices with
+// both their end points, linked through prev and next as points are
+// removed. The segments of all of them, each under the index of its start,
+// are bucketed into one uniform grid over the layer; a removal tests the
+// segments in the cells under the shortened edge for crossings, of its own
+// chain, the other rings of its polygon and the chains of the polygons
+// around it alike. A segment stays listed under the cells of its earlier
+// extent, the entries are only a superset of the candidates.
+struct PolygonSimplifier::Chains
+{
+    const osg::Vec2* points;
+    std::vector<unsigned int> vertices;
+    std::vector<unsigned int> first = std::vector<unsigned int>(1, 0);
+    std::vector<bool> closed;
+
+    std::vector<unsigned int> prev, next;
+    std::vector<bool> removed;
+    // the query a segment was last tested in, it may be listed in several
+    // cells
+    std::vector<unsigned int> tested;
+    unsigned int query = 0;
+
+    osg::BoundingBox bounds;
+    int side = 1;
+    float scaleX = 0.f, scaleY = 0.f;
+    std::vector<std::vector<unsigned int>> cells;
+
+    const osg::Vec2& pt(unsigned int i) const { return points[vertices[i]]; }
+
+    unsigned int getNumChains() const { return closed.size(); }
+
+    void addChain(const unsigned int* chain, unsigned int count, bool reversed,
+                  bool isClosed)
+    {
+        unsigned int base = vertices.size();
+        for (unsigned int i = 0; i < count; ++i)
+        {
+            vertices.push_back(chain[reversed ? count - 1 - i : i]);
+            prev.push_back(i ? base + i - 1 : base);
+            next.push_back(i + 1 < count ? base + i + 1 : base + i);
+        }
+        first.push_back(vertices.size());
+        closed.push_back(isClosed);
+    }
+
+    void buildGrid()
+    {
+        removed.assign(vertices.size(), false);
+        tested.assign(vertices.size(), 0);
+
+        bounds.init();
+        for (unsigned int i = 0; i < vertices.size(); ++i)
+            bounds.expandBy(osg::Vec3(pt(i), 0.f));
+        side = std::max(
+            1, int(std::sqrt(vertices.size() / chainSegmentsPerCell)));
+        float width = bounds.xMax() - bounds.xMin(),
+              height = bounds.yMax() - bounds.yMin();
+        scaleX = width > 0.f ? side / width : 0.f;
+        scaleY = height > 0.f ? side / height : 0.f;
+        cells.assign(side * side, std::vector<unsigned int>());
+
+        for (unsigned int j = 0; j < vertices.size(); ++j)
+        {
+            if (next[j] == j) continue;
+            forCells(pt(j), pt(next[j]),
+                     [j](std::vector<unsigned int>& cell)
+                     { cell.push_back(j); });
+        }
+    }
+
+    template <typename Func>
+    void forCells(const osg::Vec2& a, const osg::Vec2& b, const Func& func)
+    {
+        auto cell = [this](float v)
+        { return osg::clampBetween(int(v), 0, side - 1); };
+        int x0 = cell((std::min(a.x(), b.x()) - bounds.xMin()) * scaleX);
+        int x1 = cell((std::max(a.x(), b.x()) - bounds.xMin()) * scaleX);
+        int y0 = cell((std::min(a.y(), b.y()) - bounds.yMin()) * scaleY);
+        int y1 = cell((std::max(a.y(), b.y()) - bounds.yMin()) * scaleY);
+        for (int y = y0; y <= y1; ++y)
+            for (int x = x0; x <= x1; ++x) func(cells[y * side + x]);
+    }
+};
+
+// Visvalingam-Whyatt on one chain with fixed end points. Ties of the
+// effective area are broken by coordinates, which makes the result
+// independent of the direction the chain is walked in.
+void PolygonSimplifier::simplifyChain(Chains& chains, unsigned int chain,
+                                      float tolerance) const
+{
+    unsigned int first = chains.first[chain];
+    unsigned int last = chains.first[chain + 1] - 1;
+    std::vector<unsigned int>& prev = chains.prev;
+    std::vector<unsigned int>& next = chains.next;
+    std::vector<bool>& removed = chains.removed;
+    auto pt = [&](unsigned int i) -> const osg::Vec2& { return chains.pt(i); };
+
+    struct Entry
+    {
+        float area;
+        osg::Vec2 pos;
+        unsigned int i;
+
+        bool operator>(const Entry& e) const
+        {
+            if (area != e.area) return area > e.area;
+            return e.pos < pos;
+        }
+    };
+    std::priority_queue<Entry, std::vector<Entry>, std::greater<Entry>> heap;
+
+    std::vector<float> area(last - first + 1, 0.f);
+    for (unsigned int i = first + 1; i < last; ++i)
+    {
+        area[i - first] = triangle_area(pt(i - 1), pt(i), pt(i + 1));
+        heap.push(Entry{area[i - first], pt(i), i});
+    }
+
+    // a closed chain is a whole ring and keeps a triangle
+    unsigned int interior = last > first ? last - first - 1 : 0;
+    unsigned int minInterior = chains.closed[chain] ? 2 : 0;
+
+    while (!heap.empty() && interior > minInterior)
+    {
+        Entry e = heap.top();
+        heap.pop();
+        if (removed[e.i] || e.area != area[e.i - first]) continue; // stale
+        if (e.area >= tolerance) break;
+
+        unsigned int p = prev[e.i];
+        unsigned int n = next[e.i];
+
+        // the shortened edge must not cross any chain
+        bool valid = true;
+        unsigned int query = ++chains.query;
+        chains.forCells(pt(p), pt(n),
+                        [&](const std::vector<unsigned int>& cell)
+        {
+            for (unsigned int j : cell)
+            {
+                if (!valid) return;
+                if (removed[j] || chains.tested[j] == query || j == p
+                    || j == e.i)
+                    continue;
+                chains.tested[j] = query;
+                valid = !crosses(pt(p), pt(n), pt(j), pt(next[j]));
+            }
+        });
+        if (!valid) continue;
+
+        removed[e.i] = true;
+        interior--;
+        next[p] = n;
+        prev[n] = p;
+        chains.forCells(pt(p), pt(n), [p](std::vector<unsigned int>& cell)
+                        { cell.push_back(p); });
+
+        // neighbours never get a lower effective area than the point removed
+        if (p > first)
+        {
+            area[p - first] = std::max(
+                triangle_area(pt(prev[p]), pt(p), pt(n)), e.area);
+            heap.push(Entry{area[p - first], pt(p), p});
+        }
+        if (n < last)
+        {
+            area[n - first] = std::max(
+                triangle_area(pt(p), pt(n), pt(next[n])), e.area);
+            heap.push(Entry{area[n - first], pt(n), n});
+        }
+    }
+}
+
+void PolygonSimplifier::simplify(unsigned int level, ShapeFile& out) const
+{
+    // one pixel of area one zoom level past the start of the level
+    float tolerance = 0.f;
+    if (level > 0)
+    {
+        float pixel = float(zoomToDistance(polygonLevelZoom[level - 1] - 1.0))
+            * polygonPixelSize;
+        tolerance = pixel * pixel;
+    }
+    float minArea = tolerance * polygonMinPixels;
+
+    const osg::Vec2* src = _shp.getLocalPoints().data();
+    unsigned int numRecords = _shp.getNumRecords();
+
+    // every ring big enough for the level is cut into its chains, from chain
+    // end to chain end. A chain is stored once, in the direction that starts
+    // with the lesser first two points, and the rings refer to it; a chain
+    // shared by two polygons is walked the other way round in one of them
+    struct ChainRef
+    {
+        unsigned int chain;
+        bool reversed;
+    };
+    struct Ring
+    {
+        unsigned int record;
+        double area;
+        unsigned int firstRef, endRef;
+    };
+    std::vector<ChainRef> refs;
+    std::vector<Ring> rings;
+    std::vector<unsigned int> recordRings(1, 0);
+
+    Chains chains;
+    chains.points = src;
+    // a chain is known by the coordinates of its first two points
+    typedef std::pair<uint64_t, uint64_t> ChainKey;
+    auto key = [src](unsigned int i, unsigned int j)
+    {
+        uint32_t c[4];
+        std::memcpy(c, src[i].ptr(), sizeof(uint32_t) * 2);
+        std::memcpy(c + 2, src[j].ptr(), sizeof(uint32_t) * 2);
+        return ChainKey(uint64_t(c[0]) << 32 | c[1],
+                        uint64_t(c[2]) << 32 | c[3]);
+    };
+    struct ChainKeyHash
+    {
+        size_t operator()(const ChainKey& k) const
+        {
+            std::hash<uint64_t> h;
+            return h(k.first) ^ h(k.second) * 31;
+        }
+    };
+    std::unordered_map<ChainKey, unsigned int, ChainKeyHash> chainIds;
+
+    std::vector<unsigned int> ring, chain;
+    for (unsigned int r = 0; r < numRecords; ++r)
+    {
+        for (unsigned int p = _shp.getFirstPart(r); p < _shp.getEndPart(r);
+             ++p)
+        {
+            unsigned int n = ring_points(_shp, p, ring);
+            if (n < 3) continue;
+
+            double area = signed_area(src, ring.data(), n);
+            if (std::fabs(area) < minArea) continue;
+
+            unsigned int start = 0;
+            unsigned int numNodes = 0;
+            for (unsigned int k = n; k-- > 0;)
+            {
+                if (_node[ring[k]])
+                {
+                    start = k;
+                    numNodes++;
+                }
+            }
+
+            Ring rec{r, area, (unsigned int)refs.size(), 0};
+            unsigned int k = start;
+            do
+            {
+                chain.clear();
+                chain.push_back(ring[k]);
+                do
+                {
+                    k = (k + 1) % n;
+                    chain.push_back(ring[k]);
+                } while (!_node[ring[k]] && k != start);
+
+                unsigned int m = chain.size();
+                ChainKey forward = key(chain[0], chain[1]);
+                ChainKey backward = key(chain[m - 1], chain[m - 2]);
+                bool reversed = backward < forward;
+
+                auto it = chainIds.emplace(reversed ? backward : forward,
+                                           chains.getNumChains());
+                if (it.second)
+                    chains.addChain(chain.data(), m, reversed, numNodes <= 1);
+                refs.push_back(ChainRef{it.first->second, reversed});
+            } while (k != start);
+
+            rec.endRef = refs.size();
+            rings.push_back(rec);
+        }
+        recordRings.push_back(rings.size());
+    }
+
+    // the chains go one after the other, each against the current state of
+    // all the others
+    chains.buildGrid();
+    for (unsigned int c = 0; c < chains.getNumChains(); ++c)
+        simplifyChain(chains, c, tolerance);
+
+    std::vector<std::vector<osg::Vec2>> points(numRecords);
+    std::vector<std::vector<unsigned int>> parts(numRecords);
+    parallel_for(numRecords, [&](size_t r)
+    {
+        std::vector<unsigned int> kept;
+        for (unsigned int i = recordRings[r]; i < recordRings[r + 1]; ++i)
+        {
+            // the kept points of the chains without their last one, so the
+            // chains of the ring concatenate
+            kept.clear();
+            for (unsigned int f = rings[i].firstRef; f < rings[i].endRef; ++f)
+            {
+                const ChainRef& ref = refs[f];
+                unsigned int begin = chains.first[ref.chain];
+                unsigned int end = chains.first[ref.chain + 1] - 1;
+                if (ref.reversed)
+                {
+                    for (unsigned int v = end; v != begin; v = chains.prev[v])
+                        kept.push_back(chains.vertices[v]);
+                }
+                else
+                {
+                    for (unsigned int v = begin; v != end; v = chains.next[v])
+                        kept.push_back(chains.vertices[v]);
+                }
+            }
+
+            // the ring must keep its orientation and enough area to be seen
+            if (kept.size() < 3) continue;
+            double keptArea = signed_area(src, kept.data(), kept.size());
+            if ((keptArea > 0.0) != (rings[i].area > 0.0)
+                || std::fabs(keptArea) < minArea)
+                continue;
+
+            for (unsigned int v : kept) points[r].push_back(src[v]);
+            points[r].push_back(src[kept[0]]);
+            parts[r].push_back(points[r].size());
+        }
+    }, 16);
+
+    out._shapeType = ShapeFile::POLYGON;
+    out._geoBounds = _shp._geoBounds;
+    out._geo.clear();
+    out._local.clear();
+    out._partPoints.assign(1, 0);
+    out._recordParts.assign(1, 0);
+    out._bounds.assign(numRecords, osg::BoundingBox());
+    out._localBounds.init();
+
+    for (unsigned int r = 0; r < numRecords; ++r)
+    {
+        unsigned int base = out._local.size();
+        out._local.insert(out._local.end(), points[r].begin(), points[r].end());
+        for (unsigned int end : parts[r]) out._partPoints.push_back(base + end);
+        out._recordParts.push_back(out._partPoints.size() - 1);
+
+        for (const osg::Vec2& p : points[r])
+            out._bounds[r].expandBy(osg::Vec3(p.x(), p.y(), 0.f));
+        out._localBounds.expandBy(out._bounds[r]);
+    }
+}
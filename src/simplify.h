@@ -0,0 +1,63 @@
+#ifndef SIMPLIFY_H
+#define SIMPLIFY_H
+
+#include <osg/Vec2>
+
+#include <vector>
+#include <cfloat>
+
+#include "zoom.h"
+#include "shapefile.h"
+
+// Generalisation levels of the polygon layers: level 0 is the full detail,
+// level l is drawn from the distance of zoom polygonLevelZoom[l - 1] on.
+const unsigned int polygonNumLevels = 4;
+const double polygonLevelZoom[polygonNumLevels - 1] = {16.0, 14.0, 13.0};
+
+inline float polygonLevelMinDistance(unsigned int level)
+{
+    return level == 0
+        ? 0.f
+        : float(zoomToDistance(polygonLevelZoom[level - 1]));
+}
+
+inline float polygonLevelMaxDistance(unsigned int level)
+{
+    return level + 1 == polygonNumLevels
+        ? FLT_MAX
+        : float(zoomToDistance(polygonLevelZoom[level]));
+}
+
+////////////////////////////////////////////////////////////////////////////////
+
+// Topology preserving Visvalingam-Whyatt simplification of a polygon layer.
+// Rings are cut into chains at the vertices where polygons meet; a chain
+// shared by two polygons is simplified once, to the same points in both, so
+// adjacent polygons stay free of gaps. Vertices go in the order of their
+// effective area while it is below the tolerance of the level, unless the
+// shortened edge would cross any chain of the layer, holes and neighbours
+// included. Chains are simplified one after the other against a grid of all
+// of them. Rings that collapse or flip are dropped, and so are polygons too
+// small to be seen at the level.
+class PolygonSimplifier {
+public:
+    // finds the chain ends of the local points of shp
+    PolygonSimplifier(const ShapeFile& shp);
+
+    // polygons of the level in out, record for record with shp; dropped
+    // records have no parts
+    void simplify(unsigned int level, ShapeFile& out) const;
+
+protected:
+    struct Chains;
+    void simplifyChain(Chains& chains, unsigned int chain,
+                       float tolerance) const;
+
+    const ShapeFile& _shp;
+
+    // points where chains start and end: junctions of three or more
+    // polygons, ends of shared boundaries, and one point of rings without any
+    std::vector<bool> _node;
+};
+
+#endif // SIMPLIFY_H
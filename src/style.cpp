@@ -0,0 +1,288 @@
+#include <osg/Material>
+
+#include <iostream>
+#include <fstream>
+#include <sstream>
+#include <algorithm>
+#include <cctype>
+#include <cstdlib>
+
+#include "style.h"
+
+MapStyle::MapStyle()
+{
+    _defaults[STYLE_ROADS].width = 13.5f;
+    _defaults[STYLE_LABELS].icon = "default.png";
+    _defaults[STYLE_TERRAIN].color = osg::Vec4(0.88f, 0.86f, 0.83f, 1.f);
+    _defaults[STYLE_ROUTE].width = 6.f;
+    _defaults[STYLE_ROUTE].color = osg::Vec4(0.91f, 0.33f, 0.11f, 1.f);
+    for (auto& rule : _defaults) rule.defined = true;
+}
+
+static std::string trimmed(const std::string& str)
+{
+    const char* ws = " \t\n\r\f\v";
+    size_t start = str.find_first_not_of(ws);
+    if (start == std::string::npos) return "";
+    size_t end = str.find_last_not_of(ws);
+    return str.substr(start, end - start + 1);
+}
+
+static int layerFromName(const std::string& name)
+{
+    if (name == "roads") return STYLE_ROADS;
+    if (name == "landuse") return STYLE_LANDUSE;
+    if (name == "water") return STYLE_WATER;
+    if (name == "buildings") return STYLE_BUILDINGS;
+    if (name == "labels") return STYLE_LABELS;
+    if (name == "terrain") return STYLE_TERRAIN;
+    if (name == "route") return STYLE_ROUTE;
+    return -1;
+}
+
+// accepts "#rrggbb", "#rrggbbaa" or "r g b [a]" with components in 0..1
+static bool parseColor(const std::string& value, osg::Vec4& color)
+{
+    if (!value.empty() && value[0] == '#')
+    {
+        if (value.size() != 7 && value.size() != 9) return false;
+
+        color.a() = 1.f;
+        for (size_t i = 1, c = 0; i < value.size(); i += 2, ++c)
+        {
+            char* end = nullptr;
+            std::string byte = value.substr(i, 2);
+            long v = std::strtol(byte.c_str(), &end, 16);
+            if (*end) return false;
+            color[c] = v / 255.f;
+        }
+        return true;
+    }
+
+    std::istringstream in(value);
+    osg::Vec4 c(0.f, 0.f, 0.f, 1.f);
+    if (!(in >> c.r() >> c.g() >> c.b())) return false;
+    in >> c.a();
+    color = c;
+    return true;
+}
+
+unsigned int MapStyle::intern(const std::string& name)
+{
+    auto it = _ids.find(name);
+    if (it != _ids.end()) return it->second;
+
+    unsigned int id = _names.size();
+    _ids[name] = id;
+    _names.push_back(name);
+    return id;
+}
+
+int MapStyle::internTexture(const std::string& name)
+{
+    for (unsigned int i = 0; i < _textures.size(); ++i)
+    {
+        if (_textures[i].name == name) return i;
+    }
+    StyleTexture tex;
+    tex.name = name;
+    _textures.push_back(tex);
+    return _textures.size() - 1;
+}
+
+bool MapStyle::load(const std::string& path)
+{
+    std::ifstream file(path);
+    if (!file.is_open()) return false;
+
+    // assignments are collected first and applied in two steps, so class
+    // rules inherit every field of the layer default regardless of the
+    // order of the sections in the file
+    struct Assignment
+    {
+        int layer;
+        int texture;
+        std::vector<unsigned int> ids;
+        std::string key, value;
+        int line;
+    };
+    std::vector<Assignment> assignments;
+
+    Assignment section;
+    section.layer = -1;
+    section.texture = -1;
+
+    std::string line;
+    int lineNumber = 0;
+    while (std::getline(file, line))
+    {
+        ++lineNumber;
+        line = trimmed(line);
+        if (line.empty() || line[0] == '#' || line[0] == ';') continue;
+
+        if (line[0] == '[')
+        {
+            size_t close = line.find(']');
+            std::string name = trimmed(line.substr(1, close - 1));
+            std::string classes;
+            size_t colon = name.find(':');
+            if (colon != std::string::npos)
+            {
+                classes = name.substr(colon + 1);
+                name = trimmed(name.substr(0, colon));
+            }
+
+            section.layer = -1;
+            section.texture = -1;
+            section.ids.clear();
+
+            if (name == "texture")
+            {
+                section.texture = internTexture(trimmed(classes));
+                continue;
+            }
+
+            section.layer = layerFromName(name);
+            if (section.layer < 0)
+            {
+                std::cout << path << ":" << lineNumber
+                          << ": unknown style layer " << name << std::endl;
+                continue;
+            }
+
+            std::istringstream list(classes);
+            std::string cls;
+            while (std::getline(list, cls, ','))
+            {
+                cls = trimmed(cls);
+                if (!cls.empty()) section.ids.push_back(intern(cls));
+            }
+            continue;
+        }
+
+        size_t eq = line.find('=');
+        if (eq == std::string::npos
+            || (section.layer < 0 && section.texture < 0))
+        {
+            std::cout << path << ":" << lineNumber << ": ignored line"
+                      << std::endl;
+            continue;
+        }
+
+        Assignment a = section;
+        a.key = trimmed(line.substr(0, eq));
+        a.value = trimmed(line.substr(eq + 1));
+        a.line = lineNumber;
+        assignments.push_back(a);
+    }
+
+    auto apply = [&](StyleRule& rule, const Assignment& a) {
+        if (a.key == "width")
+            rule.width = std::atof(a.value.c_str());
+        else if (a.key == "color")
+        {
+            if (!parseColor(a.value, rule.color))
+                std::cout << path << ":" << a.line << ": bad color "
+                          << a.value << std::endl;
+        }
+        else if (a.key == "texture")
+            rule.texture = internTexture(a.value);
+        else if (a.key == "order")
+            rule.order = std::atoi(a.value.c_str());
+        else if (a.key == "min_zoom")
+            rule.minZoom = std::atof(a.value.c_str());
+        else if (a.key == "max_zoom")
+            rule.maxZoom = std::atof(a.value.c_str());
+        else if (a.key == "icon")
+            rule.icon = a.value;
+        else if (a.key == "rank")
+            rule.rank = std::atoi(a.value.c_str());
+        else if (a.key == "chunk_size")
+            rule.chunkSize = std::atof(a.value.c_str());
+        else if (a.key == "speed")
+            rule.speed = std::atof(a.value.c_str());
+        else
+            std::cout << path << ":" << a.line << ": unknown key " << a.key
+                      << std::endl;
+    };
+
+    for (const Assignment& a : assignments)
+    {
+        if (a.texture >= 0)
+        {
+            if (a.key == "diffuse")
+                _textures[a.texture].diffuse = a.value;
+            else if (a.key == "normal")
+                _textures[a.texture].normal = a.value;
+            else
+                std::cout << path << ":" << a.line << ": unknown key "
+                          << a.key << std::endl;
+        }
+        else if (a.ids.empty())
+            apply(_defaults[a.layer], a);
+    }
+
+    // dense tables, one slot per interned name in every layer
+    for (int layer = 0; layer < STYLE_NUM_LAYERS; ++layer)
+    {
+        _tables[layer].assign(_names.size(), StyleRule());
+    }
+
+    for (const Assignment& a : assignments)
+    {
+        if (a.texture >= 0 || a.ids.empty()) continue;
+
+        for (unsigned int id : a.ids)
+        {
+            StyleRule& rule = _tables[a.layer][id];
+            if (!rule.defined)
+            {
+                rule = _defaults[a.layer];
+                rule.defined = true;
+            }
+            apply(rule, a);
+        }
+    }
+
+    for (const StyleTexture& tex : _textures)
+    {
+        if (tex.diffuse.empty())
+            std::cout << path << ": texture " << tex.name
+                      << " has no diffuse image" << std::endl;
+    }
+
+    std::cout << "--- STYLE: " << _names.size() << " classes, "
+              << _textures.size() << " textures from " << path << std::endl;
+
+    return true;
+}
+
+osg::StateSet* createColorStateSet(const osg::Vec4& color)
+{
+    // emission only, so the colour does not depend on the vertex normals
+    osg::Material* mat = new osg::Material;
+    mat->setColorMode(osg::Material::OFF);
+    mat->setAmbient(osg::Material::FRONT_AND_BACK, osg::Vec4(0, 0, 0, 1));
+    mat->setDiffuse(osg::Material::FRONT_AND_BACK, osg::Vec4(0, 0, 0, 1));
+    mat->setSpecular(osg::Material::FRONT_AND_BACK, osg::Vec4(0, 0, 0, 1));
+    mat->setEmission(osg::Material::FRONT_AND_BACK, color);
+
+    osg::StateSet* ss = new osg::StateSet;
+    ss->setAttributeAndModes(mat, osg::StateAttribute::ON);
+    return ss;
+}
+
+osg::StateSet* createLitColorStateSet(const osg::Vec4& color)
+{
+    osg::Material* mat = new osg::Material;
+    mat->setColorMode(osg::Material::OFF);
+    mat->setAmbient(osg::Material::FRONT_AND_BACK, color);
+    mat->setDiffuse(osg::Material::FRONT_AND_BACK, color);
+    mat->setSpecular(osg::Material::FRONT_AND_BACK, osg::Vec4(0, 0, 0, 1));
+
+    osg::StateSet* ss = new osg::StateSet;
+    ss->setAttributeAndModes(mat, osg::StateAttribute::ON);
+    ss->setMode(GL_LIGHTING, osg::StateAttribute::ON);
+    ss->setMode(GL_CULL_FACE, osg::StateAttribute::ON);
+    return ss;
+}
@@ -0,0 +1,132 @@
+#ifndef STYLE_H
+#define STYLE_H
+
+#include <osg/Referenced>
+#include <osg/ref_ptr>
+#include <osg/Vec4>
+#include <osg/StateSet>
+
+#include <string>
+#include <vector>
+#include <unordered_map>
+
+enum StyleLayer
+{
+    STYLE_ROADS,
+    STYLE_LANDUSE,
+    STYLE_WATER,
+    STYLE_BUILDINGS,
+    STYLE_LABELS,
+    STYLE_TERRAIN,
+    STYLE_ROUTE,
+    STYLE_NUM_LAYERS
+};
+
+struct StyleRule
+{
+    float width = 1.f;
+    osg::Vec4 color = osg::Vec4(1.f, 1.f, 1.f, 1.f);
+    // index into the [texture:...] definitions, -1 when not textured
+    int texture = -1;
+    int order = 0;
+    float minZoom = 0.f;
+    float maxZoom = 30.f;
+    std::string icon;
+    int rank = 100;
+    // side of the chunk cells of the layer, 0 for the layer's own default
+    float chunkSize = 0.f;
+    // km/h routes drive on roads of the class, 0 for ones they do not take
+    float speed = 0.f;
+    bool defined = false;
+};
+
+struct StyleTexture
+{
+    std::string name;
+    std::string diffuse;
+    std::string normal;
+};
+
+////////////////////////////////////////////////////////////////////////////////
+
+// Style definition loaded from an INI file. Sections are named
+// [layer:class1,class2,...] for class rules, [layer] for the layer default
+// and [texture:name] for texture sets referenced by the rules. At load time
+// every class name is interned to a dense id and each layer is compiled into
+// a table indexed by that id, so styling on the hot path is a hash lookup of
+// the attribute followed by array indexing - no string matching.
+class MapStyle : public osg::Referenced {
+public:
+    MapStyle();
+
+    bool load(const std::string& path);
+
+    // id of an interned attribute value, -1 when the style does not know it;
+    // read-only, so it is safe to call from worker threads after load
+    int find(const std::string& name) const
+    {
+        auto it = _ids.find(name);
+        return it == _ids.end() ? -1 : int(it->second);
+    }
+
+    bool isDefined(StyleLayer layer, int id) const
+    {
+        return id >= 0 && id < int(_tables[layer].size())
+            && _tables[layer][id].defined;
+    }
+
+    // rule for an id, falls back to the layer default
+    const StyleRule& rule(StyleLayer layer, int id) const
+    {
+        return isDefined(layer, id) ? _tables[layer][id] : _defaults[layer];
+    }
+
+    const StyleRule& lookup(StyleLayer layer, const std::string& name) const
+    {
+        return rule(layer, find(name));
+    }
+
+    // first defined rule of name, then fallback, then the layer default
+    const StyleRule& lookup(StyleLayer layer, const std::string& name,
+                            const std::string& fallback) const
+    {
+        int id = find(name);
+        return isDefined(layer, id) ? _tables[layer][id]
+                                    : rule(layer, find(fallback));
+    }
+
+    const StyleRule& getDefault(StyleLayer layer) const
+    {
+        return _defaults[layer];
+    }
+
+    unsigned int getNumIds() const { return _names.size(); }
+    const std::string& getName(unsigned int id) const { return _names[id]; }
+
+    unsigned int getNumTextures() const { return _textures.size(); }
+    const StyleTexture& getTexture(unsigned int i) const
+    {
+        return _textures[i];
+    }
+
+protected:
+    unsigned int intern(const std::string& name);
+    int internTexture(const std::string& name);
+
+    std::unordered_map<std::string, unsigned int> _ids;
+    std::vector<std::string> _names;
+    std::vector<StyleTexture> _textures;
+
+    StyleRule _defaults[STYLE_NUM_LAYERS];
+    std::vector<StyleRule> _tables[STYLE_NUM_LAYERS];
+};
+
+// shared state set giving a flat colour to polygon layers
+osg::StateSet* createColorStateSet(const osg::Vec4& color);
+
+// same colour, but shaded by the scene light, for geometry with normals
+osg::StateSet* createLitColorStateSet(const osg::Vec4& color);
+
+extern osg::ref_ptr<MapStyle> map_style;
+
+#endif // STYLE_H
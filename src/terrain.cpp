@@ -0,0 +1,668 @@
+#include <osgDB/ReadFile>
+#include <osgDB/FileUtils>
+#include <osgDB/FileNameUtils>
+#include <osg/CoordinateSystemNode>
+#include <osg/Shape>
+#include <osg/Geode>
+#include <osg/Geometry>
+#include <osg/LOD>
+#include <osg/MatrixTransform>
+#include <osg/PolygonOffset>
+#include <osg/Timer>
+
+#include <iostream>
+#include <fstream>
+#include <vector>
+#include <algorithm>
+#include <cmath>
+#include <cfloat>
+#include <cstdio>
+#include <cctype>
+#include <cstdint>
+#include <unordered_map>
+
+#include "common.h"
+#include "style.h"
+#include "terrain.h"
+#include "shapefile.h"
+#include "parallel.h"
+
+// chunks are drawn with this many pixels of error at most on a viewport
+// of this height and vertical field of view; the LOD scale of the viewer
+// trades the error for speed on top
+const float terrainViewportHeight = 1080.f;
+const float terrainFieldOfView = 30.f;
+
+// levels of chunks at most, the grid is then 32 << 7 = 4096 cells a side
+const unsigned int terrainMaxLevels = 8;
+
+// heights below this are voids of the DEM
+const float terrainVoidHeight = -1000.f;
+
+const double metresPerDegree = 111320.0;
+
+// SRTM tile, named after its south west corner like N50E019.hgt: a square
+// of big endian 16 bit heights in metres, rows from the north
+static osg::HeightField* read_hgt(const std::string& fileName)
+{
+    std::string name = osgDB::getStrippedName(fileName);
+    char ns = 0, ew = 0;
+    int lat = 0, lon = 0;
+    if (std::sscanf(name.c_str(), "%c%2d%c%3d", &ns, &lat, &ew, &lon) != 4)
+        return nullptr;
+    ns = std::toupper((unsigned char)ns);
+    ew = std::toupper((unsigned char)ew);
+    if ((ns != 'N' && ns != 'S') || (ew != 'E' && ew != 'W')) return nullptr;
+    if (ns == 'S') lat = -lat;
+    if (ew == 'W') lon = -lon;
+
+    std::ifstream file(fileName, std::ios::binary | std::ios::ate);
+    if (!file.is_open()) return nullptr;
+    size_t size = size_t(file.tellg());
+    unsigned int n = (unsigned int)std::lround(std::sqrt(size / 2.0));
+    if (n < 2 || size_t(n) * n * 2 != size) return nullptr;
+
+    std::vector<unsigned char> data(size);
+    file.seekg(0);
+    if (!file.read(reinterpret_cast<char*>(data.data()), size)) return nullptr;
+
+    osg::HeightField* field = new osg::HeightField;
+    field->allocate(n, n);
+    field->setOrigin(osg::Vec3(lon, lat, 0.f));
+    field->setXInterval(1.f / (n - 1));
+    field->setYInterval(1.f / (n - 1));
+    for (unsigned int r = 0; r < n; ++r)
+    {
+        const unsigned char* row = data.data() + size_t(r) * n * 2;
+        for (unsigned int c = 0; c < n; ++c)
+            field->setHeight(
+                c, n - 1 - r,
+                float(int16_t((row[2 * c] << 8) | row[2 * c + 1])));
+    }
+    return field;
+}
+
+static osg::ref_ptr<osg::HeightField> read_tile(const std::string& fileName)
+{
+    if (osgDB::getLowerCaseFileExtension(fileName) == "hgt")
+        return read_hgt(fileName);
+    return osgDB::readRefHeightFieldFile(fileName);
+}
+
+// bilinear height of the tile at a geographic position, voids left out;
+// false outside of the tile or on voids only
+static bool sample_tile(const osg::HeightField& field, double lon, double lat,
+                        float& height)
+{
+    double fx = (lon - field.getOrigin().x()) / field.getXInterval();
+    double fy = (lat - field.getOrigin().y()) / field.getYInterval();
+    unsigned int cols = field.getNumColumns(), rows = field.getNumRows();
+    if (fx < 0.0 || fy < 0.0 || fx > cols - 1 || fy > rows - 1) return false;
+
+    unsigned int c = std::min((unsigned int)fx, cols - 2);
+    unsigned int r = std::min((unsigned int)fy, rows - 2);
+    float u = float(fx - c), v = float(fy - r);
+
+    float sum = 0.f, weight = 0.f;
+    for (unsigned int k = 0; k < 4; ++k)
+    {
+        float h = field.getHeight(c + (k & 1), r + (k >> 1));
+        if (h < terrainVoidHeight) continue;
+        float w = (k & 1 ? u : 1.f - u) * (k >> 1 ? v : 1.f - v);
+        sum += h * w;
+        weight += w;
+    }
+    if (weight <= 0.f) return false;
+
+    height = sum / weight;
+    return true;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+
+Terrain::Terrain(unsigned int chunkCells, float pixelError) :
+    _chunkCells(chunkCells),
+    _pixelError(pixelError)
+{
+}
+
+bool Terrain::build(const std::vector<std::string>& files,
+                    const osg::Matrixd& ltw,
+                    const osg::BoundingBox& bounds)
+{
+    std::vector<osg::ref_ptr<osg::HeightField>> tiles;
+    double tileSpacing = DBL_MAX;
+    for (const std::string& file : files)
+    {
+        osg::ref_ptr<osg::HeightField> field = read_tile(file);
+        if (!field || field->getNumColumns() < 2 || field->getNumRows() < 2)
+        {
+            std::cout << "Cannot load DEM tile " << file << std::endl;
+            continue;
+        }
+        tiles.push_back(field);
+        tileSpacing = std::min(tileSpacing,
+                               field->getYInterval() * metresPerDegree);
+    }
+    if (tiles.empty() || !bounds.valid()) return false;
+
+    // levels are added until the finest samples are no further apart than
+    // the ones of the tiles
+    float size = std::max(bounds.xMax() - bounds.xMin(),
+                          bounds.yMax() - bounds.yMin());
+    _numLevels = 1;
+    while (_numLevels < terrainMaxLevels
+           && size / (_chunkCells << (_numLevels - 1)) > tileSpacing)
+        _numLevels++;
+    _cells = _chunkCells << (_numLevels - 1);
+    _spacing = size / _cells;
+    _origin.set(bounds.xMin(), bounds.yMin());
+
+    // every sample is looked up in the tiles at its geographic position;
+    // where none covers it the ground is at 0
+    unsigned int side = _cells + 1;
+    _heights.assign(size_t(side) * side, 0.f);
+    parallel_for(side, [&](size_t j)
+    {
+        for (unsigned int i = 0; i < side; ++i)
+        {
+            osg::Vec3d world =
+                osg::Vec3d(_origin.x() + i * _spacing,
+                           _origin.y() + j * _spacing, 0.0) * ltw;
+            double lat, lon, height;
+            ellipsoid->convertXYZToLatLongHeight(world.x(), world.y(),
+                                                 world.z(), lat, lon, height);
+
+            float h;
+            for (const osg::ref_ptr<osg::HeightField>& tile : tiles)
+            {
+                if (!sample_tile(*tile, osg::RadiansToDegrees(lon),
+                                 osg::RadiansToDegrees(lat), h))
+                    continue;
+                _heights[j * side + i] = h;
+                break;
+            }
+        }
+    }, 1);
+
+    computeErrors();
+    return true;
+}
+
+float Terrain::getHeight(float x, float y) const
+{
+    if (_heights.empty()) return 0.f;
+
+    float fx = osg::clampBetween((x - _origin.x()) / _spacing, 0.f,
+                                 float(_cells));
+    float fy = osg::clampBetween((y - _origin.y()) / _spacing, 0.f,
+                                 float(_cells));
+    unsigned int i = std::min((unsigned int)fx, _cells - 1);
+    unsigned int j = std::min((unsigned int)fy, _cells - 1);
+    float u = fx - i, v = fy - j;
+
+    return (sample(i, j) * (1.f - u) + sample(i + 1, j) * u) * (1.f - v)
+         + (sample(i, j + 1) * (1.f - u) + sample(i + 1, j + 1) * u) * v;
+}
+
+float Terrain::getMinHeight(const osg::Vec2* points, size_t count) const
+{
+    float height = FLT_MAX;
+    for (size_t i = 0; i < count; ++i)
+        height = std::min(height, getHeight(points[i].x(), points[i].y()));
+    return count ? height : 0.f;
+}
+
+void Terrain::drape(std::vector<osg::Vec3>& points, float offset) const
+{
+    parallel_for(points.size(), [&](size_t i)
+    {
+        points[i].z() = getHeight(points[i].x(), points[i].y()) + offset;
+    }, 1024);
+}
+
+// the error of a chunk is the largest distance of the grid samples it
+// covers from its own surface, bilinear between its vertices; a chunk is
+// never taken as more accurate than its children
+void Terrain::computeErrors()
+{
+    _errors.assign(_numLevels, std::vector<float>());
+    _levelErrors.assign(_numLevels, 0.f);
+    _errors[_numLevels - 1].assign(1u << (2 * (_numLevels - 1)), 0.f);
+
+    for (unsigned int l = 0; l + 1 < _numLevels; ++l)
+    {
+        unsigned int n = 1u << l;
+        unsigned int stride = 1u << (_numLevels - 1 - l);
+        std::vector<float>& errors = _errors[l];
+        errors.assign(n * n, 0.f);
+
+        parallel_for(n * n, [&](size_t t)
+        {
+            unsigned int i0 = (t % n) * _chunkCells * stride;
+            unsigned int j0 = (t / n) * _chunkCells * stride;
+            float error = 0.f;
+            for (unsigned int j = j0; j <= j0 + _chunkCells * stride; ++j)
+            {
+                unsigned int cj = std::min((j - j0) / stride, _chunkCells - 1);
+                unsigned int sj = j0 + cj * stride;
+                float v = float(j - sj) / stride;
+                for (unsigned int i = i0; i <= i0 + _chunkCells * stride; ++i)
+                {
+                    unsigned int ci = std::min((i - i0) / stride,
+                                               _chunkCells - 1);
+                    unsigned int si = i0 + ci * stride;
+                    float u = float(i - si) / stride;
+
+                    float h = (sample(si, sj) * (1.f - u)
+                               + sample(si + stride, sj) * u) * (1.f - v)
+                            + (sample(si, sj + stride) * (1.f - u)
+                               + sample(si + stride, sj + stride) * u) * v;
+                    error = std::max(error, std::fabs(sample(i, j) - h));
+                }
+            }
+            errors[t] = error;
+        }, 1);
+    }
+
+    for (unsigned int l = _numLevels - 1; l-- > 0;)
+    {
+        unsigned int n = 1u << l;
+        for (unsigned int y = 0; y < n; ++y)
+        {
+            for (unsigned int x = 0; x < n; ++x)
+            {
+                float& error = _errors[l][y * n + x];
+                for (unsigned int q = 0; q < 4; ++q)
+                    error = std::max(error, getError(l + 1, 2 * x + (q & 1),
+                                                     2 * y + (q >> 1)));
+                _levelErrors[l] = std::max(_levelErrors[l], error);
+            }
+        }
+    }
+}
+
+osg::Geometry* Terrain::createChunkGeometry(unsigned int level, unsigned int x,
+                                            unsigned int y,
+                                            const osg::Vec3& origin) const
+{
+    unsigned int n = _chunkCells;
+    unsigned int stride = 1u << (_numLevels - 1 - level);
+    unsigned int i0 = x * n * stride, j0 = y * n * stride;
+    float step = _spacing * stride;
+
+    // the neighbours of a chunk are rarely more than a level coarser, the
+    // cracks to them are within the error of that level
+    float skirt = _levelErrors[level > 0 ? level - 1 : 0] + step;
+
+    osg::Vec3Array* verts = new osg::Vec3Array;
+    osg::Vec3Array* normals = new osg::Vec3Array;
+    verts->reserve((n + 1) * (n + 1) + 4 * n);
+    normals->reserve(verts->capacity());
+    for (unsigned int j = 0; j <= n; ++j)
+    {
+        unsigned int sj = j0 + j * stride;
+        for (unsigned int i = 0; i <= n; ++i)
+        {
+            unsigned int si = i0 + i * stride;
+            verts->push_back(osg::Vec3(_origin.x() + si * _spacing,
+                                       _origin.y() + sj * _spacing,
+                                       sample(si, sj)) - origin);
+
+            // central differences at the spacing of the level
+            unsigned int left = si >= stride ? si - stride : si,
+                         right = std::min(si + stride, _cells);
+            unsigned int down = sj >= stride ? sj - stride : sj,
+                         up = std::min(sj + stride, _cells);
+            osg::Vec3 normal((sample(left, sj) - sample(right, sj))
+                                 / ((right - left) * _spacing),
+                             (sample(si, down) - sample(si, up))
+                                 / ((up - down) * _spacing),
+                             1.f);
+            normal.normalize();
+            normals->push_back(normal);
+        }
+    }
+
+    osg::DrawElementsUShort* tris = new osg::DrawElementsUShort(GL_TRIANGLES);
+    tris->reserve(6 * n * n + 24 * n);
+    for (unsigned int j = 0; j < n; ++j)
+    {
+        for (unsigned int i = 0; i < n; ++i)
+        {
+            unsigned short a = j * (n + 1) + i;
+            unsigned short b = a + 1, c = a + n + 2, d = a + n + 1;
+            tris->push_back(a); tris->push_back(b); tris->push_back(c);
+            tris->push_back(a); tris->push_back(c); tris->push_back(d);
+        }
+    }
+
+    // the skirt hangs from the border, walked counter clockwise so that
+    // its faces look out of the chunk
+    std::vector<unsigned short> border;
+    for (unsigned int i = 0; i < n; ++i) border.push_back(i);
+    for (unsigned int j = 0; j < n; ++j) border.push_back(j * (n + 1) + n);
+    for (unsigned int i = n; i > 0; --i) border.push_back(n * (n + 1) + i);
+    for (unsigned int j = n; j > 0; --j) border.push_back(j * (n + 1));
+
+    unsigned short first = verts->size();
+    for (unsigned short b : border)
+    {
+        verts->push_back((*verts)[b] - osg::Vec3(0.f, 0.f, skirt));
+        normals->push_back((*normals)[b]);
+    }
+    for (size_t k = 0; k < border.size(); ++k)
+    {
+        size_t next = (k + 1) % border.size();
+        unsigned short a = border[k], b = border[next];
+        unsigned short sa = first + k, sb = first + next;
+        tris->push_back(a); tris->push_back(sa); tris->push_back(sb);
+        tris->push_back(a); tris->push_back(sb); tris->push_back(b);
+    }
+
+    osg::Geometry* geom = new osg::Geometry;
+    geom->setUseDisplayList(false);
+    geom->setUseVertexBufferObjects(true);
+    geom->setVertexArray(verts);
+    geom->setNormalArray(normals, osg::Array::BIND_PER_VERTEX);
+    geom->addPrimitiveSet(tris);
+    return geom;
+}
+
+osg::Node* Terrain::createChunkNode(unsigned int level, unsigned int x,
+                                    unsigned int y) const
+{
+    float side = _spacing * (_cells >> level);
+    osg::Vec3 origin(_origin.x() + (x + 0.5f) * side,
+                     _origin.y() + (y + 0.5f) * side, 0.f);
+
+    osg::Geode* geode = new osg::Geode;
+    geode->addDrawable(createChunkGeometry(level, x, y, origin));
+    osg::MatrixTransform* chunk =
+        new osg::MatrixTransform(osg::Matrix::translate(origin));
+    chunk->addChild(geode);
+
+    if (level + 1 == _numLevels) return chunk;
+
+    osg::Group* children = new osg::Group;
+    for (unsigned int q = 0; q < 4; ++q)
+        children->addChild(createChunkNode(level + 1, 2 * x + (q & 1),
+                                           2 * y + (q >> 1)));
+
+    // the distance where the error of the chunk covers _pixelError pixels,
+    // from the edge of the chunk rather than its centre
+    float pixelsPerUnit = terrainViewportHeight
+        / (2.f * std::tan(osg::DegreesToRadians(terrainFieldOfView) * 0.5f));
+    float range = getError(level, x, y) * pixelsPerUnit / _pixelError
+        + side * 0.70711f;
+
+    osg::LOD* lod = new osg::LOD;
+    lod->addChild(children, 0.f, range);
+    lod->addChild(chunk, range, FLT_MAX);
+    return lod;
+}
+
+osg::Node* Terrain::createNode() const
+{
+    if (_numLevels == 0) return nullptr;
+
+    osg::Node* node = createChunkNode(0, 0, 0);
+
+    // drawn before the landuse and water polygons on it and pushed back in
+    // depth, so that they win where they lie on its surface
+    osg::StateSet* ss =
+        createLitColorStateSet(map_style->getDefault(STYLE_TERRAIN).color);
+    ss->setAttributeAndModes(new osg::PolygonOffset(1.f, 1.f));
+    ss->setRenderBinDetails(-11, "RenderBin");
+    ss->setNestRenderBins(false);
+    node->setStateSet(ss);
+    return node;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+
+DrapeVisitor::DrapeVisitor(const Terrain* terrain, float offset,
+                           float maxSegment) :
+    osg::NodeVisitor(osg::NodeVisitor::TRAVERSE_ALL_CHILDREN),
+    _terrain(terrain),
+    _offset(offset),
+    _maxSegment(maxSegment)
+{
+}
+
+void DrapeVisitor::apply(osg::Geode& geode)
+{
+    osg::Vec3 translation = osg::computeLocalToWorld(getNodePath()).getTrans();
+    for (unsigned int i = 0; i < geode.getNumDrawables(); ++i)
+    {
+        osg::Geometry* geom = geode.getDrawable(i)->asGeometry();
+        if (!geom || !dynamic_cast<osg::Vec3Array*>(geom->getVertexArray()))
+            continue;
+        _geometries.push_back(std::make_pair(geom, translation));
+    }
+}
+
+// the strips or the triangles of the primitive sets get points at most
+// _maxSegment apart; other primitives leave the geometry as it is
+void DrapeVisitor::densify(osg::Geometry* geom) const
+{
+    bool strips = true, triangles = true;
+    for (unsigned int p = 0; p < geom->getNumPrimitiveSets(); ++p)
+    {
+        const osg::PrimitiveSet* set = geom->getPrimitiveSet(p);
+        strips = strips
+            && set->getType() == osg::PrimitiveSet::DrawArraysPrimitiveType
+            && (set->getMode() == GL_LINE_STRIP
+                || set->getMode() == GL_LINE_LOOP);
+        triangles = triangles
+            && set->getType()
+                == osg::PrimitiveSet::DrawElementsUIntPrimitiveType
+            && set->getMode() == GL_TRIANGLES;
+    }
+    if (strips) densifyStrips(geom);
+    else if (triangles) densifyTriangles(geom);
+}
+
+void DrapeVisitor::densifyStrips(osg::Geometry* geom) const
+{
+    const osg::Vec3Array& points =
+        *static_cast<osg::Vec3Array*>(geom->getVertexArray());
+    osg::ref_ptr<osg::Vec3Array> dense = new osg::Vec3Array;
+    dense->reserve(points.size());
+    for (unsigned int p = 0; p < geom->getNumPrimitiveSets(); ++p)
+    {
+        osg::DrawArrays* strip =
+            static_cast<osg::DrawArrays*>(geom->getPrimitiveSet(p));
+        GLint first = dense->size();
+        for (GLint k = strip->getFirst();
+             k < strip->getFirst() + strip->getCount(); ++k)
+        {
+            if (k > strip->getFirst())
+            {
+                const osg::Vec3& a = points[k - 1];
+                osg::Vec3 d = points[k] - a;
+                unsigned int steps = (unsigned int)std::ceil(
+                    osg::Vec2(d.x(), d.y()).length() / _maxSegment);
+                for (unsigned int s = 1; s < steps; ++s)
+                    dense->push_back(a + d * (float(s) / steps));
+            }
+            dense->push_back(points[k]);
+        }
+        strip->setFirst(first);
+        strip->setCount(dense->size() - first);
+    }
+
+    // the other per vertex arrays no longer match
+    geom->setVertexArray(dense.get());
+    geom->setNormalArray(nullptr);
+    geom->setColorArray(nullptr);
+}
+
+// a triangle is halved across its longest edge until none is longer than
+// _maxSegment. Edges are only ever split at their middle, which is shared
+// through the map, so the triangles on both sides of an edge split it alike
+// and the draped surface has no cracks.
+void DrapeVisitor::densifyTriangles(osg::Geometry* geom) const
+{
+    osg::Vec3Array& points =
+        *static_cast<osg::Vec3Array*>(geom->getVertexArray());
+    float max2 = _maxSegment * _maxSegment;
+    auto length2 = [&points](GLuint a, GLuint b)
+    {
+        osg::Vec3 d = points[b] - points[a];
+        return d.x() * d.x() + d.y() * d.y();
+    };
+
+    std::unordered_map<uint64_t, GLuint> middles;
+    auto middle = [&](GLuint a, GLuint b)
+    {
+        uint64_t key = (uint64_t(std::min(a, b)) << 32) | std::max(a, b);
+        auto it = middles.find(key);
+        if (it != middles.end()) return it->second;
+
+        GLuint m = points.size();
+        points.push_back((points[a] + points[b]) * 0.5f);
+        middles.insert(std::make_pair(key, m));
+        return m;
+    };
+
+    std::vector<GLuint> dense, stack;
+    for (unsigned int p = 0; p < geom->getNumPrimitiveSets(); ++p)
+    {
+        osg::DrawElementsUInt* tris =
+            static_cast<osg::DrawElementsUInt*>(geom->getPrimitiveSet(p));
+        dense.clear();
+        for (size_t i = 0; i + 2 < tris->size(); i += 3)
+        {
+            stack.assign(tris->begin() + i, tris->begin() + i + 3);
+            while (!stack.empty())
+            {
+                GLuint c = stack.back(); stack.pop_back();
+                GLuint b = stack.back(); stack.pop_back();
+                GLuint a = stack.back(); stack.pop_back();
+
+                // the longest edge to ab, the winding stays
+                float ab = length2(a, b), bc = length2(b, c),
+                      ca = length2(c, a);
+                if (bc > ab && bc >= ca)
+                {
+                    std::swap(a, b);
+                    std::swap(b, c);
+                    ab = bc;
+                }
+                else if (ca > ab)
+                {
+                    std::swap(a, c);
+                    std::swap(b, c);
+                    ab = ca;
+                }
+                if (ab <= max2)
+                {
+                    dense.insert(dense.end(), {a, b, c});
+                    continue;
+                }
+
+                GLuint m = middle(a, b);
+                stack.insert(stack.end(), {a, m, c, m, b, c});
+            }
+        }
+        tris->assign(dense.begin(), dense.end());
+        tris->dirty();
+    }
+
+    // the other per vertex arrays no longer match
+    points.dirty();
+    if (geom->getNormalArray()
+        && geom->getNormalArray()->getBinding() == osg::Array::BIND_PER_VERTEX)
+        geom->setNormalArray(nullptr);
+    if (geom->getColorArray()
+        && geom->getColorArray()->getBinding() == osg::Array::BIND_PER_VERTEX)
+        geom->setColorArray(nullptr);
+}
+
+void DrapeVisitor::drape()
+{
+    parallel_for(_geometries.size(), [&](size_t g)
+    {
+        osg::Geometry* geom = _geometries[g].first.get();
+        const osg::Vec3& t = _geometries[g].second;
+        if (_maxSegment > 0.f) densify(geom);
+
+        osg::Vec3Array* verts =
+            static_cast<osg::Vec3Array*>(geom->getVertexArray());
+        for (osg::Vec3& v : *verts)
+            v.z() = _terrain->getHeight(v.x() + t.x(), v.y() + t.y())
+                + _offset - t.z();
+        verts->dirty();
+    }, 16);
+
+    // bounds are dirtied up the parents, which the geometries share
+    for (auto& g : _geometries) g.first->dirtyBound();
+    _geometries.clear();
+}
+
+////////////////////////////////////////////////////////////////////////////////
+
+osg::Node* process_terrain(osg::Matrixd& ltw, const std::string& file_path,
+                           const std::vector<std::string>& dem_paths)
+{
+    // a directory stands for the tiles in it
+    std::vector<std::string> files;
+    for (const std::string& path : dem_paths)
+    {
+        if (osgDB::fileType(path) != osgDB::DIRECTORY)
+        {
+            files.push_back(path);
+            continue;
+        }
+        osgDB::DirectoryContents contents =
+            osgDB::getSortedDirectoryContents(path);
+        for (const std::string& name : contents)
+        {
+            std::string ext = osgDB::getLowerCaseFileExtension(name);
+            if (ext == "hgt" || ext == "tif" || ext == "tiff")
+                files.push_back(osgDB::concatPaths(path, name));
+        }
+    }
+
+    // the grid covers the map, the extent of the landuse layer
+    osg::BoundingBoxd mgbb;
+    if (!ShapeFile::readGeoBounds(file_path + "/gis_osm_landuse_a_free_1.shp",
+                                  mgbb))
+    {
+        std::cout << "Cannot read the extent of the map for the terrain"
+                  << std::endl;
+        return nullptr;
+    }
+    osg::Matrixd wtl = osg::Matrixd::inverse(ltw);
+    osg::BoundingBox bounds;
+    for (unsigned i = 0; i < 4; i++)
+    {
+        osg::Vec3d pos;
+        ellipsoid->convertLatLongHeightToXYZ(
+            osg::DegreesToRadians(i & 1 ? mgbb.yMax() : mgbb.yMin()),
+            osg::DegreesToRadians(i & 2 ? mgbb.xMax() : mgbb.xMin()), 0.0,
+            pos[0], pos[1], pos[2]);
+        bounds.expandBy(pos * wtl);
+    }
+
+    osg::Timer_t start = osg::Timer::instance()->tick();
+    osg::ref_ptr<Terrain> terrain = new Terrain;
+    if (!terrain->build(files, ltw, bounds))
+    {
+        std::cout << "Cannot build terrain of " << files.size() << " DEM tiles"
+                  << std::endl;
+        return nullptr;
+    }
+    osg::Node* node = terrain->createNode();
+
+    std::cout << "--- TERRAIN: " << files.size() << " DEM tiles resampled at "
+              << terrain->getSpacing() << " m in "
+              << osg::Timer::instance()->delta_m(start,
+                                                 osg::Timer::instance()->tick())
+              << " ms" << std::endl;
+
+    // the layers loaded after it take their heights from it
+    map_terrain = terrain;
+    return node;
+}
@@ -0,0 +1,123 @@
+#ifndef TERRAIN_H
+#define TERRAIN_H
+
+#include <osg/Referenced>
+#include <osg/ref_ptr>
+#include <osg/Vec2>
+#include <osg/Vec3>
+#include <osg/Matrixd>
+#include <osg/BoundingBox>
+#include <osg/Node>
+#include <osg/NodeVisitor>
+#include <osg/Geometry>
+
+#include <string>
+#include <vector>
+#include <utility>
+
+////////////////////////////////////////////////////////////////////////////////
+
+// Ground heights of the map from DEM tiles. The tiles are resampled once
+// into a square grid over the local map frame, as fine as the finest tile
+// but at most terrainMaxLevels of chunks deep; the layers take their
+// heights from this grid, so they sit on the ground that is drawn. Like the
+// rest of the map the grid ignores the curvature of the earth, a height is
+// the z of the local frame.
+//
+// The ground is drawn as chunked LOD: a quadtree of chunks with the same
+// number of cells each, every level at twice the sample spacing of the one
+// below. A chunk knows how far its surface is from the full grid and gives
+// way to its children once that error would cover more than a couple of
+// pixels, so the triangles drawn follow the relief on screen and not the
+// resolution of the DEM. Skirts along the chunk edges hide the cracks
+// between neighbours of different levels.
+class Terrain : public osg::Referenced {
+public:
+    Terrain(unsigned int chunkCells = 32, float pixelError = 2.f);
+
+    // resamples the tiles over bounds, a rectangle of the local frame of
+    // ltw; the files are SRTM .hgt tiles or rasters in geographic
+    // coordinates the GDAL plugin reads, GeoTIFF among them
+    bool build(const std::vector<std::string>& files, const osg::Matrixd& ltw,
+               const osg::BoundingBox& bounds);
+
+    // distance of the grid samples
+    float getSpacing() const { return _spacing; }
+
+    // bilinear height of the grid at a point of the local frame, the
+    // nearest edge of the grid outside of it
+    float getHeight(float x, float y) const;
+
+    // lowest height under the points
+    float getMinHeight(const osg::Vec2* points, size_t count) const;
+
+    // sets z of the points to the ground plus offset, in parallel
+    void drape(std::vector<osg::Vec3>& points, float offset) const;
+
+    // quadtree of the chunks under transforms to their centres
+    osg::Node* createNode() const;
+
+protected:
+    void computeErrors();
+    osg::Node* createChunkNode(unsigned int level, unsigned int x,
+                               unsigned int y) const;
+    osg::Geometry* createChunkGeometry(unsigned int level, unsigned int x,
+                                       unsigned int y,
+                                       const osg::Vec3& origin) const;
+
+    float sample(unsigned int i, unsigned int j) const
+    {
+        return _heights[j * (_cells + 1) + i];
+    }
+    float getError(unsigned int level, unsigned int x, unsigned int y) const
+    {
+        return _errors[level][(y << level) + x];
+    }
+
+    unsigned int _chunkCells;
+    float _pixelError;
+
+    // the grid covers the square [_origin, _origin + _cells * _spacing]
+    unsigned int _numLevels = 0;
+    unsigned int _cells = 0;
+    osg::Vec2 _origin;
+    float _spacing = 0.f;
+    std::vector<float> _heights;
+
+    // largest distance of every chunk and its descendants from the grid,
+    // per level, and the largest one of each level for the skirts
+    std::vector<std::vector<float>> _errors;
+    std::vector<float> _levelErrors;
+};
+
+extern osg::ref_ptr<Terrain> map_terrain;
+
+////////////////////////////////////////////////////////////////////////////////
+
+// Puts the vertices of the geometries below a node on the ground of the
+// terrain, offset above it; the transforms on the way, the chunk origins, are
+// taken into account as translations. With maxSegment the line strips and the
+// triangles are first split into edges no longer than it, so that they follow
+// the ground between their points. Geometries are collected by the traversal
+// and draped by drape() in parallel.
+class DrapeVisitor : public osg::NodeVisitor {
+public:
+    DrapeVisitor(const Terrain* terrain, float offset = 0.f,
+                 float maxSegment = 0.f);
+
+    void apply(osg::Geode& geode) override;
+
+    void drape();
+
+protected:
+    void densify(osg::Geometry* geom) const;
+    void densifyStrips(osg::Geometry* geom) const;
+    void densifyTriangles(osg::Geometry* geom) const;
+
+    const Terrain* _terrain;
+    float _offset;
+    float _maxSegment;
+    std::vector<std::pair<osg::ref_ptr<osg::Geometry>, osg::Vec3>> _geometries;
+};
+
+#endif // TERRAIN_H
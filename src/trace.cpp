@@ -0,0 +1,252 @@
+#include <osg/Stats>
+#include <osg/Camera>
+#include <osgGA/GUIEventAdapter>
+#include <osgGA/GUIActionAdapter>
+
+#include <iostream>
+#include <fstream>
+#include <iomanip>
+
+#include "trace.h"
+#include "chunker.h"
+
+// tracks of the trace; the traversal spans of the viewer stats are put on
+// their own tracks, the scopes of callbacks on the thread they ran on, the
+// main thread sharing the track of event and update
+enum TraceTrack
+{
+    TRACK_MAIN = 1,
+    TRACK_CULL = 2,
+    TRACK_DRAW = 3,
+    TRACK_THREADS = 10
+};
+
+static std::atomic<unsigned int> nextThreadTrack(TRACK_THREADS);
+static thread_local unsigned int threadTrack = 0;
+
+static unsigned int thread_track()
+{
+    if (threadTrack == 0)
+        threadTrack = nextThreadTrack.fetch_add(1, std::memory_order_relaxed);
+    return threadTrack;
+}
+
+static void write_string(std::ostream& out, const char* s)
+{
+    out << '"';
+    for (; *s; ++s)
+    {
+        if (*s == '"' || *s == '\\') out << '\\';
+        if ((unsigned char)*s >= 0x20) out << *s;
+    }
+    out << '"';
+}
+
+// begin and end of a traversal as a span on track, in the time base of the
+// viewer stats
+static void add_stats_span(FrameTrace& trace, osg::Stats* stats,
+                           unsigned int frame, const char* name,
+                           const std::string& beginAttribute,
+                           const std::string& endAttribute, unsigned int track)
+{
+    double begin, end;
+    if (!stats || !stats->getAttribute(frame, beginAttribute, begin)
+        || !stats->getAttribute(frame, endAttribute, end))
+        return;
+
+    TraceEvent event;
+    event.name = name;
+    event.thread = track;
+    event.time = begin * 1e6;
+    event.duration = (end - begin) * 1e6;
+    trace.addEvent(event);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+
+FrameTrace::FrameTrace(const std::string& filename, size_t capacity) :
+    _filename(filename),
+    _capacity(capacity),
+    _slots(new Slot[capacity]),
+    _next(0),
+    _startTick(osg::Timer::instance()->tick())
+{
+    for (size_t i = 0; i < _capacity; ++i)
+        _slots[i].sequence.store(0, std::memory_order_relaxed);
+}
+
+void FrameTrace::attach(osgViewer::Viewer* viewer)
+{
+    _startTick = viewer->getStartTick();
+    threadTrack = TRACK_MAIN;
+
+    viewer->getViewerStats()->collectStats("event", true);
+    viewer->getViewerStats()->collectStats("update", true);
+    if (viewer->getCamera()->getStats())
+        viewer->getCamera()->getStats()->collectStats("rendering", true);
+}
+
+double FrameTrace::now() const
+{
+    return osg::Timer::instance()->delta_u(_startTick,
+                                           osg::Timer::instance()->tick());
+}
+
+void FrameTrace::addSpan(const char* name, double begin, double end)
+{
+    TraceEvent event;
+    event.name = name;
+    event.thread = thread_track();
+    event.time = begin;
+    event.duration = end - begin;
+    addEvent(event);
+}
+
+void FrameTrace::addEvent(const TraceEvent& event)
+{
+    // the sequence is cleared while the slot is written, a reader that
+    // sees the same sequence before and after its copy got a whole event
+    uint64_t index = _next.fetch_add(1, std::memory_order_relaxed);
+    Slot& slot = _slots[index % _capacity];
+    slot.sequence.store(0, std::memory_order_relaxed);
+    std::atomic_thread_fence(std::memory_order_release);
+    slot.event = event;
+    slot.sequence.store(index + 1, std::memory_order_release);
+}
+
+void FrameTrace::addFrame(osgViewer::Viewer* viewer, unsigned int frame)
+{
+    static const std::string eventBegin = "Event traversal begin time";
+    static const std::string eventEnd = "Event traversal end time";
+    static const std::string updateBegin = "Update traversal begin time";
+    static const std::string updateEnd = "Update traversal end time";
+    static const std::string cullBegin = "Cull traversal begin time";
+    static const std::string cullEnd = "Cull traversal end time";
+    static const std::string drawBegin = "Draw traversal begin time";
+    static const std::string drawEnd = "Draw traversal end time";
+
+    osg::Stats* stats = viewer->getViewerStats();
+    osg::Stats* cameraStats = viewer->getCamera()->getStats();
+    add_stats_span(*this, stats, frame, "event", eventBegin, eventEnd,
+                   TRACK_MAIN);
+    add_stats_span(*this, stats, frame, "update", updateBegin, updateEnd,
+                   TRACK_MAIN);
+    add_stats_span(*this, cameraStats, frame, "cull", cullBegin, cullEnd,
+                   TRACK_CULL);
+    add_stats_span(*this, cameraStats, frame, "draw", drawBegin, drawEnd,
+                   TRACK_DRAW);
+
+    // the layers register their chunks while they load, before the first frame
+    if (_layers.size() != map_chunk_stats.size())
+    {
+        _layers.clear();
+        for (const osg::ref_ptr<ChunkStats>& chunkStats : map_chunk_stats)
+        {
+            LayerCounter layer;
+            layer.drawnAttribute = chunkStats->getName() + " chunks drawn";
+            layer.culledAttribute = chunkStats->getName() + " chunks culled";
+            layer.name = intern(chunkStats->getName() + " chunks");
+            _layers.push_back(layer);
+        }
+    }
+
+    double time;
+    if (!stats->getAttribute(frame, eventBegin, time)) return;
+
+    for (const LayerCounter& layer : _layers)
+    {
+        TraceEvent event;
+        event.name = layer.name;
+        event.phase = 'C';
+        event.time = time * 1e6;
+        event.series[0] = "drawn";
+        event.series[1] = "culled";
+        if (!stats->getAttribute(frame, layer.drawnAttribute, event.values[0])
+            || !stats->getAttribute(frame, layer.culledAttribute,
+                                    event.values[1]))
+            continue;
+        addEvent(event);
+    }
+}
+
+const char* FrameTrace::intern(const std::string& name)
+{
+    _names.push_back(name);
+    return _names.back().c_str();
+}
+
+bool FrameTrace::write() const
+{
+    std::ofstream out(_filename);
+    if (!out)
+    {
+        std::cerr << "Cannot write the trace to " << _filename << std::endl;
+        return false;
+    }
+
+    out << "{\"displayTimeUnit\":\"ms\",\"traceEvents\":[" << std::endl;
+    out << "{\"name\":\"process_name\",\"ph\":\"M\",\"pid\":1,"
+           "\"args\":{\"name\":\"osgMap\"}}";
+    const std::pair<TraceTrack, const char*> tracks[] = {
+        {TRACK_MAIN, "main"}, {TRACK_CULL, "cull"}, {TRACK_DRAW, "draw"}};
+    for (const auto& track : tracks)
+    {
+        out << ",\n{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":1,\"tid\":"
+            << track.first << ",\"args\":{\"name\":\"" << track.second
+            << "\"}}";
+    }
+
+    out << std::fixed << std::setprecision(3);
+    uint64_t end = _next.load(std::memory_order_acquire);
+    uint64_t begin = end > _capacity ? end - _capacity : 0;
+    size_t written = 0;
+    for (uint64_t i = begin; i < end; ++i)
+    {
+        const Slot& slot = _slots[i % _capacity];
+        if (slot.sequence.load(std::memory_order_acquire) != i + 1) continue;
+        TraceEvent event = slot.event;
+        std::atomic_thread_fence(std::memory_order_acquire);
+        if (slot.sequence.load(std::memory_order_relaxed) != i + 1) continue;
+
+        out << ",\n{\"name\":";
+        write_string(out, event.name);
+        out << ",\"ph\":\"" << event.phase << "\",\"pid\":1,\"tid\":"
+            << event.thread << ",\"ts\":" << event.time;
+        if (event.phase == 'X')
+        {
+            out << ",\"dur\":" << event.duration;
+        }
+        else
+        {
+            out << ",\"args\":{";
+            for (int s = 0; s < 2 && event.series[s]; ++s)
+            {
+                if (s) out << ',';
+                write_string(out, event.series[s]);
+                out << ':' << event.values[s];
+            }
+            out << '}';
+        }
+        out << '}';
+        ++written;
+    }
+    out << "\n]}" << std::endl;
+
+    std::cout << "--- TRACE: " << written << " events to " << _filename;
+    if (begin > 0) std::cout << ", " << begin << " older ones overwritten";
+    std::cout << std::endl;
+    return bool(out);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+
+bool TraceHandler::handle(const osgGA::GUIEventAdapter& ea,
+                          osgGA::GUIActionAdapter&)
+{
+    if (ea.getEventType() != osgGA::GUIEventAdapter::KEYDOWN
+        || ea.getKey() != 'T' || !map_trace.valid())
+        return false;
+
+    map_trace->write();
+    return true;
+}
@@ -0,0 +1,116 @@
+#ifndef TRACE_H
+#define TRACE_H
+
+#include <osg/Referenced>
+#include <osg/ref_ptr>
+#include <osg/Timer>
+#include <osgViewer/Viewer>
+#include <osgGA/GUIEventHandler>
+
+#include <atomic>
+#include <memory>
+#include <string>
+#include <vector>
+#include <list>
+
+// One entry of the trace. Names point to string literals or to strings
+// interned by the trace, so recording never copies or allocates.
+struct TraceEvent
+{
+    const char* name = nullptr;
+    // 'X' a span of duration, 'C' counters named by series
+    char phase = 'X';
+    unsigned int thread = 0;
+    // microseconds since the viewer started
+    double time = 0.0;
+    double duration = 0.0;
+    const char* series[2] = {nullptr, nullptr};
+    double values[2] = {0.0, 0.0};
+};
+
+// Frames of a session as a Chrome trace, readable by chrome://tracing and
+// Perfetto. The traversal spans of every frame and the chunks drawn and
+// culled per layer are taken from the viewer stats once the frame is
+// complete; scopes of our own callbacks are recorded as they run. Events
+// go into a ring buffer that keeps the latest ones: writers claim a slot
+// with one atomic increment and publish it with its sequence number, so
+// any thread records without locking and the dump skips slots that are
+// being overwritten.
+class FrameTrace : public osg::Referenced {
+public:
+    FrameTrace(const std::string& filename, size_t capacity = 1 << 18);
+
+    // takes the viewer's time base and turns on the stats of the traversals
+    void attach(osgViewer::Viewer* viewer);
+
+    // microseconds since the viewer started
+    double now() const;
+
+    void addSpan(const char* name, double begin, double end);
+    void addEvent(const TraceEvent& event);
+
+    // traversal spans and layer counters of a frame the viewer finished;
+    // the draw of the last frame may still run, so this is called for an
+    // older one
+    void addFrame(osgViewer::Viewer* viewer, unsigned int frame);
+
+    // a copy of name that lives as long as the trace, for setup code
+    const char* intern(const std::string& name);
+
+    // writes the events in the buffer, oldest first
+    bool write() const;
+
+protected:
+    struct Slot
+    {
+        std::atomic<uint64_t> sequence;
+        TraceEvent event;
+    };
+
+    struct LayerCounter
+    {
+        std::string drawnAttribute;
+        std::string culledAttribute;
+        const char* name;
+    };
+
+    std::string _filename;
+    size_t _capacity;
+    std::unique_ptr<Slot[]> _slots;
+    std::atomic<uint64_t> _next;
+    osg::Timer_t _startTick;
+
+    std::list<std::string> _names;
+    std::vector<LayerCounter> _layers;
+};
+
+extern osg::ref_ptr<FrameTrace> map_trace;
+
+// span of a scope in our callbacks, nothing when tracing is off
+class TraceScope {
+public:
+    TraceScope(const char* name) :
+        _name(name),
+        _begin(map_trace.valid() ? map_trace->now() : 0.0)
+    {
+    }
+
+    ~TraceScope()
+    {
+        if (map_trace.valid())
+            map_trace->addSpan(_name, _begin, map_trace->now());
+    }
+
+protected:
+    const char* _name;
+    double _begin;
+};
+
+// writes the trace on 'T'
+class TraceHandler : public osgGA::GUIEventHandler {
+public:
+    bool handle(const osgGA::GUIEventAdapter& ea,
+                osgGA::GUIActionAdapter& aa) override;
+};
+
+#endif // TRACE_H
@@ -0,0 +1,823 @@
+#include <osg/Geometry>
+
+#include <algorithm>
+#include <cmath>
+#include <limits>
+
+#include "triangulator.h"
+#include "parallel.h"
+
+struct TriangulatorNode
+{
+    unsigned int i;
+    double x, y;
+    TriangulatorNode* prev;
+    TriangulatorNode* next;
+    int z;
+    TriangulatorNode* prevZ;
+    TriangulatorNode* nextZ;
+    bool steiner;
+};
+
+typedef TriangulatorNode Node;
+
+Triangulator::Triangulator()
+{
+}
+
+Triangulator::~Triangulator()
+{
+}
+
+// signed area of a triangle, negative when counter clockwise
+static double area(const Node* p, const Node* q, const Node* r)
+{
+    return (q->y - p->y) * (r->x - q->x) - (q->x - p->x) * (r->y - q->y);
+}
+
+static bool equals(const Node* p1, const Node* p2)
+{
+    return p1->x == p2->x && p1->y == p2->y;
+}
+
+static int sign(double val)
+{
+    return (0.0 < val) - (val < 0.0);
+}
+
+// for collinear points p, q, r: whether q lies on segment pr
+static bool onSegment(const Node* p, const Node* q, const Node* r)
+{
+    return q->x <= std::max(p->x, r->x) && q->x >= std::min(p->x, r->x)
+        && q->y <= std::max(p->y, r->y) && q->y >= std::min(p->y, r->y);
+}
+
+static bool intersects(const Node* p1, const Node* q1, const Node* p2,
+                       const Node* q2)
+{
+    int o1 = sign(area(p1, q1, p2));
+    int o2 = sign(area(p1, q1, q2));
+    int o3 = sign(area(p2, q2, p1));
+    int o4 = sign(area(p2, q2, q1));
+
+    if (o1 != o2 && o3 != o4) return true;
+
+    if (o1 == 0 && onSegment(p1, p2, q1)) return true;
+    if (o2 == 0 && onSegment(p1, q2, q1)) return true;
+    if (o3 == 0 && onSegment(p2, p1, q2)) return true;
+    if (o4 == 0 && onSegment(p2, q1, q2)) return true;
+
+    return false;
+}
+
+// whether the diagonal ab crosses any edge of the polygon
+static bool intersectsPolygon(const Node* a, const Node* b)
+{
+    const Node* p = a;
+    do
+    {
+        if (p->i != a->i && p->next->i != a->i && p->i != b->i
+            && p->next->i != b->i && intersects(p, p->next, a, b))
+            return true;
+        p = p->next;
+    } while (p != a);
+
+    return false;
+}
+
+static bool locallyInside(const Node* a, const Node* b)
+{
+    return area(a->prev, a, a->next) < 0
+        ? area(a, b, a->next) >= 0 && area(a, a->prev, b) >= 0
+        : area(a, b, a->prev) < 0 || area(a, a->next, b) < 0;
+}
+
+// whether the middle of the diagonal ab is inside the polygon
+static bool middleInside(const Node* a, const Node* b)
+{
+    const Node* p = a;
+    bool inside = false;
+    double px = (a->x + b->x) / 2;
+    double py = (a->y + b->y) / 2;
+    do
+    {
+        if (((p->y > py) != (p->next->y > py)) && p->next->y != p->y
+            && (px < (p->next->x - p->x) * (py - p->y) / (p->next->y - p->y)
+                        + p->x))
+            inside = !inside;
+        p = p->next;
+    } while (p != a);
+
+    return inside;
+}
+
+static bool pointInTriangle(double ax, double ay, double bx, double by,
+                            double cx, double cy, double px, double py)
+{
+    return (cx - px) * (ay - py) >= (ax - px) * (cy - py)
+        && (ax - px) * (by - py) >= (bx - px) * (ay - py)
+        && (bx - px) * (cy - py) >= (cx - px) * (by - py);
+}
+
+// whether the diagonal ab lies inside the polygon and splits it cleanly
+static bool isValidDiagonal(const Node* a, const Node* b)
+{
+    return a->next->i != b->i && a->prev->i != b->i && !intersectsPolygon(a, b)
+        && ((locallyInside(a, b) && locallyInside(b, a) && middleInside(a, b)
+             && (area(a->prev, a, b->prev) != 0.0
+                 || area(a, b->prev, b) != 0.0))
+            || (equals(a, b) && area(a->prev, a, a->next) > 0
+                && area(b->prev, b, b->next) > 0));
+}
+
+static bool sectorContainsSector(const Node* m, const Node* p)
+{
+    return area(m->prev, m, p->prev) < 0 && area(p->next, m, m->next) < 0;
+}
+
+static Node* getLeftmost(Node* start)
+{
+    Node* p = start;
+    Node* leftmost = start;
+    do
+    {
+        if (p->x < leftmost->x || (p->x == leftmost->x && p->y < leftmost->y))
+            leftmost = p;
+        p = p->next;
+    } while (p != start);
+
+    return leftmost;
+}
+
+static void removeNode(Node* p)
+{
+    p->next->prev = p->prev;
+    p->prev->next = p->next;
+
+    if (p->prevZ) p->prevZ->nextZ = p->nextZ;
+    if (p->nextZ) p->nextZ->prevZ = p->prevZ;
+}
+
+Node* Triangulator::createNode(unsigned int i, double x, double y)
+{
+    if (_used == _blocks.size() * blockSize)
+        _blocks.emplace_back(new Node[blockSize]);
+
+    Node* p = &_blocks[_used / blockSize][_used % blockSize];
+    ++_used;
+
+    p->i = i;
+    p->x = x;
+    p->y = y;
+    p->prev = p->next = nullptr;
+    p->z = 0;
+    p->prevZ = p->nextZ = nullptr;
+    p->steiner = false;
+    return p;
+}
+
+// circular doubly linked list of the ring in the requested winding
+Node* Triangulator::linkedList(const Ring& ring, bool clockwise)
+{
+    double sum = 0.0;
+    for (unsigned int i = ring.first, j = ring.second - 1; i < ring.second;
+         j = i++)
+    {
+        const osg::Vec2& p1 = _points[i];
+        const osg::Vec2& p2 = _points[j];
+        sum += (double(p2.x()) - p1.x()) * (double(p1.y()) + p2.y());
+    }
+
+    Node* last = nullptr;
+    auto insert = [&](unsigned int i)
+    {
+        Node* p = createNode(i, _points[i].x(), _points[i].y());
+        if (!last)
+        {
+            p->prev = p;
+            p->next = p;
+        }
+        else
+        {
+            p->next = last->next;
+            p->prev = last;
+            last->next->prev = p;
+            last->next = p;
+        }
+        last = p;
+    };
+
+    if (clockwise == (sum > 0))
+        for (unsigned int i = ring.first; i < ring.second; ++i) insert(i);
+    else
+        for (unsigned int i = ring.second; i-- > ring.first;) insert(i);
+
+    // the closing vertex repeated by shapefiles
+    if (last && equals(last, last->next))
+    {
+        removeNode(last);
+        last = last->next;
+    }
+
+    return last;
+}
+
+// removes duplicate and collinear points
+Node* Triangulator::filterPoints(Node* start, Node* end)
+{
+    if (!end) end = start;
+
+    Node* p = start;
+    bool again;
+    do
+    {
+        again = false;
+
+        if (!p->steiner
+            && (equals(p, p->next) || area(p->prev, p, p->next) == 0))
+        {
+            removeNode(p);
+            p = end = p->prev;
+
+            if (p == p->next) break;
+            again = true;
+        }
+        else
+        {
+            p = p->next;
+        }
+    } while (again || p != end);
+
+    return end;
+}
+
+// main ear slicing loop
+void Triangulator::earcutLinked(Node* ear, int pass)
+{
+    if (!ear) return;
+
+    if (!pass && _hashing) indexCurve(ear);
+
+    Node* stop = ear;
+    while (ear->prev != ear->next)
+    {
+        Node* prev = ear->prev;
+        Node* next = ear->next;
+
+        if (_hashing ? isEarHashed(ear) : isEar(ear))
+        {
+            _triangles->push_back(prev->i);
+            _triangles->push_back(ear->i);
+            _triangles->push_back(next->i);
+
+            removeNode(ear);
+
+            // skipping the next vertex leads to less sliver triangles
+            ear = next->next;
+            stop = next->next;
+            continue;
+        }
+
+        ear = next;
+
+        // no ear left in a whole loop: filter the points and retry, then
+        // cure small self-intersections, then split the polygon in two
+        if (ear == stop)
+        {
+            if (!pass)
+                earcutLinked(filterPoints(ear), 1);
+            else if (pass == 1)
+                earcutLinked(cureLocalIntersections(filterPoints(ear)), 2);
+            else if (pass == 2)
+                splitEarcut(ear);
+            break;
+        }
+    }
+}
+
+bool Triangulator::isEar(Node* ear)
+{
+    const Node* a = ear->prev;
+    const Node* b = ear;
+    const Node* c = ear->next;
+
+    if (area(a, b, c) >= 0) return false; // reflex
+
+    for (Node* p = ear->next->next; p != ear->prev; p = p->next)
+    {
+        if (pointInTriangle(a->x, a->y, b->x, b->y, c->x, c->y, p->x, p->y)
+            && area(p->prev, p, p->next) >= 0)
+            return false;
+    }
+    return true;
+}
+
+bool Triangulator::isEarHashed(Node* ear)
+{
+    const Node* a = ear->prev;
+    const Node* b = ear;
+    const Node* c = ear->next;
+
+    if (area(a, b, c) >= 0) return false; // reflex
+
+    double minTX = std::min(a->x, std::min(b->x, c->x));
+    double minTY = std::min(a->y, std::min(b->y, c->y));
+    double maxTX = std::max(a->x, std::max(b->x, c->x));
+    double maxTY = std::max(a->y, std::max(b->y, c->y));
+
+    // only the z-order range of the triangle bounds has to be searched,
+    // up the curve and then down
+    int minZ = zOrder(minTX, minTY);
+    int maxZ = zOrder(maxTX, maxTY);
+
+    for (Node* p = ear->nextZ; p && p->z <= maxZ; p = p->nextZ)
+    {
+        if (p != ear->prev && p != ear->next
+            && pointInTriangle(a->x, a->y, b->x, b->y, c->x, c->y, p->x, p->y)
+            && area(p->prev, p, p->next) >= 0)
+            return false;
+    }
+
+    for (Node* p = ear->prevZ; p && p->z >= minZ; p = p->prevZ)
+    {
+        if (p != ear->prev && p != ear->next
+            && pointInTriangle(a->x, a->y, b->x, b->y, c->x, c->y, p->x, p->y)
+            && area(p->prev, p, p->next) >= 0)
+            return false;
+    }
+
+    return true;
+}
+
+Node* Triangulator::cureLocalIntersections(Node* start)
+{
+    Node* p = start;
+    do
+    {
+        Node* a = p->prev;
+        Node* b = p->next->next;
+
+        // edge (a, p) crosses edge (p->next, b)
+        if (!equals(a, b) && intersects(a, p, p->next, b)
+            && locallyInside(a, b) && locallyInside(b, a))
+        {
+            _triangles->push_back(a->i);
+            _triangles->push_back(p->i);
+            _triangles->push_back(b->i);
+
+            removeNode(p);
+            removeNode(p->next);
+
+            p = start = b;
+        }
+        p = p->next;
+    } while (p != start);
+
+    return filterPoints(p);
+}
+
+void Triangulator::splitEarcut(Node* start)
+{
+    Node* a = start;
+    do
+    {
+        for (Node* b = a->next->next; b != a->prev; b = b->next)
+        {
+            if (a->i != b->i && isValidDiagonal(a, b))
+            {
+                Node* c = splitPolygon(a, b);
+
+                a = filterPoints(a, a->next);
+                c = filterPoints(c, c->next);
+
+                earcutLinked(a);
+                earcutLinked(c);
+                return;
+            }
+        }
+        a = a->next;
+    } while (a != start);
+}
+
+// links every hole into the outer ring, left to right
+Node* Triangulator::eliminateHoles(const Ring* rings, unsigned int numRings,
+                                   Node* outerNode)
+{
+    std::vector<Node*> queue;
+    for (unsigned int i = 1; i < numRings; ++i)
+    {
+        if (rings[i].second - rings[i].first < 3) continue;
+
+        Node* list = linkedList(rings[i], false);
+        if (list)
+        {
+            if (list == list->next) list->steiner = true;
+            queue.push_back(getLeftmost(list));
+        }
+    }
+    std::sort(queue.begin(), queue.end(),
+              [](const Node* a, const Node* b) { return a->x < b->x; });
+
+    for (Node* hole : queue) outerNode = eliminateHole(hole, outerNode);
+
+    return outerNode;
+}
+
+Node* Triangulator::eliminateHole(Node* hole, Node* outerNode)
+{
+    Node* bridge = findHoleBridge(hole, outerNode);
+    if (!bridge) return outerNode;
+
+    Node* bridgeReverse = splitPolygon(bridge, hole);
+    filterPoints(bridgeReverse, bridgeReverse->next);
+
+    // the outer node may have been filtered out
+    return filterPoints(bridge, bridge->next);
+}
+
+// David Eberly's search for a vertex of the outer ring visible from the
+// leftmost vertex of the hole
+Node* Triangulator::findHoleBridge(Node* hole, Node* outerNode)
+{
+    Node* p = outerNode;
+    double hx = hole->x;
+    double hy = hole->y;
+    double qx = -std::numeric_limits<double>::infinity();
+    Node* m = nullptr;
+
+    // segment hit by a ray from the hole to the left; its endpoint with the
+    // lesser x is the candidate
+    do
+    {
+        if (hy <= p->y && hy >= p->next->y && p->next->y != p->y)
+        {
+            double x =
+                p->x + (hy - p->y) * (p->next->x - p->x) / (p->next->y - p->y);
+            if (x <= hx && x > qx)
+            {
+                qx = x;
+                m = p->x < p->next->x ? p : p->next;
+                if (x == hx) return m; // hole touches the outer segment
+            }
+        }
+        p = p->next;
+    } while (p != outerNode);
+
+    if (!m) return nullptr;
+
+    // vertices inside the triangle of the hole vertex, the hit point and the
+    // candidate block it; then the one with the least angle to the ray wins
+    const Node* stop = m;
+    double tanMin = std::numeric_limits<double>::infinity();
+    double mx = m->x;
+    double my = m->y;
+
+    p = m;
+    do
+    {
+        if (hx >= p->x && p->x >= mx && hx != p->x
+            && pointInTriangle(hy < my ? hx : qx, hy, mx, my, hy < my ? qx : hx,
+                               hy, p->x, p->y))
+        {
+            double tanCur = std::abs(hy - p->y) / (hx - p->x);
+
+            if (locallyInside(p, hole)
+                && (tanCur < tanMin
+                    || (tanCur == tanMin
+                        && (p->x > m->x
+                            || (p->x == m->x && sectorContainsSector(m, p))))))
+            {
+                m = p;
+                tanMin = tanCur;
+            }
+        }
+        p = p->next;
+    } while (p != stop);
+
+    return m;
+}
+
+// links the nodes in z-order
+void Triangulator::indexCurve(Node* start)
+{
+    Node* p = start;
+    do
+    {
+        p->z = p->z ? p->z : zOrder(p->x, p->y);
+        p->prevZ = p->prev;
+        p->nextZ = p->next;
+        p = p->next;
+    } while (p != start);
+
+    p->prevZ->nextZ = nullptr;
+    p->prevZ = nullptr;
+
+    sortLinked(p);
+}
+
+// Simon Tatham's linked list merge sort
+Node* Triangulator::sortLinked(Node* list)
+{
+    int inSize = 1;
+    for (;;)
+    {
+        Node* p = list;
+        Node* tail = nullptr;
+        int numMerges = 0;
+        list = nullptr;
+
+        while (p)
+        {
+            numMerges++;
+            Node* q = p;
+            int pSize = 0;
+            for (int i = 0; i < inSize; i++)
+            {
+                pSize++;
+                q = q->nextZ;
+                if (!q) break;
+            }
+
+            int qSize = inSize;
+            while (pSize > 0 || (qSize > 0 && q))
+            {
+                Node* e;
+                if (pSize == 0)
+                {
+                    e = q;
+                    q = q->nextZ;
+                    qSize--;
+                }
+                else if (qSize == 0 || !q || p->z <= q->z)
+                {
+                    e = p;
+                    p = p->nextZ;
+                    pSize--;
+                }
+                else
+                {
+                    e = q;
+                    q = q->nextZ;
+                    qSize--;
+                }
+
+                if (tail) tail->nextZ = e;
+                else list = e;
+
+                e->prevZ = tail;
+                tail = e;
+            }
+
+            p = q;
+        }
+
+        tail->nextZ = nullptr;
+
+        if (numMerges <= 1) return list;
+
+        inSize *= 2;
+    }
+}
+
+// interleaved bits of the 15 bit coordinates inside the polygon bounds
+int Triangulator::zOrder(double px, double py) const
+{
+    int x = int((px - _minX) * _invSize);
+    int y = int((py - _minY) * _invSize);
+
+    x = (x | (x << 8)) & 0x00FF00FF;
+    x = (x | (x << 4)) & 0x0F0F0F0F;
+    x = (x | (x << 2)) & 0x33333333;
+    x = (x | (x << 1)) & 0x55555555;
+
+    y = (y | (y << 8)) & 0x00FF00FF;
+    y = (y | (y << 4)) & 0x0F0F0F0F;
+    y = (y | (y << 2)) & 0x33333333;
+    y = (y | (y << 1)) & 0x55555555;
+
+    return x | (y << 1);
+}
+
+// joins a and b with a bridge; splits a ring in two, or merges a hole
+// into the outer ring
+Node* Triangulator::splitPolygon(Node* a, Node* b)
+{
+    Node* a2 = createNode(a->i, a->x, a->y);
+    Node* b2 = createNode(b->i, b->x, b->y);
+    Node* an = a->next;
+    Node* bp = b->prev;
+
+    a->next = b;
+    b->prev = a;
+
+    a2->next = an;
+    an->prev = a2;
+
+    b2->next = a2;
+    a2->prev = b2;
+
+    bp->next = b2;
+    b2->prev = bp;
+
+    return b2;
+}
+
+unsigned int Triangulator::triangulate(const osg::Vec2* points,
+                                       const Ring* rings, unsigned int numRings,
+                                       std::vector<unsigned int>& triangles)
+{
+    if (numRings == 0 || rings[0].second - rings[0].first < 3) return 0;
+
+    _points = points;
+    _triangles = &triangles;
+    _used = 0;
+    size_t start = triangles.size();
+
+    Node* outerNode = linkedList(rings[0], true);
+    if (!outerNode || outerNode->next == outerNode->prev) return 0;
+
+    unsigned int numPoints = 0;
+    for (unsigned int i = 0; i < numRings; ++i)
+        numPoints += rings[i].second - rings[i].first;
+
+    if (numRings > 1) outerNode = eliminateHoles(rings, numRings, outerNode);
+
+    // the z-order hash pays off only for larger polygons
+    _hashing = numPoints > 80;
+    if (_hashing)
+    {
+        double maxX, maxY;
+        _minX = maxX = outerNode->x;
+        _minY = maxY = outerNode->y;
+        Node* p = outerNode->next;
+        do
+        {
+            _minX = std::min(_minX, p->x);
+            _minY = std::min(_minY, p->y);
+            maxX = std::max(maxX, p->x);
+            maxY = std::max(maxY, p->y);
+            p = p->next;
+        } while (p != outerNode);
+
+        _invSize = std::max(maxX - _minX, maxY - _minY);
+        _invSize = _invSize != 0.0 ? 32767.0 / _invSize : 0.0;
+    }
+
+    // clipping ears from the clockwise ring emits counter clockwise triangles
+    earcutLinked(outerNode);
+
+    return (triangles.size() - start) / 3;
+}
+
+static double ring_area(const osg::Vec2* points, const Triangulator::Ring& ring)
+{
+    double area = 0.0;
+    for (unsigned int i = ring.first, j = ring.second - 1; i < ring.second;
+         j = i++)
+        area += double(points[j].x()) * points[i].y()
+            - double(points[i].x()) * points[j].y();
+    return 0.5 * area;
+}
+
+static bool ring_contains(const osg::Vec2* points,
+                          const Triangulator::Ring& ring, const osg::Vec2& pt)
+{
+    bool inside = false;
+    for (unsigned int i = ring.first, j = ring.second - 1; i < ring.second;
+         j = i++)
+    {
+        const osg::Vec2& a = points[i];
+        const osg::Vec2& b = points[j];
+        if ((a.y() > pt.y()) != (b.y() > pt.y())
+            && pt.x() < (b.x() - a.x()) * (pt.y() - a.y()) / (b.y() - a.y())
+                    + a.x())
+            inside = !inside;
+    }
+    return inside;
+}
+
+unsigned int Triangulator::triangulate(const ShapeFile& shp,
+                                       unsigned int record,
+                                       std::vector<unsigned int>& triangles)
+{
+    const osg::Vec2* points = shp.getLocalPoints().data();
+
+    _rings.clear();
+    _areas.clear();
+    double largest = 0.0;
+    for (unsigned int p = shp.getFirstPart(record); p < shp.getEndPart(record);
+         ++p)
+    {
+        Ring ring(shp.getFirstPoint(p), shp.getEndPoint(p));
+        if (ring.second - ring.first < 3) continue;
+
+        double area = ring_area(points, ring);
+        if (std::fabs(area) > std::fabs(largest)) largest = area;
+        _rings.push_back(ring);
+        _areas.push_back(area);
+    }
+    if (_rings.empty()) return 0;
+
+    // outer rings share the winding of the largest ring (clockwise in
+    // shapefiles), holes have the opposite one
+    unsigned int numTriangles = 0;
+    for (unsigned int o = 0; o < _rings.size(); ++o)
+    {
+        if ((_areas[o] > 0.0) != (largest > 0.0)) continue;
+
+        _group.clear();
+        _group.push_back(_rings[o]);
+
+        for (unsigned int h = 0; h < _rings.size(); ++h)
+        {
+            if ((_areas[h] > 0.0) == (largest > 0.0)) continue;
+
+            // the first outer ring holding the hole owns it, holes inside
+            // no ring go to the largest one
+            const osg::Vec2& pt = points[_rings[h].first];
+            unsigned int owner = o;
+            bool found = false;
+            for (unsigned int k = 0; k < _rings.size() && !found; ++k)
+            {
+                if ((_areas[k] > 0.0) != (largest > 0.0)) continue;
+                if (ring_contains(points, _rings[k], pt))
+                {
+                    owner = k;
+                    found = true;
+                }
+            }
+            if (!found)
+            {
+                for (unsigned int k = 0; k < _rings.size(); ++k)
+                    if (_areas[k] == largest) owner = k;
+            }
+
+            if (owner == o) _group.push_back(_rings[h]);
+        }
+
+        numTriangles += triangulate(points, _group.data(), _group.size(),
+                                    triangles);
+    }
+    return numTriangles;
+}
+
+osg::Geometry* createPolygonGeometry(const ShapeFile& shp,
+                                     const std::vector<unsigned int>& records,
+                                     const osg::Vec3& origin)
+{
+    // triangles of every record, indexed in the points of the shapefile
+    std::vector<std::vector<unsigned int>> triangles(records.size());
+    parallel_for(records.size(), [&](size_t r)
+    {
+        thread_local Triangulator triangulator;
+        triangulator.triangulate(shp, records[r], triangles[r]);
+    });
+
+    // every record copies its own points, so the offsets of its vertices
+    // and indices in the merged arrays are prefix sums
+    std::vector<size_t> vertexOffsets(records.size() + 1, 0);
+    std::vector<size_t> indexOffsets(records.size() + 1, 0);
+    for (size_t r = 0; r < records.size(); ++r)
+    {
+        unsigned int record = records[r];
+        unsigned int numPoints = triangles[r].empty()
+            ? 0
+            : shp.getFirstPoint(shp.getEndPart(record))
+                - shp.getFirstPoint(shp.getFirstPart(record));
+        vertexOffsets[r + 1] = vertexOffsets[r] + numPoints;
+        indexOffsets[r + 1] = indexOffsets[r] + triangles[r].size();
+    }
+
+    osg::Vec3Array* verts = new osg::Vec3Array(vertexOffsets.back());
+    osg::DrawElementsUInt* tris = new osg::DrawElementsUInt(
+        osg::PrimitiveSet::TRIANGLES, indexOffsets.back());
+    const std::vector<osg::Vec2>& points = shp.getLocalPoints();
+
+    parallel_for(records.size(), [&](size_t r)
+    {
+        if (triangles[r].empty()) return;
+
+        unsigned int first = shp.getFirstPoint(shp.getFirstPart(records[r]));
+        size_t base = vertexOffsets[r];
+        for (size_t i = base; i < vertexOffsets[r + 1]; ++i)
+        {
+            const osg::Vec2& p = points[first + i - base];
+            (*verts)[i].set(p.x() - origin.x(), p.y() - origin.y(), 0.f);
+        }
+
+        size_t out = indexOffsets[r];
+        for (unsigned int index : triangles[r])
+            (*tris)[out++] = base + index - first;
+    });
+
+    osg::Vec3Array* normals = new osg::Vec3Array;
+    normals->push_back(osg::Vec3(0.f, 0.f, 1.f));
+
+    osg::Geometry* geom = new osg::Geometry;
+    geom->setUseDisplayList(false);
+    geom->setUseVertexBufferObjects(true);
+    geom->setVertexArray(verts);
+    geom->setNormalArray(normals, osg::Array::BIND_OVERALL);
+    geom->addPrimitiveSet(tris);
+    return geom;
+}
@@ -0,0 +1,84 @@
+#ifndef TRIANGULATOR_H
+#define TRIANGULATOR_H
+
+#include <osg/Vec2>
+#include <osg/Geometry>
+
+#include <vector>
+#include <memory>
+#include <utility>
+
+#include "shapefile.h"
+
+struct TriangulatorNode;
+
+// Ear clipping triangulation of polygons with holes, following the earcut
+// algorithm: holes are bridged into the outer ring, then ears are clipped
+// from a circular linked list of the remaining vertices. Rings with many
+// vertices index their nodes along a z-order curve, so the test for
+// vertices inside a candidate ear only visits the ear's neighbourhood.
+// Nodes come from blocks kept between calls, so one instance per thread
+// triangulates any number of polygons without allocating.
+class Triangulator {
+public:
+    typedef std::pair<unsigned int, unsigned int> Ring;
+
+    Triangulator();
+    ~Triangulator();
+
+    // rings[0] is the outer ring, the others are its holes; each ring is a
+    // [begin, end) range of points. Triangles are appended as indices into
+    // points, counter clockwise; returns the number of triangles added.
+    unsigned int triangulate(const osg::Vec2* points, const Ring* rings,
+                             unsigned int numRings,
+                             std::vector<unsigned int>& triangles);
+
+    // triangulates a shapefile polygon record in local coordinates; records
+    // with several outer rings get each hole assigned to the ring holding it
+    unsigned int triangulate(const ShapeFile& shp, unsigned int record,
+                             std::vector<unsigned int>& triangles);
+
+protected:
+    typedef TriangulatorNode Node;
+
+    Node* createNode(unsigned int i, double x, double y);
+    Node* linkedList(const Ring& ring, bool clockwise);
+    Node* filterPoints(Node* start, Node* end = nullptr);
+    void earcutLinked(Node* ear, int pass = 0);
+    bool isEar(Node* ear);
+    bool isEarHashed(Node* ear);
+    Node* cureLocalIntersections(Node* start);
+    void splitEarcut(Node* start);
+    Node* eliminateHoles(const Ring* rings, unsigned int numRings,
+                         Node* outerNode);
+    Node* eliminateHole(Node* hole, Node* outerNode);
+    Node* findHoleBridge(Node* hole, Node* outerNode);
+    void indexCurve(Node* start);
+    Node* sortLinked(Node* list);
+    int zOrder(double x, double y) const;
+    Node* splitPolygon(Node* a, Node* b);
+
+    const osg::Vec2* _points = nullptr;
+    std::vector<unsigned int>* _triangles = nullptr;
+
+    bool _hashing = false;
+    double _minX = 0.0, _minY = 0.0, _invSize = 0.0;
+
+    static const unsigned int blockSize = 1024;
+    std::vector<std::unique_ptr<Node[]>> _blocks;
+    unsigned int _used = 0;
+
+    // scratch of the shapefile overload
+    std::vector<Ring> _rings;
+    std::vector<double> _areas;
+    std::vector<Ring> _group;
+};
+
+// triangulates the polygon records in parallel and merges them into one
+// indexed geometry in the local frame of the shapefile moved to origin, at
+// z = 0
+osg::Geometry* createPolygonGeometry(const ShapeFile& shp,
+                                     const std::vector<unsigned int>& records,
+                                     const osg::Vec3& origin = osg::Vec3());
+
+#endif // TRIANGULATOR_H
@@ -7,30 +7,101 @@
 #include <osgText/Text>
 #include <osg/MatrixTransform>
 #include <osg/ShapeDrawable>
+#include <osg/Geode>
+#include <osg/LOD>
 
 #include <iostream>
+#include <map>
+#include <cmath>
 
 #include "common.h"
+#include "style.h"
+#include "shapefile.h"
+#include "triangulator.h"
+#include "simplify.h"
+#include "picking.h"
+#include "chunker.h"
+#include "terrain.h"
 
 using namespace osg;
 
+// side of the square ground cells the water is merged in
+const float waterChunkSize = 5000.f;
+
 osg::Node* process_water(osg::Matrixd& ltw, const std::string & file_path)
 {
     std::string water_file_path = file_path + "/gis_osm_water_a_free_1.shp";
 
     // load the data
-    osg::ref_ptr<osg::Node> water_model = osgDB::readRefNodeFile(water_file_path);
-    if (!water_model)
+    ShapeFile shp;
+    if (!shp.load(water_file_path))
     {
         std::cout << "Cannot load file " << water_file_path << std::endl;
         return nullptr;
     }
 
-    ConvertFromGeoProjVisitor<true> cfgp;
-    water_model->accept(cfgp);
+    shp.toLocal(ltw);
+
+    // generalised copies for the distant views, level 0 is the layer itself
+    PolygonSimplifier simplifier(shp);
+    std::vector<ShapeFile> generalised(polygonNumLevels - 1);
+    const ShapeFile* levels[polygonNumLevels] = {&shp};
+    for (unsigned l = 1; l < polygonNumLevels; l++)
+    {
+        simplifier.simplify(l, generalised[l - 1]);
+        levels[l] = &generalised[l - 1];
+    }
+
+    // all water polygons share one colour, so every chunk is one geometry
+    // per level, switched by an osg::LOD
+    float chunkSize = map_style->getDefault(STYLE_WATER).chunkSize;
+    GridChunker chunker(chunkSize > 0.f ? chunkSize : waterChunkSize);
+    std::map<GridChunker::Cell, std::vector<unsigned int>> chunks;
+    chunker.split(shp, std::vector<unsigned int>(), chunks);
+
+    size_t numVerts[polygonNumLevels] = {};
+    for (auto& chunk : chunks)
+    {
+        osg::LOD* lod = new osg::LOD;
+        for (unsigned l = 0; l < polygonNumLevels; l++)
+        {
+            osg::ref_ptr<osg::Geometry> geom = createPolygonGeometry(
+                *levels[l], chunk.second, chunker.getOrigin(chunk.first));
+            if (geom->getPrimitiveSet(0)->getNumIndices() == 0) continue;
+
+            osg::Geode* geode = new osg::Geode;
+            geode->addDrawable(geom.get());
+            lod->addChild(geode, polygonLevelMinDistance(l),
+                          polygonLevelMaxDistance(l));
+            numVerts[l] += geom->getVertexArray()->getNumElements();
+        }
+        chunker.addChunk(chunk.first, lod);
+    }
+    osg::ref_ptr<osg::Node> water_model =
+        chunker.build(register_chunk_stats("Water"));
+
+    // on a DEM the polygons lie on its ground, their triangles split down
+    // to the samples of the grid so that they follow it between vertices
+    if (map_terrain.valid())
+    {
+        DrapeVisitor drape(map_terrain.get(), 0.f, map_terrain->getSpacing());
+        water_model->accept(drape);
+        drape.drape();
+    }
+
+    std::cout << "--- WATER: " << shp.getNumRecords() << " polygons in "
+              << chunks.size() << " chunks, vertices per level";
+    for (unsigned l = 0; l < polygonNumLevels; l++)
+        std::cout << (l ? "/" : " ") << numVerts[l];
+    std::cout << std::endl;
+
+    water_model->setStateSet(
+        createColorStateSet(map_style->getDefault(STYLE_WATER).color));
 
-    WorldToLocalVisitor ltwv(ltw, true);
-    water_model->accept(ltwv);
+    // the source polygons stay for picking, on the ground of a DEM
+    if (map_picker.valid())
+        register_pick_index(
+            new FeatureIndex("water", shp, ground_bases(shp), {0.f}));
 
 
 
@@ -0,0 +1,80 @@
+#ifndef ZOOM_H
+#define ZOOM_H
+
+#include <osg/Referenced>
+#include <osg/ref_ptr>
+#include <osg/Node>
+#include <osg/NodeCallback>
+#include <osg/NodeVisitor>
+
+#include <atomic>
+#include <cmath>
+
+// Map zoom levels follow the web map convention: every level halves the
+// camera distance, level 0 has the whole globe in view.
+const double zoomReferenceDistance = 7.5e7;
+
+inline double zoomToDistance(double zoom)
+{
+    return zoomReferenceDistance / std::pow(2.0, zoom);
+}
+
+inline double distanceToZoom(double distance)
+{
+    return std::log2(zoomReferenceDistance / distance);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+
+// the discrete level moves only once the zoom is this far past a level
+// boundary, so scrolling back and forth across it does not toggle layers
+const double zoomHysteresis = 0.25;
+
+// Zoom level of the map camera, published by GoogleMapsManipulator whenever
+// its distance changes. Layers read the discrete level during cull.
+class ZoomLevel : public osg::Referenced {
+public:
+    ZoomLevel() : _zoom(0.0), _level(0) {}
+
+    void setZoom(double zoom)
+    {
+        _zoom = zoom;
+
+        int level = _level;
+        if (zoom >= level + 1 + zoomHysteresis || zoom < level - zoomHysteresis)
+            _level = int(std::floor(zoom));
+    }
+
+    double getZoom() const { return _zoom; }
+    int getLevel() const { return _level; }
+
+protected:
+    std::atomic<double> _zoom;
+    std::atomic<int> _level;
+};
+
+extern osg::ref_ptr<ZoomLevel> map_zoom;
+
+////////////////////////////////////////////////////////////////////////////////
+
+// Cull callback of a layer subtree visible in the zoom levels
+// [minZoom, maxZoom]; outside of them the whole subtree is skipped.
+class ZoomRangeCallback : public osg::NodeCallback {
+public:
+    ZoomRangeCallback(double minZoom, double maxZoom = 30.0) :
+        _minZoom(minZoom), _maxZoom(maxZoom)
+    {}
+
+    void operator()(osg::Node* node, osg::NodeVisitor* nv) override
+    {
+        int level = map_zoom->getLevel();
+        if (level < _minZoom || level > _maxZoom) return;
+
+        traverse(node, nv);
+    }
+
+protected:
+    double _minZoom, _maxZoom;
+};
+
+#endif // ZOOM_H